@@ -0,0 +1,219 @@
+/*
+ *  This file is part of pom-ng.
+ *  Copyright (C) 2015 Guy Martin <gmsoft@tuxicoman.be>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+// Measure the time taken by filter_match() for a few typical expressions
+//
+// The filter code is built in with synthetic integer and string properties
+// so no module needs to be loaded. From the top of a configured tree :
+//
+//   gcc -O2 -std=gnu99 -D_GNU_SOURCE -Iinclude -Isrc `xml2-config --cflags` \
+//	contrib/filter_bench.c -o filter_bench -lpthread
+//
+// Add -DFILTER_BENCH_NO_RESOLVE when building against a filter.c that
+// predates the prop_resolve callback, i.e. the old recursive tree walker :
+//
+//   git show <rev>:src/filter.c > src/filter.c
+
+#include "../src/filter.c"
+#include "../src/filter_strmatch.c"
+
+#include <stdarg.h>
+#include <time.h>
+
+#define FILTER_BENCH_ITERATIONS	2000000
+
+// Properties of the fake object : i* are integers, everything else is a string
+struct filter_bench_obj {
+	uint64_t ints[4];
+	char *strs[4];
+};
+
+static char *filter_bench_exprs[] = {
+	"i0 == 80",
+	"i0 == 80 || i1 == 80",
+	"i0 == 6 && i1 > 1024 && i2 < 1024",
+	"i0 in { 22, 25, 53, 80, 110, 143, 443, 993 }",
+	"(i0 == 17 && i1 == 53) || (i0 == 6 && (i1 == 80 || i1 == 443))",
+	"s0 == \"www.example.com\"",
+	"s0 endswith \".example.com\" && i1 == 443",
+	"s1 contains \"Mozilla\" || s1 contains \"curl\"",
+	NULL
+};
+
+static struct filter_bench_obj filter_bench_obj = {
+	.ints = { 6, 443, 8080, 0 },
+	.strs = { "www.example.com", "curl/7.38.0", "", "" },
+};
+
+//
+// Stubs for the parts of pom-ng that the filters use
+//
+
+void pomlog_internal(const char *file, const char *format, ...) {
+
+	va_list arg_list;
+	va_start(arg_list, format);
+	vfprintf(stderr, format, arg_list);
+	va_end(arg_list);
+	fprintf(stderr, "\n");
+}
+
+void pom_oom_internal(size_t size, char *file, unsigned int line) {
+	fprintf(stderr, "Out of memory (%zu bytes) at %s:%u\n", size, file, line);
+	abort();
+}
+
+static struct ptype_reg_info filter_bench_ptype_info;
+static struct ptype_reg filter_bench_ptypes[16];
+
+struct ptype_reg *ptype_get_type(char *name) {
+
+	// Only the pointers are compared, give a distinct one for each name
+	static char *names[16];
+	unsigned int i;
+	for (i = 0; i < 16 && names[i] && strcmp(names[i], name); i++);
+	if (i >= 16)
+		return NULL;
+	names[i] = name;
+	filter_bench_ptypes[i].info = &filter_bench_ptype_info;
+	return &filter_bench_ptypes[i];
+}
+
+struct ptype *ptype_alloc(const char *type) {
+
+	// Never parsed successfully, the filters only see integers and strings
+	struct ptype *pt = malloc(sizeof(struct ptype));
+	if (pt)
+		memset(pt, 0, sizeof(struct ptype));
+	return pt;
+}
+
+int ptype_parse_val(struct ptype *pt, char *val) {
+	return POM_ERR;
+}
+
+int ptype_cleanup(struct ptype *pt) {
+	free(pt);
+	return POM_OK;
+}
+
+size_t ptype_get_fixed_size(struct ptype_reg *reg) {
+	return 0;
+}
+
+int ptype_compare_val(int op, struct ptype *a, struct ptype *b) {
+	return 0;
+}
+
+//
+// Properties of the fake object
+//
+
+static int filter_bench_prop_compile(struct filter *f, char *prop_str, struct filter_value *v) {
+
+	unsigned int idx = prop_str[1] - '0';
+	if ((prop_str[0] != 'i' && prop_str[0] != 's') || idx > 3 || prop_str[2])
+		return POM_ERR;
+
+	unsigned int *prop = malloc(sizeof(unsigned int));
+	if (!prop)
+		return POM_ERR;
+	*prop = idx;
+
+	v->type = filter_value_type_prop;
+	v->val.prop.out_type = (prop_str[0] == 'i' ? filter_value_type_int : filter_value_type_string);
+	v->val.prop.priv = prop;
+
+	return POM_OK;
+}
+
+static int filter_bench_prop_get_val(struct filter_value *inval, struct filter_value *outval, void *obj) {
+
+	struct filter_bench_obj *o = obj;
+	unsigned int idx = *(unsigned int *)inval->val.prop.priv;
+
+	if (inval->val.prop.out_type == filter_value_type_int) {
+		outval->type = filter_value_type_int;
+		outval->val.integer = o->ints[idx];
+	} else {
+		outval->type = filter_value_type_string;
+		outval->val.string = o->strs[idx];
+	}
+
+	return POM_OK;
+}
+
+static void filter_bench_prop_cleanup(void *prop) {
+	free(prop);
+}
+
+static uint64_t filter_bench_now() {
+
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000000ULL) + ts.tv_nsec;
+}
+
+int main(int argc, char *argv[]) {
+
+	unsigned int iterations = FILTER_BENCH_ITERATIONS;
+	if (argc > 1)
+		iterations = strtoul(argv[1], NULL, 10);
+	if (!iterations)
+		iterations = 1;
+
+	unsigned int i;
+	for (i = 0; filter_bench_exprs[i]; i++) {
+
+#ifdef FILTER_BENCH_NO_RESOLVE
+		struct filter *f = filter_alloc(filter_bench_prop_compile, NULL, filter_bench_prop_get_val, filter_bench_prop_cleanup);
+#else
+		struct filter *f = filter_alloc(filter_bench_prop_compile, NULL, filter_bench_prop_get_val, NULL, filter_bench_prop_cleanup);
+#endif
+		if (!f)
+			return 1;
+
+		// The parser modifies the expression
+		char *expr = strdup(filter_bench_exprs[i]);
+		if (!expr)
+			return 1;
+
+		// Older trees don't support all the operators
+		if (filter_compile(expr, f) != POM_OK) {
+			printf("     n/a    %s\n", filter_bench_exprs[i]);
+			free(expr);
+			filter_cleanup(f);
+			continue;
+		}
+		free(expr);
+
+		unsigned int j, matched = 0;
+		uint64_t start = filter_bench_now();
+		for (j = 0; j < iterations; j++)
+			matched += (filter_match(f, &filter_bench_obj) == FILTER_MATCH_YES);
+		uint64_t end = filter_bench_now();
+
+		printf("%8.1f ns  %s%s\n", (double)(end - start) / iterations, filter_bench_exprs[i], (matched ? "" : "  (no match)"));
+
+		filter_cleanup(f);
+	}
+
+	return 0;
+}
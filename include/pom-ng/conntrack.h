@@ -41,6 +41,7 @@ struct conntrack_entry {
 	pthread_mutex_t lock; ///< Lock of the conntrack entry
 	uint32_t hash; ///< Full hash prior to modulo
 	unsigned int refcount; ///< Reference count (mostly in how many proto_stack it's referenced)
+	unsigned int flags; ///< Flags used to choose which conntrack to evict
 };
 
 struct conntrack_node_list {
@@ -50,11 +51,6 @@ struct conntrack_node_list {
 	uint32_t hash; ///< Hash of the conntrack
 };
 
-struct conntrack_list {
-	struct conntrack_entry *ce; ///< Corresponding conntrack
-	struct conntrack_list *prev, *next; ///< Next and previous connection in the list
-};
-
 struct conntrack_info {
 	int (*cleanup_handler) (void *ce_priv);
 	unsigned int default_table_size;
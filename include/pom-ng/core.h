@@ -32,6 +32,7 @@
 
 int core_process_multi_packet(struct proto_process_stack *s, unsigned int stack_index, struct packet *p);
 int core_queue_packet(struct packet *p, unsigned int flags, unsigned int thread_affinity);
+int core_queue_packet_group(struct packet *p, unsigned int flags, unsigned int group, unsigned int group_count);
 struct proto_process_stack *core_stack_backup(struct proto_process_stack *stack, struct packet* old_pkt, struct packet *new_pkt);
 void core_stack_release(struct proto_process_stack *stack);
 ptime core_get_clock();
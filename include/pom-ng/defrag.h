@@ -0,0 +1,53 @@
+/*
+ *  This file is part of pom-ng.
+ *  Copyright (C) 2015 Guy Martin <gmsoft@tuxicoman.be>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+
+
+#ifndef __POM_NG_DEFRAG_H__
+#define __POM_NG_DEFRAG_H__
+
+#include <pom-ng/base.h>
+#include <pom-ng/proto.h>
+#include <pom-ng/registry.h>
+
+// Maximum size of the addresses identifying a datagram
+#define DEFRAG_ADDR_MAX		16
+
+struct defrag_fragment {
+
+	void *src, *dst; // Addresses of the datagram
+	unsigned int addr_len;
+	uint32_t id; // Identification of the datagram
+	uint8_t proto; // Protocol number of the payload
+	void *parent; // Conntrack of the layer below, datagrams from different parents are never mixed
+	uint32_t offset; // Offset of the fragment in the datagram
+	void *data;
+	uint32_t len;
+	int more; // More fragments follow
+
+};
+
+struct defrag;
+
+struct defrag *defrag_alloc(struct proto *proto, struct registry_instance *ri);
+int defrag_cleanup(struct defrag *d);
+int defrag_process(struct defrag *d, struct defrag_fragment *f, struct packet *p, struct proto_process_stack *stack, unsigned int stack_index);
+
+#endif
@@ -41,12 +41,16 @@ struct input {
 	struct registry_perf *perf_pkts_in;
 	struct registry_perf *perf_bytes_in;
 	struct registry_perf *perf_runtime;
+	struct registry_perf *perf_cpu;
+
+	struct ptype *p_cpus;
 
 	int running;
 
 	void *priv;
 
 	pthread_t thread;
+	pid_t tid;
 
 	struct input *prev, *next;
 };
@@ -42,6 +42,8 @@ struct packet {
 	struct input *input; // Input the packet came from initially
 	struct packet_buffer *pkt_buff; // Structure pointing to the buffer information (if any)
 	struct packet_multipart *multipart; // Multipart details if the current packet is compose of multiple ones
+	void (*buff_release) (void *priv); // Called when the packet is released if the buffer belongs to the input
+	void *buff_release_priv;
 	unsigned int refcount; // Reference count
 	struct packet *prev, *next; // Used internally
 };
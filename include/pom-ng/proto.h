@@ -34,6 +34,9 @@
 // The listener needs the payload of the specified protocol
 #define PROTO_PACKET_LISTENER_PLOAD_ONLY	0x2
 
+// The protocol creates expectations for itself on numbers negotiated at runtime
+#define PROTO_REG_FLAG_EXPECTATIONS		0x1
+
 
 // Error code definition
 #define PROTO_STOP	1
@@ -71,6 +74,7 @@ struct proto_reg_info {
 	struct conntrack_info *ct_info;
 	struct proto_event_reg *events;
 	char *number_class;
+	unsigned int flags;
 
 	int (*init) (struct proto *proto, struct registry_instance *i);
 	int (*process) (void *proto_priv, struct packet *p, struct proto_process_stack *stack, unsigned int stack_index);
@@ -78,6 +82,12 @@ struct proto_reg_info {
 	int (*cleanup) (void *proto_priv);
 };
 
+// Number of a protocol that leads to a listened protocol
+struct proto_listened_number {
+	char *number_class;
+	unsigned int val;
+};
+
 struct proto_packet_listener {
 
 	int flags;
@@ -134,5 +144,11 @@ struct proto_reg_info *proto_get_info(struct proto *p);
 int proto_number_register(char *class, unsigned int proto_num, struct proto *p);
 struct proto *proto_get_by_number(struct proto *p, unsigned int num);
 
+/// Get the numbers leading to all the listened protocols, nums is NULL if all the traffic is needed
+int proto_listened_numbers_get(struct proto_listened_number **nums, unsigned int *count, uint32_t *serial);
+
+/// Get the serial of the listened numbers, increased each time they change
+uint32_t proto_listened_serial_get();
+
 int proto_add_param(struct proto *proto, struct registry_param *p);
 #endif
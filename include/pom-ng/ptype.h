@@ -52,7 +52,7 @@
 
 
 // Current ptype API version
-#define PTYPE_API_VER	1
+#define PTYPE_API_VER	2
 
 // Reserved for ptypes own usage
 #define PTYPE_FLAG_RESERVED	0xffff
@@ -157,6 +157,13 @@ struct ptype_reg_info {
 	 **/
 	 size_t (*value_size) (struct ptype *pt);
 
+	/// Size of the value if it never changes
+	/**
+	 * When set, the value can be stored inline in a bigger block instead of being
+	 * allocated by the alloc function. Leave it to 0 for variable size values.
+	 **/
+	size_t fixed_size;
+
 
 };
 
@@ -21,12 +21,18 @@
 #include "proto.h"
 #include "conntrack.h"
 #include "jhash.h"
+#include "siphash.h"
 #include "common.h"
 #include "ptype.h"
 #include "core.h"
 
 #include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stddef.h>
+#include <sys/time.h>
 #include <pom-ng/timer.h>
+#include <pom-ng/ptype_uint32.h>
 
 //#define DEBUG_CONNTRACK
 
@@ -36,6 +42,116 @@
 #define debug_conntrack(x ...)
 #endif
 
+static unsigned int conntrack_count = 0;
+
+static struct siphash_key conntrack_hash_key;
+static pthread_once_t conntrack_hash_key_once = PTHREAD_ONCE_INIT;
+
+static pthread_key_t conntrack_pool_key;
+static pthread_once_t conntrack_pool_key_once = PTHREAD_ONCE_INIT;
+
+static void conntrack_pool_destroy(void *priv) {
+
+	struct conntrack_pool *pool = priv;
+	while (pool->head) {
+		struct conntrack_entry_obj *obj = pool->head;
+		pool->head = obj->pool_next;
+		pthread_mutex_destroy(&obj->ce.lock);
+		free(obj);
+	}
+	free(pool);
+}
+
+static void conntrack_pool_key_init() {
+
+	int res = pthread_key_create(&conntrack_pool_key, conntrack_pool_destroy);
+	if (res) {
+		pomlog(POMLOG_ERR "Error while creating the conntrack pool key : %s", pom_strerror(res));
+		abort();
+	}
+}
+
+static struct conntrack_pool *conntrack_pool_get() {
+
+	pthread_once(&conntrack_pool_key_once, conntrack_pool_key_init);
+
+	struct conntrack_pool *pool = pthread_getspecific(conntrack_pool_key);
+	if (pool)
+		return pool;
+
+	pool = malloc(sizeof(struct conntrack_pool));
+	if (!pool) {
+		pom_oom(sizeof(struct conntrack_pool));
+		return NULL;
+	}
+	memset(pool, 0, sizeof(struct conntrack_pool));
+
+	int res = pthread_setspecific(conntrack_pool_key, pool);
+	if (res) {
+		pomlog(POMLOG_ERR "Error while setting the conntrack pool : %s", pom_strerror(res));
+		free(pool);
+		return NULL;
+	}
+
+	return pool;
+}
+
+// Allocate a conntrack with its nodes and cleanup timer, the lock is already initialized
+static struct conntrack_entry *conntrack_entry_alloc(struct proto *proto) {
+
+	struct conntrack_entry_obj *obj = NULL;
+	struct conntrack_pool *pool = conntrack_pool_get();
+
+	if (pool && pool->head) {
+		obj = pool->head;
+		pool->head = obj->pool_next;
+		pool->count--;
+
+		// Keep the lock initialized
+		memset(obj, 0, offsetof(struct conntrack_entry_obj, ce.lock));
+		memset((void*)obj + offsetof(struct conntrack_entry_obj, ce.lock) + sizeof(pthread_mutex_t), 0, sizeof(struct conntrack_entry_obj) - offsetof(struct conntrack_entry_obj, ce.lock) - sizeof(pthread_mutex_t));
+	} else {
+		obj = malloc(sizeof(struct conntrack_entry_obj));
+		if (!obj) {
+			pom_oom(sizeof(struct conntrack_entry_obj));
+			return NULL;
+		}
+		memset(obj, 0, sizeof(struct conntrack_entry_obj));
+
+		if (pom_mutex_init_type(&obj->ce.lock, PTHREAD_MUTEX_ERRORCHECK) != POM_OK) {
+			free(obj);
+			return NULL;
+		}
+	}
+
+	obj->ce.proto = proto;
+
+	return &obj->ce;
+}
+
+// The conntrack must not be locked
+static void conntrack_entry_free(struct conntrack_entry *ce) {
+
+	struct conntrack_entry_obj *obj = (struct conntrack_entry_obj *) ce;
+	struct conntrack_pool *pool = conntrack_pool_get();
+
+	if (pool && pool->count < CONNTRACK_POOL_MAX) {
+		obj->pool_next = pool->head;
+		pool->head = obj;
+		pool->count++;
+		return;
+	}
+
+	pthread_mutex_destroy(&ce->lock);
+	free(obj);
+}
+
+// Called once the handler of the cleanup timer is not running anymore
+static void conntrack_entry_release(void *priv) {
+
+	conntrack_entry_free(priv);
+}
+
 struct conntrack_tables* conntrack_table_alloc(size_t table_size, int has_rev) {
 
 	struct conntrack_tables *ct = malloc(sizeof(struct conntrack_tables));
@@ -45,33 +161,52 @@ struct conntrack_tables* conntrack_table_alloc(size_t table_size, int has_rev) {
 	}
 	memset(ct, 0, sizeof(struct conntrack_tables));
 
-
-	size_t size = sizeof(struct conntrack_list) * table_size;
-	ct->table = malloc(size);
-	if (!ct->table) {
-		pom_oom(size);
-		goto err;
+	int res = pthread_mutex_init(&ct->evict_lock, NULL);
+	if (res) {
+		pomlog(POMLOG_ERR "Could not initialize conntrack eviction lock : %s", pom_strerror(res));
+		free(ct);
+		return NULL;
 	}
-	memset(ct->table, 0, size);
 
-	size = sizeof(pthread_mutex_t) *table_size;
-	ct->locks = malloc(size);
-	if (!ct->locks) {
+	// Small tables don't need to be split
+	unsigned int segment_bits = 0;
+	while ((1 << segment_bits) < CONNTRACK_TABLE_SEGMENTS_MAX && ((size_t)CONNTRACK_SEGMENT_MIN_SIZE << (segment_bits + 1)) <= table_size)
+		segment_bits++;
+
+	unsigned int segment_count = 1 << segment_bits;
+	ct->segment_shift = 32 - segment_bits;
+
+	unsigned int segment_size = CONNTRACK_SEGMENT_MIN_SIZE;
+	while (CONNTRACK_SEGMENT_LOAD_MAX((size_t)segment_size * segment_count) < table_size)
+		segment_size <<= 1;
+
+	size_t size = sizeof(struct conntrack_segment) * segment_count;
+	ct->segments = malloc(size);
+	if (!ct->segments) {
 		pom_oom(size);
 		goto err;
-
 	}
+	memset(ct->segments, 0, size);
 
-	unsigned int i;
+	for (ct->segment_count = 0; ct->segment_count < segment_count; ct->segment_count++) {
+		struct conntrack_segment *seg = &ct->segments[ct->segment_count];
 
-	for (i = 0; i < table_size; i++) {
-		int res = pthread_mutex_init(&ct->locks[i], NULL);
+		size = sizeof(struct conntrack_slot) * segment_size;
+		seg->slots = malloc(size);
+		if (!seg->slots) {
+			pom_oom(size);
+			goto err;
+		}
+		memset(seg->slots, 0, size);
+		seg->mask = segment_size - 1;
+
+		res = pthread_mutex_init(&seg->lock, NULL);
 		if (res) {
 			pomlog(POMLOG_ERR "Could not initialize conntrack hash lock : %s", pom_strerror(res));
+			free(seg->slots);
 			goto err;
 		}
 	}
-	ct->table_size = table_size;
 
 	return ct;
 
@@ -81,132 +216,644 @@ err:
 }
 
 
-int conntrack_table_empty(struct conntrack_tables *ct) {
+int conntrack_table_empty(struct conntrack_tables *ct) {
+
+	if (!ct || !ct->segments)
+		return POM_ERR;
+
+	unsigned int i, j;
+	for (i = 0; i < ct->segment_count; i++) {
+		struct conntrack_segment *seg = &ct->segments[i];
+
+		// Entries move around when others are removed, loop until it's empty
+		while (seg->count) {
+			unsigned int count = seg->count;
+			for (j = 0; j <= seg->mask; j++) {
+				struct conntrack_slot *slot = &seg->slots[j];
+				while (slot->ce) {
+					struct conntrack_entry *ce = slot->ce;
+					conntrack_cleanup(ct, slot->hash, ce);
+					if (slot->ce == ce)
+						break;
+				}
+			}
+
+			if (seg->count == count) {
+				pomlog(POMLOG_WARN "Some conntracks could not be cleaned up");
+				break;
+			}
+		}
+	}
+
+	return POM_OK;
+}
+
+int conntrack_table_cleanup(struct conntrack_tables *ct) {
+
+	if (!ct)
+		return POM_OK;
+
+
+	if (ct->segments) {
+		conntrack_table_empty(ct);
+
+		unsigned int i;
+		for (i = 0; i < ct->segment_count; i++) {
+			struct conntrack_segment *seg = &ct->segments[i];
+			int res = pthread_mutex_destroy(&seg->lock);
+			if (res) {
+				pomlog(POMLOG_WARN "Error while destroying a hash lock : %s", pom_strerror(errno));
+			}
+
+			while (seg->retired) {
+				struct conntrack_slots_retired *tmp = seg->retired;
+				seg->retired = tmp->next;
+				free(tmp->slots);
+				free(tmp);
+			}
+			free(seg->slots);
+		}
+		free(ct->segments);
+	}
+
+	pthread_mutex_destroy(&ct->evict_lock);
+
+
+	free(ct);
+
+	return POM_OK;
+}
+
+static struct conntrack_segment *conntrack_table_segment(struct conntrack_tables *ct, uint32_t hash) {
+
+	if (ct->segment_count == 1)
+		return &ct->segments[0];
+
+	return &ct->segments[hash >> ct->segment_shift];
+}
+
+static void conntrack_segment_write_begin(struct conntrack_segment *seg) {
+	seg->seq++;
+	__sync_synchronize();
+}
+
+static void conntrack_segment_write_end(struct conntrack_segment *seg) {
+	__sync_synchronize();
+	seg->seq++;
+}
+
+static void conntrack_key_init(struct conntrack_key *key, struct ptype *a, struct ptype *b) {
+
+	key->val = 0;
+	key->len = 0;
+
+	// Only values of fixed size types can be compared as raw bytes
+	if (!ptype_get_fixed_size(a->type) || (b && !ptype_get_fixed_size(b->type)))
+		return;
+
+	size_t size_a = ptype_get_value_size(a);
+	size_t size_b = (b ? ptype_get_value_size(b) : 0);
+	if (size_a + size_b > CONNTRACK_KEY_INLINE_MAX)
+		return;
+
+	memcpy(&key->val, a->value, size_a);
+	if (b)
+		memcpy((void*)&key->val + size_a, b->value, size_b);
+	key->len = size_a + size_b;
+}
+
+static unsigned int conntrack_probe_hist_bucket(struct conntrack_segment *seg, unsigned int idx, uint32_t hash) {
+
+	unsigned int probes = ((idx - hash) & seg->mask) + 1;
+
+	unsigned int bucket = 0;
+	// Buckets are 1, 2, 3-4, 5-8, 9-16 and more
+	while (bucket < CONNTRACK_PROBE_HIST_COUNT - 1 && probes > (1U << bucket))
+		bucket++;
+
+	return bucket;
+}
+
+// The segment must be locked and marked as being written
+static int conntrack_segment_add(struct conntrack_segment *seg, uint32_t hash, struct conntrack_key *key, void *parent, struct conntrack_entry *ce) {
+
+	unsigned int idx = hash & seg->mask, home = idx;
+	while (seg->slots[idx].ce)
+		idx = (idx + 1) & seg->mask;
+
+	struct conntrack_slot *slot = &seg->slots[idx];
+	slot->hash = hash;
+	slot->key_len = (key ? key->len : 0);
+	slot->key = (key ? key->val : 0);
+	slot->parent = parent;
+	slot->ce = ce;
+	seg->count++;
+	seg->probe_hist[conntrack_probe_hist_bucket(seg, idx, hash)]++;
+
+	return (idx != home);
+}
+
+static int conntrack_segment_grow(struct conntrack_segment *seg) {
+
+	unsigned int old_mask = seg->mask;
+	struct conntrack_slot *old_slots = seg->slots;
+
+	size_t size = sizeof(struct conntrack_slot) * (old_mask + 1) * 2;
+	struct conntrack_slot *slots = malloc(size);
+	if (!slots) {
+		pom_oom(size);
+		return POM_ERR;
+	}
+	memset(slots, 0, size);
+
+	struct conntrack_slots_retired *retired = malloc(sizeof(struct conntrack_slots_retired));
+	if (!retired) {
+		pom_oom(sizeof(struct conntrack_slots_retired));
+		free(slots);
+		return POM_ERR;
+	}
+
+	// Lockless readers load the mask first, it must never be bigger than the slots they see
+	__atomic_store_n(&seg->slots, slots, __ATOMIC_RELEASE);
+	__atomic_store_n(&seg->mask, (old_mask << 1) | 1, __ATOMIC_RELEASE);
+	seg->count = 0;
+	memset(seg->probe_hist, 0, sizeof(seg->probe_hist));
+
+	unsigned int i;
+	for (i = 0; i <= old_mask; i++) {
+		struct conntrack_slot *slot = &old_slots[i];
+		if (!slot->ce)
+			continue;
+		struct conntrack_key key = { slot->key, slot->key_len };
+		conntrack_segment_add(seg, slot->hash, &key, slot->parent, slot->ce);
+	}
+
+	// Lockless readers might still be browsing the old slots
+	retired->slots = old_slots;
+	retired->next = seg->retired;
+	seg->retired = retired;
+
+	return POM_OK;
+}
+
+static int conntrack_segment_insert(struct conntrack_segment *seg, uint32_t hash, struct conntrack_key *key, void *parent, struct conntrack_entry *ce) {
+
+	conntrack_segment_write_begin(seg);
+
+	if (seg->count + 1 > CONNTRACK_SEGMENT_LOAD_MAX(seg->mask + 1) && conntrack_segment_grow(seg) != POM_OK) {
+		conntrack_segment_write_end(seg);
+		return POM_ERR;
+	}
+
+	int res = conntrack_segment_add(seg, hash, key, parent, ce);
+
+	conntrack_segment_write_end(seg);
+
+	return res;
+}
+
+// The segment must be locked
+static struct conntrack_slot *conntrack_segment_find_ce(struct conntrack_segment *seg, uint32_t hash, struct conntrack_entry *ce) {
+
+	unsigned int idx = hash & seg->mask;
+	for (; seg->slots[idx].ce; idx = (idx + 1) & seg->mask) {
+		if (seg->slots[idx].ce == ce)
+			return &seg->slots[idx];
+	}
+
+	return NULL;
+}
+
+static void conntrack_segment_remove(struct conntrack_segment *seg, struct conntrack_slot *slot) {
+
+	conntrack_segment_write_begin(seg);
+
+	// Shift back the following entries so lookups never stop too early
+	unsigned int hole = slot - seg->slots;
+	seg->probe_hist[conntrack_probe_hist_bucket(seg, hole, slot->hash)]--;
+
+	unsigned int idx = (hole + 1) & seg->mask;
+	while (seg->slots[idx].ce) {
+		uint32_t hash = seg->slots[idx].hash;
+		unsigned int home = hash & seg->mask;
+		// Move the entry if its home isn't between the hole and its current position
+		if (((idx - home) & seg->mask) >= ((idx - hole) & seg->mask)) {
+			seg->probe_hist[conntrack_probe_hist_bucket(seg, idx, hash)]--;
+			seg->probe_hist[conntrack_probe_hist_bucket(seg, hole, hash)]++;
+			seg->slots[hole] = seg->slots[idx];
+			hole = idx;
+		}
+		idx = (idx + 1) & seg->mask;
+	}
+	memset(&seg->slots[hole], 0, sizeof(struct conntrack_slot));
+	seg->count--;
+
+	conntrack_segment_write_end(seg);
+}
+
+static int conntrack_slot_match(struct conntrack_slot *slot, uint32_t hash, struct conntrack_key *key, struct ptype *fwd_value, struct ptype *rev_value, struct conntrack_entry *parent) {
+
+	if (slot->hash != hash)
+		return 0;
+
+	if (key->len)
+		return (slot->key_len == key->len && slot->key == key->val && slot->parent == parent);
+
+	return conntrack_match(slot->ce, fwd_value, rev_value, parent);
+}
+
+// The segment must be locked
+static struct conntrack_entry *conntrack_segment_lookup(struct conntrack_segment *seg, uint32_t hash, struct conntrack_key *key_fwd, struct conntrack_key *key_rev, struct ptype *fwd_value, struct ptype *rev_value, struct conntrack_entry *parent, int *dir) {
+
+	struct conntrack_entry *res_rev = NULL;
+
+	unsigned int idx = hash & seg->mask;
+	for (; seg->slots[idx].ce; idx = (idx + 1) & seg->mask) {
+		struct conntrack_slot *slot = &seg->slots[idx];
+
+		// Prefer a match in the forward direction
+		if (conntrack_slot_match(slot, hash, key_fwd, fwd_value, rev_value, parent)) {
+			*dir = POM_DIR_FWD;
+			return slot->ce;
+		}
+
+		if (key_rev && !res_rev && conntrack_slot_match(slot, hash, key_rev, rev_value, fwd_value, parent))
+			res_rev = slot->ce;
+	}
+
+	*dir = POM_DIR_REV;
+	return res_rev;
+}
+
+// Only valid for inline keys, the entries must not be dereferenced without the lock
+static struct conntrack_entry *conntrack_segment_lookup_lockless(struct conntrack_segment *seg, uint32_t hash, struct conntrack_key *key_fwd, struct conntrack_key *key_rev, struct conntrack_entry *parent, int *dir, unsigned int *seq) {
+
+	struct conntrack_entry *res = NULL;
+
+	do {
+		*seq = __atomic_load_n(&seg->seq, __ATOMIC_ACQUIRE);
+		if (*seq & 1)
+			continue;
+
+		unsigned int mask = __atomic_load_n(&seg->mask, __ATOMIC_ACQUIRE);
+		struct conntrack_slot *slots = __atomic_load_n(&seg->slots, __ATOMIC_ACQUIRE);
+		struct conntrack_entry *res_rev = NULL;
+		res = NULL;
+
+		unsigned int idx = hash & mask, probes;
+		for (probes = 0; probes <= mask; probes++, idx = (idx + 1) & mask) {
+			struct conntrack_slot slot = slots[idx];
+			if (!slot.ce)
+				break;
+			if (slot.hash != hash || slot.parent != parent || slot.key_len != key_fwd->len)
+				continue;
+			if (slot.key == key_fwd->val) {
+				res = slot.ce;
+				break;
+			}
+			if (key_rev && !res_rev && slot.key == key_rev->val)
+				res_rev = slot.ce;
+		}
+
+		*dir = POM_DIR_FWD;
+		if (!res && res_rev) {
+			res = res_rev;
+			*dir = POM_DIR_REV;
+		}
+
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+	} while ((*seq & 1) || *seq != __atomic_load_n(&seg->seq, __ATOMIC_RELAXED));
+
+	return res;
+}
+
+static void conntrack_hash_key_init() {
+
+	// Random key so the hash distribution can't be predicted from the traffic
+	int fd = open("/dev/urandom", O_RDONLY);
+	if (fd != -1) {
+		if (read(fd, &conntrack_hash_key, sizeof(conntrack_hash_key)) == sizeof(conntrack_hash_key)) {
+			close(fd);
+			return;
+		}
+		close(fd);
+	}
+
+	pomlog(POMLOG_WARN "Could not read /dev/urandom, conntrack hash key will be weak");
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	conntrack_hash_key.k0 = ((uint64_t)tv.tv_sec << 32) ^ tv.tv_usec;
+	conntrack_hash_key.k1 = ((uint64_t)getpid() << 32) ^ (uint64_t)&tv;
+}
+
+uint32_t conntrack_hash(struct ptype *a, struct ptype *b, void *parent) {
+
+	if (!a)
+		return POM_ERR;
+
+	pthread_once(&conntrack_hash_key_once, conntrack_hash_key_init);
+
+	struct siphash_state state;
+	siphash_init(&state, &conntrack_hash_key);
+	siphash_update(&state, &parent, sizeof(parent));
+
+	size_t size_a = ptype_get_value_size(a);
+
+	if (b) {
+		// Hash the values in a fixed order so that both directions give the same result
+		size_t size_b = ptype_get_value_size(b);
+		int cmp = memcmp(a->value, b->value, (size_a < size_b ? size_a : size_b));
+		if (cmp > 0 || (!cmp && size_a > size_b)) {
+			struct ptype *tmp = a;
+			a = b;
+			b = tmp;
+			size_t tmp_size = size_a;
+			size_a = size_b;
+			size_b = tmp_size;
+		}
+		siphash_update(&state, a->value, size_a);
+		siphash_update(&state, b->value, size_b);
+	} else {
+		siphash_update(&state, a->value, size_a);
+	}
+
+	uint64_t hash = siphash_final(&state);
+	return (uint32_t) (hash ^ (hash >> 32));
+}
+
+static int conntrack_probe_hist_update(uint64_t *cur_val, void *priv) {
+
+	struct conntrack_probe_hist *hist = priv;
+	struct conntrack_tables *ct = hist->ct;
+
+	// The segments keep their histogram up to date, no need to browse the slots
+	uint64_t count = 0;
+	unsigned int i;
+	for (i = 0; i < ct->segment_count; i++)
+		count += __atomic_load_n(&ct->segments[i].probe_hist[hist->bucket], __ATOMIC_RELAXED);
+
+	*cur_val = count;
+
+	return POM_OK;
+}
+
+int conntrack_table_add_perfs(struct conntrack_tables *ct, struct registry_instance *ri) {
+
+	static const char *names[CONNTRACK_PROBE_HIST_COUNT] = { "conn_probe_1", "conn_probe_2", "conn_probe_3_4", "conn_probe_5_8", "conn_probe_9_16", "conn_probe_17_more" };
+	static const char *descrs[CONNTRACK_PROBE_HIST_COUNT] = {
+		"Number of conntracks found at their hash position",
+		"Number of conntracks found after 2 probes",
+		"Number of conntracks found after 3 to 4 probes",
+		"Number of conntracks found after 5 to 8 probes",
+		"Number of conntracks found after 9 to 16 probes",
+		"Number of conntracks found after more than 16 probes" };
+
+	unsigned int i;
+	for (i = 0; i < CONNTRACK_PROBE_HIST_COUNT; i++) {
+		struct registry_perf *perf = registry_instance_add_perf(ri, names[i], registry_perf_type_gauge, descrs[i], "connections");
+		if (!perf)
+			return POM_ERR;
+		ct->probe_hist[i].ct = ct;
+		ct->probe_hist[i].bucket = i;
+		registry_perf_set_update_hook(perf, conntrack_probe_hist_update, &ct->probe_hist[i]);
+	}
+
+	return POM_OK;
+}
+
+
+int conntrack_match(struct conntrack_entry *ce, struct ptype *fwd_value, struct ptype *rev_value, struct conntrack_entry *parent) {
+
+	if (!fwd_value || !ce->fwd_value)
+		return 0;
+
+	// Check the parent conntrack
+	if (ce->parent && ce->parent->ce != parent)
+		return 0;
+
+	// Check the forward value
+	if (!ptype_compare_val(PTYPE_OP_EQ, ce->fwd_value, fwd_value))
+		return 0;
+
+	// Check the reverse value if present
+	if (ce->rev_value)  {
+		if (!rev_value) {
+			// Conntrack_entry has a reverse value but none was provided
+			return 0;
+		}
+
+		if (!ptype_compare_val(PTYPE_OP_EQ, ce->rev_value, rev_value))
+			return 0;
+
+	} else if (rev_value) {
+		// Conntrack entry does not have a reverse value but one was provided
+		return 0;
+	}
+
+	return 1;
+}
+
+// The conntrack must be locked and already removed from its table
+static int conntrack_cleanup_removed(struct conntrack_entry *ce) {
+
+	// The cleanup timer is part of the conntrack allocation, it is released once everything else is cleaned up
+	struct timer *cleanup_timer = NULL;
+	if (ce->cleanup_timer && ce->cleanup_timer != (void *) -1)
+		cleanup_timer = ce->cleanup_timer->timer;
+	ce->cleanup_timer = (void *) -1; // Mark that the conntrack is being cleaned up
+
+	// Once the conntrack is removed from the hash table, it will not be referenced ever again
+	conntrack_unlock(ce);
+
+	if (ce->parent) {
+		debug_conntrack("Cleaning up conntrack %p, with parent %p", ce, ce->parent->ce);
+	} else {
+		debug_conntrack("Cleaning up conntrack %p, with no parent", ce);
+	}
+
+	
+	if (ce->parent) {
+		// Remove the child from the parent
+		
+		// Make sure the parent still exists
+		struct conntrack_segment *parent_seg = conntrack_table_segment(ce->parent->ct, ce->parent->hash);
+		pom_mutex_lock(&parent_seg->lock);
+
+		if (conntrack_segment_find_ce(parent_seg, ce->parent->hash, ce->parent->ce)) {
+
+			conntrack_lock(ce->parent->ce);
+			struct conntrack_node_list *tmp = ce->parent->ce->children;
+
+			for (; tmp && tmp->ce != ce; tmp = tmp->next);
+
+			if (tmp) {
+				if (tmp->prev)
+					tmp->prev->next = tmp->next;
+				else
+					ce->parent->ce->children = tmp->next;
+
+				if (tmp->next)
+					tmp->next->prev = tmp->prev;
+
+			} else {
+				pomlog(POMLOG_WARN "Conntrack %s not found in parent's %s children list", ce, ce->parent->ce);
+			}
+
+			if (!ce->parent->ce->children) // Parent has no child anymore, clean it up after some time
+				conntrack_delayed_cleanup(ce->parent->ce, CONNTRACK_CHILDLESS_TIMEOUT, core_get_clock_last());
+
+			conntrack_unlock(ce->parent->ce);
+		} else {
+			debug_conntrack("Parent conntrack %p not found while cleaning child %p !", ce->parent->ce, ce);
+		}
+
+		pom_mutex_unlock(&parent_seg->lock);
+	}
+
+	if (ce->session)
+		conntrack_session_refcount_dec(ce->session);
+
+	// Cleanup private stuff from the conntrack
+	if (ce->priv && ce->proto->info->ct_info->cleanup_handler) {
+		if (ce->proto->info->ct_info->cleanup_handler(ce->priv) != POM_OK)
+			pomlog(POMLOG_WARN "Unable to free the private memory of a conntrack");
+	}
+
+	// Cleanup the priv_list
+	struct conntrack_priv_list *priv_lst = ce->priv_list;
+	while (priv_lst) {
+		if (priv_lst->cleanup) {
+			if (priv_lst->cleanup(priv_lst->obj, priv_lst->priv) != POM_OK)
+				pomlog(POMLOG_WARN "Error while cleaning up private objects in conntrack_entry");
+		}
+		ce->priv_list = priv_lst->next;
+		free(priv_lst);
+		priv_lst = ce->priv_list;
+
+	}
+
 
-	if (!ct || !ct->table)
-		return POM_ERR;
+	// Cleanup the children
+	while (ce->children) {
+		struct conntrack_node_list *child = ce->children;
+		ce->children = child->next;
 
-	unsigned int i;
-	for (i = 0; i < ct->table_size; i++) {
-		while (ct->table[i]) {
-			struct conntrack_list *tmp = ct->table[i];
-			conntrack_cleanup(ct, tmp->ce->hash, tmp->ce);
-		}
+		if (conntrack_cleanup(child->ct, child->hash, child->ce) != POM_OK) 
+			return POM_ERR;
 	}
 
-	return POM_OK;
-}
+	
+	if (ce->fwd_value)
+		ptype_cleanup(ce->fwd_value);
+	if (ce->rev_value)
+		ptype_cleanup(ce->rev_value);
 
-int conntrack_table_cleanup(struct conntrack_tables *ct) {
+	registry_perf_dec(ce->proto->perf_conn_cur, 1);
+	__sync_fetch_and_sub(&ce->proto->ct->count, 1);
+	__sync_fetch_and_sub(&conntrack_count, 1);
 
-	if (!ct)
-		return POM_OK;
+	// If the cleanup timer is firing on another thread, the conntrack is reused only once its handler returned
+	if (cleanup_timer)
+		timer_release(cleanup_timer, conntrack_entry_release, ce);
+	else
+		conntrack_entry_free(ce);
 
+	return POM_OK;
+}
 
-	if (ct->table) {
-		conntrack_table_empty(ct);
-		free(ct->table);
-	}
+static unsigned int conntrack_table_over_limit(struct proto *proto) {
 
-	if (ct->locks) {
-		unsigned int i;
-		for (i = 0; i < ct->table_size; i++) {
-			int res = pthread_mutex_destroy(&ct->locks[i]);
-			if (res) {
-				pomlog(POMLOG_WARN "Error while destroying a hash lock : %s", pom_strerror(errno));
-			}
-		}
-		free(ct->locks);
-	}
+	unsigned int over = 0;
 
+	unsigned int max = *PTYPE_UINT32_GETVAL(proto->param_conntrack_max);
+	unsigned int count = proto->ct->count;
+	if (max && count > max)
+		over = count - max;
 
-	free(ct);
+	max = core_get_conntrack_max();
+	count = conntrack_count;
+	if (max && count > max && count - max > over)
+		over = count - max;
 
-	return POM_OK;
+	return over;
 }
 
+// Free some conntracks using the CLOCK algorithm
+// The first pass only evicts half-open or payload-less connections
+static void conntrack_table_evict(struct proto *proto, unsigned int count) {
 
-uint32_t conntrack_hash(struct ptype *a, struct ptype *b, void *parent) {
+	struct conntrack_tables *ct = proto->ct;
 
-	// Create a reversible hash for a and b
-	if (!a)
-		return POM_ERR;
+	// Another thread is already evicting from this table
+	if (pthread_mutex_trylock(&ct->evict_lock))
+		return;
 
-	// Use the parent pointer as an init value
-	uint32_t parent_initval = (uint32_t) ((uint64_t)parent & 0xFFFFFFFF);
-	size_t size_a = ptype_get_value_size(a);
+	if (count > CONNTRACK_EVICT_BATCH)
+		count = CONNTRACK_EVICT_BATCH;
 
-	if (!b) {
-		// Only fwd direction
-		// Try to use the best hash function
-		if (size_a == sizeof(uint32_t)) { // exactly one word
-			return jhash_1word(*((uint32_t*)a->value), parent_initval);
-		} else if (size_a == 2 * sizeof(uint32_t))  { // exactly two words
-			return jhash_2words(*((uint32_t*)a->value), *((uint32_t*)(a->value + sizeof(uint32_t))), parent_initval);
-		} else if (size_a == 3 * sizeof(uint32_t)) { // exactly 3 words
-			return jhash_3words(*((uint32_t*)a->value), *((uint32_t*)(a->value + sizeof(uint32_t))), *((uint32_t*)(a->value + (2 * sizeof(uint32_t)))), parent_initval);
-		}
+	unsigned int evicted = 0, pass;
+	for (pass = 0; pass < 2 && evicted < count; pass++) {
 
-		// Fallback on all size function
-		return jhash((char*)a->value, size_a, parent_initval);
+		unsigned int scanned;
+		for (scanned = 0; scanned < CONNTRACK_EVICT_SCAN && evicted < count; scanned++) {
 
-	}
-	 
-	size_t size_b = ptype_get_value_size(b);
+			struct conntrack_segment *seg = &ct->segments[ct->evict_seg];
+			pom_mutex_lock(&seg->lock);
 
-	// Try to use the best hash function
-	if (size_a == sizeof(uint16_t) && size_b == sizeof(uint16_t)) { // Multiply the two 16bit values
-		uint32_t value_a = *((uint16_t*)a->value);
-		uint32_t value_b = *((uint16_t*)b->value);
-		return jhash_1word(value_a * value_b, parent_initval);
-	} else if (size_a == sizeof(uint32_t) && size_b == sizeof(uint32_t)) { // XOR the two 32bit values before hashing
-		return jhash_1word(*((uint32_t*)a->value) ^ *((uint32_t*)b->value), parent_initval);
-	}
+			if (ct->evict_idx > seg->mask) {
+				pom_mutex_unlock(&seg->lock);
+				ct->evict_idx = 0;
+				ct->evict_seg = (ct->evict_seg + 1) % ct->segment_count;
+				continue;
+			}
 
-	uint32_t hash_a = jhash((char*)a->value, size_a, parent_initval);
-	uint32_t hash_b = jhash((char*)b->value, size_b, parent_initval);
-	return hash_a ^ hash_b;
-}
+			struct conntrack_slot *slot = &seg->slots[ct->evict_idx];
+			struct conntrack_entry *ce = slot->ce;
+			int weak = 0;
 
+			if (ce && !pthread_mutex_trylock(&ce->lock)) {
 
-struct conntrack_entry *conntrack_find(struct conntrack_list *lst, struct ptype *fwd_value, struct ptype *rev_value, struct conntrack_entry *parent) {
+				weak = !(ce->flags & CONNTRACK_FLAG_BIDIR);
 
-	if (!fwd_value)
-		return NULL;
+				// Never evict unique conntracks or parents of other conntracks
+				if (ce->refcount || !ce->fwd_value || ce->children || (!weak && !pass)) {
+					ce = NULL;
+				} else if (ce->flags & CONNTRACK_FLAG_REFERENCED) {
+					// Give it a second chance
+					ce->flags &= ~CONNTRACK_FLAG_REFERENCED;
+					ce = NULL;
+				}
 
+				if (!ce)
+					conntrack_unlock(slot->ce);
+			} else {
+				ce = NULL;
+			}
 
-	for (; lst; lst = lst->next) {
-		struct conntrack_entry *ce = lst->ce;
+			if (ce) {
+				// The next entry might be shifted in this slot, don't move the hand
+				conntrack_segment_remove(seg, slot);
+			} else {
+				ct->evict_idx++;
+			}
 
-		// Check the parent conntrack
-		if (ce->parent && ce->parent->ce != parent)
-			continue;
+			pom_mutex_unlock(&seg->lock);
 
-		// Check the forward value
-		if (!ptype_compare_val(PTYPE_OP_EQ, ce->fwd_value, fwd_value))
-			continue;
-		
-		// Check the reverse value if present
-		if (ce->rev_value)  {
-			if (!rev_value) {
-				// Conntrack_entry has a reverse value but none was provided
+			if (!ce)
 				continue;
-			}
 
-			if (!ptype_compare_val(PTYPE_OP_EQ, ce->rev_value, rev_value))
-				continue;
+			debug_conntrack("Evicting conntrack %p", ce);
+			conntrack_cleanup_removed(ce);
+			evicted++;
 
-		} else if (rev_value) {
-			// Conntrack entry does not have a reverse value but one was provided
-			continue;
+			registry_perf_inc(proto->perf_conn_evicted, 1);
+			if (weak)
+				registry_perf_inc(proto->perf_conn_evicted_weak, 1);
 		}
-
-		return ce;
-
 	}
 
-	// No conntrack entry found
-	return NULL;
+	pom_mutex_unlock(&ct->evict_lock);
 }
 
 int conntrack_get_unique(struct proto_process_stack *stack, unsigned int stack_index) {
@@ -228,63 +875,45 @@ int conntrack_get_unique(struct proto_process_stack *stack, unsigned int stack_i
 		return POM_OK;
 	}
 
+	// The unique conntrack has no key, no parent and is stored with a hash of 0
 	struct conntrack_tables *ct = s->proto->ct;
-	pom_mutex_lock(&ct->locks[0]);
+	struct conntrack_segment *seg = conntrack_table_segment(ct, 0);
+	pom_mutex_lock(&seg->lock);
 
-	struct conntrack_list *lst = ct->table[0];
+	unsigned int idx;
+	for (idx = 0; seg->slots[idx].ce && (seg->slots[idx].hash || seg->slots[idx].parent || seg->slots[idx].ce->fwd_value); idx = (idx + 1) & seg->mask);
 
-	for (lst = ct->table[0]; lst && lst->ce->parent; lst = lst->next);
-
-	if (lst) {
-		// Conntrack found
-		s->ce = lst->ce;
-		pom_mutex_unlock(&ct->locks[0]);
+	if (seg->slots[idx].ce) {
+		// Conntrack found, pin it before releasing the segment
+		s->ce = seg->slots[idx].ce;
+		__sync_fetch_and_add(&s->ce->refcount, 1);
+		pom_mutex_unlock(&seg->lock);
 	} else {
 		// Alloc the conntrack
-		struct conntrack_entry *res = NULL;
-		res = malloc(sizeof(struct conntrack_entry));
+		struct conntrack_entry *res = conntrack_entry_alloc(s->proto);
 		if (!res) {
-			pom_oom(sizeof(struct conntrack_entry));
-			pom_mutex_unlock(&ct->locks[0]);
-			return POM_ERR;
-		}
-
-		memset(res, 0, sizeof(struct conntrack_entry));
-		res->proto = s->proto;
-
-		if (pom_mutex_init_type(&res->lock, PTHREAD_MUTEX_ERRORCHECK) != POM_OK) {
-			pom_mutex_unlock(&ct->locks[0]);
-			free(res);
+			pom_mutex_unlock(&seg->lock);
 			return POM_ERR;
 		}
 
-		// Alloc the list node
-		lst = malloc(sizeof(struct conntrack_list));
-		if (!lst) {
-			pom_oom(sizeof(struct conntrack_list));
-			pom_mutex_unlock(&ct->locks[0]);
-			pthread_mutex_destroy(&res->lock);
-			free(res);
+		// Add the conntrack to the table
+		if (conntrack_segment_insert(seg, 0, NULL, NULL, res) < 0) {
+			pom_mutex_unlock(&seg->lock);
+			conntrack_entry_free(res);
 			return POM_ERR;
 		}
-		memset(lst, 0, sizeof(struct conntrack_list));
-		lst->ce = res;
-
-		// Add the conntrack to the table
-		lst->next = ct->table[0];
-		if (lst->next)
-			lst->next->prev = lst;
-		ct->table[0] = lst;
-		pom_mutex_unlock(&ct->locks[0]);
+		__sync_fetch_and_add(&res->refcount, 1);
+		pom_mutex_unlock(&seg->lock);
 		debug_conntrack("Allocated unique conntrack %p", res);
 
 		registry_perf_inc(s->proto->perf_conn_cur, 1);
 		registry_perf_inc(s->proto->perf_conn_tot, 1);
+		__sync_fetch_and_add(&ct->count, 1);
+		__sync_fetch_and_add(&conntrack_count, 1);
 		s->ce = res;
 	}
 
 	conntrack_lock(s->ce);
-	__sync_fetch_and_add(&s->ce->refcount, 1);
 
 	struct proto_process_stack *s_next = &stack[stack_index + 1];
 	s_next->direction = s->direction;
@@ -296,7 +925,6 @@ int conntrack_get_unique(struct proto_process_stack *stack, unsigned int stack_i
 int conntrack_get_unique_from_parent(struct proto_process_stack *stack, unsigned int stack_index) {
 
 	struct conntrack_node_list *child = NULL;
-	struct conntrack_list *lst = NULL;
 
 	struct proto_process_stack *s = &stack[stack_index];
 	struct proto_process_stack *s_prev = &stack[stack_index - 1];
@@ -341,71 +969,54 @@ int conntrack_get_unique_from_parent(struct proto_process_stack *stack, unsigned
 	if (!res) {
 
 		// Alloc the conntrack
-		res = malloc(sizeof(struct conntrack_entry));
-		if (!res) {
-			pom_oom(sizeof(struct conntrack_entry));
+		res = conntrack_entry_alloc(s->proto);
+		if (!res)
 			goto err;
-		}
 
-		memset(res, 0, sizeof(struct conntrack_entry));
-		res->proto = s->proto;
-
-		if (pom_mutex_init_type(&res->lock, PTHREAD_MUTEX_ERRORCHECK) != POM_OK)
-			goto err;
+		struct conntrack_entry_obj *obj = (struct conntrack_entry_obj *) res;
 
-		// Alloc the child list
-		child = malloc(sizeof(struct conntrack_node_list));
-		if (!child) 
-			goto err;
-		
-		memset(child, 0, sizeof(struct conntrack_node_list));
+		child = &obj->child_node;
 		child->ce = res;
 		child->ct = ct;
 
-		// Alloc the parent node
-		res->parent = malloc(sizeof(struct conntrack_node_list));
-		if (!res->parent) {
-			free(child);
-			goto err;
-		}
-		memset(res->parent, 0, sizeof(struct conntrack_node_list));
+		res->parent = &obj->parent_node;
 		res->parent->ce = parent;
 		res->parent->ct = parent->proto->ct;
 		res->parent->hash = parent->hash;
 
-		// Alloc the list node
-		lst = malloc(sizeof(struct conntrack_list));
-		if (!lst) {
-			pom_oom(sizeof(struct conntrack_list));
+		// There is only one of these per parent, spread them using the conntrack address
+		uint64_t addr = (uint64_t) res;
+		res->hash = jhash_2words((uint32_t) addr, (uint32_t) (addr >> 32), 0);
+		child->hash = res->hash;
+
+		// Add the conntrack to the table
+		struct conntrack_segment *seg = conntrack_table_segment(ct, res->hash);
+		pom_mutex_lock(&seg->lock);
+		if (conntrack_segment_insert(seg, res->hash, NULL, parent, res) < 0) {
+			pom_mutex_unlock(&seg->lock);
 			goto err;
 		}
-		memset(lst, 0, sizeof(struct conntrack_list));
-		lst->ce = res;
+		pom_mutex_unlock(&seg->lock);
 
 		// Add the child to the parent
 		child->next = parent->children;
 		if (child->next)
 			child->next->prev = child;
 		parent->children = child;
-
-		// Add the conntrack to the table
-		pom_mutex_lock(&ct->locks[0]);
-		lst->next = ct->table[0];
-		if (lst->next)
-			lst->next->prev = lst;
-		ct->table[0] = lst;
-		pom_mutex_unlock(&ct->locks[0]);
 		debug_conntrack("Allocated conntrack %p with parent %p (uniq child)", res, parent);
 
 		registry_perf_inc(s->proto->perf_conn_cur, 1);
 		registry_perf_inc(s->proto->perf_conn_tot, 1);
+		__sync_fetch_and_add(&ct->count, 1);
+		__sync_fetch_and_add(&conntrack_count, 1);
 
 	}
 
+	// Pin the conntrack before releasing the parent
+	__sync_fetch_and_add(&res->refcount, 1);
 	conntrack_unlock(parent);
 
 	conntrack_lock(res);
-	__sync_fetch_and_add(&res->refcount, 1);
 	s->ce = res;
 	s->direction = s_prev->direction;
 
@@ -415,13 +1026,9 @@ int conntrack_get_unique_from_parent(struct proto_process_stack *stack, unsigned
 	return POM_OK;
 
 err:
-	if (res) {
-		pthread_mutex_destroy(&res->lock);
-		free(res);
-	}
+	if (res)
+		conntrack_entry_free(res);
 
-	if (child)
-		free(child);
 	conntrack_unlock(parent);
 
 	return POM_ERR;
@@ -454,47 +1061,51 @@ int conntrack_get(struct proto_process_stack *stack, unsigned int stack_index) {
 
 	struct conntrack_tables *ct = s->proto->ct;
 
-	uint32_t hash = conntrack_hash(fwd_value, rev_value, s_prev->ce) % ct->table_size;
+	uint32_t hash = conntrack_hash(fwd_value, rev_value, s_prev->ce);
+	struct conntrack_segment *seg = conntrack_table_segment(ct, hash);
 
-	// Lock the specific hash while browsing for a conntrack
-	pom_mutex_lock(&ct->locks[hash]);
+	struct conntrack_key key_fwd = { 0 }, key_rev = { 0 };
+	conntrack_key_init(&key_fwd, fwd_value, rev_value);
+	if (rev_value)
+		conntrack_key_init(&key_rev, rev_value, fwd_value);
+	struct conntrack_key *key = &key_fwd;
 
-	// Try to find the conntrack in the forward table
+	int dir = POM_DIR_FWD;
+	unsigned int seq = 0;
+	struct conntrack_entry *found = NULL;
 
-	// Check if we can find this entry in the forward way
-	if (ct->table[hash]) {
-		s->ce = conntrack_find(ct->table[hash], fwd_value, rev_value, s_prev->ce);
-		if (s->ce) {
-			int dir = POM_DIR_FWD;
+	// Probe the slots before taking the lock when the values fit in them
+	// The slots are then browsed again under the lock only if they changed
+	if (key_fwd.len)
+		found = conntrack_segment_lookup_lockless(seg, hash, &key_fwd, (rev_value ? &key_rev : NULL), s_prev->ce, &dir, &seq);
 
-			if (fwd_value && rev_value && ptype_compare_val(PTYPE_OP_EQ, fwd_value, rev_value)) {
-				// The conntrack could match in both direction
-				// Use the previous stack for the direction
-				dir = s_prev->direction;
-			}
+	// The lock is needed in any case to pin the conntrack found or to add a new one
+	pom_mutex_lock(&seg->lock);
 
-			s->direction = dir;
-			s_next->direction = dir;
-			pom_mutex_lock(&s->ce->lock);
-			__sync_fetch_and_add(&s->ce->refcount, 1);
-			pom_mutex_unlock(&ct->locks[hash]);
-			return POM_OK;;
-		}
-	}
+	// The result of the probe, hit or miss, stands only if nothing changed since
+	if (!key_fwd.len || seg->seq != seq)
+		found = conntrack_segment_lookup(seg, hash, &key_fwd, (rev_value ? &key_rev : NULL), fwd_value, rev_value, s_prev->ce, &dir);
 
+	if (found) {
 
-	// It wasn't found in the forward way, maybe in the reverse direction ?
-	if (rev_value) {
-		s->ce = conntrack_find(ct->table[hash], rev_value, fwd_value, s_prev->ce);
-		if (s->ce) {
-			s->direction = POM_DIR_REV;
-			s_next->direction = POM_DIR_REV;
-			pom_mutex_lock(&s->ce->lock);
-			__sync_fetch_and_add(&s->ce->refcount, 1);
-			pom_mutex_unlock(&ct->locks[hash]);
-			return POM_OK;
+		unsigned int flags = CONNTRACK_FLAG_REFERENCED;
+		if (dir == POM_DIR_REV)
+			flags |= CONNTRACK_FLAG_BIDIR;
+
+		if (dir == POM_DIR_FWD && rev_value && ptype_compare_val(PTYPE_OP_EQ, fwd_value, rev_value)) {
+			// The conntrack could match in both direction
+			// Use the previous stack for the direction
+			dir = s_prev->direction;
 		}
 
+		s->ce = found;
+		s->direction = dir;
+		s_next->direction = dir;
+		pom_mutex_lock(&s->ce->lock);
+		s->ce->flags |= flags;
+		__sync_fetch_and_add(&s->ce->refcount, 1);
+		pom_mutex_unlock(&seg->lock);
+		return POM_OK;
 	}
 
 	// It's not found in the reverse direction either, let's create it then
@@ -505,24 +1116,18 @@ int conntrack_get(struct proto_process_stack *stack, unsigned int stack_index) {
 		struct ptype *tmp = rev_value;
 		rev_value = fwd_value;
 		fwd_value = tmp;
+		key = &key_rev;
 	}
 
 
 	// Alloc the conntrack entry
-	struct conntrack_entry *ce = malloc(sizeof(struct conntrack_entry));
+	struct conntrack_entry *ce = conntrack_entry_alloc(s->proto);
 	if (!ce) {
-		pom_mutex_unlock(&ct->locks[hash]);
-		pom_oom(sizeof(struct conntrack_entry));
-		return POM_ERR;
-	}
-	memset(ce, 0, sizeof(struct conntrack_entry));
-
-	if (pom_mutex_init_type(&ce->lock, PTHREAD_MUTEX_ERRORCHECK) != POM_OK) {
-		pom_mutex_unlock(&ct->locks[hash]);
-		free(ce);
+		pom_mutex_unlock(&seg->lock);
 		return POM_ERR;
 	}
 
+	struct conntrack_entry_obj *obj = (struct conntrack_entry_obj *) ce;
 	struct conntrack_node_list *child = NULL;
 
 	// We shouldn't have to check if the parent still exists as it
@@ -531,41 +1136,20 @@ int conntrack_get(struct proto_process_stack *stack, unsigned int stack_index) {
 	// was called by core_process_stack.
 	if (s_prev->ce) {
 
-		child = malloc(sizeof(struct conntrack_node_list));
-		if (!child) {
-			pthread_mutex_destroy(&ce->lock);
-			pom_mutex_unlock(&ct->locks[hash]);
-			free(ce);
-			pom_oom(sizeof(struct conntrack_node_list));
-			return POM_ERR;
-		}
-		memset(child, 0, sizeof(struct conntrack_node_list));
-
+		child = &obj->child_node;
 		child->ce = ce;
 		child->ct = s->proto->ct;
 		child->hash = hash;
 
-		ce->parent = malloc(sizeof(struct conntrack_node_list));
-		if (!ce->parent) {
-			pthread_mutex_destroy(&ce->lock);
-			pom_mutex_unlock(&ct->locks[hash]);
-			free(child);
-			free(ce);
-			pom_oom(sizeof(struct conntrack_node_list));
-			return POM_ERR;
-		}
+		ce->parent = &obj->parent_node;
 		ce->parent->ce = s_prev->ce;
 		ce->parent->ct = s_prev->ce->proto->ct;
 		ce->parent->hash = s_prev->ce->hash;
 
 	}
 
-	ce->proto = s->proto;
-
 	ce->hash = hash;
 
-	struct conntrack_list *lst = NULL;
-
 	ce->fwd_value = ptype_alloc_from(fwd_value);
 	if (!ce->fwd_value)
 		goto err;
@@ -575,22 +1159,13 @@ int conntrack_get(struct proto_process_stack *stack, unsigned int stack_index) {
 		if (!ce->rev_value)
 			goto err;
 	}
-	// Alloc the list node
-	lst = malloc(sizeof(struct conntrack_list));
-	if (!lst) {
-		pom_oom(sizeof(struct conntrack_list));
-		goto err;
-	}
-	memset(lst, 0, sizeof(struct conntrack_list));
-	lst->ce = ce;
 
 	// Insert in the conntrack table
-	lst->next = ct->table[hash];
-	if (lst->next) {
-		lst->next->prev = lst;
+	int res = conntrack_segment_insert(seg, hash, key, s_prev->ce, ce);
+	if (res < 0)
+		goto err;
+	else if (res)
 		registry_perf_inc(s->proto->perf_conn_hash_col, 1);
-	}
-	ct->table[hash] = lst;
 
 	// Add the child to the parent if any
 	if (child) {
@@ -612,7 +1187,7 @@ int conntrack_get(struct proto_process_stack *stack, unsigned int stack_index) {
 	}
 	pom_mutex_lock(&ce->lock);
 	__sync_fetch_and_add(&ce->refcount, 1);
-	pom_mutex_unlock(&ct->locks[hash]);
+	pom_mutex_unlock(&seg->lock);
 
 	s->ce = ce;
 	s->direction = s_prev->direction;
@@ -623,25 +1198,26 @@ int conntrack_get(struct proto_process_stack *stack, unsigned int stack_index) {
 	registry_perf_inc(ce->proto->perf_conn_cur, 1);
 	registry_perf_inc(ce->proto->perf_conn_tot, 1);
 
+	__sync_fetch_and_add(&ct->count, 1);
+	__sync_fetch_and_add(&conntrack_count, 1);
+
+	// Make some room if we are above the limits
+	unsigned int over = conntrack_table_over_limit(s->proto);
+	if (over)
+		conntrack_table_evict(s->proto, over);
+
 	return POM_OK;
 
 err:
-	pom_mutex_unlock(&ct->locks[hash]);
-
-	pthread_mutex_destroy(&ce->lock);
-	if (child)
-		free(child);
+	pom_mutex_unlock(&seg->lock);
 
-	if (ce->parent)
-		free(ce->parent);
-	
 	if (ce->fwd_value)
 		ptype_cleanup(ce->fwd_value);
 
 	if (ce->rev_value)
 		ptype_cleanup(ce->rev_value);
 
-	free(ce);
+	conntrack_entry_free(ce);
 
 	return POM_ERR;
 }
@@ -720,12 +1296,9 @@ void conntrack_remove_priv(struct conntrack_entry *ce, void *obj) {
 int conntrack_delayed_cleanup(struct conntrack_entry *ce, unsigned int delay, ptime now) {
 
 	if (!delay) {
-		if (ce->cleanup_timer && ce->cleanup_timer != (void*)-1) {
-			timer_dequeue(ce->cleanup_timer->timer);
-			timer_cleanup(ce->cleanup_timer->timer);
-			free(ce->cleanup_timer);
-			ce->cleanup_timer = NULL;
-		}
+		// Keep the timer initialized, its handler might still be running on another thread
+		if (ce->cleanup_timer && ce->cleanup_timer != (void*)-1)
+			timer_release(ce->cleanup_timer->timer, NULL, NULL);
 		return POM_OK;
 	}
 
@@ -735,17 +1308,14 @@ int conntrack_delayed_cleanup(struct conntrack_entry *ce, unsigned int delay, pt
 	}
 
 	if (!ce->cleanup_timer) {
-		ce->cleanup_timer = malloc(sizeof(struct conntrack_timer));
-		if (!ce->cleanup_timer) {
-			pom_oom(sizeof(struct conntrack_timer));
-			return POM_ERR;
-		}
-		ce->cleanup_timer->timer = timer_alloc(ce->cleanup_timer, conntrack_timed_cleanup);
-		if (!ce->cleanup_timer->timer) {
-			free(ce->cleanup_timer);
-			ce->cleanup_timer = NULL;
-			return POM_ERR;
-		}
+		// The cleanup timer is allocated along with the conntrack
+		struct conntrack_entry_obj *obj = (struct conntrack_entry_obj *) ce;
+		struct conntrack_timer *t = &obj->cleanup_timer;
+		memset(t, 0, sizeof(struct conntrack_timer));
+		t->timer = &obj->cleanup_wheel_timer;
+		timer_init(t->timer, t, conntrack_timed_cleanup);
+
+		ce->cleanup_timer = t;
 
 		ce->cleanup_timer->ce = ce;
 		ce->cleanup_timer->proto = ce->proto;
@@ -762,154 +1332,74 @@ int conntrack_delayed_cleanup(struct conntrack_entry *ce, unsigned int delay, pt
 
 int conntrack_timed_cleanup(void *timer, ptime now) {
 
+	// The timer is part of the conntrack allocation which is released only once this handler returns
 	struct conntrack_timer *t = timer;
-	return conntrack_cleanup(t->proto->ct, t->hash, t->ce);
-
-}
-
-int conntrack_cleanup(struct conntrack_tables *ct, uint32_t hash, struct conntrack_entry *ce) {
-
-	// Remove the conntrack from the conntrack table
-	pom_mutex_lock(&ct->locks[hash]);
-
-	// Try to find the conntrack in the list
-	struct conntrack_list *lst = NULL;
+	struct conntrack_entry *ce = t->ce;
+	uint32_t hash = t->hash;
 
-	for (lst = ct->table[hash]; lst && lst->ce != ce; lst = lst->next);
+	struct conntrack_segment *seg = conntrack_table_segment(t->proto->ct, hash);
+	pom_mutex_lock(&seg->lock);
 
-	if (!lst) {
-		pom_mutex_unlock(&ct->locks[hash]);
-		pomlog(POMLOG_ERR "Trying to cleanup a non existing conntrack : %p", ce);
+	struct conntrack_slot *slot = conntrack_segment_find_ce(seg, hash, ce);
+	if (!slot) {
+		// Evicted or cleaned up while the timer was firing
+		pom_mutex_unlock(&seg->lock);
 		return POM_OK;
 	}
 
 	conntrack_lock(ce);
-	if (ce->refcount) {
-		debug_conntrack(POMLOG_ERR "Conntrack %p is still being referenced : %u !", ce, ce->refcount);
-		conntrack_delayed_cleanup(ce, 1, core_get_clock_last());
+
+	// The cleanup was delayed again while we were waiting for the lock
+	if (timer_is_queued(t->timer)) {
 		conntrack_unlock(ce);
-		pom_mutex_unlock(&ct->locks[hash]);
+		pom_mutex_unlock(&seg->lock);
 		return POM_OK;
 	}
 
-
-	if (lst->prev)
-		lst->prev->next = lst->next;
-	else
-		ct->table[hash] = lst->next;
-
-	if (lst->next)
-		lst->next->prev = lst->prev;
-
-	free(lst);
-
-	pom_mutex_unlock(&ct->locks[hash]);
-
-	if (ce->cleanup_timer && ce->cleanup_timer != (void *) -1) {
-		conntrack_timer_cleanup(ce->cleanup_timer);
-		ce->cleanup_timer = (void *) -1; // Mark that the conntrack is being cleaned up
-	}
-
-	// Once the conntrack is removed from the hash table, it will not be referenced ever again
-	conntrack_unlock(ce);
-
-	if (ce->parent) {
-		debug_conntrack("Cleaning up conntrack %p, with parent %p", ce, ce->parent->ce);
-	} else {
-		debug_conntrack("Cleaning up conntrack %p, with no parent", ce);
+	if (ce->refcount) {
+		debug_conntrack("Conntrack %p is still being referenced : %u !", ce, ce->refcount);
+		conntrack_delayed_cleanup(ce, 1, now);
+		conntrack_unlock(ce);
+		pom_mutex_unlock(&seg->lock);
+		return POM_OK;
 	}
 
-	
-	if (ce->parent) {
-		// Remove the child from the parent
-		
-		// Make sure the parent still exists
-		uint32_t hash = ce->parent->hash;
-		pom_mutex_lock(&ce->parent->ct->locks[hash]);
-		
-		for (lst = ce->parent->ct->table[hash]; lst && lst->ce != ce->parent->ce; lst = lst->next);
-
-		if (lst) {
-
-			conntrack_lock(ce->parent->ce);
-			struct conntrack_node_list *tmp = ce->parent->ce->children;
-
-			for (; tmp && tmp->ce != ce; tmp = tmp->next);
-
-			if (tmp) {
-				if (tmp->prev)
-					tmp->prev->next = tmp->next;
-				else
-					ce->parent->ce->children = tmp->next;
-
-				if (tmp->next)
-					tmp->next->prev = tmp->prev;
-
-				free(tmp);
-			} else {
-				pomlog(POMLOG_WARN "Conntrack %s not found in parent's %s children list", ce, ce->parent->ce);
-			}
-
-			if (!ce->parent->ce->children) // Parent has no child anymore, clean it up after some time
-				conntrack_delayed_cleanup(ce->parent->ce, CONNTRACK_CHILDLESS_TIMEOUT, core_get_clock_last());
-
-			conntrack_unlock(ce->parent->ce);
-		} else {
-			debug_conntrack("Parent conntrack %p not found while cleaning child %p !", ce->parent->ce, ce);
-		}
+	conntrack_segment_remove(seg, slot);
 
-		pom_mutex_unlock(&ce->parent->ct->locks[hash]);
+	pom_mutex_unlock(&seg->lock);
 
-		free(ce->parent);
-	}
+	return conntrack_cleanup_removed(ce);
+}
 
-	if (ce->session)
-		conntrack_session_refcount_dec(ce->session);
+int conntrack_cleanup(struct conntrack_tables *ct, uint32_t hash, struct conntrack_entry *ce) {
 
-	// Cleanup private stuff from the conntrack
-	if (ce->priv && ce->proto->info->ct_info->cleanup_handler) {
-		if (ce->proto->info->ct_info->cleanup_handler(ce->priv) != POM_OK)
-			pomlog(POMLOG_WARN "Unable to free the private memory of a conntrack");
-	}
+	// Remove the conntrack from the conntrack table
+	struct conntrack_segment *seg = conntrack_table_segment(ct, hash);
+	pom_mutex_lock(&seg->lock);
 
-	// Cleanup the priv_list
-	struct conntrack_priv_list *priv_lst = ce->priv_list;
-	while (priv_lst) {
-		if (priv_lst->cleanup) {
-			if (priv_lst->cleanup(priv_lst->obj, priv_lst->priv) != POM_OK)
-				pomlog(POMLOG_WARN "Error while cleaning up private objects in conntrack_entry");
-		}
-		ce->priv_list = priv_lst->next;
-		free(priv_lst);
-		priv_lst = ce->priv_list;
+	// Try to find the conntrack in the table
+	struct conntrack_slot *slot = conntrack_segment_find_ce(seg, hash, ce);
 
+	if (!slot) {
+		pom_mutex_unlock(&seg->lock);
+		pomlog(POMLOG_ERR "Trying to cleanup a non existing conntrack : %p", ce);
+		return POM_OK;
 	}
 
-
-	// Cleanup the children
-	while (ce->children) {
-		struct conntrack_node_list *child = ce->children;
-		ce->children = child->next;
-
-		if (conntrack_cleanup(child->ct, child->hash, child->ce) != POM_OK) 
-			return POM_ERR;
-
-		free(child);
+	conntrack_lock(ce);
+	if (ce->refcount) {
+		debug_conntrack(POMLOG_ERR "Conntrack %p is still being referenced : %u !", ce, ce->refcount);
+		conntrack_delayed_cleanup(ce, 1, core_get_clock_last());
+		conntrack_unlock(ce);
+		pom_mutex_unlock(&seg->lock);
+		return POM_OK;
 	}
 
-	
-	if (ce->fwd_value)
-		ptype_cleanup(ce->fwd_value);
-	if (ce->rev_value)
-		ptype_cleanup(ce->rev_value);
-
-	pthread_mutex_destroy(&ce->lock);
-
-	registry_perf_dec(ce->proto->perf_conn_cur, 1);
+	conntrack_segment_remove(seg, slot);
 
-	free(ce);
+	pom_mutex_unlock(&seg->lock);
 
-	return POM_OK;
+	return conntrack_cleanup_removed(ce);
 }
 
 struct conntrack_timer *conntrack_timer_alloc(struct conntrack_entry *ce, int (*handler) (struct conntrack_entry *ce, void *priv, ptime now), void *priv) {
@@ -949,6 +1439,14 @@ int conntrack_timer_dequeue(struct conntrack_timer *t) {
 	return timer_dequeue(t->timer);
 }
 
+// Called once the handler of the timer is not running anymore
+static void conntrack_timer_free(void *priv) {
+
+	struct conntrack_timer *t = priv;
+	timer_cleanup(t->timer);
+	free(t);
+}
+
 int conntrack_timer_cleanup(struct conntrack_timer *t) {
 
 #ifdef DEBUG_CONNTRACK
@@ -963,8 +1461,10 @@ int conntrack_timer_cleanup(struct conntrack_timer *t) {
 	}
 #endif
 
-	timer_cleanup(t->timer);
-	free(t);
+	// The handler might be waiting for the conntrack lock on another thread
+	t->released = 1;
+	timer_release(t->timer, conntrack_timer_free, t);
+
 	return POM_OK;
 
 }
@@ -975,17 +1475,14 @@ int conntrack_timer_process(void *priv, ptime now) {
 
 	struct conntrack_tables *ct = t->proto->ct;
 
-	// Lock the main table
-	pom_mutex_lock(&ct->locks[t->hash]);
+	// Lock the table segment
+	struct conntrack_segment *seg = conntrack_table_segment(ct, t->hash);
+	pom_mutex_lock(&seg->lock);
 
 	// Check if the conntrack still exists
-
-	struct conntrack_list *lst = NULL;
-	for (lst = ct->table[t->hash]; lst && lst->ce != t->ce; lst = lst->next);
-
-	if (!lst) {
+	if (!conntrack_segment_find_ce(seg, t->hash, t->ce)) {
 		pomlog(POMLOG_DEBUG "Timer fired but conntrack doesn't exists anymore");
-		pom_mutex_unlock(&ct->locks[t->hash]);
+		pom_mutex_unlock(&seg->lock);
 		return POM_OK;
 	}
 
@@ -993,9 +1490,16 @@ int conntrack_timer_process(void *priv, ptime now) {
 	// Save the reference to the conntrack as the timer might get cleaned up
 	struct conntrack_entry *ce = t->ce;
 
-	// The handler will unlock the conntrack
 	conntrack_lock(ce);
-	pom_mutex_unlock(&ct->locks[t->hash]);
+	pom_mutex_unlock(&seg->lock);
+
+	// Cleaned up or queued again while we were waiting for the lock
+	if (t->released || timer_is_queued(t->timer)) {
+		conntrack_unlock(ce);
+		return POM_OK;
+	}
+
+	// The handler will unlock the conntrack
 	
 	int res = t->handler(ce, t->priv, now);
 	
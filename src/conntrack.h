@@ -25,12 +25,74 @@
 #include <pom-ng/proto.h>
 #include <pom-ng/conntrack.h>
 
+#include "timer.h"
+
 #define CONNTRACK_CHILDLESS_TIMEOUT	10
 
+// Each table is split in independent segments which grow on their own
+#define CONNTRACK_TABLE_SEGMENTS_MAX	64
+#define CONNTRACK_SEGMENT_MIN_SIZE	64
+#define CONNTRACK_SEGMENT_LOAD_MAX(x)	(((x) * 3) / 4)
+
+// Conntracks are evicted in small batches when the limits are reached
+#define CONNTRACK_EVICT_BATCH		8
+#define CONNTRACK_EVICT_SCAN		1024
+
+// Maximum number of free conntracks kept by each thread
+#define CONNTRACK_POOL_MAX		4096
+
+// Conntrack flags
+#define CONNTRACK_FLAG_REFERENCED	0x1 // Used since the last eviction scan
+#define CONNTRACK_FLAG_BIDIR		0x2 // Packets were seen in both directions
+
+// Maximum size of the forward and reverse values to be stored in the slots
+#define CONNTRACK_KEY_INLINE_MAX	8
+
+struct conntrack_key {
+	uint64_t val; // Forward value followed by the reverse value
+	uint32_t len; // 0 if the values don't fit
+};
+
+struct conntrack_slot {
+	uint32_t hash;
+	uint32_t key_len;
+	uint64_t key;
+	void *parent;
+	struct conntrack_entry *ce; // NULL if the slot is free
+};
+
+struct conntrack_slots_retired {
+	struct conntrack_slot *slots;
+	struct conntrack_slots_retired *next;
+};
+
+// Number of probe length ranges reported, see conntrack_table_add_perfs()
+#define CONNTRACK_PROBE_HIST_COUNT	6
+
+struct conntrack_segment {
+	pthread_mutex_t lock; // Taken to modify the segment or to pin one of its conntracks
+	volatile unsigned int seq; // Odd while the segment is being modified
+	struct conntrack_slot *slots;
+	unsigned int mask;
+	unsigned int count;
+	unsigned int probe_hist[CONNTRACK_PROBE_HIST_COUNT]; // Number of entries per probe length range
+	struct conntrack_slots_retired *retired; // Lockless readers may still be looking at those
+};
+
+struct conntrack_probe_hist {
+	struct conntrack_tables *ct;
+	unsigned int bucket;
+};
+
 struct conntrack_tables {
-	struct conntrack_list **table;
-	pthread_mutex_t *locks;
-	size_t table_size;
+	struct conntrack_segment *segments;
+	unsigned int segment_count;
+	unsigned int segment_shift;
+	struct conntrack_probe_hist probe_hist[CONNTRACK_PROBE_HIST_COUNT];
+
+	unsigned int count;
+	pthread_mutex_t evict_lock;
+	unsigned int evict_seg, evict_idx; // Position of the clock hand
 };
 
 struct conntrack_session {
@@ -56,15 +118,33 @@ struct conntrack_timer {
 	uint32_t hash;
 	int (*handler) (struct conntrack_entry *ce, void *priv, ptime now);
 	void *priv;
+	int released; // Cleaned up, the handler must not run anymore
 
 	struct conntrack_timer *prev, *next;
 };
 
+// Everything a conntrack needs, allocated at once
+struct conntrack_entry_obj {
+	struct conntrack_entry ce; // Must be first
+	struct conntrack_node_list parent_node; // Pointed by ce.parent
+	struct conntrack_node_list child_node; // Our node in the parent's children list
+	struct conntrack_timer cleanup_timer;
+	struct timer cleanup_wheel_timer; // Pointed by cleanup_timer.timer
+	struct conntrack_entry_obj *pool_next;
+};
+
+// Per thread cache of free conntracks
+struct conntrack_pool {
+	struct conntrack_entry_obj *head;
+	unsigned int count;
+};
+
 struct conntrack_tables* conntrack_table_alloc(size_t table_size, int has_rev);
 int conntrack_table_empty(struct conntrack_tables *ct);
 int conntrack_table_cleanup(struct conntrack_tables *ct);
+int conntrack_table_add_perfs(struct conntrack_tables *ct, struct registry_instance *ri);
 uint32_t conntrack_hash(struct ptype *a, struct ptype *b, void *parent);
-struct conntrack_entry *conntrack_find(struct conntrack_list *lst, struct ptype *fwd_value, struct ptype *rev_value, struct conntrack_entry *parent);
+int conntrack_match(struct conntrack_entry *ce, struct ptype *fwd_value, struct ptype *rev_value, struct conntrack_entry *parent);
 int conntrack_timed_cleanup(void *timer, ptime now);
 int conntrack_cleanup(struct conntrack_tables *ct, uint32_t hash, struct conntrack_entry *ce);
 
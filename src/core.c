@@ -31,9 +31,15 @@
 #include "analyzer.h"
 #include "dns.h"
 #include "pload.h"
+#include "jhash.h"
 
 #include <pom-ng/ptype_bool.h>
 #include <pom-ng/ptype_string.h>
+#include <pom-ng/ptype_uint32.h>
+
+#include <netinet/in.h>
+#include <sched.h>
+#include <sys/syscall.h>
 
 #if 0
 #define debug_core(x ...) pomlog(POMLOG_DEBUG x)
@@ -51,15 +57,27 @@ static ptime core_start_time;
 static struct core_processing_thread *core_processing_threads[CORE_PROCESS_THREAD_MAX];
 static unsigned int core_num_threads = 0;
 static pthread_rwlock_t core_processing_lock = PTHREAD_RWLOCK_INITIALIZER;
-static volatile unsigned int core_pkt_queue_count = 0;
+// Keeps the perf hooks from reading a thread's queue while it's being freed
+static pthread_mutex_t core_processing_threads_lock = PTHREAD_MUTEX_INITIALIZER;
 
+// Inputs waiting for some room in the processing threads queues
+static volatile unsigned int core_pkt_queue_waiting = 0;
 static pthread_mutex_t core_pkt_queue_wait_lock = PTHREAD_MUTEX_INITIALIZER;
 static pthread_cond_t core_pkt_queue_wait_cond = PTHREAD_COND_INITIALIZER;
 
 static volatile ptime core_clock[CORE_PROCESS_THREAD_MAX] = { 0 };
 
 static struct registry_class *core_registry_class = NULL;
-static struct ptype *core_param_dump_pkt = NULL, *core_param_offline_dns = NULL, *core_param_reset_perf_on_restart = NULL, *core_param_http_admin_password = NULL;
+static struct ptype *core_param_dump_pkt = NULL, *core_param_offline_dns = NULL, *core_param_reset_perf_on_restart = NULL, *core_param_http_admin_password = NULL, *core_param_flow_affinity = NULL, *core_param_pkt_batch_size = NULL, *core_param_processing_cpus = NULL, *core_param_conntrack_max = NULL, *core_param_stream_buff_max = NULL;
+
+// CPUs assigned to the processing threads
+static unsigned int core_processing_cpus[CORE_CPU_LIST_MAX] = { 0 };
+static unsigned int core_processing_cpus_count = 0;
+static volatile unsigned int core_processing_cpus_serial = 0;
+static pthread_mutex_t core_processing_cpus_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Datalinks understood by the flow hash pre-parser
+static struct proto *core_proto_ethernet = NULL, *core_proto_ipv4 = NULL, *core_proto_ipv6 = NULL;
 
 // Perf objects
 struct registry_perf *perf_pkt_queue = NULL;
@@ -67,6 +85,148 @@ struct registry_perf *perf_thread_active = NULL;
 struct registry_perf *perf_pkt_dropped = NULL;
 
 
+static unsigned int core_processing_thread_queue_count(struct core_processing_thread *t) {
+
+	// Read the head first so the tail can never be behind it
+	unsigned int head = __atomic_load_n(&t->pkt_queue_head, __ATOMIC_ACQUIRE);
+	unsigned int tail = __atomic_load_n(&t->pkt_queue_tail, __ATOMIC_ACQUIRE);
+
+	return tail - head;
+}
+
+static int core_perf_pkt_queue(uint64_t *value, void *priv) {
+
+	uint64_t count = 0;
+
+	pom_mutex_lock(&core_processing_threads_lock);
+	unsigned int i;
+	for (i = 0; i < core_num_threads; i++) {
+		struct core_processing_thread *t = core_processing_threads[i];
+		if (t)
+			count += core_processing_thread_queue_count(t);
+	}
+	pom_mutex_unlock(&core_processing_threads_lock);
+
+	*value = count;
+
+	return POM_OK;
+}
+
+static int core_processing_thread_queue_empty(struct core_processing_thread *t) {
+
+	unsigned int head = t->pkt_queue_head;
+	struct core_packet_queue *slot = &t->pkt_queue[head & (CORE_THREAD_PKT_QUEUE_MAX - 1)];
+
+	return (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != head + 1);
+}
+
+static void core_processing_thread_wake(struct core_processing_thread *t) {
+
+	pom_mutex_lock(&t->pkt_queue_lock);
+	int res = pthread_cond_signal(&t->pkt_queue_cond);
+	if (res) {
+		pomlog(POMLOG_ERR "Error while signaling the thread pkt_queue restart condition : %s", pom_strerror(res));
+		abort();
+	}
+	pom_mutex_unlock(&t->pkt_queue_lock);
+}
+
+// Add a packet to a thread's ring. Can be called by multiple inputs at the same time
+static int core_processing_thread_enqueue(struct core_processing_thread *t, struct packet *p) {
+
+	unsigned int pos = __atomic_load_n(&t->pkt_queue_tail, __ATOMIC_RELAXED);
+
+	while (1) {
+		struct core_packet_queue *slot = &t->pkt_queue[pos & (CORE_THREAD_PKT_QUEUE_MAX - 1)];
+		unsigned int seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+		int diff = (int) (seq - pos);
+
+		if (diff < 0) // The thread didn't release this slot yet, the ring is full
+			return POM_ERR;
+
+		if (!diff) {
+			if (__atomic_compare_exchange_n(&t->pkt_queue_tail, &pos, pos + 1, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+			// pos was updated with the current tail, try again
+		} else {
+			// Another input took that slot in the meantime
+			pos = __atomic_load_n(&t->pkt_queue_tail, __ATOMIC_RELAXED);
+		}
+	}
+
+	struct core_packet_queue *slot = &t->pkt_queue[pos & (CORE_THREAD_PKT_QUEUE_MAX - 1)];
+	slot->pkt = p;
+	__atomic_store_n(&slot->seq, pos + 1, __ATOMIC_SEQ_CST);
+
+	// Only bother with the lock if the thread is sleeping
+	if (__atomic_load_n(&t->waiting, __ATOMIC_SEQ_CST))
+		core_processing_thread_wake(t);
+
+	return POM_OK;
+}
+
+// Get the next packet from a thread's ring. Must only be called by the thread owning the ring
+static struct packet *core_processing_thread_dequeue(struct core_processing_thread *t) {
+
+	unsigned int head = t->pkt_queue_head;
+	struct core_packet_queue *slot = &t->pkt_queue[head & (CORE_THREAD_PKT_QUEUE_MAX - 1)];
+
+	if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != head + 1)
+		return NULL;
+
+	struct packet *p = slot->pkt;
+	slot->pkt = NULL;
+
+	// Give back the slot to the inputs
+	__atomic_store_n(&slot->seq, head + CORE_THREAD_PKT_QUEUE_MAX, __ATOMIC_RELEASE);
+	__atomic_store_n(&t->pkt_queue_head, head + 1, __ATOMIC_SEQ_CST);
+
+	return p;
+}
+
+static int core_param_processing_cpus_update(void *priv, struct registry_param *p, struct ptype *value) {
+
+	unsigned int cpus[CORE_CPU_LIST_MAX];
+	int count = core_cpu_list_parse(PTYPE_STRING_GETVAL(value), cpus, CORE_CPU_LIST_MAX);
+	if (count == POM_ERR)
+		return POM_ERR;
+
+	pom_mutex_lock(&core_processing_cpus_lock);
+	memcpy(core_processing_cpus, cpus, sizeof(unsigned int) * count);
+	core_processing_cpus_count = count;
+	// The threads will pin themselves when they notice the change
+	core_processing_cpus_serial++;
+	pom_mutex_unlock(&core_processing_cpus_lock);
+
+	unsigned int i;
+	for (i = 0; i < core_num_threads; i++)
+		core_processing_thread_wake(core_processing_threads[i]);
+
+	return POM_OK;
+}
+
+static int core_processing_thread_set_cpus(struct core_processing_thread *t) {
+
+	pom_mutex_lock(&core_processing_cpus_lock);
+	unsigned int count = core_processing_cpus_count;
+	unsigned int cpu = (count ? core_processing_cpus[t->thread_id % count] : 0);
+	t->cpus_serial = core_processing_cpus_serial;
+	pom_mutex_unlock(&core_processing_cpus_lock);
+
+	if (count) {
+		if (core_thread_set_cpus(&cpu, 1) != POM_OK)
+			return POM_OK;
+		pomlog(POMLOG_INFO "Processing thread %u pinned to CPU %u", t->thread_id, cpu);
+	} else {
+		if (core_thread_set_cpus(NULL, 0) != POM_OK)
+			return POM_OK;
+	}
+
+	// Drop the unused packet_info so new ones are allocated on the memory node of our CPU
+	// The pool and its layout are kept as conntracks and streams still reference some of its blocks
+	return packet_info_pool_trim();
+}
+
 int core_init(unsigned int num_threads) {
 
 	struct registry_param *param = NULL;
@@ -82,6 +242,8 @@ int core_init(unsigned int num_threads) {
 	if (!perf_pkt_queue || !perf_thread_active || !perf_pkt_dropped)
 		return POM_ERR;
 
+	registry_perf_set_update_hook(perf_pkt_queue, core_perf_pkt_queue, NULL);
+
 	core_param_dump_pkt = ptype_alloc("bool");
 	if (!core_param_dump_pkt)
 		goto err;
@@ -98,6 +260,26 @@ int core_init(unsigned int num_threads) {
 	if (!core_param_http_admin_password)
 		goto err;
 
+	core_param_flow_affinity = ptype_alloc("bool");
+	if (!core_param_flow_affinity)
+		goto err;
+
+	core_param_pkt_batch_size = ptype_alloc_unit("uint32", "pkts");
+	if (!core_param_pkt_batch_size)
+		goto err;
+
+	core_param_processing_cpus = ptype_alloc("string");
+	if (!core_param_processing_cpus)
+		goto err;
+
+	core_param_conntrack_max = ptype_alloc_unit("uint32", "connections");
+	if (!core_param_conntrack_max)
+		goto err;
+
+	core_param_stream_buff_max = ptype_alloc_unit("uint32", "bytes");
+	if (!core_param_stream_buff_max)
+		goto err;
+
 	param = registry_new_param("dump_pkt", "no", core_param_dump_pkt, "Dump packets to logs", REGISTRY_PARAM_FLAG_CLEANUP_VAL);
 	if (registry_class_add_param(core_registry_class, param) != POM_OK)
 		goto err;
@@ -113,6 +295,30 @@ int core_init(unsigned int num_threads) {
 	param = registry_new_param("http_admin_password", "", core_param_http_admin_password, "HTTP password for the user admin", REGISTRY_PARAM_FLAG_CLEANUP_VAL);
 	if (registry_class_add_param(core_registry_class, param) != POM_OK)
 		goto err;
+
+	param = registry_new_param("flow_affinity", "yes", core_param_flow_affinity, "Process all the packets of a connection in the same thread", REGISTRY_PARAM_FLAG_CLEANUP_VAL);
+	if (registry_class_add_param(core_registry_class, param) != POM_OK)
+		goto err;
+
+	param = registry_new_param("pkt_batch_size", CORE_THREAD_PKT_BATCH_DEFAULT, core_param_pkt_batch_size, "Maximum number of packets processed by a thread at once", REGISTRY_PARAM_FLAG_CLEANUP_VAL);
+	if (registry_param_info_set_min_max(param, 1, CORE_THREAD_PKT_BATCH_MAX) != POM_OK)
+		goto err;
+	if (registry_class_add_param(core_registry_class, param) != POM_OK)
+		goto err;
+
+	param = registry_new_param("processing_cpus", "", core_param_processing_cpus, "List of CPUs to pin the processing threads to, one per thread (ex: 1,2,4-7)", REGISTRY_PARAM_FLAG_CLEANUP_VAL);
+	if (registry_param_set_callbacks(param, NULL, NULL, core_param_processing_cpus_update) != POM_OK)
+		goto err;
+	if (registry_class_add_param(core_registry_class, param) != POM_OK)
+		goto err;
+
+	param = registry_new_param("conntrack_max", CORE_CONNTRACK_MAX_DEFAULT, core_param_conntrack_max, "Maximum number of connections tracked by all the protocols, 0 for no limit", REGISTRY_PARAM_FLAG_CLEANUP_VAL);
+	if (registry_class_add_param(core_registry_class, param) != POM_OK)
+		goto err;
+
+	param = registry_new_param("stream_buff_max", CORE_STREAM_BUFF_MAX_DEFAULT, core_param_stream_buff_max, "Maximum number of bytes buffered by all the streams waiting for missing packets, 0 for no limit", REGISTRY_PARAM_FLAG_CLEANUP_VAL);
+	if (registry_class_add_param(core_registry_class, param) != POM_OK)
+		goto err;
 	
 	param = NULL;
 
@@ -154,9 +360,23 @@ int core_init(unsigned int num_threads) {
 
 		tmp->thread_id = i;
 
+		size_t queue_size = sizeof(struct core_packet_queue) * CORE_THREAD_PKT_QUEUE_MAX;
+		tmp->pkt_queue = malloc(queue_size);
+		if (!tmp->pkt_queue) {
+			pom_oom(queue_size);
+			free(tmp);
+			goto err;
+		}
+		memset(tmp->pkt_queue, 0, queue_size);
+
+		unsigned int j;
+		for (j = 0; j < CORE_THREAD_PKT_QUEUE_MAX; j++)
+			tmp->pkt_queue[j].seq = j;
+
 		int res = pthread_mutex_init(&tmp->pkt_queue_lock, NULL);
 		if (res) {
 			pomlog(POMLOG_ERR "Error while initializing a thread pkt_queue lock : %s", pom_strerror(res));
+			free(tmp->pkt_queue);
 			free(tmp);
 			goto err;
 		}
@@ -165,21 +385,38 @@ int core_init(unsigned int num_threads) {
 		if (res) {
 			pomlog(POMLOG_ERR "Error while initializing a thread pkt_queue condition : %s", pom_strerror(res));
 			pthread_mutex_destroy(&tmp->pkt_queue_lock);
+			free(tmp->pkt_queue);
 			free(tmp);
 			goto err;
 		}
 
 
+		char perf_name[32];
+		snprintf(perf_name, sizeof(perf_name), "thread_cpu_%u", i);
+		tmp->perf_cpu = registry_class_add_perf(core_registry_class, perf_name, registry_perf_type_gauge, "CPU currently used by the processing thread", "cpu");
+		if (!tmp->perf_cpu) {
+			pthread_mutex_destroy(&tmp->pkt_queue_lock);
+			pthread_cond_destroy(&tmp->pkt_queue_cond);
+			free(tmp->pkt_queue);
+			free(tmp);
+			goto err;
+		}
+		registry_perf_set_update_hook(tmp->perf_cpu, core_perf_thread_cpu, &tmp->tid);
+
 		if (pthread_create(&tmp->thread, NULL, core_processing_thread_func, tmp)) {
 			pomlog(POMLOG_ERR "Error while creating a new processing thread : %s", pom_strerror(errno));
+			registry_perf_set_update_hook(tmp->perf_cpu, NULL, NULL);
 			pthread_mutex_destroy(&tmp->pkt_queue_lock);
 			pthread_cond_destroy(&tmp->pkt_queue_cond);
+			free(tmp->pkt_queue);
 			free(tmp);
 			goto err;
 		}
 
 
+		pom_mutex_lock(&core_processing_threads_lock);
 		core_processing_threads[i] = tmp;
+		pom_mutex_unlock(&core_processing_threads_lock);
 	}
 
 	return POM_OK;
@@ -199,15 +436,19 @@ int core_cleanup(int emergency_cleanup) {
 
 	core_run = 0;
 
+	// Release the inputs waiting for some room in the queues
+	pom_mutex_lock(&core_pkt_queue_wait_lock);
+	int res = pthread_cond_broadcast(&core_pkt_queue_wait_cond);
+	if (res) {
+		pomlog(POMLOG_ERR "Error while signaling the main pkt_queue condition : %s", pom_strerror(res));
+		abort();
+	}
+	pom_mutex_unlock(&core_pkt_queue_wait_lock);
 
 	int i;
 	for (i = 0; i < CORE_PROCESS_THREAD_MAX && core_processing_threads[i]; i++) {
 		struct core_processing_thread *t = core_processing_threads[i];
-		int res = pthread_cond_signal(&t->pkt_queue_cond);
-		if (res) {
-			pomlog(POMLOG_ERR "Error while signaling the restart condition : %s", pom_strerror(res));
-			abort();
-		}
+		core_processing_thread_wake(t);
 		pthread_join(t->thread, NULL);
 		res = pthread_mutex_destroy(&t->pkt_queue_lock);
 		if (res)
@@ -218,30 +459,116 @@ int core_cleanup(int emergency_cleanup) {
 			pomlog(POMLOG_WARN "Error while destroying a processing thread condition : %s", pom_strerror(res));
 
 
-		struct core_packet_queue *tmp = NULL;
-		while (t->pkt_queue_head) {
-			tmp = t->pkt_queue_head;
-			t->pkt_queue_head = tmp->next;
-			// packet_pool_cleanup() was already called when the thread stopped
-			// packet_pool_release(tmp->pkt);
-			free(tmp);
+		// packet_pool_cleanup() was already called when the thread stopped
+		while (core_processing_thread_dequeue(t))
 			pomlog(POMLOG_WARN "A packet was still in a thread's queue");
-		}
 
-		while (t->pkt_queue_unused) {
-			tmp = t->pkt_queue_unused;
-			t->pkt_queue_unused = tmp->next;
-			// packet_pool_cleanup() was already called when the thread stopped
-			// packet_pool_release(tmp->pkt);
-			free(tmp);
-		}
+		registry_perf_set_update_hook(t->perf_cpu, NULL, NULL);
+
+		// Make sure the pkt_queue perf is done with this thread before freeing it
+		pom_mutex_lock(&core_processing_threads_lock);
+		core_processing_threads[i] = NULL;
+		pom_mutex_unlock(&core_processing_threads_lock);
 
+		free(t->pkt_queue);
 		free(t);
 	}
 
 	return POM_OK;
 }
 
+// Compute a hash of the packet's addresses and ports which is the same in both directions
+static int core_packet_flow_hash(struct packet *p, uint32_t *hash) {
+
+	unsigned char *buff = p->buff;
+	size_t len = p->len, offset = 0;
+	unsigned int ip_ver = 0;
+
+	if (!p->datalink) {
+		return POM_ERR;
+	} else if (p->datalink == core_proto_ethernet) {
+		if (len < 14)
+			return POM_ERR;
+		uint16_t ether_type = (buff[12] << 8) | buff[13];
+		offset = 14;
+
+		// Skip up to two VLAN tags
+		int i;
+		for (i = 0; i < 2 && (ether_type == 0x8100 || ether_type == 0x88a8 || ether_type == 0x9100); i++) {
+			if (len < offset + 4)
+				return POM_ERR;
+			ether_type = (buff[offset + 2] << 8) | buff[offset + 3];
+			offset += 4;
+		}
+
+		if (ether_type == 0x0800)
+			ip_ver = 4;
+		else if (ether_type == 0x86dd)
+			ip_ver = 6;
+		else
+			return POM_ERR;
+
+	} else if (p->datalink == core_proto_ipv4 || p->datalink == core_proto_ipv6) {
+		if (!len)
+			return POM_ERR;
+		ip_ver = buff[0] >> 4;
+	} else {
+		return POM_ERR;
+	}
+
+	uint32_t src = 0, dst = 0;
+	uint16_t sport = 0, dport = 0;
+	unsigned int ip_proto = 0, frag = 0;
+	unsigned char *ip = buff + offset;
+
+	if (ip_ver == 4) {
+		if (len < offset + 20)
+			return POM_ERR;
+		unsigned int hdr_len = (ip[0] & 0xf) * 4;
+		if (hdr_len < 20)
+			return POM_ERR;
+		ip_proto = ip[9];
+		// Only use the addresses for fragments so they all end up in the same thread
+		frag = ((ip[6] << 8) | ip[7]) & 0x3fff;
+		memcpy(&src, ip + 12, sizeof(src));
+		memcpy(&dst, ip + 16, sizeof(dst));
+		offset += hdr_len;
+	} else if (ip_ver == 6) {
+		if (len < offset + 40)
+			return POM_ERR;
+		ip_proto = ip[6];
+		uint32_t addr[8];
+		memcpy(addr, ip + 8, sizeof(addr));
+		src = addr[0] ^ addr[1] ^ addr[2] ^ addr[3];
+		dst = addr[4] ^ addr[5] ^ addr[6] ^ addr[7];
+		offset += 40;
+	} else {
+		return POM_ERR;
+	}
+
+	if (!frag && (ip_proto == IPPROTO_TCP || ip_proto == IPPROTO_UDP) && len >= offset + 4) {
+		sport = (buff[offset] << 8) | buff[offset + 1];
+		dport = (buff[offset + 2] << 8) | buff[offset + 3];
+	}
+
+	// Order the values so both directions give the same hash
+	if (src > dst) {
+		uint32_t tmp = src;
+		src = dst;
+		dst = tmp;
+	}
+
+	if (sport > dport) {
+		uint16_t tmp = sport;
+		sport = dport;
+		dport = tmp;
+	}
+
+	*hash = jhash_3words(src, dst, ((uint32_t) sport << 16) | dport, ip_proto);
+
+	return POM_OK;
+}
+
 int core_queue_packet(struct packet *p, unsigned int flags, unsigned int thread_affinity) {
 
 	
@@ -254,120 +581,114 @@ int core_queue_packet(struct packet *p, unsigned int flags, unsigned int thread_
 
 	debug_core("Queuing packet %p (%u.%06u)", p, pom_ptime_sec(p->ts), pom_ptime_usec(p->ts));
 
+	// Keep all the packets of a connection in the same thread if the input didn't choose one
+	uint32_t flow_hash = 0;
+	if (!(flags & CORE_QUEUE_HAS_THREAD_AFFINITY) && *PTYPE_BOOL_GETVAL(core_param_flow_affinity) && core_packet_flow_hash(p, &flow_hash) == POM_OK) {
+		flags |= CORE_QUEUE_HAS_THREAD_AFFINITY;
+		thread_affinity = flow_hash;
+	}
+
 	// Find the right thread to queue to
 
 	struct core_processing_thread *t = NULL;
-	if (flags & CORE_QUEUE_HAS_THREAD_AFFINITY) {
-		t = core_processing_threads[thread_affinity % core_num_threads];
-		pom_mutex_lock(&t->pkt_queue_lock);
-	} else {
-		static volatile unsigned int start = 0;
-		unsigned int i;
-		while (1) {
-			unsigned int thread_id = start;
+
+	while (1) {
+
+		if (flags & CORE_QUEUE_HAS_THREAD_AFFINITY) {
+			t = core_processing_threads[thread_affinity % core_num_threads];
+			if (core_processing_thread_enqueue(t, p) == POM_OK)
+				break;
+		} else {
+			static volatile unsigned int start = 0;
+			unsigned int i, thread_id = start;
 			for (i = 0; i < core_num_threads; i++) {
 				thread_id++;
 				if (thread_id >= core_num_threads)
 					thread_id -= core_num_threads;
 				t = core_processing_threads[thread_id];
-				int res = pthread_mutex_trylock(&t->pkt_queue_lock);
-				if (res == EBUSY) {
-					// Thread is busy, go to the next one
-					continue;
-				} else if (res) {
-					pomlog(POMLOG_ERR "Error while locking a processing thread pkt_queue mutex : %s", pom_strerror(res));
-					abort();
-					return POM_ERR;
-				}
 
-				// We've got the lock, check if it's ok to queue here
-				if (t->pkt_count < CORE_THREAD_PKT_QUEUE_MAX) {
-					// Use this thread
+				if (core_processing_thread_enqueue(t, p) == POM_OK)
 					break;
-				}
 
 				// Too many packets pending in this thread, go to the next one
-				pom_mutex_unlock(&t->pkt_queue_lock);
 			}
 
 			if (i < core_num_threads) {
-				// We locked on a thread
+				// We queued to a thread
 				start = thread_id;
 				break;
 			}
 
-			// No thread found
-			if (core_pkt_queue_count >= ((CORE_THREAD_PKT_QUEUE_MAX - 1) * core_num_threads)) {
-				// Queue full
-				if (flags & CORE_QUEUE_DROP_IF_FULL) {
-					packet_release(p);
-					registry_perf_inc(perf_pkt_dropped, 1);
-					debug_core("Dropped packet %p (%u.%06u) to thread %u", p, pom_ptime_sec(p->ts), pom_ptime_usec(p->ts));
-					return POM_OK;
-				}
-
-				// We're not going to drop this. Wait then
-				debug_core("All queues full. Waiting ...");
-				pom_mutex_lock(&core_pkt_queue_wait_lock);
-
-				// Recheck the count after locking
-				if (core_pkt_queue_count >= ((CORE_THREAD_PKT_QUEUE_MAX - 1) * core_num_threads)) {
-					int res = pthread_cond_wait(&core_pkt_queue_wait_cond, &core_pkt_queue_wait_lock);
-					if (res) {
-						pomlog(POMLOG_ERR "Error while waiting for the core pkt_queue condition : %s", pom_strerror(res));
-						abort();
-					}
-				}
-				pom_mutex_unlock(&core_pkt_queue_wait_lock);
+			t = NULL;
+		}
 
-			}
+		// Queue(s) full
+		if (flags & CORE_QUEUE_DROP_IF_FULL) {
+			packet_release(p);
+			registry_perf_inc(perf_pkt_dropped, 1);
+			debug_core("Dropped packet %p (%u.%06u)", p, pom_ptime_sec(p->ts), pom_ptime_usec(p->ts));
+			return POM_OK;
 		}
 
-	}
+		// We're not going to drop this. Wait then
+		debug_core("Queue(s) full. Waiting ...");
+		pom_mutex_lock(&core_pkt_queue_wait_lock);
+		__sync_fetch_and_add(&core_pkt_queue_waiting, 1);
+
+		// Recheck the queues now that the processing threads know we are waiting
+		int full = 1;
+		if (t) {
+			full = (core_processing_thread_queue_count(t) >= CORE_THREAD_PKT_QUEUE_MAX);
+		} else {
+			unsigned int i;
+			for (i = 0; i < core_num_threads && full; i++)
+				full = (core_processing_thread_queue_count(core_processing_threads[i]) >= CORE_THREAD_PKT_QUEUE_MAX);
+		}
 
-	// We've got the thread's lock, add it to the queue
+		if (full && core_run) {
+			int res = pthread_cond_wait(&core_pkt_queue_wait_cond, &core_pkt_queue_wait_lock);
+			if (res) {
+				pomlog(POMLOG_ERR "Error while waiting for the core pkt_queue condition : %s", pom_strerror(res));
+				abort();
+			}
+		}
+		__sync_fetch_and_sub(&core_pkt_queue_waiting, 1);
+		pom_mutex_unlock(&core_pkt_queue_wait_lock);
 
-	struct core_packet_queue *tmp = NULL;
-	if (t->pkt_queue_unused) {
-		tmp = t->pkt_queue_unused;
-		t->pkt_queue_unused = tmp->next;
-	} else {
-		tmp = malloc(sizeof(struct core_packet_queue));
-		if (!tmp) {
-			pom_mutex_unlock(&t->pkt_queue_lock);
-			pom_oom(sizeof(struct core_packet_queue));
+		if (!core_run) {
+			packet_release(p);
 			return POM_ERR;
 		}
 	}
 
-	tmp->pkt = p;
-	tmp->next = NULL;
-	if (t->pkt_queue_tail) {
-		t->pkt_queue_tail->next = tmp;
-	} else {
-		t->pkt_queue_head = tmp;
+	debug_core("Queued packet %p (%u.%06u) to thread %u", p, pom_ptime_sec(p->ts), pom_ptime_usec(p->ts), t->thread_id);
 
-		// The queue was empty, we need to signal it
-		int res = pthread_cond_signal(&t->pkt_queue_cond);
-		if (res) {
-			pomlog(POMLOG_ERR "Error while signaling the thread pkt_queue restart condition : %s", pom_strerror(res));
-			abort();
-			return POM_ERR;
-		}
+	return POM_OK;
+}
 
-	}
-	t->pkt_queue_tail = tmp;
+int core_queue_packet_group(struct packet *p, unsigned int flags, unsigned int group, unsigned int group_count) {
 
-	t->pkt_count++;
-	__sync_fetch_and_add(&core_pkt_queue_count, 1);
+	// Inputs reading from multiple queues keep each of them on its own subset of threads
+	// Group g uses the threads g, g + group_count, g + 2 * group_count, ...
 
-	registry_perf_inc(perf_pkt_queue, 1);
+	if (group_count > core_num_threads)
+		group_count = core_num_threads;
 
-	debug_core("Queued packet %p (%u.%06u) to thread %u", p, pom_ptime_sec(p->ts), pom_ptime_usec(p->ts), t->thread_id);
+	if (group_count <= 1)
+		return core_queue_packet(p, flags, 0);
 
-	pom_mutex_unlock(&t->pkt_queue_lock);
+	group %= group_count;
+	unsigned int group_size = (core_num_threads - group + group_count - 1) / group_count;
 
-	return POM_OK;
+	uint32_t hash = 0;
+	if (!*PTYPE_BOOL_GETVAL(core_param_flow_affinity) || core_packet_flow_hash(p, &hash) != POM_OK) {
+		static volatile unsigned int next = 0;
+		hash = __sync_fetch_and_add(&next, 1);
+	}
+
+	unsigned int thread_id = group + group_count * (hash % group_size);
+
+	return core_queue_packet(p, flags | CORE_QUEUE_HAS_THREAD_AFFINITY, thread_id);
 }
 
 
@@ -375,6 +696,8 @@ void *core_processing_thread_func(void *priv) {
 
 	struct core_processing_thread *tpriv = priv;
 
+	tpriv->tid = core_thread_get_tid();
+
 	if (packet_info_pool_init()) {
 		halt("Error while initializing the packet_info_pool", 1);
 		return NULL;
@@ -383,53 +706,69 @@ void *core_processing_thread_func(void *priv) {
 	registry_perf_inc(perf_thread_active, 1);
 
 
+	struct packet *pkts[CORE_THREAD_PKT_BATCH_MAX];
+
 	while (core_run) {
-		
-		pom_mutex_lock(&tpriv->pkt_queue_lock);
-		while (!tpriv->pkt_queue_head) {
-			// We are not active while waiting for a packet
-			registry_perf_dec(perf_thread_active, 1);
 
-			debug_core("thread %u : waiting", tpriv->thread_id);
+		if (tpriv->cpus_serial != core_processing_cpus_serial && core_processing_thread_set_cpus(tpriv) != POM_OK)
+			break;
 
-			if (registry_perf_getval(perf_thread_active) == 0) {
-				if (core_get_state() == core_state_finishing)
-					core_set_state(core_state_idle);
-			}
+		unsigned int batch_size = *PTYPE_UINT32_GETVAL(core_param_pkt_batch_size);
+		if (batch_size < 1)
+			batch_size = 1;
+		else if (batch_size > CORE_THREAD_PKT_BATCH_MAX)
+			batch_size = CORE_THREAD_PKT_BATCH_MAX;
+
+		// Dequeue as many packets as we can
+		unsigned int pkt_count;
+		for (pkt_count = 0; pkt_count < batch_size; pkt_count++) {
+			pkts[pkt_count] = core_processing_thread_dequeue(tpriv);
+			if (!pkts[pkt_count])
+				break;
+		}
 
-			if (!core_run) {
-				pom_mutex_unlock(&tpriv->pkt_queue_lock);
-				goto end;
-			}
+		if (!pkt_count) {
 
-			int res = pthread_cond_wait(&tpriv->pkt_queue_cond, &tpriv->pkt_queue_lock);
-			if (res) {
-				pomlog(POMLOG_ERR "Error while waiting for restart condition : %s", pom_strerror(res));
-				abort();
-				return NULL;
-			}
-			registry_perf_inc(perf_thread_active, 1);
-		}
+			// Nothing to do, give back the packets released to this thread
+			packet_slab_trim();
 
+			pom_mutex_lock(&tpriv->pkt_queue_lock);
+			__atomic_store_n(&tpriv->waiting, 1, __ATOMIC_SEQ_CST);
 
-		// Dequeue a packet
-		struct core_packet_queue *tmp = tpriv->pkt_queue_head;
-		tpriv->pkt_queue_head = tmp->next;
-		if (!tpriv->pkt_queue_head)
-			tpriv->pkt_queue_tail = NULL;
+			// Recheck once the inputs know that they need to wake us up
+			if (core_processing_thread_queue_empty(tpriv)) {
 
+				// We are not active while waiting for a packet
+				registry_perf_dec(perf_thread_active, 1);
 
-		// Add it to the unused list
-		tmp->next = tpriv->pkt_queue_unused;
-		tpriv->pkt_queue_unused = tmp;
+				debug_core("thread %u : waiting", tpriv->thread_id);
 
-		tpriv->pkt_count--;
+				if (registry_perf_getval(perf_thread_active) == 0) {
+					if (core_get_state() == core_state_finishing)
+						core_set_state(core_state_idle);
+				}
 
-		registry_perf_dec(perf_pkt_queue, 1);
+				if (!core_run) {
+					tpriv->waiting = 0;
+					pom_mutex_unlock(&tpriv->pkt_queue_lock);
+					goto end;
+				}
 
-		__sync_fetch_and_sub(&core_pkt_queue_count, 1);
+				int res = pthread_cond_wait(&tpriv->pkt_queue_cond, &tpriv->pkt_queue_lock);
+				if (res) {
+					pomlog(POMLOG_ERR "Error while waiting for restart condition : %s", pom_strerror(res));
+					abort();
+					return NULL;
+				}
+				registry_perf_inc(perf_thread_active, 1);
+			}
 
-		if (tpriv->pkt_count < CORE_THREAD_PKT_QUEUE_MIN) {
+			tpriv->waiting = 0;
+			pom_mutex_unlock(&tpriv->pkt_queue_lock);
+			continue;
+		}
+
+		if (__atomic_load_n(&core_pkt_queue_waiting, __ATOMIC_SEQ_CST) && core_processing_thread_queue_count(tpriv) < CORE_THREAD_PKT_QUEUE_MIN) {
 
 			pom_mutex_lock(&core_pkt_queue_wait_lock);
 			// Tell the input processes that they can continue queuing packets
@@ -441,40 +780,53 @@ void *core_processing_thread_func(void *priv) {
 			pom_mutex_unlock(&core_pkt_queue_wait_lock);
 		}
 
-		// Keep track of our packet
-		struct packet *pkt = tmp->pkt;
-
-		debug_core("thread %u : Processing packet %p (%u.%06u)", tpriv->thread_id, pkt, pom_ptime_sec(pkt->ts), pom_ptime_usec(pkt->ts));
-		pom_mutex_unlock(&tpriv->pkt_queue_lock);
+		debug_core("thread %u : Processing %u packet(s)", tpriv->thread_id, pkt_count);
 
 		// Lock the processing lock
 		pom_rwlock_rlock(&core_processing_lock);
 
-		// Update the current clock
-		if (core_clock[tpriv->thread_id] < pkt->ts) // Make sure we keep it monotonous
-			core_clock[tpriv->thread_id] = pkt->ts;
+		// Update the current clock before processing the timers
+		if (core_clock[tpriv->thread_id] < pkts[0]->ts) // Make sure we keep it monotonous
+			core_clock[tpriv->thread_id] = pkts[0]->ts;
 
 		// Process timers
-		if (timers_process() != POM_OK) {
+		if (timers_process(tpriv->thread_id) != POM_OK) {
 			pom_rwlock_unlock(&core_processing_lock);
 			break;
 		}
 
-		//pomlog(POMLOG_DEBUG "Thread %u processing ...", pthread_self());
-		if (core_process_packet(pkt) == POM_ERR) {
-			core_run = 0;
-			pom_rwlock_unlock(&core_processing_lock);
-			break;
+		unsigned int i;
+		for (i = 0; i < pkt_count; i++) {
+
+			struct packet *pkt = pkts[i];
+
+			debug_core("thread %u : Processing packet %p (%u.%06u)", tpriv->thread_id, pkt, pom_ptime_sec(pkt->ts), pom_ptime_usec(pkt->ts));
+
+			if (core_clock[tpriv->thread_id] < pkt->ts)
+				core_clock[tpriv->thread_id] = pkt->ts;
+
+			if (core_process_packet(pkt) == POM_ERR) {
+				core_run = 0;
+				break;
+			}
+
+			debug_core("thread %u : Processed packet %p (%u.%06u)", tpriv->thread_id, pkt, pom_ptime_sec(pkt->ts), pom_ptime_usec(pkt->ts));
 		}
 
 		pom_rwlock_unlock(&core_processing_lock);
 
-		debug_core("thread %u : Processed packet %p (%u.%06u)", tpriv->thread_id, pkt, pom_ptime_sec(pkt->ts), pom_ptime_usec(pkt->ts));
-
-		if (packet_release(pkt) != POM_OK) {
-			pomlog(POMLOG_ERR "Error while releasing the packet");
+		if (i < pkt_count)
 			break;
+
+		for (i = 0; i < pkt_count; i++) {
+			if (packet_release(pkts[i]) != POM_OK) {
+				pomlog(POMLOG_ERR "Error while releasing the packet");
+				break;
+			}
 		}
+
+		if (i < pkt_count)
+			break;
 	}
 
 	halt("Processing thread encountered an error", 1);
@@ -602,7 +954,7 @@ int core_process_packet_stack(struct proto_process_stack *stack, unsigned int st
 		if (stack[i].ce)
 			conntrack_refcount_dec(stack[i].ce);
 
-		packet_info_pool_release(stack[i].pkt_info, stack[i].proto->id);
+		packet_info_pool_release(stack[i].pkt_info, stack[i].proto);
 	}
 	
 	return res;
@@ -648,7 +1000,7 @@ struct proto_process_stack *core_stack_backup(struct proto_process_stack *stack,
 			if (!new_stack[i].pkt_info) {
 				for (; i; i--) {
 					if (new_stack[i].pkt_info)
-						packet_info_pool_release(new_stack[i].pkt_info, stack[i].proto->id);
+						packet_info_pool_release(new_stack[i].pkt_info, stack[i].proto);
 				}
 				free(new_stack);
 				return NULL;
@@ -667,7 +1019,7 @@ void core_stack_release(struct proto_process_stack *stack) {
 
 	int i;
 	for (i = 1; i < CORE_PROTO_STACK_MAX && stack[i].proto; i++)
-		packet_info_pool_release(stack[i].pkt_info, stack[i].proto->id);
+		packet_info_pool_release(stack[i].pkt_info, stack[i].proto);
 
 	free(stack);
 }
@@ -731,6 +1083,10 @@ static int core_processing_start() {
 
 	core_pause_processing();
 
+	core_proto_ethernet = proto_get("ethernet");
+	core_proto_ipv4 = proto_get("ipv4");
+	core_proto_ipv6 = proto_get("ipv6");
+
 	if (*PTYPE_BOOL_GETVAL(core_param_offline_dns) && dns_core_init() != POM_OK) {
 		core_resume_processing();
 		return POM_ERR;
@@ -810,17 +1166,8 @@ int core_set_state(enum core_state state) {
 	} else if (state == core_state_finishing) {
 		// Signal all the threads
 		unsigned int i;
-		for (i = 0; i < core_num_threads; i++) {
-			struct core_processing_thread *t = core_processing_threads[i];
-
-			pom_mutex_lock(&t->pkt_queue_lock);
-			int res = pthread_cond_broadcast(&t->pkt_queue_cond);
-			pom_mutex_unlock(&t->pkt_queue_lock);
-			if (res) {
-				pomlog(POMLOG_ERR "Error while broadcasting restart condition after set state");
-				abort();
-			}
-		}
+		for (i = 0; i < core_num_threads; i++)
+			core_processing_thread_wake(core_processing_threads[i]);
 	}
 	return res;
 }
@@ -866,6 +1213,14 @@ unsigned int core_get_num_threads() {
 	return core_num_threads;
 }
 
+unsigned int core_get_conntrack_max() {
+	return *PTYPE_UINT32_GETVAL(core_param_conntrack_max);
+}
+
+unsigned int core_get_stream_buff_max() {
+	return *PTYPE_UINT32_GETVAL(core_param_stream_buff_max);
+}
+
 char *core_get_http_admin_password() {
 	char *passwd = PTYPE_STRING_GETVAL(core_param_http_admin_password);
 	if (!strlen(passwd))
@@ -873,3 +1228,124 @@ char *core_get_http_admin_password() {
 
 	return passwd;
 }
+
+int core_cpu_list_parse(char *list, unsigned int *cpus, unsigned int max_cpus) {
+
+	unsigned int count = 0;
+	char *cur = list;
+
+	while (*cur) {
+
+		while (*cur == ' ' || *cur == ',')
+			cur++;
+		if (!*cur)
+			break;
+
+		char *end = NULL;
+		unsigned long first = strtoul(cur, &end, 10), last;
+		if (end == cur)
+			goto err;
+
+		last = first;
+		if (*end == '-') {
+			cur = end + 1;
+			last = strtoul(cur, &end, 10);
+			if (end == cur || last < first)
+				goto err;
+		}
+
+		if (*end && *end != ',' && *end != ' ')
+			goto err;
+
+		for (; first <= last; first++) {
+			if (first >= CORE_CPU_LIST_MAX || count >= max_cpus)
+				goto err;
+			cpus[count++] = first;
+		}
+		cur = end;
+	}
+
+	return count;
+
+err:
+	pomlog(POMLOG_ERR "Invalid CPU list \"%s\"", list);
+	return POM_ERR;
+}
+
+int core_thread_set_cpus(unsigned int *cpus, unsigned int count) {
+
+#ifdef HAVE_PTHREAD_SETAFFINITY_NP
+	cpu_set_t set;
+	CPU_ZERO(&set);
+
+	unsigned int i;
+	if (count) {
+		for (i = 0; i < count; i++)
+			CPU_SET(cpus[i], &set);
+	} else {
+		// Allow all the CPUs
+		for (i = 0; i < CPU_SETSIZE; i++)
+			CPU_SET(i, &set);
+	}
+
+	int res = pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &set);
+	if (res) {
+		pomlog(POMLOG_ERR "Error while setting the thread CPU affinity : %s", pom_strerror(res));
+		return POM_ERR;
+	}
+
+	return POM_OK;
+#else
+	if (!count)
+		return POM_OK;
+
+	pomlog(POMLOG_WARN "Setting the CPU affinity of threads is not supported on this platform");
+	return POM_ERR;
+#endif
+}
+
+pid_t core_thread_get_tid() {
+
+#ifdef SYS_gettid
+	return syscall(SYS_gettid);
+#else
+	return 0;
+#endif
+}
+
+int core_perf_thread_cpu(uint64_t *value, void *priv) {
+
+	pid_t tid = *(pid_t *)priv;
+	if (!tid) // Thread not started yet
+		return POM_OK;
+
+	char path[64];
+	snprintf(path, sizeof(path), "/proc/self/task/%u/stat", (unsigned int) tid);
+
+	FILE *f = fopen(path, "r");
+	if (!f)
+		return POM_OK;
+
+	char buff[1024] = { 0 };
+	size_t len = fread(buff, 1, sizeof(buff) - 1, f);
+	fclose(f);
+	buff[len] = 0;
+
+	// The thread name may contain spaces, start after it
+	char *field = strrchr(buff, ')');
+	if (!field)
+		return POM_ERR;
+
+	// The CPU is the 39th field, 37 fields after the name
+	unsigned int i;
+	for (i = 0; i < 37 && field; i++) {
+		field = strchr(field + 1, ' ');
+	}
+
+	if (!field)
+		return POM_ERR;
+
+	*value = strtoul(field + 1, NULL, 10);
+
+	return POM_OK;
+}
@@ -33,7 +33,16 @@
 #define CORE_PROCESS_THREAD_DEFAULT	1
 
 #define CORE_THREAD_PKT_QUEUE_MIN	5
-#define CORE_THREAD_PKT_QUEUE_MAX	512
+#define CORE_THREAD_PKT_QUEUE_MAX	512 // Must be a power of 2
+
+#define CORE_CPU_LIST_MAX		1024
+
+#define CORE_THREAD_PKT_BATCH_DEFAULT	"32"
+#define CORE_THREAD_PKT_BATCH_MAX	256
+
+#define CORE_CONNTRACK_MAX_DEFAULT	"2000000"
+
+#define CORE_STREAM_BUFF_MAX_DEFAULT	"268435456"
 
 #define CORE_REGISTRY "core"
 enum core_state {
@@ -42,19 +51,29 @@ enum core_state {
 	core_state_finishing, // There are still packets in the input
 };
 
+// Slot of a processing thread's packet ring
 struct core_packet_queue {
+	volatile unsigned int seq; // Sequence number used to synchronize the slot
 	struct packet *pkt;
-	struct core_packet_queue *next;
 };
 
 struct core_processing_thread {
 	pthread_t thread;
 	unsigned int thread_id;
-	unsigned int pkt_count;
+
+	// Thread's own ring, filled by the inputs and drained by the thread only
+	struct core_packet_queue *pkt_queue;
+	volatile unsigned int pkt_queue_head; // Next slot to be dequeued, only updated by the thread
+	volatile unsigned int pkt_queue_tail; // Next slot to be queued, shared by the inputs
+
+	pid_t tid; // Kernel thread id, used to find the current CPU
+	struct registry_perf *perf_cpu;
+	unsigned int cpus_serial; // Version of the CPU list the thread is currently pinned with
+
+	// Only used to park the thread while its ring is empty
+	volatile int waiting;
 	pthread_mutex_t pkt_queue_lock;
 	pthread_cond_t pkt_queue_cond;
-	struct core_packet_queue *pkt_queue_head, *pkt_queue_tail; // Thread's own queue
-	struct core_packet_queue *pkt_queue_unused;
 
 };
 
@@ -78,6 +97,13 @@ void core_assert_is_paused();
 struct registry_perf *core_add_perf(const char *name, enum registry_perf_type type, const char *description, const char *unit);
 
 unsigned int core_get_num_threads();
+unsigned int core_get_conntrack_max();
+unsigned int core_get_stream_buff_max();
+
+int core_cpu_list_parse(char *list, unsigned int *cpus, unsigned int max_cpus);
+int core_thread_set_cpus(unsigned int *cpus, unsigned int count);
+pid_t core_thread_get_tid();
+int core_perf_thread_cpu(uint64_t *value, void *priv);
 
 char *core_get_http_admin_password();
 
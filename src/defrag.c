@@ -0,0 +1,569 @@
+/*
+ *  This file is part of pom-ng.
+ *  Copyright (C) 2015 Guy Martin <gmsoft@tuxicoman.be>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+
+
+#include "common.h"
+#include "defrag.h"
+#include "packet.h"
+#include "jhash.h"
+
+#include <pom-ng/core.h>
+#include <pom-ng/ptype_string.h>
+#include <pom-ng/ptype_uint32.h>
+
+#if 0
+#define debug_defrag(x ...) pomlog(POMLOG_DEBUG x)
+#else
+#define debug_defrag(x ...)
+#endif
+
+static int defrag_policy_parse(char *value) {
+
+	if (!strcmp(value, DEFRAG_POLICY_FIRST))
+		return defrag_policy_first;
+	else if (!strcmp(value, DEFRAG_POLICY_LAST))
+		return defrag_policy_last;
+	else if (!strcmp(value, DEFRAG_POLICY_BSD))
+		return defrag_policy_bsd;
+	else if (!strcmp(value, DEFRAG_POLICY_LINUX))
+		return defrag_policy_linux;
+
+	return POM_ERR;
+}
+
+static int defrag_param_policy_check(void *priv, struct registry_param *p, char *value) {
+
+	if (defrag_policy_parse(value) == POM_ERR) {
+		pomlog(POMLOG_ERR "Invalid fragment overlap policy : %s", value);
+		return POM_ERR;
+	}
+
+	return POM_OK;
+}
+
+static int defrag_param_policy_update(void *priv, struct registry_param *p, struct ptype *value) {
+
+	struct defrag *d = priv;
+	d->policy = defrag_policy_parse(PTYPE_STRING_GETVAL(value));
+
+	return POM_OK;
+}
+
+static struct defrag_dgram **defrag_bucket(struct defrag_partition *part, uint32_t hash) {
+
+	// The lowest bits of the hash select the partition
+	return &part->table[(hash >> DEFRAG_PARTITION_BITS) & (DEFRAG_TABLE_SIZE - 1)];
+}
+
+// The partition must be locked
+static void defrag_dgram_release(struct defrag_partition *part, struct defrag_dgram *dgram) {
+
+	struct defrag *d = part->d;
+
+	// Remove it from the table
+	struct defrag_dgram **tmp = defrag_bucket(part, dgram->hash);
+	while (*tmp != dgram)
+		tmp = &(*tmp)->hash_next;
+	*tmp = dgram->hash_next;
+
+	if (dgram->prev)
+		dgram->prev->next = dgram->next;
+	else
+		part->head = dgram->next;
+
+	if (dgram->next)
+		dgram->next->prev = dgram->prev;
+	else
+		part->tail = dgram->prev;
+
+	if (dgram->pkt)
+		packet_release(dgram->pkt);
+	free(dgram->buff);
+	free(dgram->bitmap);
+	free(dgram->owner);
+
+	__sync_fetch_and_sub(&d->mem, dgram->mem);
+	registry_perf_dec(d->perf_mem, dgram->mem);
+
+	memset(dgram, 0, sizeof(struct defrag_dgram));
+	dgram->next = part->unused;
+	part->unused = dgram;
+}
+
+static void defrag_dgram_drop(struct defrag_partition *part, struct defrag_dgram *dgram, struct registry_perf *reason) {
+
+	registry_perf_inc(part->d->perf_frags_dropped, dgram->count);
+	registry_perf_inc(reason, dgram->count);
+	defrag_dgram_release(part, dgram);
+}
+
+int defrag_cleanup(struct defrag *d) {
+
+	unsigned int i;
+	for (i = 0; i < DEFRAG_PARTITIONS; i++) {
+		struct defrag_partition *part = &d->parts[i];
+
+		timer_release(&part->timer, NULL, NULL);
+
+		while (part->head)
+			defrag_dgram_drop(part, part->head, d->perf_frags_timeout);
+
+		while (part->slabs) {
+			struct defrag_slab *tmp = part->slabs;
+			part->slabs = tmp->next;
+			free(tmp);
+		}
+
+		pthread_mutex_destroy(&part->lock);
+	}
+
+	ptype_cleanup(d->param_timeout);
+	ptype_cleanup(d->param_mem_max);
+	ptype_cleanup(d->param_policy);
+
+	free(d);
+
+	return POM_OK;
+}
+
+// The partition must be locked
+static void defrag_expire(struct defrag_partition *part, ptime now) {
+
+	struct defrag *d = part->d;
+
+	// Datagrams are sorted by the time of their first fragment
+	ptime timeout = pom_sec_ptime(*PTYPE_UINT32_GETVAL(d->param_timeout));
+	while (part->head && part->head->ts + timeout < now) {
+		debug_defrag("Datagram %p with id %u timed out, %u fragments dropped", part->head, part->head->id, part->head->count);
+		defrag_dgram_drop(part, part->head, d->perf_frags_timeout);
+	}
+
+	if (!part->head)
+		return;
+
+	// Come back when the oldest remaining datagram times out
+	ptime left = part->head->ts + timeout - now;
+	timer_queue_now(&part->timer, pom_ptime_sec(left) + 1, now);
+}
+
+static int defrag_timeout(void *priv, ptime now) {
+
+	// Drop the datagrams which didn't receive all their fragments in time
+	struct defrag_partition *part = priv;
+
+	pom_mutex_lock(&part->lock);
+	defrag_expire(part, now);
+	pom_mutex_unlock(&part->lock);
+
+	return POM_OK;
+}
+
+struct defrag *defrag_alloc(struct proto *proto, struct registry_instance *ri) {
+
+	struct defrag *d = malloc(sizeof(struct defrag));
+	if (!d) {
+		pom_oom(sizeof(struct defrag));
+		return NULL;
+	}
+	memset(d, 0, sizeof(struct defrag));
+
+	unsigned int i;
+	for (i = 0; i < DEFRAG_PARTITIONS; i++) {
+		struct defrag_partition *part = &d->parts[i];
+		int res = pthread_mutex_init(&part->lock, NULL);
+		if (res) {
+			pomlog(POMLOG_ERR "Error while initializing the defrag lock : %s", pom_strerror(res));
+			while (i--)
+				pthread_mutex_destroy(&d->parts[i].lock);
+			free(d);
+			return NULL;
+		}
+		part->d = d;
+		timer_init(&part->timer, part, defrag_timeout);
+	}
+
+	struct registry_param *p = NULL;
+
+	d->perf_frags = registry_instance_add_perf(ri, "fragments", registry_perf_type_counter, "Number of fragments received", "pkts");
+	d->perf_frags_dropped = registry_instance_add_perf(ri, "dropped_fragments", registry_perf_type_counter, "Number of fragments dropped", "pkts");
+	d->perf_frags_overlap = registry_instance_add_perf(ri, "overlapping_fragments", registry_perf_type_counter, "Number of fragments overlapping data already received", "pkts");
+	d->perf_frags_timeout = registry_instance_add_perf(ri, "timedout_fragments", registry_perf_type_counter, "Number of fragments dropped because their datagram timed out", "pkts");
+	d->perf_frags_evicted = registry_instance_add_perf(ri, "evicted_fragments", registry_perf_type_counter, "Number of fragments dropped to stay within the memory limit", "pkts");
+	d->perf_reassembled_pkts = registry_instance_add_perf(ri, "reassembled_pkts", registry_perf_type_counter, "Number of reassembled packets", "pkts");
+	d->perf_mem = registry_instance_add_perf(ri, "fragment_mem", registry_perf_type_gauge, "Memory used by incomplete datagrams", "bytes");
+
+	if (!d->perf_frags || !d->perf_frags_dropped || !d->perf_frags_overlap || !d->perf_frags_timeout || !d->perf_frags_evicted || !d->perf_reassembled_pkts || !d->perf_mem)
+		goto err;
+
+	d->param_timeout = ptype_alloc_unit("uint32", "seconds");
+	d->param_mem_max = ptype_alloc_unit("uint32", "bytes");
+	d->param_policy = ptype_alloc("string");
+	if (!d->param_timeout || !d->param_mem_max || !d->param_policy)
+		goto err;
+
+	p = registry_new_param("fragment_timeout", DEFRAG_TIMEOUT_DEFAULT, d->param_timeout, "Timeout for incomplete datagrams", 0);
+	if (proto_add_param(proto, p) != POM_OK)
+		goto err;
+
+	p = registry_new_param("fragment_mem_max", DEFRAG_MEM_MAX_DEFAULT, d->param_mem_max, "Maximum memory used by incomplete datagrams, 0 for no limit", 0);
+	if (proto_add_param(proto, p) != POM_OK)
+		goto err;
+
+	p = registry_new_param("fragment_overlap_policy", DEFRAG_POLICY_FIRST, d->param_policy, "Data kept when fragments overlap", 0);
+	if (registry_param_info_add_value(p, DEFRAG_POLICY_FIRST) != POM_OK ||
+		registry_param_info_add_value(p, DEFRAG_POLICY_LAST) != POM_OK ||
+		registry_param_info_add_value(p, DEFRAG_POLICY_BSD) != POM_OK ||
+		registry_param_info_add_value(p, DEFRAG_POLICY_LINUX) != POM_OK)
+		goto err;
+	if (registry_param_set_callbacks(p, d, defrag_param_policy_check, defrag_param_policy_update) != POM_OK)
+		goto err;
+	if (proto_add_param(proto, p) != POM_OK)
+		goto err;
+
+	return d;
+
+err:
+	if (p)
+		registry_cleanup_param(p);
+
+	if (d->param_timeout)
+		ptype_cleanup(d->param_timeout);
+	if (d->param_mem_max)
+		ptype_cleanup(d->param_mem_max);
+	if (d->param_policy)
+		ptype_cleanup(d->param_policy);
+
+	for (i = 0; i < DEFRAG_PARTITIONS; i++)
+		pthread_mutex_destroy(&d->parts[i].lock);
+	free(d);
+
+	return NULL;
+}
+
+static struct defrag_dgram *defrag_dgram_get(struct defrag_partition *part, struct defrag_fragment *f, uint32_t hash, ptime now) {
+
+	struct defrag *d = part->d;
+
+	struct defrag_dgram **bucket = defrag_bucket(part, hash);
+	struct defrag_dgram *dgram = *bucket;
+	for (; dgram; dgram = dgram->hash_next) {
+		if (dgram->hash == hash && dgram->id == f->id && dgram->proto == f->proto && dgram->parent == f->parent &&
+			!memcmp(dgram->src, f->src, f->addr_len) && !memcmp(dgram->dst, f->dst, f->addr_len))
+			return dgram;
+	}
+
+	if (!part->unused) {
+		struct defrag_slab *slab = malloc(sizeof(struct defrag_slab));
+		if (!slab) {
+			pom_oom(sizeof(struct defrag_slab));
+			return NULL;
+		}
+		memset(slab, 0, sizeof(struct defrag_slab));
+		slab->next = part->slabs;
+		part->slabs = slab;
+
+		int i;
+		for (i = DEFRAG_SLAB_SIZE - 1; i >= 0; i--) {
+			slab->dgrams[i].next = part->unused;
+			part->unused = &slab->dgrams[i];
+		}
+	}
+
+	dgram = part->unused;
+	part->unused = dgram->next;
+
+	memcpy(dgram->src, f->src, f->addr_len);
+	memcpy(dgram->dst, f->dst, f->addr_len);
+	dgram->id = f->id;
+	dgram->proto = f->proto;
+	dgram->parent = f->parent;
+	dgram->hash = hash;
+	dgram->policy = d->policy;
+	dgram->ts = now;
+
+	dgram->hash_next = *bucket;
+	*bucket = dgram;
+
+	dgram->next = NULL;
+	dgram->prev = part->tail;
+	if (dgram->prev) {
+		dgram->prev->next = dgram;
+	} else {
+		part->head = dgram;
+		// Make sure it gets dropped if it's never completed
+		if (!timer_is_queued(&part->timer))
+			timer_queue_now(&part->timer, *PTYPE_UINT32_GETVAL(d->param_timeout) + 1, now);
+	}
+	part->tail = dgram;
+
+	return dgram;
+}
+
+static int defrag_mem_reserve(struct defrag_partition *part, struct defrag_dgram *dgram, size_t mem) {
+
+	struct defrag *d = part->d;
+
+	// Make room by dropping the oldest datagrams
+	// Only those of this partition can be dropped, the others expire on their own
+	uint32_t mem_max = *PTYPE_UINT32_GETVAL(d->param_mem_max);
+	if (!mem_max)
+		return POM_OK;
+
+	while (d->mem + mem > mem_max) {
+		struct defrag_dgram *victim = part->head;
+		if (victim == dgram)
+			victim = dgram->next;
+		if (!victim)
+			return POM_ERR;
+		debug_defrag("Datagram %p with id %u evicted, %u fragments dropped", victim, victim->id, victim->count);
+		defrag_dgram_drop(part, victim, d->perf_frags_evicted);
+	}
+
+	return POM_OK;
+}
+
+static int defrag_dgram_resize(struct defrag_partition *part, struct defrag_dgram *dgram, uint32_t size, int final) {
+
+	struct defrag *d = part->d;
+
+
+	// Grow the buffer and the maps to hold size bytes, the final size uses a packet as buffer
+	size_t words = (DEFRAG_BLOCKS(size) + 63) / 64;
+	size_t old_words = (DEFRAG_BLOCKS(dgram->size) + 63) / 64;
+	size_t blocks = DEFRAG_BLOCKS(size);
+	size_t old_blocks = DEFRAG_BLOCKS(dgram->size);
+
+	size_t mem = size + words * sizeof(uint64_t);
+	if (dgram->policy == defrag_policy_bsd || dgram->policy == defrag_policy_linux)
+		mem += blocks * sizeof(uint16_t);
+
+	if (mem > dgram->mem && defrag_mem_reserve(part, dgram, mem - dgram->mem) != POM_OK)
+		return POM_ERR;
+
+	if (words > old_words) {
+		uint64_t *bitmap = realloc(dgram->bitmap, words * sizeof(uint64_t));
+		if (!bitmap) {
+			pom_oom(words * sizeof(uint64_t));
+			return POM_ERR;
+		}
+		memset(bitmap + old_words, 0, (words - old_words) * sizeof(uint64_t));
+		dgram->bitmap = bitmap;
+	}
+
+	if ((dgram->policy == defrag_policy_bsd || dgram->policy == defrag_policy_linux) && blocks > old_blocks) {
+		uint16_t *owner = realloc(dgram->owner, blocks * sizeof(uint16_t));
+		if (!owner) {
+			pom_oom(blocks * sizeof(uint16_t));
+			return POM_ERR;
+		}
+		dgram->owner = owner;
+	}
+
+	if (final) {
+		dgram->pkt = packet_alloc();
+		if (!dgram->pkt)
+			return POM_ERR;
+		if (packet_buffer_alloc(dgram->pkt, size, 0) != POM_OK) {
+			packet_release(dgram->pkt);
+			dgram->pkt = NULL;
+			return POM_ERR;
+		}
+		if (dgram->buff) {
+			memcpy(dgram->pkt->buff, dgram->buff, dgram->end);
+			free(dgram->buff);
+			dgram->buff = NULL;
+		}
+	} else {
+		void *buff = realloc(dgram->buff, size);
+		if (!buff) {
+			pom_oom(size);
+			return POM_ERR;
+		}
+		dgram->buff = buff;
+	}
+
+	dgram->size = size;
+
+	if (mem > dgram->mem) {
+		__sync_fetch_and_add(&d->mem, mem - dgram->mem);
+		registry_perf_inc(d->perf_mem, mem - dgram->mem);
+	} else {
+		__sync_fetch_and_sub(&d->mem, dgram->mem - mem);
+		registry_perf_dec(d->perf_mem, dgram->mem - mem);
+	}
+	dgram->mem = mem;
+
+	return POM_OK;
+}
+
+static int defrag_dgram_write(struct defrag_dgram *dgram, struct defrag_fragment *f) {
+
+	// Copy the blocks of the fragment which are either new or win over the existing ones
+	// Returns 1 if the fragment overlapped data already received
+
+	void *buff = (dgram->pkt ? dgram->pkt->buff : dgram->buff);
+	uint32_t end = f->offset + f->len;
+	uint32_t first = f->offset >> DEFRAG_BLOCK_SHIFT, last = DEFRAG_BLOCKS(end);
+	uint16_t frag_block = first;
+	int overlap = 0;
+
+	uint32_t b, run = last;
+	for (b = first; b <= last; b++) {
+
+		int write = 0;
+		if (b < last) {
+			uint64_t mask = 1ULL << (b & 63);
+			if (!(dgram->bitmap[b >> 6] & mask)) {
+				dgram->bitmap[b >> 6] |= mask;
+				dgram->blocks++;
+				write = 1;
+			} else {
+				overlap = 1;
+				switch (dgram->policy) {
+					case defrag_policy_first:
+						break;
+					case defrag_policy_last:
+						write = 1;
+						break;
+					case defrag_policy_bsd:
+						write = (frag_block < dgram->owner[b]);
+						break;
+					case defrag_policy_linux:
+						write = (frag_block <= dgram->owner[b]);
+						break;
+				}
+			}
+
+			if (write && dgram->owner)
+				dgram->owner[b] = frag_block;
+		}
+
+		if (write) {
+			if (run == last)
+				run = b;
+			continue;
+		}
+
+		// Copy the blocks of the current run
+		if (run != last) {
+			uint32_t start = run << DEFRAG_BLOCK_SHIFT;
+			uint32_t stop = b << DEFRAG_BLOCK_SHIFT;
+			if (stop > end)
+				stop = end;
+			memcpy(buff + start, f->data + (start - f->offset), stop - start);
+			run = last;
+		}
+	}
+
+	return overlap;
+}
+
+int defrag_process(struct defrag *d, struct defrag_fragment *f, struct packet *p, struct proto_process_stack *stack, unsigned int stack_index) {
+
+	registry_perf_inc(d->perf_frags, 1);
+
+	uint32_t end = f->offset + f->len;
+
+	// Only the last fragment may not end on a block boundary
+	if (!f->len || end > DEFRAG_DGRAM_MAX || (f->more && (f->len & ((1 << DEFRAG_BLOCK_SHIFT) - 1))) || f->addr_len > DEFRAG_ADDR_MAX) {
+		registry_perf_inc(d->perf_frags_dropped, 1);
+		return PROTO_INVALID;
+	}
+
+	uint32_t hash = jhash_3words(jhash(f->src, f->addr_len, 0), jhash(f->dst, f->addr_len, 0), f->id, jhash(&f->parent, sizeof(f->parent), f->proto));
+
+	struct defrag_partition *part = &d->parts[hash & (DEFRAG_PARTITIONS - 1)];
+	pom_mutex_lock(&part->lock);
+
+	struct defrag_dgram *dgram = defrag_dgram_get(part, f, hash, p->ts);
+	if (!dgram) {
+		pom_mutex_unlock(&part->lock);
+		return PROTO_ERR;
+	}
+
+	if (dgram->flags & DEFRAG_FLAG_GOT_LAST) {
+		if (end > dgram->total || (!f->more && end != dgram->total)) {
+			debug_defrag("Datagram %p with id %u : fragment with offset %u and length %u doesn't fit in the total size of %u", dgram, dgram->id, f->offset, f->len, dgram->total);
+			goto drop;
+		}
+	} else if (!f->more) {
+		// We now know the size of the datagram
+		if (end < dgram->end)
+			goto drop;
+
+		if (defrag_dgram_resize(part, dgram, end, 1) != POM_OK)
+			goto drop;
+
+		dgram->total = end;
+		dgram->flags |= DEFRAG_FLAG_GOT_LAST;
+	} else if (end > dgram->size) {
+		uint32_t size = (end + DEFRAG_BUFF_STEP - 1) & ~(DEFRAG_BUFF_STEP - 1);
+		if (size > DEFRAG_DGRAM_MAX)
+			size = DEFRAG_DGRAM_MAX;
+		if (defrag_dgram_resize(part, dgram, size, 0) != POM_OK)
+			goto drop;
+	}
+
+	if (defrag_dgram_write(dgram, f))
+		registry_perf_inc(d->perf_frags_overlap, 1);
+
+	dgram->count++;
+	if (end > dgram->end)
+		dgram->end = end;
+
+	struct packet *pkt = NULL;
+	if ((dgram->flags & DEFRAG_FLAG_GOT_LAST) && dgram->blocks == DEFRAG_BLOCKS(dgram->total)) {
+		// All the data is there
+		pkt = dgram->pkt;
+		dgram->pkt = NULL;
+		debug_defrag("Datagram %p with id %u : reassembled %u bytes from %u fragments", dgram, dgram->id, dgram->total, dgram->count);
+		defrag_dgram_release(part, dgram);
+	}
+
+	pom_mutex_unlock(&part->lock);
+
+	if (!pkt)
+		return PROTO_STOP;
+
+	registry_perf_inc(d->perf_reassembled_pkts, 1);
+
+	struct proto_process_stack *s_next = &stack[stack_index + 1];
+
+	pkt->ts = p->ts;
+	pkt->input = p->input;
+	pkt->datalink = s_next->proto;
+	s_next->pload = pkt->buff;
+	s_next->plen = pkt->len;
+
+	int res = core_process_multi_packet(stack, stack_index + 1, pkt);
+
+	packet_release(pkt);
+
+	return (res == PROTO_ERR ? PROTO_ERR : PROTO_STOP);
+
+drop:
+	registry_perf_inc(d->perf_frags_dropped, 1);
+	if (!dgram->count)
+		defrag_dgram_release(part, dgram);
+	pom_mutex_unlock(&part->lock);
+
+	return PROTO_STOP;
+}
@@ -0,0 +1,113 @@
+/*
+ *  This file is part of pom-ng.
+ *  Copyright (C) 2015 Guy Martin <gmsoft@tuxicoman.be>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+
+
+#ifndef __DEFRAG_H__
+#define __DEFRAG_H__
+
+#include <pom-ng/defrag.h>
+#include "timer.h"
+
+#define DEFRAG_PARTITION_BITS	6
+#define DEFRAG_PARTITIONS	(1 << DEFRAG_PARTITION_BITS) // Independently locked parts of the table
+#define DEFRAG_TABLE_SIZE	64 // Buckets per partition, must be a power of 2
+#define DEFRAG_SLAB_SIZE	256 // Datagrams allocated at once
+#define DEFRAG_BUFF_STEP	2048 // Growth of the buffer while the datagram size is unknown
+#define DEFRAG_DGRAM_MAX	0xFFFF
+
+#define DEFRAG_TIMEOUT_DEFAULT	"60"
+#define DEFRAG_MEM_MAX_DEFAULT	"16777216"
+
+// Fragments are stored by blocks of 8 bytes
+#define DEFRAG_BLOCK_SHIFT	3
+#define DEFRAG_BLOCKS(x)	(((x) + 7) >> DEFRAG_BLOCK_SHIFT)
+
+#define DEFRAG_FLAG_GOT_LAST	0x1
+
+#define DEFRAG_POLICY_FIRST	"first"
+#define DEFRAG_POLICY_LAST	"last"
+#define DEFRAG_POLICY_BSD	"bsd"
+#define DEFRAG_POLICY_LINUX	"linux"
+
+// Which data is kept when fragments overlap
+enum defrag_policy {
+	defrag_policy_first = 0, // Data received first
+	defrag_policy_last, // Data received last
+	defrag_policy_bsd, // Data received first unless the new fragment starts before the one already there
+	defrag_policy_linux, // Same as bsd but the new fragment also wins when both start at the same offset
+};
+
+struct defrag_dgram {
+
+	uint8_t src[DEFRAG_ADDR_MAX], dst[DEFRAG_ADDR_MAX];
+	uint32_t id;
+	uint8_t proto;
+	void *parent;
+	uint32_t hash;
+	enum defrag_policy policy; // Policy when the first fragment was received
+
+	unsigned int flags;
+	uint32_t total; // Size of the datagram, known once the last fragment is received
+	uint32_t end; // Highest offset received
+	uint32_t size; // Size of the buffer
+	unsigned int blocks; // Number of blocks received
+	unsigned int count; // Number of fragments received
+	size_t mem; // Memory accounted for this datagram
+
+	void *buff; // Used until the size of the datagram is known
+	struct packet *pkt; // Holds the datagram once its size is known
+	uint64_t *bitmap; // Blocks received
+	uint16_t *owner; // Offset in blocks of the fragment which provided each block
+
+	ptime ts; // Timestamp of the first fragment
+	struct defrag_dgram *hash_next;
+	struct defrag_dgram *prev, *next; // Oldest first
+
+};
+
+struct defrag_slab {
+	struct defrag_dgram dgrams[DEFRAG_SLAB_SIZE];
+	struct defrag_slab *next;
+};
+
+// Datagrams are spread in partitions by hash so that threads rarely wait for each other
+struct defrag_partition {
+
+	pthread_mutex_t lock;
+	struct defrag_dgram *table[DEFRAG_TABLE_SIZE];
+	struct defrag_dgram *head, *tail;
+	struct defrag_dgram *unused;
+	struct defrag_slab *slabs;
+	struct timer timer; // Expires the oldest datagrams
+	struct defrag *d;
+};
+
+struct defrag {
+
+	struct defrag_partition parts[DEFRAG_PARTITIONS];
+	size_t mem; // Shared by all the partitions
+	enum defrag_policy policy;
+
+	struct ptype *param_timeout, *param_mem_max, *param_policy;
+	struct registry_perf *perf_frags, *perf_frags_dropped, *perf_frags_overlap, *perf_frags_timeout, *perf_frags_evicted, *perf_reassembled_pkts, *perf_mem;
+};
+
+#endif
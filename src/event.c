@@ -25,6 +25,7 @@
 #include "registry.h"
 #include "core.h"
 #include "filter.h"
+#include "proto.h"
 
 #if 0
 #define debug_event(x ...) pomlog(POMLOG_DEBUG x)
@@ -314,6 +315,9 @@ int event_listener_register(struct event_reg *evt_reg, void *obj, int (*process_
 		}
 	}
 
+	if (!lst->next)
+		proto_listened_update();
+
 	registry_perf_inc(evt_reg->perf_listeners, 1);
 	
 	return POM_OK;
@@ -358,6 +362,9 @@ int event_listener_unregister(struct event_reg *evt_reg, void *obj) {
 		}
 	}
 
+	if (!evt_reg->listeners)
+		proto_listened_update();
+
 	registry_perf_dec(evt_reg->perf_listeners, 1);
 
 	return POM_OK;
@@ -393,6 +400,17 @@ int event_has_listener(struct event_reg *evt_reg) {
 	return (evt_reg->listeners ? 1 : 0);
 }
 
+int event_source_has_listener(char *source_name) {
+
+	struct event_reg *tmp;
+	for (tmp = event_reg_head; tmp; tmp = tmp->next) {
+		if (tmp->listeners && tmp->info->source_name && !strcmp(tmp->info->source_name, source_name))
+			return 1;
+	}
+
+	return 0;
+}
+
 int event_process(struct event *evt, struct proto_process_stack *stack, int stack_index, ptime ts) {
 
 
@@ -730,7 +748,7 @@ void event_filter_prop_cleanup(void *prop) {
 
 struct filter *event_filter_compile(char *filter_expr, struct event_reg *evt) {
 
-	struct filter *f = filter_alloc(event_filter_prop_compile, evt, event_filter_prop_get_val, event_filter_prop_cleanup);
+	struct filter *f = filter_alloc(event_filter_prop_compile, evt, event_filter_prop_get_val, NULL, event_filter_prop_cleanup);
 	if (!f)
 		return NULL;
 	if (filter_compile(filter_expr, f) != POM_OK) {
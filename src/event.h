@@ -79,5 +79,6 @@ struct event_filter_prop {
 int event_init();
 int event_finish();
 int event_add_listener(struct event *evt, void *obj, int (*process_begin) (struct event *evt, void *obj, struct proto_process_stack *stack, unsigned int stack_index), int (*process_end) (struct event *evt, void *obj));
+int event_source_has_listener(char *source_name);
 
 #endif
@@ -23,10 +23,18 @@
 #include "core.h"
 #include "proto.h"
 #include "ptype.h"
+#include "jhash.h"
+#include "filter_strmatch.h"
+
+#include <endian.h>
 
 #include <pom-ng/ptype_string.h>
+#include <pom-ng/ptype_ipv4.h>
+#include <pom-ng/ptype_ipv6.h>
+#include <pom-ng/ptype_mac.h>
 
 static struct ptype_reg *ptype_string = NULL, *ptype_bool = NULL, *ptype_uint8 = NULL, *ptype_uint16 = NULL, *ptype_uint32 = NULL, *ptype_uint64 = NULL;
+static struct ptype_reg *ptype_ipv4 = NULL, *ptype_ipv6 = NULL, *ptype_mac = NULL;
 static int addon_ptype_initialized = 0;
 
 //
@@ -44,6 +52,11 @@ static int filter_ptype_init() {
 	ptype_uint32 = ptype_get_type("uint32");
 	ptype_uint64 = ptype_get_type("uint64");
 
+	// Those are only used to pick specialized comparisons
+	ptype_ipv4 = ptype_get_type("ipv4");
+	ptype_ipv6 = ptype_get_type("ipv6");
+	ptype_mac = ptype_get_type("mac");
+
 	addon_ptype_initialized = 1;
 
 	if (!ptype_string || !ptype_bool || !ptype_uint8 || !ptype_uint16 || !ptype_uint32 || !ptype_uint64) {
@@ -57,6 +70,7 @@ static int filter_ptype_init() {
 struct filter *filter_alloc(int (*prop_compile) (struct filter *f, char *prop_str, struct filter_value *v),
 				void *priv,
 				int (*prop_get_val) (struct filter_value *inval, struct filter_value *outval, void *obj),
+				int (*prop_resolve) (void **bases, void **objs, unsigned int count, void *obj),
 				void (*prop_cleanup) (void *prop)
 				) {
 
@@ -70,11 +84,29 @@ struct filter *filter_alloc(int (*prop_compile) (struct filter *f, char *prop_st
 	f->prop_compile = prop_compile;
 	f->priv = priv;
 	f->prop_get_val = prop_get_val;
+	f->prop_resolve = prop_resolve;
 	f->prop_cleanup = prop_cleanup;
 
 	return f;
 }
 
+static void filter_lookup_cleanup(struct filter_lookup *l) {
+
+	if (l->ranges)
+		free(l->ranges);
+
+	if (l->strings) {
+		unsigned int i;
+		for (i = 0; i <= l->string_mask; i++) {
+			if (l->strings[i])
+				free(l->strings[i]);
+		}
+		free(l->strings);
+	}
+
+	free(l);
+}
+
 void filter_node_cleanup(struct filter *f, struct filter_node *n) {
 
 	if (!n)
@@ -91,6 +123,10 @@ void filter_node_cleanup(struct filter *f, struct filter_node *n) {
 			free(n->value[i].val.string);
 		} else if (n->value[i].type == filter_value_type_ptype) {
 			ptype_cleanup(n->value[i].val.ptype);
+		} else if (n->value[i].type == filter_value_type_lookup) {
+			filter_lookup_cleanup(n->value[i].val.lookup);
+		} else if (n->value[i].type == filter_value_type_strmatch) {
+			filter_strmatch_cleanup(n->value[i].val.strmatch);
 		}
 	}
 
@@ -101,6 +137,16 @@ void filter_node_cleanup(struct filter *f, struct filter_node *n) {
 void filter_cleanup(struct filter *f) {
 
 	filter_node_cleanup(f, f->n);
+
+	if (f->prog)
+		free(f->prog);
+	if (f->props)
+		free(f->props);
+	if (f->bases)
+		free(f->bases);
+	if (f->preds)
+		free(f->preds);
+
 	free(f);
 }
 
@@ -158,9 +204,378 @@ void filter_ptype_to_value(struct filter_value *v, struct ptype *pt) {
 // Compilation functions
 //
 
+static int filter_lookup_key_cmp(const uint64_t *a, const uint64_t *b) {
+
+	int i;
+	for (i = 0; i < 2; i++) {
+		if (a[i] < b[i])
+			return -1;
+		if (a[i] > b[i])
+			return 1;
+	}
+
+	return 0;
+}
+
+static int filter_lookup_range_cmp(const void *a, const void *b) {
+
+	const struct filter_lookup_range *ra = a, *rb = b;
+	return filter_lookup_key_cmp(ra->start, rb->start);
+}
+
+static void filter_lookup_ipv6_key(struct in6_addr *addr, uint64_t *key) {
+
+	memcpy(&key[0], addr->s6_addr, sizeof(uint64_t));
+	memcpy(&key[1], addr->s6_addr + sizeof(uint64_t), sizeof(uint64_t));
+	key[0] = be64toh(key[0]);
+	key[1] = be64toh(key[1]);
+}
+
+static uint32_t filter_lookup_string_hash(char *str) {
+
+	return jhash(str, strlen(str), 0);
+}
+
+static int filter_lookup_add_range(struct filter_lookup *l, unsigned int *size, uint64_t *start, uint64_t *end) {
+
+	if (l->range_count >= *size) {
+		unsigned int new_size = (*size ? *size * 2 : 16);
+		struct filter_lookup_range *ranges = realloc(l->ranges, sizeof(struct filter_lookup_range) * new_size);
+		if (!ranges) {
+			pom_oom(sizeof(struct filter_lookup_range) * new_size);
+			return POM_ERR;
+		}
+		l->ranges = ranges;
+		*size = new_size;
+	}
+
+	struct filter_lookup_range *r = &l->ranges[l->range_count++];
+	memcpy(r->start, start, sizeof(r->start));
+	memcpy(r->end, end, sizeof(r->end));
+
+	return POM_OK;
+}
+
+// Remove the backslash in front of the escaped double quotes, returns the new length
+static size_t filter_unescape_string(char *str, size_t len) {
+
+	size_t i, j;
+	for (i = 0, j = 0; i < len; i++, j++) {
+		if (str[i] == '\\' && i + 1 < len && str[i + 1] == '"')
+			i++;
+		str[j] = str[i];
+	}
+	str[j] = 0;
+
+	return j;
+}
+
+static int filter_lookup_add_string(struct filter_lookup *l, unsigned int *size, char *str, size_t len) {
+
+	// Strings are stored in the table as they come and hashed once all are known
+	if (l->range_count >= *size) {
+		unsigned int new_size = (*size ? *size * 2 : 16);
+		char **strings = realloc(l->strings, sizeof(char *) * new_size);
+		if (!strings) {
+			pom_oom(sizeof(char *) * new_size);
+			return POM_ERR;
+		}
+		l->strings = strings;
+		*size = new_size;
+	}
+
+	char *dup = strndup(str, len);
+	if (!dup) {
+		pom_oom(len + 1);
+		return POM_ERR;
+	}
+	l->strings[l->range_count++] = dup;
+
+	return POM_OK;
+}
+
+static int filter_parse_lookup_elem(struct filter_lookup *l, unsigned int *size, char *elem, size_t len, int first) {
+
+	enum filter_lookup_type type;
+	uint64_t start[2] = { 0 }, end[2] = { 0 };
+
+	if (*elem == '"') {
+		if (len < 2 || elem[len - 1] != '"') {
+			pomlog(POMLOG_ERR "Unterminated double quoted string in list");
+			return POM_ERR;
+		}
+		type = filter_lookup_type_string;
+	} else if (strspn(elem, "0123456789-") == len) {
+		type = filter_lookup_type_int;
+		// Either a number or exactly one dash between two numbers
+		char *dash = memchr(elem, '-', len);
+		if (dash && (dash == elem || dash == elem + len - 1 || memchr(dash + 1, '-', elem + len - dash - 1))) {
+			pomlog(POMLOG_ERR "Invalid integer range '%s' in list", elem);
+			return POM_ERR;
+		}
+		if (sscanf(elem, "%"SCNu64, &start[1]) != 1 || (dash && sscanf(dash + 1, "%"SCNu64, &end[1]) != 1)) {
+			pomlog(POMLOG_ERR "Invalid integer range '%s' in list", elem);
+			return POM_ERR;
+		}
+		if (!dash)
+			end[1] = start[1];
+		if (end[1] < start[1]) {
+			pomlog(POMLOG_ERR "Invalid integer range '%s' in list", elem);
+			return POM_ERR;
+		}
+	} else {
+		type = (memchr(elem, ':', len) ? filter_lookup_type_ipv6 : filter_lookup_type_ipv4);
+		struct ptype *pt = ptype_alloc(type == filter_lookup_type_ipv6 ? "ipv6" : "ipv4");
+		if (!pt)
+			return POM_ERR;
+		if (ptype_parse_val(pt, elem) != POM_OK) {
+			ptype_cleanup(pt);
+			pomlog(POMLOG_ERR "Invalid value '%s' in list", elem);
+			return POM_ERR;
+		}
+
+		if (type == filter_lookup_type_ipv4) {
+			struct ptype_ipv4_val *v = pt->value;
+			uint32_t mask = (v->mask ? 0xffffffff << (32 - v->mask) : 0);
+			start[1] = ntohl(v->addr.s_addr) & mask;
+			end[1] = start[1] | (~mask & 0xffffffff);
+		} else {
+			struct ptype_ipv6_val *v = pt->value;
+			uint64_t mask[2];
+			mask[0] = (v->mask >= 64 ? ~0ULL : (v->mask ? ~0ULL << (64 - v->mask) : 0));
+			mask[1] = (v->mask >= 128 ? ~0ULL : (v->mask > 64 ? ~0ULL << (128 - v->mask) : 0));
+			filter_lookup_ipv6_key(&v->addr, start);
+			int i;
+			for (i = 0; i < 2; i++) {
+				start[i] &= mask[i];
+				end[i] = start[i] | ~mask[i];
+			}
+		}
+		ptype_cleanup(pt);
+	}
+
+	if (first) {
+		l->type = type;
+	} else if (l->type != type) {
+		pomlog(POMLOG_ERR "All the values of a list must have the same type");
+		return POM_ERR;
+	}
+
+	if (type == filter_lookup_type_string) {
+		len = filter_unescape_string(elem + 1, len - 2);
+		return filter_lookup_add_string(l, size, elem + 1, len);
+	}
+
+	return filter_lookup_add_range(l, size, start, end);
+}
+
+static int filter_lookup_compile(struct filter_lookup *l) {
+
+	unsigned int i, j;
+
+	if (l->type != filter_lookup_type_string) {
+		// Sort the ranges and merge the ones overlapping
+		qsort(l->ranges, l->range_count, sizeof(struct filter_lookup_range), filter_lookup_range_cmp);
+		for (i = 1, j = 0; i < l->range_count; i++) {
+			if (filter_lookup_key_cmp(l->ranges[i].start, l->ranges[j].end) <= 0) {
+				if (filter_lookup_key_cmp(l->ranges[i].end, l->ranges[j].end) > 0)
+					memcpy(l->ranges[j].end, l->ranges[i].end, sizeof(l->ranges[j].end));
+			} else {
+				memcpy(&l->ranges[++j], &l->ranges[i], sizeof(struct filter_lookup_range));
+			}
+		}
+		l->range_count = j + 1;
+		return POM_OK;
+	}
+
+	// Build a hash table at most half full out of the strings
+	unsigned int count = l->range_count, size = 16;
+	while (size < count * 2)
+		size <<= 1;
+
+	char **table = malloc(sizeof(char *) * size);
+	if (!table) {
+		pom_oom(sizeof(char *) * size);
+		return POM_ERR;
+	}
+	memset(table, 0, sizeof(char *) * size);
+
+	for (i = 0; i < count; i++) {
+		char *str = l->strings[i];
+		uint32_t pos = filter_lookup_string_hash(str) & (size - 1);
+		while (table[pos] && strcmp(table[pos], str))
+			pos = (pos + 1) & (size - 1);
+
+		if (table[pos])
+			free(str);
+		else
+			table[pos] = str;
+	}
+
+	free(l->strings);
+	l->strings = table;
+	l->string_mask = size - 1;
+	l->range_count = 0;
+
+	return POM_OK;
+}
+
+static void filter_parse_list_cleanup(struct filter_lookup *l) {
+
+	// The strings aren't in a hash table yet
+	if (l->type == filter_lookup_type_string && l->strings) {
+		unsigned int i;
+		for (i = 0; i < l->range_count; i++)
+			free(l->strings[i]);
+		free(l->strings);
+		l->strings = NULL;
+	}
+
+	filter_lookup_cleanup(l);
+}
+
+// Parse a list of values (i.e. "{ 10.0.0.0/8, 192.168.1.1 }", "1000-2000")
+static struct filter_lookup *filter_parse_list(char *tok, unsigned int len) {
+
+	if (filter_ptype_init() != POM_OK)
+		return NULL;
+
+	if (*tok == '{') {
+		if (len < 2 || tok[len - 1] != '}') {
+			pomlog(POMLOG_ERR "Unterminated list");
+			return NULL;
+		}
+		tok++;
+		len -= 2;
+	}
+
+	char *str = strndup(tok, len);
+	if (!str) {
+		pom_oom(len + 1);
+		return NULL;
+	}
+
+	struct filter_lookup *l = malloc(sizeof(struct filter_lookup));
+	if (!l) {
+		free(str);
+		pom_oom(sizeof(struct filter_lookup));
+		return NULL;
+	}
+	memset(l, 0, sizeof(struct filter_lookup));
+
+	unsigned int size = 0, count = 0;
+	char *elem = str, *cur;
+	int in_str = 0;
+	for (cur = str; ; cur++) {
+		if (in_str && *cur == '\\' && cur[1]) {
+			// Skip the escaped character
+			cur++;
+			continue;
+		}
+		if (*cur == '"') {
+			in_str = !in_str;
+			continue;
+		}
+		if (*cur && (*cur != ',' || in_str))
+			continue;
+
+		int last = !*cur;
+		if (in_str) {
+			pomlog(POMLOG_ERR "Unterminated double quoted string in list");
+			goto err;
+		}
+		*cur = 0;
+
+		while (*elem == ' ')
+			elem++;
+		size_t elem_len = strlen(elem);
+		while (elem_len && elem[elem_len - 1] == ' ')
+			elem[--elem_len] = 0;
+
+		if (!elem_len) {
+			pomlog(POMLOG_ERR "Empty value in list");
+			goto err;
+		}
+
+		if (filter_parse_lookup_elem(l, &size, elem, elem_len, !count) != POM_OK)
+			goto err;
+		count++;
+
+		if (last)
+			break;
+		elem = cur + 1;
+	}
+
+	free(str);
+
+	return l;
+
+err:
+	free(str);
+	filter_parse_list_cleanup(l);
+	return NULL;
+}
+
+// Parse the values of the "in" operator
+static int filter_parse_lookup(char *tok, unsigned int len, struct filter_value *v) {
+
+	struct filter_lookup *l = filter_parse_list(tok, len);
+	if (!l)
+		return POM_ERR;
+
+	if (filter_lookup_compile(l) != POM_OK) {
+		filter_parse_list_cleanup(l);
+		return POM_ERR;
+	}
+
+	v->type = filter_value_type_lookup;
+	v->val.lookup = l;
+
+	return POM_OK;
+}
+
+// Parse the patterns of the string operators (i.e. "\"admin\"", "{ \"login\", \"admin\" }")
+static int filter_parse_strmatch(char *tok, unsigned int len, int op, struct filter_value *v) {
+
+	struct filter_lookup *l = filter_parse_list(tok, len);
+	if (!l)
+		return POM_ERR;
+
+	if (l->type != filter_lookup_type_string) {
+		pomlog(POMLOG_ERR "String operators expect double quoted strings");
+		filter_parse_list_cleanup(l);
+		return POM_ERR;
+	}
+
+	enum filter_strmatch_mode mode = filter_strmatch_contains;
+	if (op == FILTER_OP_STARTSWITH)
+		mode = filter_strmatch_startswith;
+	else if (op == FILTER_OP_ENDSWITH)
+		mode = filter_strmatch_endswith;
+	else if (op == FILTER_OP_MATCHES)
+		mode = filter_strmatch_matches;
+
+	struct filter_strmatch *m = filter_strmatch_compile(mode, l->strings, l->range_count);
+	filter_parse_list_cleanup(l);
+
+	if (!m)
+		return POM_ERR;
+
+	v->type = filter_value_type_strmatch;
+	v->val.strmatch = m;
+
+	return POM_OK;
+}
+
 // Parse a token into a node value (i.e. "ipv4", "some string", "10.2.4.6")
 int filter_parse_expr_token(struct filter *f, char *tok, unsigned int len, struct filter_node *n, int tok_idx) {
 
+	if (tok_idx == 1 && n->op == FILTER_OP_IN)
+		return filter_parse_lookup(tok, len, &n->value[1]);
+
+	if (tok_idx == 1 && FILTER_OP_IS_STRMATCH(n->op))
+		return filter_parse_strmatch(tok, len, n->op, &n->value[1]);
+
 
 	// Check if it's a string
 	if (*tok == '"') {
@@ -176,16 +591,7 @@ int filter_parse_expr_token(struct filter *f, char *tok, unsigned int len, struc
 			return POM_ERR;
 		}
 
-		len -= 2;
-
-		char *str = n->value[tok_idx].val.string;
-		char *dq = str + 1;
-		len--;
-		while ( (dq = memchr(dq, '"', len)) ) {
-			// The dquote must be escaped at this point
-			memmove(dq - 1, dq, len);
-			len--;
-		}
+		filter_unescape_string(n->value[tok_idx].val.string, len - 2);
 
 		return POM_OK;
 	} else if (!strncasecmp(tok, "true", len) || !strncasecmp(tok, "yes", len)) {
@@ -268,6 +674,16 @@ int filter_op_compile(struct filter_node *n, char *op) {
 		n->op = FILTER_OP_LE;
 	} else if (!strncmp(op, "neq", 3) || !strncmp(op, "!=", 2)) {
 		n->op = FILTER_OP_NEQ;
+	} else if (!strncmp(op, "in ", 3)) {
+		n->op = FILTER_OP_IN;
+	} else if (!strncmp(op, "contains ", strlen("contains "))) {
+		n->op = FILTER_OP_CONTAINS;
+	} else if (!strncmp(op, "startswith ", strlen("startswith "))) {
+		n->op = FILTER_OP_STARTSWITH;
+	} else if (!strncmp(op, "endswith ", strlen("endswith "))) {
+		n->op = FILTER_OP_ENDSWITH;
+	} else if (!strncmp(op, "matches ", strlen("matches "))) {
+		n->op = FILTER_OP_MATCHES;
 	}
 
 	if (n->op == FILTER_OP_NOP)
@@ -486,6 +902,8 @@ int filter_validate(struct filter_node *n) {
 			case filter_value_type_string:
 			case filter_value_type_int:
 			case filter_value_type_ptype:
+			case filter_value_type_lookup:
+			case filter_value_type_strmatch:
 				type[i] = n->value[i].type;
 				break;
 			case filter_value_type_prop:
@@ -494,6 +912,64 @@ int filter_validate(struct filter_node *n) {
 		}
 	}
 
+	if (n->op == FILTER_OP_IN) {
+		if (type[1] != filter_value_type_lookup) {
+			pomlog(POMLOG_ERR "Operator 'in' expects a list of values");
+			return POM_ERR;
+		}
+
+		struct ptype_reg *reg = NULL;
+		if (n->value[0].type == filter_value_type_prop)
+			reg = n->value[0].val.prop.out_ptype;
+		else if (n->value[0].type == filter_value_type_ptype)
+			reg = n->value[0].val.ptype->type;
+
+		int valid = 1;
+		switch (n->value[1].val.lookup->type) {
+			case filter_lookup_type_int:
+				valid = (type[0] == filter_value_type_int);
+				break;
+			case filter_lookup_type_string:
+				valid = (type[0] == filter_value_type_string);
+				break;
+			case filter_lookup_type_ipv4:
+				valid = (type[0] == filter_value_type_ptype && reg == ptype_ipv4);
+				break;
+			case filter_lookup_type_ipv6:
+				valid = (type[0] == filter_value_type_ptype && reg == ptype_ipv6);
+				break;
+		}
+
+		if (type[0] != filter_value_type_unknown && !valid) {
+			pomlog(POMLOG_ERR "Trying to look up a value in a list of a different type");
+			return POM_ERR;
+		}
+
+		return POM_OK;
+	}
+
+	if (FILTER_OP_IS_STRMATCH(n->op)) {
+		if (type[1] != filter_value_type_strmatch) {
+			pomlog(POMLOG_ERR "String operators expect double quoted strings");
+			return POM_ERR;
+		}
+		if (type[0] != filter_value_type_unknown && type[0] != filter_value_type_string) {
+			pomlog(POMLOG_ERR "String operators can only be used on strings");
+			return POM_ERR;
+		}
+		return POM_OK;
+	}
+
+	if (type[0] == filter_value_type_lookup || type[1] == filter_value_type_lookup) {
+		pomlog(POMLOG_ERR "Lists of values can only be used with the 'in' operator");
+		return POM_ERR;
+	}
+
+	if (type[0] == filter_value_type_strmatch || type[1] == filter_value_type_strmatch) {
+		pomlog(POMLOG_ERR "Patterns can only be used with string operators");
+		return POM_ERR;
+	}
+
 	if (type[0] == filter_value_type_unknown || type[1] == filter_value_type_unknown)
 		return POM_OK;
 
@@ -513,6 +989,283 @@ int filter_validate(struct filter_node *n) {
 	return POM_OK;
 }
 
+// Generate the bytecode
+
+static int filter_emit(struct filter *f, enum filter_insn_code code) {
+
+	if (f->prog_len >= f->prog_size) {
+		unsigned int size = (f->prog_size ? f->prog_size * 2 : 16);
+		struct filter_insn *prog = realloc(f->prog, sizeof(struct filter_insn) * size);
+		if (!prog) {
+			pom_oom(sizeof(struct filter_insn) * size);
+			return -1;
+		}
+		f->prog = prog;
+		f->prog_size = size;
+	}
+
+	struct filter_insn *insn = &f->prog[f->prog_len];
+	memset(insn, 0, sizeof(struct filter_insn));
+	insn->code = code;
+
+	return f->prog_len++;
+}
+
+static int filter_compile_base(struct filter *f, void *base, unsigned int *idx) {
+
+	unsigned int i;
+	for (i = 0; i < f->base_count && f->bases[i] != base; i++);
+
+	if (i >= f->base_count) {
+		void **bases = realloc(f->bases, sizeof(void *) * (f->base_count + 1));
+		if (!bases) {
+			pom_oom(sizeof(void *) * (f->base_count + 1));
+			return POM_ERR;
+		}
+		bases[f->base_count] = base;
+		f->bases = bases;
+		f->base_count++;
+	}
+
+	*idx = i;
+
+	return POM_OK;
+}
+
+static enum filter_value_type filter_compile_value_type(struct filter_value *v, struct ptype_reg **reg) {
+
+	*reg = NULL;
+
+	if (v->type == filter_value_type_prop) {
+		*reg = v->val.prop.out_ptype;
+		return v->val.prop.out_type;
+	}
+
+	if (v->type == filter_value_type_ptype)
+		*reg = v->val.ptype->type;
+
+	return v->type;
+}
+
+static enum filter_insn_code filter_compile_cmp_code(struct filter_node *n) {
+
+	if (n->op == FILTER_OP_NOP)
+		return filter_insn_exists;
+
+	if (n->op == FILTER_OP_IN)
+		return filter_insn_in;
+
+	if (FILTER_OP_IS_STRMATCH(n->op))
+		return filter_insn_strmatch;
+
+	struct ptype_reg *reg[2];
+	enum filter_value_type type[2];
+	type[0] = filter_compile_value_type(&n->value[0], &reg[0]);
+	type[1] = filter_compile_value_type(&n->value[1], &reg[1]);
+
+	if (type[0] != type[1])
+		return filter_insn_cmp_any;
+
+	switch (type[0]) {
+		case filter_value_type_int:
+			return filter_insn_cmp_int;
+		case filter_value_type_string:
+			return filter_insn_cmp_string;
+		case filter_value_type_ptype:
+			if (!reg[0] || reg[0] != reg[1])
+				break;
+			if ((n->op != FILTER_OP_EQ && n->op != FILTER_OP_NEQ) || !(reg[0]->info->ops & n->op))
+				return filter_insn_cmp_ptype;
+			if (reg[0] == ptype_ipv4)
+				return filter_insn_cmp_ipv4;
+			if (reg[0] == ptype_ipv6)
+				return filter_insn_cmp_ipv6;
+			if (reg[0] == ptype_mac)
+				return filter_insn_cmp_mac;
+			return filter_insn_cmp_ptype;
+		default:
+			break;
+	}
+
+	return filter_insn_cmp_any;
+}
+
+static int filter_compile_reg(struct filter *f, struct filter_value *v, unsigned int *reg) {
+
+	// The same property relative to the same base is fetched only once
+	unsigned int i;
+	if (v->val.prop.base) {
+		for (i = 0; i < f->reg_count; i++) {
+			struct filter_prop *prop = &f->props[i]->val.prop;
+			if (prop->base == v->val.prop.base && prop->id == v->val.prop.id) {
+				*reg = i;
+				return POM_OK;
+			}
+		}
+	}
+
+	struct filter_value **props = realloc(f->props, sizeof(struct filter_value *) * (f->reg_count + 1));
+	if (!props) {
+		pom_oom(sizeof(struct filter_value *) * (f->reg_count + 1));
+		return POM_ERR;
+	}
+	props[f->reg_count] = v;
+	f->props = props;
+	*reg = f->reg_count++;
+
+	return POM_OK;
+}
+
+static int filter_compile_value_equal(struct filter_value *a, struct filter_value *b) {
+
+	if (a->type != b->type)
+		return 0;
+
+	switch (a->type) {
+		case filter_value_type_string:
+			return !strcmp(a->val.string, b->val.string);
+		case filter_value_type_int:
+			return (a->val.integer == b->val.integer);
+		case filter_value_type_ptype: {
+			if (a->val.ptype->type != b->val.ptype->type)
+				return 0;
+			size_t size = ptype_get_fixed_size(a->val.ptype->type);
+			return (size && !memcmp(a->val.ptype->value, b->val.ptype->value, size));
+		}
+		case filter_value_type_lookup:
+			return (a->val.lookup == b->val.lookup);
+		case filter_value_type_strmatch:
+			return (a->val.strmatch == b->val.strmatch);
+		default:
+			break;
+	}
+
+	return 0;
+}
+
+static int filter_compile_pred(struct filter *f, struct filter_insn *cmp, unsigned int *pred) {
+
+	unsigned int i, j;
+	for (i = 0; i < f->pred_count; i++) {
+		struct filter_insn *p = &f->preds[i];
+		if (p->code != cmp->code || p->op != cmp->op)
+			continue;
+
+		for (j = 0; j < 2; j++) {
+			if (!p->val[j] != !cmp->val[j])
+				break;
+			if (p->val[j] && !filter_compile_value_equal(p->val[j], cmp->val[j]))
+				break;
+			if (!p->val[j] && p->reg[j] != cmp->reg[j])
+				break;
+		}
+
+		if (j == 2) {
+			*pred = i;
+			return POM_OK;
+		}
+	}
+
+	struct filter_insn *preds = realloc(f->preds, sizeof(struct filter_insn) * (f->pred_count + 1));
+	if (!preds) {
+		pom_oom(sizeof(struct filter_insn) * (f->pred_count + 1));
+		return POM_ERR;
+	}
+	memcpy(&preds[f->pred_count], cmp, sizeof(struct filter_insn));
+	f->preds = preds;
+	*pred = f->pred_count++;
+
+	return POM_OK;
+}
+
+static int filter_compile_leaf(struct filter *f, struct filter_node *n) {
+
+	struct filter_insn cmp = { 0 };
+	cmp.code = filter_compile_cmp_code(n);
+	cmp.op = n->op;
+
+	int count = (n->op == FILTER_OP_NOP ? 1 : 2);
+
+	int i, idx;
+	for (i = 0; i < count; i++) {
+		if (n->value[i].type != filter_value_type_prop)
+			cmp.val[i] = &n->value[i];
+		else if (filter_compile_reg(f, &n->value[i], &cmp.reg[i]) != POM_OK)
+			return POM_ERR;
+	}
+
+	int pred_idx = -1;
+	if (f->shared) {
+		unsigned int pred;
+		if (filter_compile_pred(f, &cmp, &pred) != POM_OK)
+			return POM_ERR;
+		pred_idx = filter_emit(f, filter_insn_pred);
+		if (pred_idx < 0)
+			return POM_ERR;
+		f->prog[pred_idx].reg[0] = pred;
+	}
+
+	// Properties are fetched right before being compared so skipped branches don't fetch anything
+	for (i = 0; i < count; i++) {
+		if (cmp.val[i])
+			continue;
+
+		unsigned int base = FILTER_BASE_NONE;
+		void *base_obj = f->props[cmp.reg[i]]->val.prop.base;
+		if (base_obj && filter_compile_base(f, base_obj, &base) != POM_OK)
+			return POM_ERR;
+
+		idx = filter_emit(f, filter_insn_load);
+		if (idx < 0)
+			return POM_ERR;
+
+		f->prog[idx].reg[0] = cmp.reg[i];
+		f->prog[idx].target = base;
+	}
+
+	idx = filter_emit(f, cmp.code);
+	if (idx < 0)
+		return POM_ERR;
+	memcpy(&f->prog[idx], &cmp, sizeof(struct filter_insn));
+
+	if (f->shared) {
+		idx = filter_emit(f, filter_insn_store);
+		if (idx < 0)
+			return POM_ERR;
+		f->prog[idx].reg[0] = f->prog[pred_idx].reg[0];
+		f->prog[pred_idx].target = f->prog_len;
+	}
+
+	return POM_OK;
+}
+
+static int filter_compile_node(struct filter *f, struct filter_node *n) {
+
+	if (n->op == FILTER_OP_AND || n->op == FILTER_OP_OR) {
+
+		if (filter_compile_node(f, n->value[0].val.node) != POM_OK)
+			return POM_ERR;
+
+		// Skip the second branch if the first one decides already
+		int jmp = filter_emit(f, (n->op == FILTER_OP_AND ? filter_insn_jmp_false : filter_insn_jmp_true));
+		if (jmp < 0)
+			return POM_ERR;
+
+		if (filter_compile_node(f, n->value[1].val.node) != POM_OK)
+			return POM_ERR;
+
+		f->prog[jmp].target = f->prog_len;
+
+	} else if (filter_compile_leaf(f, n) != POM_OK) {
+		return POM_ERR;
+	}
+
+	if (n->not && filter_emit(f, filter_insn_not) < 0)
+		return POM_ERR;
+
+	return POM_OK;
+}
+
 int filter_compile(char *filter_expr, struct filter *f) {
 
 	if (f->n) {
@@ -528,6 +1281,12 @@ int filter_compile(char *filter_expr, struct filter *f) {
 		return POM_ERR;
 	}
 
+	if (filter_ptype_init() != POM_OK)
+		return POM_ERR;
+
+	if (filter_compile_node(f, f->n) != POM_OK || filter_emit(f, filter_insn_ret) < 0)
+		return POM_ERR;
+
 	return POM_OK;
 }
 
@@ -535,147 +1294,387 @@ int filter_compile(char *filter_expr, struct filter *f) {
 // Matching funtions
 //
 
-int filter_match_node(struct filter *f, struct filter_node *n, void *obj) {
+static int filter_match_int(int op, uint64_t a, uint64_t b) {
+
+	switch (op) {
+		case FILTER_OP_EQ:
+			return (a == b);
+		case FILTER_OP_GT:
+			return (a > b);
+		case FILTER_OP_GE:
+			return (a >= b);
+		case FILTER_OP_LT:
+			return (a < b);
+		case FILTER_OP_LE:
+			return (a <= b);
+		case FILTER_OP_NEQ:
+			return (a != b);
+	}
 
-	int res = FILTER_MATCH_NO;
+	return FILTER_MATCH_NO;
+}
 
-	struct filter_value value[2] = { { 0 } };
-	value[0].type = n->value[0].type;
-	value[1].type = n->value[1].type;
+static int filter_match_string(int op, char *a, char *b) {
 
+	if (op == FILTER_OP_EQ)
+		return !strcmp(a, b);
+	else if (op == FILTER_OP_NEQ)
+		return (strcmp(a, b) != 0);
 
-	int i;
+	return POM_ERR;
+}
 
-	// Fetch both values
-	for (i = 0; i < 2; i++) {
-		switch (n->value[i].type) {
-			case filter_value_type_unknown:
-				// Nothing to do
-				break;
-			case filter_value_type_prop: {
-				value[i].type = filter_value_type_unknown;
-				if (f->prop_get_val(&n->value[i], &value[i], obj) != POM_OK)
-					return POM_ERR;
-				break;
-			}
-			case filter_value_type_string:
-				value[i].val.string = n->value[i].val.string;
-				break;
-			case filter_value_type_int:
-				value[i].val.integer = n->value[i].val.integer;
-				break;
-			case filter_value_type_node:
-				value[i].val.node = n->value[i].val.node;
-				break;
-			case filter_value_type_ptype:
-				value[i].val.ptype = n->value[i].val.ptype;
-				break;
-		}
-	}
+static int filter_match_ipv4(struct ptype *a, struct ptype *b) {
+
+	struct ptype_ipv4_val *va = a->value, *vb = b->value;
+
+	unsigned int mask = (va->mask < vb->mask ? va->mask : vb->mask);
+	if (!mask)
+		return FILTER_MATCH_YES;
 
+	return !((va->addr.s_addr ^ vb->addr.s_addr) & htonl(0xffffffff << (32 - mask)));
+}
+
+static int filter_match_ipv6(struct ptype *a, struct ptype *b) {
 
-	if (n->op != FILTER_OP_NOP) {
-		if (value[0].type == filter_value_type_unknown || value[1].type == filter_value_type_unknown)
+	struct ptype_ipv6_val *va = a->value, *vb = b->value;
+
+	int mask = (va->mask < vb->mask ? va->mask : vb->mask);
+	int i;
+	for (i = 0; i < 4 && mask > 0; i++, mask -= 32) {
+		uint32_t m = (mask >= 32 ? 0xffffffff : htonl(0xffffffff << (32 - mask)));
+		if ((va->addr.s6_addr32[i] ^ vb->addr.s6_addr32[i]) & m)
 			return FILTER_MATCH_NO;
+	}
+
+	return FILTER_MATCH_YES;
+}
+
+static int filter_match_mac(struct ptype *a, struct ptype *b) {
+
+	struct ptype_mac_val *va = a->value, *vb = b->value;
+
+	return !memcmp(va->addr, vb->addr, sizeof(va->addr));
+}
 
-		if (value[0].type != value[1].type) {
-			pomlog(POMLOG_DEBUG "Cannot compare different values");
+static int filter_match_lookup(struct filter_lookup *l, struct filter_value *v) {
+
+	uint64_t key[2] = { 0 };
+
+	switch (l->type) {
+		case filter_lookup_type_string: {
+			if (v->type != filter_value_type_string || !v->val.string)
+				return FILTER_MATCH_NO;
+			uint32_t pos = filter_lookup_string_hash(v->val.string) & l->string_mask;
+			while (l->strings[pos]) {
+				if (!strcmp(l->strings[pos], v->val.string))
+					return FILTER_MATCH_YES;
+				pos = (pos + 1) & l->string_mask;
+			}
 			return FILTER_MATCH_NO;
 		}
+		case filter_lookup_type_int:
+			if (v->type != filter_value_type_int)
+				return FILTER_MATCH_NO;
+			key[1] = v->val.integer;
+			break;
+		case filter_lookup_type_ipv4:
+			if (v->type != filter_value_type_ptype || v->val.ptype->type != ptype_ipv4)
+				return FILTER_MATCH_NO;
+			key[1] = ntohl(PTYPE_IPV4_GETADDR(v->val.ptype).s_addr);
+			break;
+		case filter_lookup_type_ipv6:
+			if (v->type != filter_value_type_ptype || v->val.ptype->type != ptype_ipv6)
+				return FILTER_MATCH_NO;
+			filter_lookup_ipv6_key(&PTYPE_IPV6_GETADDR(v->val.ptype), key);
+			break;
 	}
 
-	// Match the values
-	switch (value[0].type) {
-		case filter_value_type_unknown:
-			res = FILTER_MATCH_NO;
-			break;
+	// Find the last range starting before the key
+	unsigned int lo = 0, hi = l->range_count;
+	while (lo < hi) {
+		unsigned int mid = (lo + hi) / 2;
+		if (filter_lookup_key_cmp(key, l->ranges[mid].start) < 0)
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
 
-		case filter_value_type_prop:
-			pomlog(POMLOG_ERR "Internal error, invalid value type");
-			res = POM_ERR;
-			break;
+	if (!lo)
+		return FILTER_MATCH_NO;
+
+	return (filter_lookup_key_cmp(key, l->ranges[lo - 1].end) <= 0);
+}
+
+// Compare values whose types are only known now
+static int filter_match_any(int op, struct filter_value *a, struct filter_value *b) {
+
+	if (a->type == filter_value_type_unknown || b->type == filter_value_type_unknown)
+		return FILTER_MATCH_NO;
+
+	if (a->type != b->type) {
+		pomlog(POMLOG_DEBUG "Cannot compare different values");
+		return FILTER_MATCH_NO;
+	}
 
+	switch (a->type) {
 		case filter_value_type_string:
-			if (n->op == FILTER_OP_NOP) {
-				res = value[0].val.string || value[1].val.string;
-			} else if (n->op == FILTER_OP_EQ) {
-				res = !strcmp(value[0].val.string, value[1].val.string);
-			} else if (n->op == FILTER_OP_NEQ) {
-				res = strcmp(value[0].val.string, value[1].val.string);
-			} else {
-				res = POM_ERR;
-			}
+			return filter_match_string(op, a->val.string, b->val.string);
+		case filter_value_type_int:
+			return filter_match_int(op, a->val.integer, b->val.integer);
+		case filter_value_type_ptype:
+			return ptype_compare_val(op, a->val.ptype, b->val.ptype);
+		default:
 			break;
+	}
 
-		case filter_value_type_int:
-			switch (n->op) {
-				case FILTER_OP_NOP:
-					res = FILTER_MATCH_YES;
-					break;
-				case FILTER_OP_EQ:
-					res = (value[0].val.integer == value[1].val.integer);
-					break;
-				case FILTER_OP_GT:
-					res = (value[0].val.integer > value[1].val.integer);
-					break;
-				case FILTER_OP_GE:
-					res = (value[0].val.integer >= value[1].val.integer);
-					break;
-				case FILTER_OP_LT:
-					res = (value[0].val.integer < value[1].val.integer);
-					break;
-				case FILTER_OP_LE:
-					res = (value[0].val.integer <= value[1].val.integer);
-					break;
-				case FILTER_OP_NEQ:
-					res = (value[0].val.integer != value[1].val.integer);
+	pomlog(POMLOG_ERR "Internal error, invalid value type");
+	return POM_ERR;
+}
+
+#define FILTER_OPERAND(insn, regs, i) ((insn)->val[i] ? (insn)->val[i] : &(regs)[(insn)->reg[i]])
+
+// Both values must have been fetched for a typed comparison
+#define FILTER_OPERANDS_SET(a, b) ((a)->type != filter_value_type_unknown && (a)->type == (b)->type)
+
+static int filter_run(struct filter *f, void *obj, uint64_t *matches) {
+
+	struct filter_value regs[f->reg_count + 1];
+	char loaded[f->reg_count + 1];
+	memset(loaded, 0, f->reg_count);
+
+	// Result of the shared comparisons, -1 if not evaluated yet
+	signed char preds[f->pred_count + 1];
+	memset(preds, -1, f->pred_count);
+
+	void *objs[f->base_count + 1];
+	int resolved = 0;
+
+	int res = FILTER_MATCH_NO;
+
+	struct filter_insn *insn = f->prog;
+	while (1) {
+
+		struct filter_value *a = NULL, *b = NULL;
+		if (insn->code >= filter_insn_exists && insn->code <= filter_insn_cmp_any) {
+			a = FILTER_OPERAND(insn, regs, 0);
+			b = FILTER_OPERAND(insn, regs, 1);
+		}
+
+		switch (insn->code) {
+			case filter_insn_ret:
+				return res;
+
+			case filter_insn_load: {
+				if (loaded[insn->reg[0]])
 					break;
+				loaded[insn->reg[0]] = 1;
+
+				struct filter_value *out = &regs[insn->reg[0]];
+				out->type = filter_value_type_unknown;
+				void *o = obj;
+				if (insn->target != FILTER_BASE_NONE) {
+					// Find all the objects the properties are relative to in one go
+					if (!resolved) {
+						memset(objs, 0, sizeof(void *) * f->base_count);
+						if (f->prop_resolve(f->bases, objs, f->base_count, obj) != POM_OK)
+							return POM_ERR;
+						resolved = 1;
+					}
+					o = objs[insn->target];
+					if (!o)
+						break;
+				}
+				if (f->prop_get_val(f->props[insn->reg[0]], out, o) != POM_OK)
+					return POM_ERR;
+				break;
 			}
-			break;
 
-		case filter_value_type_node: {
-			res = filter_match_node(f, value[0].val.node, obj);
-			if (res == POM_ERR)
-				return POM_ERR;
+			case filter_insn_exists:
+				if (a->type == filter_value_type_string)
+					res = (a->val.string != NULL);
+				else if (a->type == filter_value_type_ptype)
+					res = (a->val.ptype != NULL);
+				else
+					res = (a->type == filter_value_type_int);
+				break;
 
-			if (n->op == FILTER_OP_AND && !res) {
-				// First value is false so expression will be false
+			case filter_insn_cmp_int:
+				res = FILTER_OPERANDS_SET(a, b) && filter_match_int(insn->op, a->val.integer, b->val.integer);
 				break;
-			} else if (n->op == FILTER_OP_OR && res) {
-				// First value is true so expression will be true
+
+			case filter_insn_cmp_string:
+				res = FILTER_OPERANDS_SET(a, b) && filter_match_string(insn->op, a->val.string, b->val.string);
+				break;
+
+			case filter_insn_cmp_ipv4:
+				res = FILTER_OPERANDS_SET(a, b) && (filter_match_ipv4(a->val.ptype, b->val.ptype) == (insn->op == FILTER_OP_EQ));
+				break;
+
+			case filter_insn_cmp_ipv6:
+				res = FILTER_OPERANDS_SET(a, b) && (filter_match_ipv6(a->val.ptype, b->val.ptype) == (insn->op == FILTER_OP_EQ));
 				break;
-			} else {
-				res = filter_match_node(f, value[1].val.node, obj);
 
+			case filter_insn_cmp_mac:
+				res = FILTER_OPERANDS_SET(a, b) && (filter_match_mac(a->val.ptype, b->val.ptype) == (insn->op == FILTER_OP_EQ));
+				break;
+
+			case filter_insn_cmp_ptype:
+				res = FILTER_OPERANDS_SET(a, b) && ptype_compare_val(insn->op, a->val.ptype, b->val.ptype);
+				break;
+
+			case filter_insn_in:
+				res = filter_match_lookup(b->val.lookup, a);
+				break;
+
+			case filter_insn_strmatch:
+				res = (a->type == filter_value_type_string && a->val.string && filter_strmatch_match(b->val.strmatch, a->val.string));
+				break;
+
+			case filter_insn_cmp_any:
+				res = filter_match_any(insn->op, a, b);
 				if (res == POM_ERR)
 					return POM_ERR;
+				break;
 
-				// If it's AND, first value was true, the second one sets the whole expression value
-				// If it's OR, first was false, the second one sets the whole expression value
+			case filter_insn_not:
+				res = !res;
+				break;
 
-			}
-			break;
+			case filter_insn_jmp_false:
+				if (!res) {
+					insn = f->prog + insn->target;
+					continue;
+				}
+				break;
+
+			case filter_insn_jmp_true:
+				if (res) {
+					insn = f->prog + insn->target;
+					continue;
+				}
+				break;
+
+			case filter_insn_pred:
+				if (preds[insn->reg[0]] >= 0) {
+					res = preds[insn->reg[0]];
+					insn = f->prog + insn->target;
+					continue;
+				}
+				break;
+
+			case filter_insn_store:
+				preds[insn->reg[0]] = (res ? FILTER_MATCH_YES : FILTER_MATCH_NO);
+				break;
+
+			case filter_insn_match:
+				if (res)
+					matches[insn->reg[0] / 64] |= (1ULL << (insn->reg[0] % 64));
+				break;
 		}
 
-		case filter_value_type_ptype:
-			if (n->op == FILTER_OP_NOP) {
-				res = value[0].val.ptype || value[1].val.ptype;
-			} else {
-				res = ptype_compare_val(n->op, value[0].val.ptype, value[1].val.ptype);
-			}
-			break;
+		insn++;
+	}
+
+	return POM_ERR;
+}
+
+int filter_match(struct filter *f, void *obj) {
+
+	return filter_run(f, obj, NULL);
+}
+
+//
+// Filter sets
+//
+
+struct filter_set *filter_set_compile(struct filter **filters, unsigned int count) {
 
+	// All the filters must fetch their properties the same way
+	struct filter *tmpl = NULL;
+	unsigned int i;
+	for (i = 0; i < count; i++) {
+		struct filter *f = filters[i];
+		if (!f)
+			continue;
+		if (!tmpl) {
+			tmpl = f;
+		} else if (f->prop_get_val != tmpl->prop_get_val || f->prop_resolve != tmpl->prop_resolve || f->priv != tmpl->priv) {
+			pomlog(POMLOG_DEBUG "Cannot evaluate filters of different kinds together");
+			return NULL;
+		}
+	}
+
+	struct filter_set *fs = malloc(sizeof(struct filter_set));
+	if (!fs) {
+		pom_oom(sizeof(struct filter_set));
+		return NULL;
 	}
+	memset(fs, 0, sizeof(struct filter_set));
+	fs->count = count;
 
-	if (n->not)
-		return !res;
+	fs->always = calloc(FILTER_SET_WORDS(count) + 1, sizeof(uint64_t));
+	if (!fs->always) {
+		pom_oom((FILTER_SET_WORDS(count) + 1) * sizeof(uint64_t));
+		goto err;
+	}
 
-	return res;
+	if (!tmpl)
+		return fs;
+
+	// The nodes and their values belong to the filters of the set
+	fs->f = filter_alloc(tmpl->prop_compile, tmpl->priv, tmpl->prop_get_val, tmpl->prop_resolve, NULL);
+	if (!fs->f)
+		goto err;
+	fs->f->shared = 1;
+
+	for (i = 0; i < count; i++) {
+		if (!filters[i] || !filters[i]->n) {
+			fs->always[i / 64] |= (1ULL << (i % 64));
+			continue;
+		}
+
+		if (filter_compile_node(fs->f, filters[i]->n) != POM_OK)
+			goto err;
+
+		int idx = filter_emit(fs->f, filter_insn_match);
+		if (idx < 0)
+			goto err;
+		fs->f->prog[idx].reg[0] = i;
+	}
+
+	if (filter_emit(fs->f, filter_insn_ret) < 0)
+		goto err;
+
+	pomlog(POMLOG_DEBUG "Filter set of %u filters compiled with %u shared comparisons", count, fs->f->pred_count);
+
+	return fs;
+
+err:
+	filter_set_cleanup(fs);
+	return NULL;
 }
 
-int filter_match(struct filter *f, void *obj) {
+int filter_set_match(struct filter_set *fs, void *obj, uint64_t *matches) {
+
+	memcpy(matches, fs->always, FILTER_SET_WORDS(fs->count) * sizeof(uint64_t));
+
+	if (!fs->f)
+		return POM_OK;
 
-	return filter_match_node(f, f->n, obj);
+	if (filter_run(fs->f, obj, matches) == POM_ERR)
+		return POM_ERR;
 
+	return POM_OK;
 }
 
+void filter_set_cleanup(struct filter_set *fs) {
+
+	if (fs->f)
+		filter_cleanup(fs->f);
+
+	if (fs->always)
+		free(fs->always);
+
+	free(fs);
+}
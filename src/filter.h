@@ -38,6 +38,15 @@
 // Remove this one when merge complete
 #define FILTER_OP_NOT	(PTYPE_OP_ALL + 3)
 
+#define FILTER_OP_IN	(PTYPE_OP_ALL + 4)
+
+#define FILTER_OP_CONTAINS	(PTYPE_OP_ALL + 5)
+#define FILTER_OP_STARTSWITH	(PTYPE_OP_ALL + 6)
+#define FILTER_OP_ENDSWITH	(PTYPE_OP_ALL + 7)
+#define FILTER_OP_MATCHES	(PTYPE_OP_ALL + 8)
+
+#define FILTER_OP_IS_STRMATCH(x)	((x) >= FILTER_OP_CONTAINS && (x) <= FILTER_OP_MATCHES)
+
 #include <pom-ng/data.h>
 
 
@@ -55,12 +64,37 @@ enum filter_value_type {
 	filter_value_type_int,
 	filter_value_type_node,
 	filter_value_type_ptype,
+	filter_value_type_lookup,
+	filter_value_type_strmatch,
+};
+
+enum filter_lookup_type {
+	filter_lookup_type_int,
+	filter_lookup_type_string,
+	filter_lookup_type_ipv4,
+	filter_lookup_type_ipv6,
+};
+
+// Range of integers or addresses, most significant word first
+struct filter_lookup_range {
+	uint64_t start[2], end[2];
+};
+
+// Values on the right side of the "in" operator
+struct filter_lookup {
+	enum filter_lookup_type type;
+	struct filter_lookup_range *ranges; // Sorted and without overlap
+	unsigned int range_count;
+	char **strings; // Hash table of the strings
+	unsigned int string_mask;
 };
 
 struct filter_prop {
 	void *priv;
 	enum filter_value_type out_type;
 	struct ptype_reg *out_ptype;
+	void *base; // Object resolved once per match and given to prop_get_val(), NULL if none
+	int id; // Identifies the property within its base
 };
 
 union filter_value_u {
@@ -69,6 +103,8 @@ union filter_value_u {
 	uint64_t integer;
 	struct filter_node *node;
 	struct ptype *ptype;
+	struct filter_lookup *lookup;
+	struct filter_strmatch *strmatch;
 };
 
 struct filter_value {
@@ -84,17 +120,73 @@ struct filter_node {
 	struct filter_value value[2];
 };
 
+// Instructions of the compiled filter
+enum filter_insn_code {
+	filter_insn_ret, // Return the result
+	filter_insn_load, // Fetch a property in a register
+	// Instructions using operands, from exists to cmp_any
+	filter_insn_exists, // Result is set if the operand has a value
+	filter_insn_cmp_int,
+	filter_insn_cmp_string,
+	filter_insn_cmp_ipv4,
+	filter_insn_cmp_ipv6,
+	filter_insn_cmp_mac,
+	filter_insn_cmp_ptype,
+	filter_insn_in,
+	filter_insn_strmatch,
+	filter_insn_cmp_any, // Types only known at match time
+	filter_insn_not,
+	filter_insn_jmp_false,
+	filter_insn_jmp_true,
+	filter_insn_pred, // Use the cached result of a shared comparison if known
+	filter_insn_store, // Cache the result of a shared comparison
+	filter_insn_match, // Flag the filter of a set as matching
+};
+
+struct filter_insn {
+	enum filter_insn_code code;
+	int op;
+	struct filter_value *val[2]; // Constant operands
+	unsigned int reg[2]; // Registers used when val is NULL, predicate or filter index
+	unsigned int target; // Jump destination or base of the loaded property
+};
+
+#define FILTER_BASE_NONE	((unsigned int) -1)
+
 struct filter {
 
 	struct filter_node *n;
 	int (*prop_compile) (struct filter *f, char *prop_str, struct filter_value *v);
 	int (*prop_get_val) (struct filter_value *inval, struct filter_value *outval, void *obj);
+	int (*prop_resolve) (void **bases, void **objs, unsigned int count, void *obj);
 	void (*prop_cleanup) (void *prop);
 	void *priv;
+
+	struct filter_insn *prog;
+	unsigned int prog_len, prog_size;
+	struct filter_value **props; // Property loaded in each register
+	unsigned int reg_count;
+	void **bases;
+	unsigned int base_count;
+
+	// Comparisons shared by the filters of a set
+	int shared;
+	struct filter_insn *preds;
+	unsigned int pred_count;
+};
+
+// Filters evaluated together, identical comparisons are only done once
+struct filter_set {
+	struct filter *f; // Program of all the filters, NULL if none has one
+	unsigned int count;
+	uint64_t *always; // Members without a filter
 };
 
+#define FILTER_SET_WORDS(x)		(((x) + 63) / 64)
+#define FILTER_SET_ISSET(matches, i)	((matches)[(i) / 64] & (1ULL << ((i) % 64)))
 
-struct filter *filter_alloc(int (*prop_compile) (struct filter *f, char *prop_str, struct filter_value *v), void *priv, int (*prop_get_val) (struct filter_value *inval, struct filter_value *outval, void *obj), void (*prop_cleanup) (void *(prop)));
+
+struct filter *filter_alloc(int (*prop_compile) (struct filter *f, char *prop_str, struct filter_value *v), void *priv, int (*prop_get_val) (struct filter_value *inval, struct filter_value *outval, void *obj), int (*prop_resolve) (void **bases, void **objs, unsigned int count, void *obj), void (*prop_cleanup) (void *(prop)));
 
 
 
@@ -111,5 +203,9 @@ int filter_node_data_match(struct filter_node *n, struct data *d);
 
 int filter_match(struct filter *n, void *obj);
 
+struct filter_set *filter_set_compile(struct filter **filters, unsigned int count);
+int filter_set_match(struct filter_set *fs, void *obj, uint64_t *matches);
+void filter_set_cleanup(struct filter_set *fs);
+
 #endif
 
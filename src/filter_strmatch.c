@@ -0,0 +1,791 @@
+/*
+ *  This file is part of pom-ng.
+ *  Copyright (C) 2015 Guy Martin <gmsoft@tuxicoman.be>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+
+#include "common.h"
+#include "filter_strmatch.h"
+#include "jhash.h"
+
+#include <pom-ng/filter.h>
+#include <ctype.h>
+
+#define FILTER_STRMATCH_SET_ADD(set, c)		(set)[(unsigned char) (c) >> 3] |= (1 << ((unsigned char) (c) & 7))
+#define FILTER_STRMATCH_SET_HAS(set, c)		((set)[(unsigned char) (c) >> 3] & (1 << ((unsigned char) (c) & 7)))
+
+//
+// Keywords
+//
+
+static uint32_t filter_strmatch_ac_build_goto(struct filter_strmatch_ac *ac, uint32_t *child, uint32_t *sibling, unsigned char *chr, uint32_t s, unsigned char c) {
+
+	if (!s)
+		return ac->root[c];
+
+	uint32_t t;
+	for (t = child[s]; t != FILTER_STRMATCH_NONE && chr[t] != c; t = sibling[t]);
+
+	return t;
+}
+
+static int filter_strmatch_edge_cmp(const void *a, const void *b) {
+
+	const struct filter_strmatch_edge *ea = a, *eb = b;
+	return (int) ea->c - (int) eb->c;
+}
+
+static int filter_strmatch_ac_build(struct filter_strmatch *m, char **patterns, unsigned int count) {
+
+	unsigned int i, max = 1;
+	for (i = 0; i < count; i++)
+		max += strlen(patterns[i]);
+
+	struct filter_strmatch_ac *ac = malloc(sizeof(struct filter_strmatch_ac));
+	if (!ac) {
+		pom_oom(sizeof(struct filter_strmatch_ac));
+		return POM_ERR;
+	}
+	memset(ac, 0, sizeof(struct filter_strmatch_ac));
+	m->ac = ac;
+
+	for (i = 0; i < 256; i++)
+		ac->root[i] = FILTER_STRMATCH_NONE;
+
+	// The trie is first built with lists of children
+	uint32_t *child = malloc(sizeof(uint32_t) * max);
+	uint32_t *sibling = malloc(sizeof(uint32_t) * max);
+	unsigned char *chr = malloc(max);
+	uint32_t *queue = malloc(sizeof(uint32_t) * max);
+	ac->fail = malloc(sizeof(uint32_t) * max);
+	m->accept = malloc(max);
+
+	if (!child || !sibling || !chr || !queue || !ac->fail || !m->accept) {
+		pom_oom(sizeof(uint32_t) * max);
+		goto err;
+	}
+	memset(m->accept, 0, max);
+
+	child[0] = FILTER_STRMATCH_NONE;
+	ac->state_count = 1;
+
+	for (i = 0; i < count; i++) {
+		uint32_t s = 0;
+		unsigned char *c;
+		for (c = (unsigned char *) patterns[i]; *c; c++) {
+			uint32_t t = filter_strmatch_ac_build_goto(ac, child, sibling, chr, s, *c);
+			if (t == FILTER_STRMATCH_NONE) {
+				t = ac->state_count++;
+				chr[t] = *c;
+				child[t] = FILTER_STRMATCH_NONE;
+				if (!s) {
+					ac->root[*c] = t;
+				} else {
+					sibling[t] = child[s];
+					child[s] = t;
+				}
+			}
+			s = t;
+		}
+		m->accept[s] = 1;
+	}
+
+	// Compute the failure links in breadth first order
+	unsigned int head = 0, tail = 0;
+	for (i = 0; i < 256; i++) {
+		if (ac->root[i] == FILTER_STRMATCH_NONE)
+			continue;
+		ac->fail[ac->root[i]] = 0;
+		queue[tail++] = ac->root[i];
+	}
+
+	ac->fail[0] = 0;
+	while (head < tail) {
+		uint32_t s = queue[head++], t;
+		for (t = child[s]; t != FILTER_STRMATCH_NONE; t = sibling[t]) {
+			uint32_t f = ac->fail[s], g;
+			while ((g = filter_strmatch_ac_build_goto(ac, child, sibling, chr, f, chr[t])) == FILTER_STRMATCH_NONE && f)
+				f = ac->fail[f];
+			ac->fail[t] = (g == FILTER_STRMATCH_NONE ? 0 : g);
+
+			// A keyword ending here also ends where the failure link points to
+			m->accept[t] |= m->accept[ac->fail[t]];
+			queue[tail++] = t;
+		}
+	}
+
+	// Store the edges of each state sorted so they can be searched
+	ac->edge_start = malloc(sizeof(uint32_t) * (ac->state_count + 1));
+	ac->edges = malloc(sizeof(struct filter_strmatch_edge) * ac->state_count);
+	if (!ac->edge_start || !ac->edges) {
+		pom_oom(sizeof(struct filter_strmatch_edge) * ac->state_count);
+		goto err;
+	}
+
+	uint32_t edge = 0, s;
+	for (s = 0; s < ac->state_count; s++) {
+		ac->edge_start[s] = edge;
+		if (!s)
+			continue;
+		uint32_t t;
+		for (t = child[s]; t != FILTER_STRMATCH_NONE; t = sibling[t]) {
+			ac->edges[edge].c = chr[t];
+			ac->edges[edge].dst = t;
+			edge++;
+		}
+		qsort(ac->edges + ac->edge_start[s], edge - ac->edge_start[s], sizeof(struct filter_strmatch_edge), filter_strmatch_edge_cmp);
+	}
+	ac->edge_start[ac->state_count] = edge;
+
+	// Unless the match is anchored, chars without a transition get back to the root
+	if (m->mode != filter_strmatch_startswith) {
+		for (i = 0; i < 256; i++) {
+			if (ac->root[i] == FILTER_STRMATCH_NONE)
+				ac->root[i] = 0;
+		}
+	}
+
+	free(child);
+	free(sibling);
+	free(chr);
+	free(queue);
+
+	return POM_OK;
+
+err:
+	if (child)
+		free(child);
+	if (sibling)
+		free(sibling);
+	if (chr)
+		free(chr);
+	if (queue)
+		free(queue);
+
+	return POM_ERR;
+}
+
+static uint32_t filter_strmatch_ac_goto(struct filter_strmatch_ac *ac, uint32_t s, unsigned char c) {
+
+	if (!s)
+		return ac->root[c];
+
+	uint32_t lo = ac->edge_start[s], hi = ac->edge_start[s + 1];
+	while (lo < hi) {
+		uint32_t mid = (lo + hi) / 2;
+		if (ac->edges[mid].c == c)
+			return ac->edges[mid].dst;
+		if (ac->edges[mid].c < c)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return FILTER_STRMATCH_NONE;
+}
+
+static int filter_strmatch_ac_match(struct filter_strmatch *m, char *str) {
+
+	struct filter_strmatch_ac *ac = m->ac;
+
+	uint32_t s = 0;
+	if (!m->accept_at_end && m->accept[s])
+		return FILTER_MATCH_YES;
+
+	unsigned char *c;
+	for (c = (unsigned char *) str; *c; c++) {
+		uint32_t t;
+		if (m->mode == filter_strmatch_startswith) {
+			t = filter_strmatch_ac_goto(ac, s, *c);
+			if (t == FILTER_STRMATCH_NONE)
+				return FILTER_MATCH_NO;
+		} else {
+			// The root has a transition for every char
+			while ((t = filter_strmatch_ac_goto(ac, s, *c)) == FILTER_STRMATCH_NONE)
+				s = ac->fail[s];
+		}
+		s = t;
+
+		if (!m->accept_at_end && m->accept[s])
+			return FILTER_MATCH_YES;
+	}
+
+	return m->accept[s];
+}
+
+//
+// Regular expressions
+//
+
+static uint32_t filter_strmatch_nfa_add(struct filter_strmatch_nfa *nfa, int type) {
+
+	if (nfa->count >= nfa->size) {
+		unsigned int size = (nfa->size ? nfa->size * 2 : 64);
+		struct filter_strmatch_nfa_state *states = realloc(nfa->states, sizeof(struct filter_strmatch_nfa_state) * size);
+		if (!states) {
+			pom_oom(sizeof(struct filter_strmatch_nfa_state) * size);
+			return FILTER_STRMATCH_NONE;
+		}
+		nfa->states = states;
+		nfa->size = size;
+	}
+
+	struct filter_strmatch_nfa_state *st = &nfa->states[nfa->count];
+	memset(st, 0, sizeof(struct filter_strmatch_nfa_state));
+	st->type = type;
+	st->out = FILTER_STRMATCH_NONE;
+	st->out1 = FILTER_STRMATCH_NONE;
+
+	return nfa->count++;
+}
+
+static int filter_strmatch_nfa_set(struct filter_strmatch_nfa *nfa, unsigned char *set, struct filter_strmatch_frag *frag) {
+
+	uint32_t s = filter_strmatch_nfa_add(nfa, FILTER_STRMATCH_NFA_CHAR);
+	uint32_t e = filter_strmatch_nfa_add(nfa, FILTER_STRMATCH_NFA_EPS);
+	if (s == FILTER_STRMATCH_NONE || e == FILTER_STRMATCH_NONE)
+		return POM_ERR;
+
+	memcpy(nfa->states[s].set, set, sizeof(nfa->states[s].set));
+	nfa->states[s].out = e;
+	frag->start = s;
+	frag->end = e;
+
+	return POM_OK;
+}
+
+// Parse an escaped char, return the char itself if it's not a class
+static int filter_strmatch_parse_escape(struct filter_strmatch_nfa *nfa, unsigned char *set) {
+
+	unsigned char c = *nfa->pos;
+	if (!c) {
+		nfa->err = "trailing backslash";
+		return -1;
+	}
+	nfa->pos++;
+
+	unsigned char tmp[32] = { 0 };
+	int i, negate = isupper(c);
+
+	switch (c) {
+		case 'D':
+		case 'd':
+			for (i = '0'; i <= '9'; i++)
+				FILTER_STRMATCH_SET_ADD(tmp, i);
+			break;
+		case 'W':
+		case 'w':
+			for (i = 0; i < 256; i++) {
+				if (isalnum(i) || i == '_')
+					FILTER_STRMATCH_SET_ADD(tmp, i);
+			}
+			break;
+		case 'S':
+		case 's':
+			for (i = 0; i < 256; i++) {
+				if (isspace(i))
+					FILTER_STRMATCH_SET_ADD(tmp, i);
+			}
+			break;
+		case 'n':
+			FILTER_STRMATCH_SET_ADD(set, '\n');
+			return '\n';
+		case 'r':
+			FILTER_STRMATCH_SET_ADD(set, '\r');
+			return '\r';
+		case 't':
+			FILTER_STRMATCH_SET_ADD(set, '\t');
+			return '\t';
+		default:
+			FILTER_STRMATCH_SET_ADD(set, c);
+			return c;
+	}
+
+	for (i = 0; i < 32; i++)
+		set[i] |= (negate ? ~tmp[i] : tmp[i]);
+
+	return 256;
+}
+
+static int filter_strmatch_parse_class(struct filter_strmatch_nfa *nfa, unsigned char *set) {
+
+	int negate = 0;
+	if (*nfa->pos == '^') {
+		negate = 1;
+		nfa->pos++;
+	}
+
+	int first = 1;
+	while (*nfa->pos != ']' || first) {
+		first = 0;
+
+		int c = (unsigned char) *nfa->pos;
+		if (!c) {
+			nfa->err = "missing ]";
+			return POM_ERR;
+		}
+		nfa->pos++;
+
+		if (c == '\\') {
+			c = filter_strmatch_parse_escape(nfa, set);
+			if (c < 0)
+				return POM_ERR;
+			if (c > 255)
+				continue;
+		} else {
+			FILTER_STRMATCH_SET_ADD(set, c);
+		}
+
+		// Range of chars
+		if (nfa->pos[0] == '-' && nfa->pos[1] && nfa->pos[1] != ']') {
+			int end = (unsigned char) nfa->pos[1];
+			nfa->pos += 2;
+			if (end < c) {
+				nfa->err = "invalid range";
+				return POM_ERR;
+			}
+			for (; c <= end; c++)
+				FILTER_STRMATCH_SET_ADD(set, c);
+		}
+	}
+	nfa->pos++;
+
+	if (negate) {
+		int i;
+		for (i = 0; i < 32; i++)
+			set[i] = ~set[i];
+	}
+
+	return POM_OK;
+}
+
+static int filter_strmatch_parse_atom(struct filter_strmatch_nfa *nfa, struct filter_strmatch_frag *frag) {
+
+	unsigned char set[32] = { 0 };
+	char c = *nfa->pos++;
+
+	switch (c) {
+		case '(':
+			if (filter_strmatch_parse_alt(nfa, frag) != POM_OK)
+				return POM_ERR;
+			if (*nfa->pos != ')') {
+				nfa->err = "missing )";
+				return POM_ERR;
+			}
+			nfa->pos++;
+			return POM_OK;
+		case '[':
+			if (filter_strmatch_parse_class(nfa, set) != POM_OK)
+				return POM_ERR;
+			break;
+		case '.':
+			memset(set, 0xff, sizeof(set));
+			break;
+		case '\\':
+			if (filter_strmatch_parse_escape(nfa, set) < 0)
+				return POM_ERR;
+			break;
+		case '*':
+		case '+':
+		case '?':
+			nfa->err = "nothing to repeat";
+			return POM_ERR;
+		default:
+			FILTER_STRMATCH_SET_ADD(set, c);
+			break;
+	}
+
+	return filter_strmatch_nfa_set(nfa, set, frag);
+}
+
+static int filter_strmatch_parse_repeat(struct filter_strmatch_nfa *nfa, struct filter_strmatch_frag *frag) {
+
+	if (filter_strmatch_parse_atom(nfa, frag) != POM_OK)
+		return POM_ERR;
+
+	while (*nfa->pos == '*' || *nfa->pos == '+' || *nfa->pos == '?') {
+
+		char op = *nfa->pos++;
+
+		uint32_t s = FILTER_STRMATCH_NONE;
+		if (op != '+' && (s = filter_strmatch_nfa_add(nfa, FILTER_STRMATCH_NFA_SPLIT)) == FILTER_STRMATCH_NONE)
+			return POM_ERR;
+
+		uint32_t e = filter_strmatch_nfa_add(nfa, FILTER_STRMATCH_NFA_EPS);
+		if (e == FILTER_STRMATCH_NONE)
+			return POM_ERR;
+
+		struct filter_strmatch_nfa_state *end = &nfa->states[frag->end];
+		if (op == '?') {
+			end->out = e;
+		} else {
+			// Loop back to the start of the fragment
+			end->type = FILTER_STRMATCH_NFA_SPLIT;
+			end->out = frag->start;
+			end->out1 = e;
+		}
+
+		if (op != '+') {
+			nfa->states[s].out = frag->start;
+			nfa->states[s].out1 = e;
+			frag->start = s;
+		}
+		frag->end = e;
+	}
+
+	return POM_OK;
+}
+
+static int filter_strmatch_parse_concat(struct filter_strmatch_nfa *nfa, struct filter_strmatch_frag *frag) {
+
+	uint32_t e = filter_strmatch_nfa_add(nfa, FILTER_STRMATCH_NFA_EPS);
+	if (e == FILTER_STRMATCH_NONE)
+		return POM_ERR;
+
+	frag->start = e;
+	frag->end = e;
+
+	while (*nfa->pos && *nfa->pos != '|' && *nfa->pos != ')') {
+		struct filter_strmatch_frag next;
+		if (filter_strmatch_parse_repeat(nfa, &next) != POM_OK)
+			return POM_ERR;
+		nfa->states[frag->end].out = next.start;
+		frag->end = next.end;
+	}
+
+	return POM_OK;
+}
+
+int filter_strmatch_parse_alt(struct filter_strmatch_nfa *nfa, struct filter_strmatch_frag *frag) {
+
+	if (filter_strmatch_parse_concat(nfa, frag) != POM_OK)
+		return POM_ERR;
+
+	while (*nfa->pos == '|') {
+		nfa->pos++;
+
+		struct filter_strmatch_frag right;
+		if (filter_strmatch_parse_concat(nfa, &right) != POM_OK)
+			return POM_ERR;
+
+		uint32_t s = filter_strmatch_nfa_add(nfa, FILTER_STRMATCH_NFA_SPLIT);
+		uint32_t e = filter_strmatch_nfa_add(nfa, FILTER_STRMATCH_NFA_EPS);
+		if (s == FILTER_STRMATCH_NONE || e == FILTER_STRMATCH_NONE)
+			return POM_ERR;
+
+		nfa->states[s].out = frag->start;
+		nfa->states[s].out1 = right.start;
+		nfa->states[frag->end].out = e;
+		nfa->states[right.end].out = e;
+
+		frag->start = s;
+		frag->end = e;
+	}
+
+	return POM_OK;
+}
+
+// Add the states reachable from s without consuming any char
+static void filter_strmatch_nfa_closure(struct filter_strmatch_nfa *nfa, uint32_t s, uint64_t *set, uint32_t *stack) {
+
+	unsigned int depth = 0;
+	stack[depth++] = s;
+
+	while (depth) {
+		s = stack[--depth];
+		if (s == FILTER_STRMATCH_NONE || (set[s / 64] & (1ULL << (s % 64))))
+			continue;
+		set[s / 64] |= (1ULL << (s % 64));
+
+		struct filter_strmatch_nfa_state *st = &nfa->states[s];
+		if (st->type == FILTER_STRMATCH_NFA_EPS || st->type == FILTER_STRMATCH_NFA_SPLIT)
+			stack[depth++] = st->out;
+		if (st->type == FILTER_STRMATCH_NFA_SPLIT)
+			stack[depth++] = st->out1;
+	}
+}
+
+// Find the DFA state of a set of NFA states, add it if new
+static uint32_t filter_strmatch_dfa_state(struct filter_strmatch *m, uint64_t *sets, unsigned int words, uint32_t *table, unsigned int table_size, uint64_t *set, uint32_t match) {
+
+	struct filter_strmatch_dfa *dfa = m->dfa;
+	size_t set_size = sizeof(uint64_t) * words;
+
+	uint32_t pos = jhash2((uint32_t *) set, words * 2, 0) & (table_size - 1);
+	uint32_t d;
+	while ((d = table[pos]) != FILTER_STRMATCH_NONE) {
+		if (!memcmp(sets + (words * d), set, set_size))
+			return d;
+		pos = (pos + 1) & (table_size - 1);
+	}
+
+	if (dfa->state_count >= FILTER_STRMATCH_DFA_MAX)
+		return FILTER_STRMATCH_NONE;
+
+	d = dfa->state_count++;
+	memcpy(sets + (words * d), set, set_size);
+	table[pos] = d;
+	m->accept[d] = ((set[match / 64] & (1ULL << (match % 64))) ? 1 : 0);
+
+	// No NFA state left, nothing can match anymore
+	unsigned int i;
+	for (i = 0; i < words && !set[i]; i++);
+	if (i == words)
+		dfa->dead = d;
+
+	return d;
+}
+
+static int filter_strmatch_dfa_build(struct filter_strmatch *m, char *regex) {
+
+	struct filter_strmatch_nfa nfa = { 0 };
+	uint64_t *sets = NULL, *start_set = NULL;
+	uint32_t *stack = NULL, *table = NULL;
+	int res = POM_ERR;
+
+	struct filter_strmatch_dfa *dfa = malloc(sizeof(struct filter_strmatch_dfa));
+	if (!dfa) {
+		pom_oom(sizeof(struct filter_strmatch_dfa));
+		return POM_ERR;
+	}
+	memset(dfa, 0, sizeof(struct filter_strmatch_dfa));
+	m->dfa = dfa;
+
+	// Anchors are only supported at the ends of the regex
+	size_t len = strlen(regex);
+	int anchored_start = 0;
+	if (*regex == '^') {
+		anchored_start = 1;
+		regex++;
+		len--;
+	}
+	if (len && regex[len - 1] == '$' && (len < 2 || regex[len - 2] != '\\')) {
+		m->accept_at_end = 1;
+		len--;
+	}
+
+	char *str = strndup(regex, len);
+	if (!str) {
+		pom_oom(len + 1);
+		return POM_ERR;
+	}
+
+	nfa.pos = str;
+	struct filter_strmatch_frag frag;
+	if (filter_strmatch_parse_alt(&nfa, &frag) != POM_OK)
+		goto err;
+
+	if (*nfa.pos) {
+		nfa.err = "unmatched )";
+		goto err;
+	}
+
+	uint32_t match = filter_strmatch_nfa_add(&nfa, FILTER_STRMATCH_NFA_MATCH);
+	if (match == FILTER_STRMATCH_NONE)
+		goto err;
+	nfa.states[frag.end].out = match;
+
+	// Split the chars in classes which are handled the same way by all the states
+	unsigned int i, j;
+	dfa->class_count = 1;
+	for (i = 0; i < nfa.count; i++) {
+		if (nfa.states[i].type != FILTER_STRMATCH_NFA_CHAR)
+			continue;
+
+		int class_map[512];
+		for (j = 0; j < dfa->class_count * 2; j++)
+			class_map[j] = -1;
+
+		unsigned int class_count = 0;
+		for (j = 0; j < 256; j++) {
+			int key = dfa->classes[j] * 2 + (FILTER_STRMATCH_SET_HAS(nfa.states[i].set, j) ? 1 : 0);
+			if (class_map[key] < 0)
+				class_map[key] = class_count++;
+			dfa->classes[j] = class_map[key];
+		}
+		dfa->class_count = class_count;
+	}
+
+	unsigned char class_char[256];
+	for (i = 256; i > 0; i--)
+		class_char[dfa->classes[i - 1]] = i - 1;
+
+	// Build the DFA out of the sets of NFA states
+	unsigned int words = (nfa.count + 63) / 64;
+	size_t set_size = sizeof(uint64_t) * words;
+	unsigned int table_size = FILTER_STRMATCH_DFA_MAX * 2;
+
+	sets = malloc(set_size * (FILTER_STRMATCH_DFA_MAX + 1));
+	start_set = malloc(set_size);
+	stack = malloc(sizeof(uint32_t) * nfa.count * 2);
+	table = malloc(sizeof(uint32_t) * table_size);
+	dfa->trans = malloc(sizeof(uint32_t) * dfa->class_count * FILTER_STRMATCH_DFA_MAX);
+	m->accept = malloc(FILTER_STRMATCH_DFA_MAX);
+	if (!sets || !start_set || !stack || !table || !dfa->trans || !m->accept) {
+		pom_oom(set_size * (FILTER_STRMATCH_DFA_MAX + 1));
+		goto err;
+	}
+	memset(table, 0xff, sizeof(uint32_t) * table_size);
+
+	memset(start_set, 0, set_size);
+	filter_strmatch_nfa_closure(&nfa, frag.start, start_set, stack);
+
+	// The last set is used to compute the next one
+	uint64_t *next = sets + (words * FILTER_STRMATCH_DFA_MAX);
+
+	dfa->dead = FILTER_STRMATCH_NONE;
+	dfa->start = filter_strmatch_dfa_state(m, sets, words, table, table_size, start_set, match);
+
+	uint32_t d;
+	for (d = 0; d < dfa->state_count; d++) {
+
+		uint64_t *cur = sets + (words * d);
+
+		unsigned int k;
+		for (k = 0; k < dfa->class_count; k++) {
+
+			memset(next, 0, set_size);
+			for (i = 0; i < nfa.count; i++) {
+				if (!(cur[i / 64] & (1ULL << (i % 64))))
+					continue;
+				struct filter_strmatch_nfa_state *st = &nfa.states[i];
+				if (st->type == FILTER_STRMATCH_NFA_CHAR && FILTER_STRMATCH_SET_HAS(st->set, class_char[k]))
+					filter_strmatch_nfa_closure(&nfa, st->out, next, stack);
+			}
+
+			// Without anchor, a match can start anywhere
+			if (!anchored_start) {
+				for (i = 0; i < words; i++)
+					next[i] |= start_set[i];
+			}
+
+			uint32_t dst = filter_strmatch_dfa_state(m, sets, words, table, table_size, next, match);
+			if (dst == FILTER_STRMATCH_NONE) {
+				nfa.err = "too many states";
+				goto err;
+			}
+			dfa->trans[d * dfa->class_count + k] = dst;
+		}
+	}
+
+	res = POM_OK;
+
+err:
+	if (nfa.err)
+		pomlog(POMLOG_ERR "Invalid regex '%s' : %s", regex, nfa.err);
+
+	free(str);
+	if (nfa.states)
+		free(nfa.states);
+	if (sets)
+		free(sets);
+	if (start_set)
+		free(start_set);
+	if (stack)
+		free(stack);
+	if (table)
+		free(table);
+
+	return res;
+}
+
+static int filter_strmatch_dfa_match(struct filter_strmatch *m, char *str) {
+
+	struct filter_strmatch_dfa *dfa = m->dfa;
+
+	uint32_t s = dfa->start;
+	if (!m->accept_at_end && m->accept[s])
+		return FILTER_MATCH_YES;
+
+	unsigned char *c;
+	for (c = (unsigned char *) str; *c; c++) {
+		s = dfa->trans[s * dfa->class_count + dfa->classes[*c]];
+		if (s == dfa->dead)
+			return FILTER_MATCH_NO;
+		if (!m->accept_at_end && m->accept[s])
+			return FILTER_MATCH_YES;
+	}
+
+	return m->accept[s];
+}
+
+//
+// Public functions
+//
+
+struct filter_strmatch *filter_strmatch_compile(enum filter_strmatch_mode mode, char **patterns, unsigned int count) {
+
+	struct filter_strmatch *m = malloc(sizeof(struct filter_strmatch));
+	if (!m) {
+		pom_oom(sizeof(struct filter_strmatch));
+		return NULL;
+	}
+	memset(m, 0, sizeof(struct filter_strmatch));
+	m->mode = mode;
+
+	if (mode == filter_strmatch_matches) {
+		if (count != 1) {
+			pomlog(POMLOG_ERR "Only one regex can be matched at a time");
+			goto err;
+		}
+		if (filter_strmatch_dfa_build(m, patterns[0]) != POM_OK)
+			goto err;
+	} else {
+		m->accept_at_end = (mode == filter_strmatch_endswith);
+		if (filter_strmatch_ac_build(m, patterns, count) != POM_OK)
+			goto err;
+	}
+
+	return m;
+
+err:
+	filter_strmatch_cleanup(m);
+	return NULL;
+}
+
+int filter_strmatch_match(struct filter_strmatch *m, char *str) {
+
+	if (m->dfa)
+		return filter_strmatch_dfa_match(m, str);
+
+	return filter_strmatch_ac_match(m, str);
+}
+
+void filter_strmatch_cleanup(struct filter_strmatch *m) {
+
+	if (m->ac) {
+		if (m->ac->edge_start)
+			free(m->ac->edge_start);
+		if (m->ac->edges)
+			free(m->ac->edges);
+		if (m->ac->fail)
+			free(m->ac->fail);
+		free(m->ac);
+	}
+
+	if (m->dfa) {
+		if (m->dfa->trans)
+			free(m->dfa->trans);
+		free(m->dfa);
+	}
+
+	if (m->accept)
+		free(m->accept);
+
+	free(m);
+}
@@ -0,0 +1,101 @@
+/*
+ *  This file is part of pom-ng.
+ *  Copyright (C) 2015 Guy Martin <gmsoft@tuxicoman.be>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+
+
+#ifndef __FILTER_STRMATCH_H__
+#define __FILTER_STRMATCH_H__
+
+#include <stdint.h>
+
+#define FILTER_STRMATCH_NONE		((uint32_t) -1)
+
+// Maximum number of states of the automaton built from a regex
+#define FILTER_STRMATCH_DFA_MAX		4096
+
+enum filter_strmatch_mode {
+	filter_strmatch_contains,
+	filter_strmatch_startswith,
+	filter_strmatch_endswith,
+	filter_strmatch_matches,
+};
+
+struct filter_strmatch_edge {
+	unsigned char c;
+	uint32_t dst;
+};
+
+// Aho-Corasick automaton of the keywords, state 0 is the root
+struct filter_strmatch_ac {
+	uint32_t root[256]; // Transitions of the root, FILTER_STRMATCH_NONE if none
+	uint32_t *edge_start; // First edge of each state
+	struct filter_strmatch_edge *edges; // Sorted by char for each state
+	uint32_t *fail;
+	unsigned int state_count;
+};
+
+// Deterministic automaton built from a regex
+struct filter_strmatch_dfa {
+	unsigned char classes[256]; // Chars that always lead to the same state share a class
+	unsigned int class_count;
+	uint32_t *trans;
+	uint32_t start, dead;
+	unsigned int state_count;
+};
+
+// States of the NFA a regex is parsed into
+#define FILTER_STRMATCH_NFA_CHAR	0 // Goes to out if the char is in set
+#define FILTER_STRMATCH_NFA_EPS		1 // Goes to out
+#define FILTER_STRMATCH_NFA_SPLIT	2 // Goes to both out and out1
+#define FILTER_STRMATCH_NFA_MATCH	3
+
+struct filter_strmatch_nfa_state {
+	int type;
+	uint32_t out, out1;
+	unsigned char set[32];
+};
+
+struct filter_strmatch_nfa {
+	struct filter_strmatch_nfa_state *states;
+	unsigned int count, size;
+	char *pos; // Current position in the regex
+	char *err;
+};
+
+// Part of the NFA, end is always an EPS state without any out yet
+struct filter_strmatch_frag {
+	uint32_t start, end;
+};
+
+struct filter_strmatch {
+	enum filter_strmatch_mode mode;
+	int accept_at_end; // Only the state reached at the end of the string decides
+	unsigned char *accept;
+	struct filter_strmatch_ac *ac;
+	struct filter_strmatch_dfa *dfa;
+};
+
+struct filter_strmatch *filter_strmatch_compile(enum filter_strmatch_mode mode, char **patterns, unsigned int count);
+int filter_strmatch_match(struct filter_strmatch *m, char *str);
+void filter_strmatch_cleanup(struct filter_strmatch *m);
+
+int filter_strmatch_parse_alt(struct filter_strmatch_nfa *nfa, struct filter_strmatch_frag *frag);
+
+#endif
@@ -30,6 +30,7 @@
 #include "packet.h"
 #include <pom-ng/ptype.h>
 #include <pom-ng/ptype_bool.h>
+#include <pom-ng/ptype_string.h>
 #include <pom-ng/proto.h>
 
 static struct registry_class *input_registry_class = NULL;
@@ -221,13 +222,33 @@ int input_instance_add(char *type, char *name) {
 		goto err;
 	}
 
+	res->p_cpus = ptype_alloc("string");
+	if (!res->p_cpus)
+		goto err;
+
+	struct registry_param *cpus_param = registry_new_param("cpus", "", res->p_cpus, "List of CPUs to pin the input thread to (ex: 0,2-3)", REGISTRY_PARAM_FLAG_CLEANUP_VAL);
+	if (!cpus_param) {
+		ptype_cleanup(res->p_cpus);
+		goto err;
+	}
+
+	if (input_add_param(res, cpus_param) != POM_OK) {
+		registry_cleanup_param(cpus_param);
+		ptype_cleanup(res->p_cpus);
+		goto err;
+	}
+
 	res->perf_pkts_in = registry_instance_add_perf(res->reg_instance, "pkts_in", registry_perf_type_counter, "Number of packets read", "pkts");
 	res->perf_bytes_in = registry_instance_add_perf(res->reg_instance, "bytes_in", registry_perf_type_counter, "Number of bytes read", "bytes");
 	res->perf_runtime = registry_instance_add_perf(res->reg_instance, "runtime", registry_perf_type_timeticks, "Runtime", NULL);
 
-	if (!res->perf_pkts_in || !res->perf_bytes_in || !res->perf_runtime)
+	res->perf_cpu = registry_instance_add_perf(res->reg_instance, "cpu", registry_perf_type_gauge, "CPU currently used by the input thread", "cpu");
+
+	if (!res->perf_pkts_in || !res->perf_bytes_in || !res->perf_runtime || !res->perf_cpu)
 		goto err;
 
+	registry_perf_set_update_hook(res->perf_cpu, core_perf_thread_cpu, &res->tid);
+
 	if (registry_uid_create(res->reg_instance) != POM_OK)
 		goto err;
 
@@ -407,6 +428,14 @@ void *input_process_thread(void *param) {
 
 	struct input *i = param;
 
+	i->tid = core_thread_get_tid();
+
+	unsigned int cpus[CORE_CPU_LIST_MAX];
+	char *cpu_list = PTYPE_STRING_GETVAL(i->p_cpus);
+	int cpu_count = core_cpu_list_parse(cpu_list, cpus, CORE_CPU_LIST_MAX);
+	if (cpu_count > 0 && core_thread_set_cpus(cpus, cpu_count) == POM_OK)
+		pomlog(POMLOG_INFO "Input %s pinned to CPU(s) %s", i->name, cpu_list);
+
 	pomlog("Input %s started", i->name);
 	registry_perf_timeticks_restart(i->perf_runtime);
 
@@ -431,6 +460,7 @@ void *input_process_thread(void *param) {
 	__sync_fetch_and_and(&i->running, ~INPUT_RUN_RUNNING);
 
 	registry_perf_timeticks_stop(i->perf_runtime);
+	i->tid = 0;
 	pomlog("Input %s stopped", i->name);
 
 	return NULL;
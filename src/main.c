@@ -38,6 +38,7 @@
 #include "pomlog.h"
 #include "proto.h"
 #include "packet.h"
+#include "stream.h"
 #include "timer.h"
 #include "analyzer.h"
 #include "output.h"
@@ -394,6 +395,11 @@ int main(int argc, char *argv[]) {
 		goto err_packet;
 	}
 
+	if (stream_init() != POM_OK) {
+		pomlog(POMLOG_ERR "Error while initializing the streams");
+		goto err_packet;
+	}
+
 	system_store = system_datastore_open(system_store_uri);
 	if (!system_store) {
 		pomlog(POMLOG_ERR "Unable to open the system datastore");
@@ -472,6 +478,7 @@ int main(int argc, char *argv[]) {
 	analyzer_cleanup();
 	pload_cleanup();
 	proto_cleanup();
+	packet_cleanup();
 	addon_cleanup();
 	datastore_close(system_store);
 	datastore_cleanup();
@@ -27,6 +27,7 @@
 
 #include <pom-ng/packet.h>
 #include <pom-ng/core.h>
+#include <pom-ng/proto.h>
 
 #include "input_pcap.h"
 #include <string.h>
@@ -36,6 +37,19 @@
 #include <regex.h>
 #include <stddef.h>
 #include <signal.h>
+#include <sys/stat.h>
+
+#ifdef INPUT_PCAP_HAVE_TPACKET
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/ioctl.h>
+#include <net/if.h>
+#include <net/if_arp.h>
+#include <arpa/inet.h>
+#include <linux/if_ether.h>
+#include <linux/filter.h>
+#include <poll.h>
+#endif
 
 struct mod_reg_info* input_pcap_reg_info() {
 	static struct mod_reg_info reg_info;
@@ -148,6 +162,12 @@ static int input_pcap_set_filter(pcap_t *p, char *filter) {
 	if (strlen(filter) <= 0)
 		return POM_OK;
 
+	return input_pcap_replace_filter(p, filter);
+}
+
+static int input_pcap_replace_filter(pcap_t *p, char *filter) {
+
+	// An empty filter replaces the current one with one accepting everything
 	struct bpf_program fp;
 
 	if (pcap_compile(p, &fp, filter, 1, PCAP_NETMASK_UNKNOWN) == -1) {
@@ -166,16 +186,13 @@ static int input_pcap_set_filter(pcap_t *p, char *filter) {
 	return POM_OK;
 }
 
-static int input_pcap_common_open(struct input *i) {
+static int input_pcap_set_datalink(struct input *i, int datalink_type) {
 
 	struct input_pcap_priv *priv = i->priv;
 
-	if (!priv || !priv->p)
-		return POM_ERR;
-
 	char *datalink = "undefined";
 
-	priv->datalink_type = pcap_datalink(priv->p);
+	priv->datalink_type = datalink_type;
 	switch (priv->datalink_type) {
 		case DLT_IEEE802_11:
 			datalink = "80211";
@@ -224,18 +241,173 @@ static int input_pcap_common_open(struct input *i) {
 
 	if (!priv->datalink_proto) {
 		pomlog(POMLOG_ERR "Cannot open input pcap : protocol %s not registered", datalink);
+		return POM_ERR;
+	}
+
+	return POM_OK;
+}
+
+static int input_pcap_common_open(struct input *i) {
+
+	struct input_pcap_priv *priv = i->priv;
+
+	if (!priv || (!priv->p && !priv->mf))
+		return POM_ERR;
+
+	int datalink_type = (priv->mf ? priv->mf->datalink : pcap_datalink(priv->p));
+	if (input_pcap_set_datalink(i, datalink_type) != POM_OK) {
 		input_pcap_close(i);
 		return POM_ERR;
 	}
 
+	int res = POM_OK;
+	if (priv->type == input_pcap_type_interface) {
+		uint32_t serial = 0;
+		char *filter = input_pcap_interface_filter_build(priv, &serial);
+		if (filter) {
+			res = input_pcap_set_filter(priv->p, filter);
+			free(filter);
+			if (res == POM_OK)
+				priv->tpriv.iface.bpf_auto_serial = serial;
+		} else {
+			res = POM_ERR;
+		}
+	} else {
+		res = input_pcap_offline_set_filter(priv);
+	}
 
-	if (input_pcap_set_filter(priv->p, PTYPE_STRING_GETVAL(priv->p_filter)) != POM_OK) {
+	if (res != POM_OK) {
 		input_pcap_close(i);
 		return POM_ERR;
 	}
 
+	if (priv->mf) {
+		// Packets point directly into the mapping, we can't align them
+		priv->align_offset = 0;
+	}
+
+	return POM_OK;
+
+}
+
+static int input_pcap_offline_init(struct input *i) {
+
+	struct input_pcap_priv *priv = i->priv;
+
+	priv->p_zero_copy = ptype_alloc("bool");
+	if (!priv->p_zero_copy)
+		return POM_ERR;
+
+	struct registry_param *p = registry_new_param("zero_copy", "yes", priv->p_zero_copy, "Map the files in memory and process the packets without copying them", 0);
+	if (input_add_param(i, p) != POM_OK) {
+		if (p)
+			registry_cleanup_param(p);
+		ptype_cleanup(priv->p_zero_copy);
+		priv->p_zero_copy = NULL;
+		return POM_ERR;
+	}
+
+	priv->perf_compressed = registry_instance_add_perf(i->reg_instance, "compressed_bytes", registry_perf_type_counter, "Number of compressed bytes read from the files", "bytes");
+	priv->perf_uncompressed = registry_instance_add_perf(i->reg_instance, "uncompressed_bytes", registry_perf_type_counter, "Number of bytes obtained after decompressing the files", "bytes");
+	if (!priv->perf_compressed || !priv->perf_uncompressed)
+		return POM_ERR;
+
+	return POM_OK;
+}
+
+static pcap_t *input_pcap_open_offline(struct input_pcap_priv *priv, char *filename, struct input_pcap_decomp **decomp, char *errbuf) {
+
+	*decomp = NULL;
+
+	enum input_pcap_decomp_type type = input_pcap_decomp_detect(filename);
+	if (type == input_pcap_decomp_none)
+		return pcap_open_offline(filename, errbuf);
+
+	FILE *f = input_pcap_decomp_open(filename, type, priv->perf_compressed, priv->perf_uncompressed, decomp);
+	if (!f) {
+		snprintf(errbuf, PCAP_ERRBUF_SIZE, "Unable to decompress the %s stream", input_pcap_decomp_type_name(type));
+		return NULL;
+	}
+
+	pcap_t *p = pcap_fopen_offline(f, errbuf);
+	if (!p) {
+		fclose(f);
+		input_pcap_decomp_close(*decomp);
+		*decomp = NULL;
+	}
+
+	return p;
+}
+
+static void input_pcap_close_offline(pcap_t *p, struct input_pcap_decomp *decomp) {
+
+	// Close the stream first so the decompression thread stops
+	pcap_close(p);
+
+	if (decomp)
+		input_pcap_decomp_close(decomp);
+}
+
+static int input_pcap_offline_open(struct input_pcap_priv *p, char *filename) {
+
+	// Compressed files can't be mapped, they are always read through libpcap
+	if (*PTYPE_BOOL_GETVAL(p->p_zero_copy) && input_pcap_decomp_detect(filename) == input_pcap_decomp_none) {
+		p->mf = input_pcap_mmap_open(filename);
+		if (p->mf)
+			return POM_OK;
+
+		pomlog(POMLOG_WARN "Unable to map file %s, falling back to libpcap", filename);
+	}
+
+	char errbuf[PCAP_ERRBUF_SIZE + 1] = { 0 };
+	p->p = input_pcap_open_offline(p, filename, &p->decomp, errbuf);
+	if (!p->p) {
+		pomlog(POMLOG_ERR "Error opening file %s for reading : %s", filename, errbuf);
+		return POM_ERR;
+	}
+
 	return POM_OK;
+}
+
+static int input_pcap_offline_set_filter(struct input_pcap_priv *p) {
+
+	char *filter = PTYPE_STRING_GETVAL(p->p_filter);
+
+	if (p->mf)
+		return input_pcap_mmap_set_filter(p->mf, filter);
+
+	return input_pcap_set_filter(p->p, filter);
+}
+
+static int input_pcap_offline_datalink(struct input_pcap_priv *p) {
+
+	if (p->mf)
+		return p->mf->datalink;
+
+	return pcap_datalink(p->p);
+}
+
+static char *input_pcap_offline_geterr(struct input_pcap_priv *p) {
+
+	if (p->mf)
+		return input_pcap_mmap_geterr(p->mf);
+
+	return pcap_geterr(p->p);
+}
+
+static void input_pcap_offline_close(struct input_pcap_priv *p) {
+
+	if (p->mf) {
+		// The mapping will go away once all its packets are processed
+		input_pcap_mmap_release(p->mf);
+		p->mf = NULL;
+	}
 
+	if (p->p) {
+		input_pcap_close_offline(p->p, p->decomp);
+		p->p = NULL;
+		p->decomp = NULL;
+	}
 }
 
 /*
@@ -246,6 +418,16 @@ static int input_pcap_interface_perf_dropped(uint64_t *value, void *priv) {
 
 	struct input_pcap_priv *p = priv;
 
+#ifdef INPUT_PCAP_HAVE_TPACKET
+	if (p && p->tpriv.iface.rings)
+		input_pcap_tpacket_update_dropped(p);
+
+	if (p && !p->p) {
+		*value = p->tpriv.iface.tpacket_dropped;
+		return POM_OK;
+	}
+#endif
+
 	if (!p || !p->p) {
 		*value = 0;
 		return POM_OK;
@@ -270,7 +452,11 @@ static int input_pcap_interface_init(struct input *i) {
 	priv->tpriv.iface.p_interface = ptype_alloc("string");
 	priv->tpriv.iface.p_promisc = ptype_alloc("bool");
 	priv->tpriv.iface.p_buff_size = ptype_alloc_unit("uint32", "bytes");
-	if (!priv->tpriv.iface.p_interface || !priv->tpriv.iface.p_promisc || !priv->tpriv.iface.p_buff_size)
+	priv->tpriv.iface.p_capture_mode = ptype_alloc("string");
+	priv->tpriv.iface.p_block_size = ptype_alloc_unit("uint32", "bytes");
+	priv->tpriv.iface.p_fanout = ptype_alloc("uint32");
+	priv->tpriv.iface.p_bpf_auto = ptype_alloc("bool");
+	if (!priv->tpriv.iface.p_interface || !priv->tpriv.iface.p_promisc || !priv->tpriv.iface.p_buff_size || !priv->tpriv.iface.p_capture_mode || !priv->tpriv.iface.p_block_size || !priv->tpriv.iface.p_fanout || !priv->tpriv.iface.p_bpf_auto)
 		goto err;
 
 	priv->tpriv.iface.perf_dropped = registry_instance_add_perf(i->reg_instance, "dropped_pkt", registry_perf_type_counter, "Dropped packets", "pkts");
@@ -313,6 +499,30 @@ static int input_pcap_interface_init(struct input *i) {
 	if (input_add_param(i, p) != POM_OK)
 		goto err;
 
+	p = registry_new_param("capture_mode", INPUT_PCAP_CAPTURE_MODE_PCAP, priv->tpriv.iface.p_capture_mode, "Use libpcap or read packets directly from the kernel's TPACKET_V3 ring without copying them", 0);
+	if (registry_param_info_add_value(p, INPUT_PCAP_CAPTURE_MODE_PCAP) != POM_OK)
+		goto err;
+#ifdef INPUT_PCAP_HAVE_TPACKET
+	if (registry_param_info_add_value(p, INPUT_PCAP_CAPTURE_MODE_TPACKET) != POM_OK)
+		goto err;
+#endif
+	if (input_add_param(i, p) != POM_OK)
+		goto err;
+
+	p = registry_new_param("tpacket_block_size", "1048576", priv->tpriv.iface.p_block_size, "Size of each block of the TPACKET_V3 ring, buff_size is the total size of the ring", 0);
+	if (input_add_param(i, p) != POM_OK)
+		goto err;
+
+	p = registry_new_param("tpacket_fanout", "1", priv->tpriv.iface.p_fanout, "Number of TPACKET_V3 rings in a hash fanout group, each with its own reader thread", 0);
+	if (registry_param_info_set_min_max(p, 1, INPUT_PCAP_TPACKET_FANOUT_MAX) != POM_OK)
+		goto err;
+	if (input_add_param(i, p) != POM_OK)
+		goto err;
+
+	p = registry_new_param("bpf_auto", "no", priv->tpriv.iface.p_bpf_auto, "Drop in the kernel the packets that none of the protocols, analyzers and outputs in use need, on top of bpf_filter", 0);
+	if (input_add_param(i, p) != POM_OK)
+		goto err;
+
 	priv->type = input_pcap_type_interface;
 
 	return POM_OK;
@@ -328,6 +538,18 @@ err:
 	if (priv->tpriv.iface.p_buff_size)
 		ptype_cleanup(priv->tpriv.iface.p_buff_size);
 
+	if (priv->tpriv.iface.p_capture_mode)
+		ptype_cleanup(priv->tpriv.iface.p_capture_mode);
+
+	if (priv->tpriv.iface.p_block_size)
+		ptype_cleanup(priv->tpriv.iface.p_block_size);
+
+	if (priv->tpriv.iface.p_fanout)
+		ptype_cleanup(priv->tpriv.iface.p_fanout);
+
+	if (priv->tpriv.iface.p_bpf_auto)
+		ptype_cleanup(priv->tpriv.iface.p_bpf_auto);
+
 	if (p)
 		registry_cleanup_param(p);
 
@@ -344,6 +566,22 @@ static int input_pcap_interface_open(struct input *i) {
 
 	char *interface = PTYPE_STRING_GETVAL(p->tpriv.iface.p_interface);
 
+	p->tpriv.iface.bpf_auto = *PTYPE_BOOL_GETVAL(p->tpriv.iface.p_bpf_auto);
+	p->tpriv.iface.bpf_auto_retry = 0;
+
+	char *capture_mode = PTYPE_STRING_GETVAL(p->tpriv.iface.p_capture_mode);
+	if (!strcmp(capture_mode, INPUT_PCAP_CAPTURE_MODE_TPACKET)) {
+#ifdef INPUT_PCAP_HAVE_TPACKET
+		return input_pcap_tpacket_open(i);
+#else
+		pomlog(POMLOG_ERR "Capture mode %s is not supported on this platform", capture_mode);
+		return POM_ERR;
+#endif
+	} else if (strcmp(capture_mode, INPUT_PCAP_CAPTURE_MODE_PCAP)) {
+		pomlog(POMLOG_ERR "Unknown capture mode %s", capture_mode);
+		return POM_ERR;
+	}
+
 	p->p = pcap_create(interface, errbuf);
 	if (!p->p) {
 		pomlog(POMLOG_ERR "Error opening interface %s : %s", interface, errbuf);
@@ -374,369 +612,1686 @@ static int input_pcap_interface_open(struct input *i) {
 
 }
 
-/*
- * input pcap type file
- */
+// The serial of the listened numbers used is stored in serial, to be saved once the filter is set
+static char *input_pcap_interface_filter_build(struct input_pcap_priv *p, uint32_t *serial) {
 
-static int input_pcap_file_init(struct input *i) {
+	struct input_pcap_interface_priv *ip = &p->tpriv.iface;
+	char *user_filter = PTYPE_STRING_GETVAL(p->p_filter);
+	char *filter = NULL;
 
-	if (input_pcap_common_init(i) != POM_OK)
-		return POM_ERR;
+	struct proto_listened_number *nums = NULL;
+	unsigned int count = 0;
+	if (ip->bpf_auto && proto_listened_numbers_get(&nums, &count, serial) != POM_OK)
+		return NULL;
 
-	struct input_pcap_priv *priv = i->priv;
+	// The vlan primitive only works on ethernet
+	if (!nums || p->datalink_type != DLT_EN10MB)
+		goto user_only;
 
-	struct registry_param *p = NULL;
+	size_t terms_size = (count * INPUT_PCAP_BPF_AUTO_TERM_MAX) + strlen(INPUT_PCAP_BPF_AUTO_ALWAYS) + 1;
+	char *terms = malloc(terms_size);
+	if (!terms) {
+		pom_oom(terms_size);
+		free(nums);
+		return NULL;
+	}
 
-	priv->tpriv.file.p_file = ptype_alloc("string");
-	if (!priv->tpriv.file.p_file)
-		goto err;
+	size_t pos = 0;
+	unsigned int j;
+	for (j = 0; j < count; j++) {
+		char *cls = nums[j].number_class;
+		unsigned int val = nums[j].val;
+		if (!strcmp(cls, "tcp")) {
+			pos += snprintf(terms + pos, terms_size - pos, "tcp port %u or ", val);
+		} else if (!strcmp(cls, "udp")) {
+			pos += snprintf(terms + pos, terms_size - pos, "udp port %u or ", val);
+		} else if (!strcmp(cls, "ip")) {
+			pos += snprintf(terms + pos, terms_size - pos, "ip proto %u or ip6 proto %u or ", val, val);
+		} else if (!strcmp(cls, "ethernet")) {
+			pos += snprintf(terms + pos, terms_size - pos, "ether proto 0x%04x or ", val);
+		} else {
+			// BPF can't find this number, keep all the traffic
+			pomlog(POMLOG_DEBUG "Cannot match %s number %u with BPF, not filtering input traffic", cls, val);
+			free(terms);
+			goto user_only;
+		}
+	}
+	strcpy(terms + pos, INPUT_PCAP_BPF_AUTO_ALWAYS);
+	free(nums);
+
+	// Match the same terms inside vlans
+	size_t size = strlen(user_filter) + (2 * strlen(terms)) + 32;
+	filter = malloc(size);
+	if (!filter) {
+		pom_oom(size);
+		free(terms);
+		return NULL;
+	}
 
-	p = registry_new_param("filename", "dump.cap", priv->tpriv.file.p_file, "File in PCAP format", 0);
-	if (input_add_param(i, p) != POM_OK)
-		goto err;
+	if (strlen(user_filter))
+		snprintf(filter, size, "(%s) and ((%s) or (vlan and (%s)))", user_filter, terms, terms);
+	else
+		snprintf(filter, size, "(%s) or (vlan and (%s))", terms, terms);
 
-	priv->type = input_pcap_type_file;
+	free(terms);
 
-	return POM_OK;
+	return filter;
 
-err:
+user_only:
+	free(nums);
+	filter = strdup(user_filter);
+	if (!filter)
+		pom_oom(strlen(user_filter) + 1);
+	return filter;
+}
 
-	if (priv->tpriv.file.p_file)
-		ptype_cleanup(priv->tpriv.file.p_file);
+static int input_pcap_interface_filter_update(struct input_pcap_priv *p) {
 
-	if (p)
-		registry_cleanup_param(p);
+	struct input_pcap_interface_priv *ip = &p->tpriv.iface;
 
-	free(priv);
+	uint32_t serial = 0;
+	char *filter = input_pcap_interface_filter_build(p, &serial);
+	if (!filter)
+		return POM_ERR;
 
-	return POM_ERR;
-}
+	int res = POM_OK;
+#ifdef INPUT_PCAP_HAVE_TPACKET
+	if (ip->rings)
+		res = input_pcap_tpacket_set_filter(p, filter);
+	else
+#endif
+		res = input_pcap_replace_filter(p->p, filter);
 
-static int input_pcap_file_open(struct input *i) {
+	if (res != POM_OK) {
+		// Keep the previous serial so that it's tried again
+		free(filter);
+		return POM_ERR;
+	}
 
-	struct input_pcap_priv *p = i->priv;
-	char errbuf[PCAP_ERRBUF_SIZE + 1] = { 0 };
+	ip->bpf_auto_serial = serial;
+	pomlog(POMLOG_INFO "Filter of interface %s updated to \"%s\"", PTYPE_STRING_GETVAL(ip->p_interface), filter);
 
-	char *filename = PTYPE_STRING_GETVAL(p->tpriv.file.p_file);
-	p->p = pcap_open_offline(filename, errbuf);
-	if (!p->p) {
-		pomlog(POMLOG_ERR "Error opening file %s for reading : %s", filename, errbuf);
-		return POM_ERR;
+#ifdef INPUT_PCAP_HAVE_TPACKET
+	if (ip->rings) {
+		free(ip->bpf_cur);
+		ip->bpf_cur = filter;
+		return POM_OK;
 	}
+#endif
 
-	return input_pcap_common_open(i);
+	free(filter);
 
+	return POM_OK;
 }
 
+#ifdef INPUT_PCAP_HAVE_TPACKET
+
 /*
- * input pcap type dir
+ * TPACKET_V3 capture mode for input pcap type interface
  */
 
-static int input_pcap_dir_init(struct input *i) {
-
-	if (input_pcap_common_init(i) != POM_OK)
-		return POM_ERR;
-
-	struct input_pcap_priv *priv = i->priv;
-
-	struct registry_param *p = NULL;
-	priv->tpriv.dir.p_dir = ptype_alloc("string");
-	priv->tpriv.dir.p_match = ptype_alloc("string");
-	if (!priv->tpriv.dir.p_dir || !priv->tpriv.dir.p_match)
-		goto err;
+static volatile unsigned int input_pcap_tpacket_fanout_next = 0;
 
-	p = registry_new_param("directory", "/tmp", priv->tpriv.dir.p_dir, "Directory containing pcap files", 0);
-	if (input_add_param(i, p) != POM_OK)
-		goto err;
+static int input_pcap_tpacket_open(struct input *i) {
 
-	p = registry_new_param("match", "\\.p\\?cap[0-9]*$", priv->tpriv.dir.p_match, "Match files with the specific pattern (regex)", 0);
-	if (input_add_param(i, p) != POM_OK)
-		goto err;
+	struct input_pcap_priv *p = i->priv;
+	struct input_pcap_interface_priv *ip = &p->tpriv.iface;
 
-	priv->type = input_pcap_type_dir;
-	
-	return POM_OK;
+	char *interface = PTYPE_STRING_GETVAL(ip->p_interface);
+	uint32_t buff_size = *PTYPE_UINT32_GETVAL(ip->p_buff_size);
+	uint32_t block_size = *PTYPE_UINT32_GETVAL(ip->p_block_size);
+	uint32_t fanout = *PTYPE_UINT32_GETVAL(ip->p_fanout);
 
-err:
-	
-	if (priv->tpriv.dir.p_dir)
-		ptype_cleanup(priv->tpriv.dir.p_dir);
+	long page_size = sysconf(_SC_PAGESIZE);
+	if (block_size < INPUT_PCAP_TPACKET_FRAME_SIZE || block_size % page_size) {
+		pomlog(POMLOG_ERR "TPACKET block size must be a multiple of the page size (%lu)", page_size);
+		return POM_ERR;
+	}
 
-	if (p)
-		registry_cleanup_param(p);
+	unsigned int block_count = buff_size / block_size;
+	if (block_count < 2) {
+		pomlog(POMLOG_ERR "TPACKET buffer size must be at least twice the block size");
+		return POM_ERR;
+	}
 
-	free(priv); 
+	if (fanout < 1)
+		fanout = 1;
 
-	return POM_ERR;
-}
+	unsigned int ifindex = if_nametoindex(interface);
+	if (!ifindex) {
+		pomlog(POMLOG_ERR "Interface %s not found", interface);
+		return POM_ERR;
+	}
 
-static int input_pcap_dir_open(struct input *i) {
+	// Find out the datalink
+	int fd = socket(AF_PACKET, SOCK_RAW, 0);
+	if (fd == -1) {
+		pomlog(POMLOG_ERR "Error while opening the packet socket : %s", pom_strerror(errno));
+		return POM_ERR;
+	}
 
-	struct input_pcap_priv *p = i->priv;
+	struct ifreq ifr;
+	memset(&ifr, 0, sizeof(struct ifreq));
+	strncpy(ifr.ifr_name, interface, IFNAMSIZ - 1);
+	int res = ioctl(fd, SIOCGIFHWADDR, &ifr);
+	close(fd);
+	if (res) {
+		pomlog(POMLOG_ERR "Error while getting the hardware type of interface %s : %s", interface, pom_strerror(errno));
+		return POM_ERR;
+	}
 
-	struct input_pcap_dir_priv *dp = &p->tpriv.dir;
+	int datalink_type = -1;
+	switch (ifr.ifr_hwaddr.sa_family) {
+		case ARPHRD_ETHER:
+		case ARPHRD_LOOPBACK:
+			datalink_type = DLT_EN10MB;
+			break;
+		case ARPHRD_IEEE80211_RADIOTAP:
+			datalink_type = DLT_IEEE802_11_RADIO;
+			break;
+		default:
+			pomlog(POMLOG_ERR "Hardware type %u of interface %s is not supported in capture mode %s", ifr.ifr_hwaddr.sa_family, interface, INPUT_PCAP_CAPTURE_MODE_TPACKET);
+			return POM_ERR;
+	}
 
-	// Reset the interrupt flag
-	dp->interrupt_scan = 0;
+	if (input_pcap_set_datalink(i, datalink_type) != POM_OK)
+		return POM_ERR;
 
-	pomlog(POMLOG_INFO "Scanning directory %s for pcap files ...", PTYPE_STRING_GETVAL(dp->p_dir));
+	// The kernel aligns the network header, don't try to do it ourselves
+	p->align_offset = 0;
 
-	int found = input_pcap_dir_browse(p);
+	if (strstr(PTYPE_STRING_GETVAL(p->p_filter), "vlan"))
+		pomlog(POMLOG_WARN "The kernel filter sees packets without their 802.1Q tag when VLAN offload is enabled on interface %s, vlan terms of the BPF filter may not match", interface);
 
-	if (dp->interrupt_scan)
+	// Compile the BPF filter with libpcap, it will be attached to each socket
+	struct bpf_program fp;
+	memset(&fp, 0, sizeof(struct bpf_program));
+	uint32_t serial = 0;
+	char *filter = input_pcap_interface_filter_build(p, &serial);
+	if (!filter)
 		return POM_ERR;
 
-	if (found == POM_ERR)
+	int has_filter = (strlen(filter) ? 1 : 0);
+	if (has_filter && input_pcap_tpacket_compile_filter(datalink_type, filter, &fp) != POM_OK) {
+		free(filter);
 		return POM_ERR;
+	}
 
-	pomlog(POMLOG_INFO "Found %u files", found);
-	
-	dp->cur_file = dp->files;
+	ip->rings = malloc(sizeof(struct input_pcap_tpacket_ring *) * fanout);
+	if (!ip->rings) {
+		pom_oom(sizeof(struct input_pcap_tpacket_ring *) * fanout);
+		pcap_freecode(&fp);
+		free(filter);
+		return POM_ERR;
+	}
+	memset(ip->rings, 0, sizeof(struct input_pcap_tpacket_ring *) * fanout);
 
-	// Skip files which were not read
-	while (dp->cur_file && !dp->cur_file->first_pkt)
-		dp->cur_file = dp->cur_file->next;
+	// All the sockets of this input share the same fanout group
+	int fanout_id = (getpid() + __sync_fetch_and_add(&input_pcap_tpacket_fanout_next, 1)) & 0xffff;
 
-	if (!dp->cur_file) {
-		pomlog(POMLOG_ERR "No useable file found");
-		return POM_ERR;
+	for (ip->ring_count = 0; ip->ring_count < fanout; ip->ring_count++) {
+		struct input_pcap_tpacket_ring *r = input_pcap_tpacket_ring_open(i, ip->ring_count, ifindex, block_size, block_count, (has_filter ? &fp : NULL), (fanout > 1 ? fanout_id : -1));
+		if (!r)
+			goto err;
+		ip->rings[ip->ring_count] = r;
 	}
 
-	char errbuf[PCAP_ERRBUF_SIZE + 1] = { 0 };
-	p->p = pcap_open_offline(dp->cur_file->full_path, errbuf);
-	if (!p->p) {
-		pomlog(POMLOG_ERR "Error opening %s for reading", dp->cur_file->full_path);
-		return POM_ERR;
+	pcap_freecode(&fp);
+
+	// Every ring has the filter now
+	ip->bpf_cur = filter;
+	filter = NULL;
+	ip->bpf_auto_serial = serial;
+
+	ip->tpacket_dropped = 0;
+	ip->readers_error = 0;
+	ip->readers_run = 1;
+
+	// The input thread reads the first ring, start a thread for each of the others
+	unsigned int j;
+	for (j = 1; j < ip->ring_count; j++) {
+		struct input_pcap_tpacket_ring *r = ip->rings[j];
+		if (pthread_create(&r->thread, NULL, input_pcap_tpacket_reader_thread, r)) {
+			pomlog(POMLOG_ERR "Unable to start a reader thread for input %s : %s", i->name, pom_strerror(errno));
+			ip->readers_run = 0;
+			while (--j > 0)
+				pthread_join(ip->rings[j]->thread, NULL);
+			goto err;
+		}
 	}
 
-	pomlog("Reading file %s", dp->cur_file->filename);
+	if (ip->ring_count > 1)
+		pomlog(POMLOG_INFO "Capturing on interface %s using %u fanout TPACKET_V3 rings of %u blocks of %u bytes", interface, ip->ring_count, block_count, block_size);
+	else
+		pomlog(POMLOG_INFO "Capturing on interface %s using a TPACKET_V3 ring of %u blocks of %u bytes", interface, block_count, block_size);
 
-	return input_pcap_common_open(i);
+	return POM_OK;
+
+err:
+	pcap_freecode(&fp);
+	free(filter);
+	free(ip->bpf_cur);
+	ip->bpf_cur = NULL;
+	for (j = 0; j < ip->ring_count; j++)
+		input_pcap_tpacket_ring_release(ip->rings[j]);
+	free(ip->rings);
+	ip->rings = NULL;
+	ip->ring_count = 0;
+	return POM_ERR;
 }
 
-static int input_pcap_dir_browse(struct input_pcap_priv *priv) {
+static int input_pcap_tpacket_compile_filter(int datalink_type, char *filter, struct bpf_program *fp) {
 
-	// Open the directory
-	char *path = PTYPE_STRING_GETVAL(priv->tpriv.dir.p_dir);
+	pcap_t *dead = pcap_open_dead(datalink_type, INPUT_PCAP_SNAPLEN_MAX);
+	if (!dead) {
+		pomlog(POMLOG_ERR "Unable to compile BPF filter \"%s\"", filter);
+		return POM_ERR;
+	}
 
-	DIR *dir = opendir(path);
-	if (!dir) {
-		pomlog(POMLOG_ERR "Error while opening directory %s : %s", path, pom_strerror(errno));
+	if (pcap_compile(dead, fp, filter, 1, PCAP_NETMASK_UNKNOWN) == -1) {
+		pomlog(POMLOG_ERR "Unable to compile BPF filter \"%s\" : %s", filter, pcap_geterr(dead));
+		pcap_close(dead);
 		return POM_ERR;
 	}
+	pcap_close(dead);
 
-	// Compile the regex used to match files
+	return POM_OK;
+}
+
+static int input_pcap_tpacket_set_filter(struct input_pcap_priv *p, char *filter) {
+
+	struct input_pcap_interface_priv *ip = &p->tpriv.iface;
+	unsigned int j;
+
+	if (!strlen(filter)) {
+		// Fails if there was no filter, which is fine
+		int dummy = 0;
+		for (j = 0; j < ip->ring_count; j++)
+			setsockopt(ip->rings[j]->fd, SOL_SOCKET, SO_DETACH_FILTER, &dummy, sizeof(dummy));
+		return POM_OK;
+	}
+
+	struct bpf_program fp;
+	memset(&fp, 0, sizeof(struct bpf_program));
+	if (input_pcap_tpacket_compile_filter(p->datalink_type, filter, &fp) != POM_OK)
+		return POM_ERR;
+
+	// The kernel swaps the filter of each socket atomically
+	struct sock_fprog prog;
+	prog.len = fp.bf_len;
+	prog.filter = (struct sock_filter *) fp.bf_insns;
+	for (j = 0; j < ip->ring_count; j++) {
+		if (setsockopt(ip->rings[j]->fd, SOL_SOCKET, SO_ATTACH_FILTER, &prog, sizeof(prog))) {
+			pomlog(POMLOG_ERR "Unable to attach the BPF filter to the packet socket : %s", pom_strerror(errno));
+			pcap_freecode(&fp);
+			// All the rings of the fanout group must keep the same filter
+			input_pcap_tpacket_restore_filter(p, j);
+			return POM_ERR;
+		}
+	}
+
+	pcap_freecode(&fp);
+
+	return POM_OK;
+}
+
+// Attach the current filter again to the first rings after a new one was partially set
+static void input_pcap_tpacket_restore_filter(struct input_pcap_priv *p, unsigned int count) {
+
+	struct input_pcap_interface_priv *ip = &p->tpriv.iface;
+	unsigned int j;
+
+	if (!ip->bpf_cur || !strlen(ip->bpf_cur)) {
+		int dummy = 0;
+		for (j = 0; j < count; j++)
+			setsockopt(ip->rings[j]->fd, SOL_SOCKET, SO_DETACH_FILTER, &dummy, sizeof(dummy));
+		return;
+	}
+
+	struct bpf_program fp;
+	memset(&fp, 0, sizeof(struct bpf_program));
+	if (input_pcap_tpacket_compile_filter(p->datalink_type, ip->bpf_cur, &fp) != POM_OK)
+		return;
+
+	struct sock_fprog prog;
+	prog.len = fp.bf_len;
+	prog.filter = (struct sock_filter *) fp.bf_insns;
+	for (j = 0; j < count; j++) {
+		if (setsockopt(ip->rings[j]->fd, SOL_SOCKET, SO_ATTACH_FILTER, &prog, sizeof(prog)))
+			pomlog(POMLOG_ERR "Unable to restore the previous BPF filter on the packet socket : %s", pom_strerror(errno));
+	}
+
+	pcap_freecode(&fp);
+}
+
+static struct input_pcap_tpacket_ring *input_pcap_tpacket_ring_open(struct input *i, unsigned int id, unsigned int ifindex, unsigned int block_size, unsigned int block_count, struct bpf_program *fp, int fanout_id) {
+
+	struct input_pcap_priv *p = i->priv;
+	struct input_pcap_interface_priv *ip = &p->tpriv.iface;
+
+	struct input_pcap_tpacket_ring *r = malloc(sizeof(struct input_pcap_tpacket_ring));
+	if (!r) {
+		pom_oom(sizeof(struct input_pcap_tpacket_ring));
+		return NULL;
+	}
+	memset(r, 0, sizeof(struct input_pcap_tpacket_ring));
+	r->map = MAP_FAILED;
+	r->refcount = 1;
+	r->block_size = block_size;
+	r->block_count = block_count;
+	r->input = i;
+	r->id = id;
+
+	r->blocks = malloc(sizeof(struct input_pcap_tpacket_block) * block_count);
+	if (!r->blocks) {
+		pom_oom(sizeof(struct input_pcap_tpacket_block) * block_count);
+		free(r);
+		return NULL;
+	}
+	memset(r->blocks, 0, sizeof(struct input_pcap_tpacket_block) * block_count);
+
+	r->fd = socket(AF_PACKET, SOCK_RAW, htons(ETH_P_ALL));
+	if (r->fd == -1) {
+		pomlog(POMLOG_ERR "Error while opening the packet socket : %s", pom_strerror(errno));
+		free(r->blocks);
+		free(r);
+		return NULL;
+	}
+
+	// From here input_pcap_tpacket_ring_release() takes care of the cleanup
+
+	int version = TPACKET_V3;
+	if (setsockopt(r->fd, SOL_PACKET, PACKET_VERSION, &version, sizeof(version))) {
+		pomlog(POMLOG_ERR "Error while setting TPACKET_V3 on the packet socket : %s", pom_strerror(errno));
+		goto err;
+	}
+
+	struct tpacket_req3 req;
+	memset(&req, 0, sizeof(struct tpacket_req3));
+	req.tp_block_size = block_size;
+	req.tp_block_nr = block_count;
+	req.tp_frame_size = INPUT_PCAP_TPACKET_FRAME_SIZE;
+	req.tp_frame_nr = (block_size * block_count) / INPUT_PCAP_TPACKET_FRAME_SIZE;
+	req.tp_retire_blk_tov = INPUT_PCAP_TPACKET_BLOCK_TIMEOUT;
+
+	if (setsockopt(r->fd, SOL_PACKET, PACKET_RX_RING, &req, sizeof(req))) {
+		pomlog(POMLOG_ERR "Error while creating the TPACKET ring : %s", pom_strerror(errno));
+		goto err;
+	}
+
+	r->map_size = (size_t) block_size * block_count;
+	r->map = mmap(NULL, r->map_size, PROT_READ | PROT_WRITE, MAP_SHARED, r->fd, 0);
+	if (r->map == MAP_FAILED) {
+		pomlog(POMLOG_ERR "Error while mapping the TPACKET ring : %s", pom_strerror(errno));
+		goto err;
+	}
+
+	unsigned int j;
+	for (j = 0; j < block_count; j++) {
+		r->blocks[j].ring = r;
+		r->blocks[j].desc = r->map + ((size_t) j * block_size);
+	}
+
+	if (fp) {
+		struct sock_fprog prog;
+		prog.len = fp->bf_len;
+		prog.filter = (struct sock_filter *) fp->bf_insns;
+		if (setsockopt(r->fd, SOL_SOCKET, SO_ATTACH_FILTER, &prog, sizeof(prog))) {
+			pomlog(POMLOG_ERR "Unable to attach the BPF filter to the packet socket : %s", pom_strerror(errno));
+			goto err;
+		}
+	}
+
+	struct sockaddr_ll sll;
+	memset(&sll, 0, sizeof(struct sockaddr_ll));
+	sll.sll_family = AF_PACKET;
+	sll.sll_protocol = htons(ETH_P_ALL);
+	sll.sll_ifindex = ifindex;
+	if (bind(r->fd, (struct sockaddr *) &sll, sizeof(sll))) {
+		pomlog(POMLOG_ERR "Error while binding to interface %s : %s", PTYPE_STRING_GETVAL(ip->p_interface), pom_strerror(errno));
+		goto err;
+	}
+
+	if (*PTYPE_BOOL_GETVAL(ip->p_promisc)) {
+		struct packet_mreq mreq;
+		memset(&mreq, 0, sizeof(struct packet_mreq));
+		mreq.mr_ifindex = ifindex;
+		mreq.mr_type = PACKET_MR_PROMISC;
+		if (setsockopt(r->fd, SOL_PACKET, PACKET_ADD_MEMBERSHIP, &mreq, sizeof(mreq)))
+			pomlog(POMLOG_WARN "Error while setting promisc mode : %s", pom_strerror(errno));
+	}
+
+	if (fanout_id >= 0) {
+		// The kernel hashes both directions of a flow to the same socket
+		int fanout_arg = fanout_id | ((PACKET_FANOUT_HASH | PACKET_FANOUT_FLAG_DEFRAG) << 16);
+		if (setsockopt(r->fd, SOL_PACKET, PACKET_FANOUT, &fanout_arg, sizeof(fanout_arg))) {
+			pomlog(POMLOG_ERR "Error while joining the fanout group of interface %s : %s", PTYPE_STRING_GETVAL(ip->p_interface), pom_strerror(errno));
+			goto err;
+		}
+	}
+
+	return r;
+
+err:
+	input_pcap_tpacket_ring_release(r);
+	return NULL;
+}
+
+static void input_pcap_tpacket_ring_release(struct input_pcap_tpacket_ring *r) {
+
+	if (__sync_sub_and_fetch(&r->refcount, 1))
+		return;
+
+	// Nobody uses the ring anymore
+	if (r->map != MAP_FAILED)
+		munmap(r->map, r->map_size);
+	close(r->fd);
+	free(r->blocks);
+	free(r);
+}
+
+static void input_pcap_tpacket_block_release(void *priv) {
+
+	struct input_pcap_tpacket_block *b = priv;
+
+	if (__sync_sub_and_fetch(&b->refcount, 1))
+		return;
+
+	// All the packets of this block were processed, give it back to the kernel
+	struct input_pcap_tpacket_ring *r = b->ring;
+	__atomic_store_n(&b->desc->hdr.bh1.block_status, TP_STATUS_KERNEL, __ATOMIC_RELEASE);
+	__atomic_store_n(&b->in_use, 0, __ATOMIC_RELEASE);
+
+	input_pcap_tpacket_ring_release(r);
+}
+
+static void *input_pcap_tpacket_reader_thread(void *priv) {
+
+	struct input_pcap_tpacket_ring *r = priv;
+	struct input *i = r->input;
+	struct input_pcap_priv *p = i->priv;
+
+	while (p->tpriv.iface.readers_run) {
+		if (input_pcap_tpacket_ring_read(i, r) != POM_OK) {
+			// The input thread will notice and stop the input
+			pomlog(POMLOG_ERR "Error while reading from fanout ring %u of input %s", r->id, i->name);
+			p->tpriv.iface.readers_error = 1;
+			break;
+		}
+	}
+
+	return NULL;
+}
+
+static int input_pcap_tpacket_read(struct input *i) {
+
+	struct input_pcap_priv *p = i->priv;
+
+	if (p->tpriv.iface.readers_error)
+		return POM_ERR;
+
+	return input_pcap_tpacket_ring_read(i, p->tpriv.iface.rings[0]);
+}
+
+static int input_pcap_tpacket_ring_read(struct input *i, struct input_pcap_tpacket_ring *r) {
+
+	struct input_pcap_priv *p = i->priv;
+	struct input_pcap_tpacket_block *b = &r->blocks[r->cur_block];
+
+	if (__atomic_load_n(&b->in_use, __ATOMIC_ACQUIRE)) {
+		// The packets of this block are still being processed
+		usleep(INPUT_PCAP_TPACKET_BUSY_WAIT);
+		return POM_OK;
+	}
+
+	if (!(__atomic_load_n(&b->desc->hdr.bh1.block_status, __ATOMIC_ACQUIRE) & TP_STATUS_USER)) {
+		// Wait for the kernel to fill this block
+		struct pollfd pfd;
+		memset(&pfd, 0, sizeof(struct pollfd));
+		pfd.fd = r->fd;
+		pfd.events = POLLIN | POLLERR;
+		int res = poll(&pfd, 1, INPUT_PCAP_TPACKET_POLL_TIMEOUT);
+		if (res == -1) {
+			if (errno == EINTR)
+				return POM_OK;
+			pomlog(POMLOG_ERR "Error while polling the packet socket : %s", pom_strerror(errno));
+			return POM_ERR;
+		}
+
+		if (pfd.revents & POLLERR) {
+			// Clear the pending error or poll() will keep returning right away
+			int err = 0;
+			socklen_t len = sizeof(err);
+			getsockopt(r->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+		}
+
+		if (res > 0 && !(__atomic_load_n(&b->desc->hdr.bh1.block_status, __ATOMIC_ACQUIRE) & TP_STATUS_USER)) {
+			// The kernel reports the socket readable as long as we hold the previous block
+			// Our block isn't there yet, don't spin on it
+			usleep(INPUT_PCAP_TPACKET_BUSY_WAIT);
+		}
+
+		return POM_OK;
+	}
+
+	struct tpacket_block_desc *desc = b->desc;
+	unsigned int num_pkts = desc->hdr.bh1.num_pkts;
+
+	// The block holds a reference to the ring until it's given back to the kernel
+	__sync_fetch_and_add(&r->refcount, 1);
+	b->in_use = 1;
+	b->refcount = num_pkts + 1;
+
+	r->cur_block++;
+	if (r->cur_block >= r->block_count)
+		r->cur_block = 0;
+
+	struct tpacket3_hdr *hdr = (void *) desc + desc->hdr.bh1.offset_to_first_pkt;
+
+	unsigned int n;
+	for (n = 0; n < num_pkts; n++) {
+
+		struct tpacket3_hdr *next = (void *) hdr + hdr->tp_next_offset;
+
+		if (hdr->tp_len > hdr->tp_snaplen && !p->warning) {
+			pomlog(POMLOG_WARN "Warning, some packets were truncated at capture time on input %s", i->name);
+			p->warning = 1;
+		}
+
+		struct packet *pkt = packet_alloc();
+		if (!pkt)
+			break;
+
+		pkt->input = i;
+		pkt->datalink = p->datalink_proto;
+		pkt->ts = ((ptime) hdr->tp_sec * 1000000UL) + (hdr->tp_nsec / 1000);
+
+		void *data = (void *) hdr + hdr->tp_mac + p->skip_offset;
+		unsigned int len = hdr->tp_snaplen - p->skip_offset;
+
+		if ((hdr->tp_status & TP_STATUS_VLAN_VALID) && len >= INPUT_PCAP_ETHER_ADDRS_LEN) {
+			// The kernel stripped the 802.1Q tag, put it back in a copy of the frame
+			// Align the network header after the 18 bytes of header
+			if (packet_buffer_alloc(pkt, len + INPUT_PCAP_VLAN_TAG_LEN, 2) != POM_OK) {
+				packet_release(pkt);
+				break;
+			}
+
+			uint16_t tpid = ETH_P_8021Q;
+#ifdef TP_STATUS_VLAN_TPID_VALID
+			if ((hdr->tp_status & TP_STATUS_VLAN_TPID_VALID) && hdr->hv1.tp_vlan_tpid)
+				tpid = hdr->hv1.tp_vlan_tpid;
+#endif
+			uint16_t tag[2] = { htons(tpid), htons(hdr->hv1.tp_vlan_tci) };
+
+			memcpy(pkt->buff, data, INPUT_PCAP_ETHER_ADDRS_LEN);
+			memcpy(pkt->buff + INPUT_PCAP_ETHER_ADDRS_LEN, tag, INPUT_PCAP_VLAN_TAG_LEN);
+			memcpy(pkt->buff + INPUT_PCAP_ETHER_ADDRS_LEN + INPUT_PCAP_VLAN_TAG_LEN, data + INPUT_PCAP_ETHER_ADDRS_LEN, len - INPUT_PCAP_ETHER_ADDRS_LEN);
+
+			// The copy doesn't need the block anymore
+			input_pcap_tpacket_block_release(b);
+		} else {
+			// The packet points directly into the ring
+			pkt->buff = data;
+			pkt->len = len;
+			pkt->buff_release = input_pcap_tpacket_block_release;
+			pkt->buff_release_priv = b;
+		}
+
+		// Each ring feeds its own subset of the processing threads
+		int res;
+		if (p->tpriv.iface.ring_count > 1)
+			res = core_queue_packet_group(pkt, CORE_QUEUE_DROP_IF_FULL, r->id, p->tpriv.iface.ring_count);
+		else
+			res = core_queue_packet(pkt, CORE_QUEUE_DROP_IF_FULL, 0);
+
+		if (res != POM_OK) {
+			packet_release(pkt);
+			n++;
+			break;
+		}
+
+		hdr = next;
+	}
+
+	// Drop the references of the packets we didn't queue and our own
+	unsigned int remaining = num_pkts - n;
+	for (; remaining; remaining--)
+		input_pcap_tpacket_block_release(b);
+	input_pcap_tpacket_block_release(b);
+
+	if (n < num_pkts)
+		return POM_ERR;
+
+	return POM_OK;
+}
+
+static int input_pcap_tpacket_update_dropped(struct input_pcap_priv *p) {
+
+	struct input_pcap_interface_priv *ip = &p->tpriv.iface;
+
+	// The kernel resets the counters each time they are read
+	unsigned int j;
+	for (j = 0; j < ip->ring_count; j++) {
+		struct tpacket_stats_v3 st;
+		socklen_t len = sizeof(st);
+		if (getsockopt(ip->rings[j]->fd, SOL_PACKET, PACKET_STATISTICS, &st, &len))
+			return POM_ERR;
+
+		__sync_fetch_and_add(&ip->tpacket_dropped, st.tp_drops);
+	}
+
+	return POM_OK;
+}
+
+static void input_pcap_tpacket_close(struct input_pcap_priv *p) {
+
+	struct input_pcap_interface_priv *ip = &p->tpriv.iface;
+
+	// Stop the other readers first
+	ip->readers_run = 0;
+	unsigned int j;
+	for (j = 1; j < ip->ring_count; j++) {
+		if (pthread_join(ip->rings[j]->thread, NULL))
+			pomlog(POMLOG_WARN "Error while joining a reader thread : %s", pom_strerror(errno));
+	}
+
+	input_pcap_tpacket_update_dropped(p);
+	pomlog(POMLOG_INFO "interface %s stats : %"PRIu64" pkts dropped by the kernel", PTYPE_STRING_GETVAL(ip->p_interface), ip->tpacket_dropped);
+
+	// The rings will be released once all their packets are processed
+	struct input_pcap_tpacket_ring **rings = ip->rings;
+	unsigned int ring_count = ip->ring_count;
+	ip->ring_count = 0;
+	ip->rings = NULL;
+	for (j = 0; j < ring_count; j++)
+		input_pcap_tpacket_ring_release(rings[j]);
+	free(rings);
+
+	free(ip->bpf_cur);
+	ip->bpf_cur = NULL;
+}
+
+#endif
+
+/*
+ * input pcap type file
+ */
+
+static int input_pcap_file_init(struct input *i) {
+
+	if (input_pcap_common_init(i) != POM_OK)
+		return POM_ERR;
+
+	struct input_pcap_priv *priv = i->priv;
+
+	struct registry_param *p = NULL;
+
+	priv->tpriv.file.p_file = ptype_alloc("string");
+	if (!priv->tpriv.file.p_file)
+		goto err;
+
+	p = registry_new_param("filename", "dump.cap", priv->tpriv.file.p_file, "File in PCAP format", 0);
+	if (input_add_param(i, p) != POM_OK)
+		goto err;
+
+	p = NULL;
+	if (input_pcap_offline_init(i) != POM_OK)
+		goto err;
+
+	priv->type = input_pcap_type_file;
+
+	return POM_OK;
+
+err:
+
+	if (priv->tpriv.file.p_file)
+		ptype_cleanup(priv->tpriv.file.p_file);
+
+	if (p)
+		registry_cleanup_param(p);
+
+	free(priv);
+
+	return POM_ERR;
+}
+
+static int input_pcap_file_open(struct input *i) {
+
+	struct input_pcap_priv *p = i->priv;
+
+	char *filename = PTYPE_STRING_GETVAL(p->tpriv.file.p_file);
+	if (input_pcap_offline_open(p, filename) != POM_OK)
+		return POM_ERR;
+
+	return input_pcap_common_open(i);
+
+}
+
+/*
+ * input pcap type dir
+ */
+
+static int input_pcap_dir_init(struct input *i) {
+
+	if (input_pcap_common_init(i) != POM_OK)
+		return POM_ERR;
+
+	struct input_pcap_priv *priv = i->priv;
+
+	struct registry_param *p = NULL;
+	priv->tpriv.dir.p_dir = ptype_alloc("string");
+	priv->tpriv.dir.p_match = ptype_alloc("string");
+	priv->tpriv.dir.p_parallel = ptype_alloc("uint32");
+	priv->tpriv.dir.p_mode = ptype_alloc("string");
+	priv->tpriv.dir.p_use_index = ptype_alloc("bool");
+	if (!priv->tpriv.dir.p_dir || !priv->tpriv.dir.p_match || !priv->tpriv.dir.p_parallel || !priv->tpriv.dir.p_mode || !priv->tpriv.dir.p_use_index)
+		goto err;
+
+	p = registry_new_param("directory", "/tmp", priv->tpriv.dir.p_dir, "Directory containing pcap files", 0);
+	if (input_add_param(i, p) != POM_OK)
+		goto err;
+
+	p = registry_new_param("match", "\\.p\\?cap[0-9]*\\(\\.\\(gz\\|zst\\|lz4\\)\\)\\?$", priv->tpriv.dir.p_match, "Match files with the specific pattern (regex)", 0);
+	if (input_add_param(i, p) != POM_OK)
+		goto err;
+
+	p = registry_new_param("parallel_files", "1", priv->tpriv.dir.p_parallel, "Number of files decoded at the same time, each by its own thread", 0);
+	if (registry_param_info_set_min_max(p, 1, INPUT_PCAP_DIR_PARALLEL_MAX) != POM_OK)
+		goto err;
+	if (input_add_param(i, p) != POM_OK)
+		goto err;
+
+	p = registry_new_param("parallel_mode", INPUT_PCAP_DIR_MODE_MERGE, priv->tpriv.dir.p_mode, "Merge the packets of the files being read by timestamp or process them as independent shards", 0);
+	if (registry_param_info_add_value(p, INPUT_PCAP_DIR_MODE_MERGE) != POM_OK || registry_param_info_add_value(p, INPUT_PCAP_DIR_MODE_SHARDS) != POM_OK)
+		goto err;
+	if (input_add_param(i, p) != POM_OK)
+		goto err;
+
+	p = registry_new_param("use_index", "yes", priv->tpriv.dir.p_use_index, "Cache the timestamp of the first packet of each file in " INPUT_PCAP_DIR_INDEX_FILE, 0);
+	if (input_add_param(i, p) != POM_OK)
+		goto err;
+
+	p = NULL;
+	if (input_pcap_offline_init(i) != POM_OK)
+		goto err;
+
+	priv->type = input_pcap_type_dir;
+	
+	return POM_OK;
+
+err:
+	
+	if (priv->tpriv.dir.p_dir)
+		ptype_cleanup(priv->tpriv.dir.p_dir);
+
+	if (priv->tpriv.dir.p_match)
+		ptype_cleanup(priv->tpriv.dir.p_match);
+
+	if (priv->tpriv.dir.p_parallel)
+		ptype_cleanup(priv->tpriv.dir.p_parallel);
+
+	if (priv->tpriv.dir.p_mode)
+		ptype_cleanup(priv->tpriv.dir.p_mode);
+
+	if (priv->tpriv.dir.p_use_index)
+		ptype_cleanup(priv->tpriv.dir.p_use_index);
+
+	if (p)
+		registry_cleanup_param(p);
+
+	free(priv); 
+
+	return POM_ERR;
+}
+
+static int input_pcap_dir_open(struct input *i) {
+
+	struct input_pcap_priv *p = i->priv;
+
+	struct input_pcap_dir_priv *dp = &p->tpriv.dir;
+
+	// Reset the interrupt flag
+	dp->interrupt_scan = 0;
+
+	pomlog(POMLOG_INFO "Scanning directory %s for pcap files ...", PTYPE_STRING_GETVAL(dp->p_dir));
+
+	int found = input_pcap_dir_browse(p);
+
+	if (dp->interrupt_scan)
+		return POM_ERR;
+
+	if (found == POM_ERR)
+		return POM_ERR;
+
+	pomlog(POMLOG_INFO "Found %u files", found);
+	
+	dp->cur_file = dp->files;
+
+	// Skip files which were not read
+	while (dp->cur_file && !dp->cur_file->first_pkt)
+		dp->cur_file = dp->cur_file->next;
+
+	if (!dp->cur_file) {
+		pomlog(POMLOG_ERR "No useable file found");
+		return POM_ERR;
+	}
+
+	if (input_pcap_offline_open(p, dp->cur_file->full_path) != POM_OK)
+		return POM_ERR;
+
+	pomlog("Reading file %s", dp->cur_file->filename);
+
+	return input_pcap_common_open(i);
+}
+
+static int input_pcap_dir_browse(struct input_pcap_priv *priv) {
+
+	// Open the directory
+	char *path = PTYPE_STRING_GETVAL(priv->tpriv.dir.p_dir);
+
+	DIR *dir = opendir(path);
+	if (!dir) {
+		pomlog(POMLOG_ERR "Error while opening directory %s : %s", path, pom_strerror(errno));
+		return POM_ERR;
+	}
+
+	// Compile the regex used to match files
 	char *match = PTYPE_STRING_GETVAL(priv->tpriv.dir.p_match);
 	regex_t preg;
 	int errcode = regcomp(&preg, match, REG_NOSUB);
 
-	if (errcode) {
-		closedir(dir);
-		char errbuf[256] = { 0 };
-		regerror(errcode, &preg, errbuf, sizeof(errbuf) - 1);
-		pomlog(POMLOG_ERR "Error while compiling regex \"%s\" : %s", match, errbuf);
-		return POM_ERR;
+	if (errcode) {
+		closedir(dir);
+		char errbuf[256] = { 0 };
+		regerror(errcode, &preg, errbuf, sizeof(errbuf) - 1);
+		pomlog(POMLOG_ERR "Error while compiling regex \"%s\" : %s", match, errbuf);
+		return POM_ERR;
+	}
+
+
+	// Load the first packet timestamps from the previous scans
+	int use_index = *PTYPE_BOOL_GETVAL(priv->tpriv.dir.p_use_index);
+	struct input_pcap_dir_index_entry *index = NULL;
+	if (use_index)
+		index = input_pcap_dir_index_load(path);
+	int index_dirty = 0;
+
+	// Browse the given directory
+	struct dirent *buf, *de = NULL;
+	size_t len = offsetof(struct dirent, d_name) + pathconf(path, _PC_NAME_MAX) + 1;
+	buf = malloc(len);
+
+	int tot_files = 0;
+
+	while (!priv->tpriv.dir.interrupt_scan) {
+
+		int res = readdir_r(dir, buf, &de);
+		if (res) {
+			pomlog(POMLOG_ERR "Error while reading directory entry : %s", pom_strerror(errno));
+			input_pcap_dir_index_cleanup(index);
+			regfree(&preg);
+			free(buf);
+			closedir(dir);
+			return POM_ERR;
+		}
+
+		if (!de)
+			break;
+
+		// Don't try to read our own index
+		if (!strncmp(buf->d_name, INPUT_PCAP_DIR_INDEX_FILE, strlen(INPUT_PCAP_DIR_INDEX_FILE)))
+			continue;
+
+		// Match our file against regex
+		if (regexec(&preg, buf->d_name, 1, NULL, 0)) {
+			pomlog(POMLOG_DEBUG "Discarding file %s, regular expression not matched", buf->d_name);
+			continue;
+		}
+
+		// Check if we already know about that file
+		struct input_pcap_dir_file *tmp = priv->tpriv.dir.files;
+		int found = 0;
+		while (tmp) {
+			if (!strcmp(tmp->filename, buf->d_name)) {
+				found = 1;
+				break;
+			}
+			tmp = tmp->next;
+		}
+		if (found)
+			continue;
+
+
+		// We don't know about this file, parse it
+		char errbuf[PCAP_ERRBUF_SIZE + 1];
+
+		// Alloc the new file
+		struct input_pcap_dir_file *cur = malloc(sizeof(struct input_pcap_dir_file));
+		if (!cur) {
+			input_pcap_dir_index_cleanup(index);
+			free(buf);
+			regfree(&preg);
+			pom_oom(sizeof(struct input_pcap_dir_file));
+			closedir(dir);
+			return POM_ERR;
+		}
+		memset(cur, 0, sizeof(struct input_pcap_dir_file));
+
+		cur->full_path = malloc(strlen(path) + strlen(buf->d_name) + 2);
+		if (!cur->full_path) {
+			free(cur);
+			pom_oom(strlen(path) + strlen(buf->d_name) + 2);
+			input_pcap_dir_index_cleanup(index);
+			free(buf);
+			regfree(&preg);
+			closedir(dir);
+			return POM_ERR;
+		}
+		strcpy(cur->full_path, path);
+		if (*cur->full_path && cur->full_path[strlen(cur->full_path) - 1] != '/')
+			strcat(cur->full_path, "/");
+		cur->filename = cur->full_path + strlen(cur->full_path);
+		strcat(cur->full_path, buf->d_name);
+
+		struct stat st;
+		if (stat(cur->full_path, &st)) {
+			cur->next = priv->tpriv.dir.files;
+			priv->tpriv.dir.files = cur; // Add at the begning in order not to process it again
+			pomlog(POMLOG_WARN "Unable to stat file %s : %s", cur->full_path, pom_strerror(errno));
+			continue;
+		}
+		cur->size = st.st_size;
+		cur->mtime = st.st_mtime;
+
+		// Check if we already know the time of the first packet
+		struct input_pcap_dir_index_entry *entry = NULL;
+		HASH_FIND_STR(index, cur->filename, entry);
+		if (entry && entry->size == cur->size && entry->mtime == cur->mtime) {
+			cur->first_pkt = entry->first_pkt;
+		} else {
+
+			// Get the time of the first packet
+			struct input_pcap_decomp *decomp = NULL;
+			pcap_t *p = input_pcap_open_offline(priv, cur->full_path, &decomp, errbuf);
+			if (!p) {
+				cur->next = priv->tpriv.dir.files;
+				priv->tpriv.dir.files = cur; // Add at the begning in order not to process it again
+				pomlog(POMLOG_WARN "Unable to open file %s : %s", cur->full_path, errbuf);
+				continue;
+			}
+
+			const u_char *next_pkt;
+			struct pcap_pkthdr *phdr;
+
+			int result = pcap_next_ex(p, &phdr, &next_pkt);
+
+			if (result <= 0) {
+				cur->next = priv->tpriv.dir.files;
+				priv->tpriv.dir.files = cur; // Add at the begning in order not to process it again
+				pomlog(POMLOG_WARN "Could not read first packet from file %s", cur->full_path);
+				input_pcap_close_offline(p, decomp);
+				continue;
+			}
+
+			cur->first_pkt = pom_timeval_to_ptime(phdr->ts);
+			input_pcap_close_offline(p, decomp);
+			index_dirty = 1;
+		}
+
+		// Add the packet at the right position
+		tmp = priv->tpriv.dir.files;
+
+		if (!tmp || (tmp && (cur->first_pkt < tmp->first_pkt))) {
+			// Add at the begining
+			cur->next = priv->tpriv.dir.files;
+			priv->tpriv.dir.files = cur;
+
+		} else {
+			while (tmp->next) {
+				if (cur->first_pkt < tmp->next->first_pkt) {
+					// Add in the middle
+					cur->next = tmp->next;
+					tmp->next = cur;
+					break;
+				}
+				tmp = tmp->next;
+			}
+
+			if (!tmp->next) {
+				// Add at the end
+				tmp->next = cur;
+			}
+		}
+
+
+		pomlog(POMLOG_DEBUG "Added file %s to the list", cur->full_path);
+		tot_files++;
+
+	}
+
+	input_pcap_dir_index_cleanup(index);
+	regfree(&preg);
+	free(buf);
+
+	closedir(dir);
+
+	if (use_index && index_dirty && !priv->tpriv.dir.interrupt_scan)
+		input_pcap_dir_index_save(priv, path);
+
+	if (priv->tpriv.dir.interrupt_scan)
+		return 0;
+
+	return tot_files;
+
+}
+
+static int input_pcap_dir_open_next(struct input_pcap_priv *p) {
+
+	struct input_pcap_dir_priv *dp = &p->tpriv.dir;
+
+	int rescanned = 0;
+	do {
+		if (!dp->cur_file->next) { // No more file
+			if (!rescanned) {
+				// Rescan the directory for possible new files
+				pomlog(POMLOG_INFO "Rescanning directory %s for pcap files ...", PTYPE_STRING_GETVAL(dp->p_dir));
+				int new_found = input_pcap_dir_browse(p);
+				if (dp->interrupt_scan) {
+					dp->cur_file = NULL;
+					return POM_OK;
+				}
+				if (new_found == POM_ERR)
+					return POM_ERR;
+				pomlog(POMLOG_INFO "Found %u new files", new_found);
+				rescanned = 1;
+				continue;
+			} else {
+				dp->cur_file = NULL;
+				return POM_OK;
+			}
+		}
+
+		dp->cur_file = dp->cur_file->next;
+
+
+		if (input_pcap_offline_open(p, dp->cur_file->full_path) != POM_OK) {
+			pomlog(POMLOG_ERR "Error while opening next file %s in the directory. Skipping", dp->cur_file->filename);
+			continue;
+		}
+
+		if (input_pcap_offline_set_filter(p) != POM_OK) {
+			pomlog(POMLOG_ERR "Error while setting filter on file %s", dp->cur_file->filename);
+			input_pcap_offline_close(p);
+			continue;
+		}
+
+		// Make sure this file has the same datalink as the previous one
+		if (input_pcap_offline_datalink(p) == p->datalink_type)
+			break;
+
+		input_pcap_offline_close(p);
+		pomlog(POMLOG_WARN "Skipping file %s as it doesn't have the same datalink type as the previous ones", dp->cur_file->filename);
+
+	} while (1);
+
+	pomlog("Reading file %s", dp->cur_file->filename);
+
+	return POM_OK;
+}
+
+static struct input_pcap_dir_index_entry *input_pcap_dir_index_load(char *path) {
+
+	size_t len = strlen(path) + strlen(INPUT_PCAP_DIR_INDEX_FILE) + 2;
+	char *filename = malloc(len);
+	if (!filename) {
+		pom_oom(len);
+		return NULL;
+	}
+	snprintf(filename, len, "%s/%s", path, INPUT_PCAP_DIR_INDEX_FILE);
+
+	FILE *f = fopen(filename, "r");
+	free(filename);
+	if (!f)
+		return NULL;
+
+	char *line = NULL;
+	size_t line_len = 0;
+	ssize_t res = getline(&line, &line_len, f);
+	if (res <= 0 || strncmp(line, INPUT_PCAP_DIR_INDEX_HEADER, strlen(INPUT_PCAP_DIR_INDEX_HEADER))) {
+		pomlog(POMLOG_DEBUG "Ignoring the index of directory %s as its format is unknown", path);
+		free(line);
+		fclose(f);
+		return NULL;
+	}
+
+	struct input_pcap_dir_index_entry *index = NULL;
+
+	while ((res = getline(&line, &line_len, f)) > 0) {
+
+		if (line[res - 1] == '\n')
+			line[res - 1] = 0;
+
+		// Each line contains the first packet time, the size, the modification time and the filename
+		uint64_t first_pkt;
+		long long size, mtime;
+		int name_pos = 0;
+		if (sscanf(line, "%"SCNu64" %lld %lld %n", &first_pkt, &size, &mtime, &name_pos) != 3 || !name_pos || !line[name_pos])
+			continue;
+
+		struct input_pcap_dir_index_entry *entry = NULL;
+		HASH_FIND_STR(index, line + name_pos, entry);
+		if (entry)
+			continue;
+
+		entry = malloc(sizeof(struct input_pcap_dir_index_entry));
+		if (!entry) {
+			pom_oom(sizeof(struct input_pcap_dir_index_entry));
+			break;
+		}
+		memset(entry, 0, sizeof(struct input_pcap_dir_index_entry));
+
+		entry->filename = strdup(line + name_pos);
+		if (!entry->filename) {
+			free(entry);
+			pom_oom(strlen(line + name_pos) + 1);
+			break;
+		}
+		entry->first_pkt = first_pkt;
+		entry->size = size;
+		entry->mtime = mtime;
+
+		HASH_ADD_KEYPTR(hh, index, entry->filename, strlen(entry->filename), entry);
+	}
+
+	free(line);
+	fclose(f);
+
+	return index;
+}
+
+static int input_pcap_dir_index_save(struct input_pcap_priv *priv, char *path) {
+
+	size_t len = strlen(path) + strlen(INPUT_PCAP_DIR_INDEX_FILE) + strlen(".tmp") + 2;
+	char *filename = malloc(len);
+	char *tmp_filename = malloc(len);
+	if (!filename || !tmp_filename) {
+		pom_oom(len);
+		goto err;
+	}
+	snprintf(filename, len, "%s/%s", path, INPUT_PCAP_DIR_INDEX_FILE);
+	snprintf(tmp_filename, len, "%s.tmp", filename);
+
+	FILE *f = fopen(tmp_filename, "w");
+	if (!f) {
+		pomlog(POMLOG_DEBUG "Unable to write the index of directory %s : %s", path, pom_strerror(errno));
+		goto err;
+	}
+
+	fprintf(f, "%s\n", INPUT_PCAP_DIR_INDEX_HEADER);
+
+	struct input_pcap_dir_file *tmp;
+	for (tmp = priv->tpriv.dir.files; tmp; tmp = tmp->next) {
+		if (!tmp->first_pkt || strchr(tmp->filename, '\n'))
+			continue;
+		fprintf(f, "%"PRIu64" %lld %lld %s\n", tmp->first_pkt, (long long) tmp->size, (long long) tmp->mtime, tmp->filename);
+	}
+
+	// Replace the old index in one go
+	if (fclose(f) || rename(tmp_filename, filename)) {
+		pomlog(POMLOG_DEBUG "Unable to write the index of directory %s : %s", path, pom_strerror(errno));
+		unlink(tmp_filename);
+		goto err;
+	}
+
+	free(tmp_filename);
+	free(filename);
+
+	return POM_OK;
+
+err:
+	free(tmp_filename);
+	free(filename);
+	return POM_ERR;
+}
+
+static void input_pcap_dir_index_cleanup(struct input_pcap_dir_index_entry *index) {
+
+	struct input_pcap_dir_index_entry *entry, *tmp;
+	HASH_ITER(hh, index, entry, tmp) {
+		HASH_DEL(index, entry);
+		free(entry->filename);
+		free(entry);
+	}
+}
+
+static struct input_pcap_dir_file *input_pcap_dir_next_file(struct input_pcap_dir_priv *dp) {
+
+	// Must be called with the readers_lock held
+
+	struct input_pcap_dir_file *f = dp->cur_file;
+	if (!f)
+		return NULL;
+
+	// Skip files which were not read
+	dp->cur_file = f->next;
+	while (dp->cur_file && !dp->cur_file->first_pkt)
+		dp->cur_file = dp->cur_file->next;
+
+	return f;
+}
+
+static int input_pcap_dir_readers_start(struct input *i) {
+
+	struct input_pcap_priv *p = i->priv;
+	struct input_pcap_dir_priv *dp = &p->tpriv.dir;
+
+	unsigned int count = *PTYPE_UINT32_GETVAL(dp->p_parallel);
+	char *mode = PTYPE_STRING_GETVAL(dp->p_mode);
+
+	struct input_pcap_dir_reader *readers = malloc(sizeof(struct input_pcap_dir_reader) * count);
+	if (!readers) {
+		pom_oom(sizeof(struct input_pcap_dir_reader) * count);
+		return POM_ERR;
+	}
+	memset(readers, 0, sizeof(struct input_pcap_dir_reader) * count);
+
+	unsigned int j;
+	for (j = 0; j < count; j++) {
+		struct input_pcap_dir_reader *r = &readers[j];
+		r->input = i;
+		r->id = j;
+		if (pthread_mutex_init(&r->lock, NULL) || pthread_cond_init(&r->cond, NULL)) {
+			pomlog(POMLOG_ERR "Error while initializing the reader lock : %s", pom_strerror(errno));
+			abort();
+		}
+	}
+
+	if (pthread_mutex_init(&dp->readers_lock, NULL) || pthread_cond_init(&dp->readers_cond, NULL)) {
+		pomlog(POMLOG_ERR "Error while initializing the readers lock : %s", pom_strerror(errno));
+		abort();
+	}
+
+	// input_pcap_dir_open() opened the first file to find out the datalink, the readers will reopen it
+	input_pcap_offline_close(p);
+
+	dp->shards = !strcmp(mode, INPUT_PCAP_DIR_MODE_SHARDS);
+	dp->reader_count = count;
+	dp->readers_done = 0;
+	dp->readers_run = 1;
+	dp->readers = readers;
+
+	pomlog(POMLOG_INFO "Reading up to %u files in parallel in %s mode", count, mode);
+
+	if (!dp->shards)
+		return POM_OK;
+
+	// Each shard thread reads the next available file until there are none left
+	pom_mutex_lock(&dp->readers_lock);
+	for (j = 0; j < count && dp->readers_run; j++) {
+		struct input_pcap_dir_reader *r = &readers[j];
+		if (pthread_create(&r->thread, NULL, input_pcap_dir_shard_thread, r)) {
+			pomlog(POMLOG_ERR "Unable to start a reader thread for input %s : %s", i->name, pom_strerror(errno));
+			pom_mutex_unlock(&dp->readers_lock);
+			return POM_ERR;
+		}
+		r->thread_running = 1;
+	}
+	pom_mutex_unlock(&dp->readers_lock);
+
+	return POM_OK;
+}
+
+static int input_pcap_dir_readers_fill(struct input *i) {
+
+	struct input_pcap_priv *p = i->priv;
+	struct input_pcap_dir_priv *dp = &p->tpriv.dir;
+
+	// Start a reader thread on the next files for each free slot
+
+	pom_mutex_lock(&dp->readers_lock);
+
+	unsigned int j;
+	for (j = 0; j < dp->reader_count && dp->readers_run; j++) {
+		struct input_pcap_dir_reader *r = &dp->readers[j];
+		if (r->file)
+			continue;
+
+		struct input_pcap_dir_file *f = NULL;
+		while (!r->file && (f = input_pcap_dir_next_file(dp)))
+			input_pcap_dir_reader_open(p, r, f);
+
+		if (!r->file) // No more file
+			break;
+
+		r->queue_head = 0;
+		r->queue_count = 0;
+		r->done = 0;
+
+		if (pthread_create(&r->thread, NULL, input_pcap_dir_reader_thread, r)) {
+			pomlog(POMLOG_ERR "Unable to start a reader thread for input %s : %s", i->name, pom_strerror(errno));
+			input_pcap_dir_reader_close(r);
+			pom_mutex_unlock(&dp->readers_lock);
+			return POM_ERR;
+		}
+		r->thread_running = 1;
+
+		pomlog("Reading file %s", f->filename);
+	}
+
+	pom_mutex_unlock(&dp->readers_lock);
+
+	return POM_OK;
+}
+
+static void input_pcap_dir_readers_stop(struct input_pcap_priv *p) {
+
+	struct input_pcap_dir_priv *dp = &p->tpriv.dir;
+
+	if (!dp->readers)
+		return;
+
+	// No reader will be started after this
+	pom_mutex_lock(&dp->readers_lock);
+	dp->readers_run = 0;
+	pthread_cond_broadcast(&dp->readers_cond);
+	pom_mutex_unlock(&dp->readers_lock);
+
+	unsigned int j;
+	for (j = 0; j < dp->reader_count; j++) {
+		struct input_pcap_dir_reader *r = &dp->readers[j];
+		pom_mutex_lock(&r->lock);
+		pthread_cond_broadcast(&r->cond);
+		pom_mutex_unlock(&r->lock);
+
+		if (__sync_fetch_and_and(&r->thread_running, 0) && pthread_join(r->thread, NULL))
+			pomlog(POMLOG_WARN "Error while joining a reader thread : %s", pom_strerror(errno));
 	}
+}
 
+static void input_pcap_dir_readers_cleanup(struct input_pcap_priv *p) {
 
-	// Browse the given directory
-	struct dirent *buf, *de = NULL;
-	size_t len = offsetof(struct dirent, d_name) + pathconf(path, _PC_NAME_MAX) + 1;
-	buf = malloc(len);
+	struct input_pcap_dir_priv *dp = &p->tpriv.dir;
 
-	int tot_files = 0;
+	if (!dp->readers)
+		return;
 
-	while (!priv->tpriv.dir.interrupt_scan) {
+	unsigned int j;
+	for (j = 0; j < dp->reader_count; j++) {
+		struct input_pcap_dir_reader *r = &dp->readers[j];
 
-		int res = readdir_r(dir, buf, &de);
-		if (res) {
-			pomlog(POMLOG_ERR "Error while reading directory entry : %s", pom_strerror(errno));
-			regfree(&preg);
-			free(buf);
-			closedir(dir);
-			return POM_ERR;
+		// Drop the packets which were not merged
+		for (; r->queue_count; r->queue_count--) {
+			packet_release(r->queue[r->queue_head]);
+			r->queue_head = (r->queue_head + 1) % INPUT_PCAP_DIR_READER_QUEUE;
 		}
 
-		if (!de)
-			break;
+		input_pcap_dir_reader_close(r);
+		pthread_mutex_destroy(&r->lock);
+		pthread_cond_destroy(&r->cond);
+	}
 
-		// Match our file against regex
-		if (regexec(&preg, buf->d_name, 1, NULL, 0)) {
-			pomlog(POMLOG_DEBUG "Discarding file %s, regular expression not matched", buf->d_name);
-			continue;
-		}
+	pthread_mutex_destroy(&dp->readers_lock);
+	pthread_cond_destroy(&dp->readers_cond);
 
-		// Check if we already know about that file
-		struct input_pcap_dir_file *tmp = priv->tpriv.dir.files;
-		int found = 0;
-		while (tmp) {
-			if (!strcmp(tmp->filename, buf->d_name)) {
-				found = 1;
-				break;
-			}
-			tmp = tmp->next;
-		}
-		if (found)
-			continue;
+	free(dp->readers);
+	dp->readers = NULL;
+	dp->reader_count = 0;
+}
 
+static int input_pcap_dir_reader_open(struct input_pcap_priv *priv, struct input_pcap_dir_reader *r, struct input_pcap_dir_file *f) {
 
-		// We don't know about this file, parse it
-		char errbuf[PCAP_ERRBUF_SIZE + 1];
+	char *filter = PTYPE_STRING_GETVAL(priv->p_filter);
+	int datalink_type;
 
-		// Alloc the new file
-		struct input_pcap_dir_file *cur = malloc(sizeof(struct input_pcap_dir_file));
-		if (!cur) {
-			free(buf);
-			regfree(&preg);
-			pom_oom(sizeof(struct input_pcap_dir_file));
-			closedir(dir);
-			return POM_ERR;
-		}
-		memset(cur, 0, sizeof(struct input_pcap_dir_file));
+	if (*PTYPE_BOOL_GETVAL(priv->p_zero_copy) && input_pcap_decomp_detect(f->full_path) == input_pcap_decomp_none)
+		r->mf = input_pcap_mmap_open(f->full_path);
 
-		cur->full_path = malloc(strlen(path) + strlen(buf->d_name) + 2);
-		if (!cur->full_path) {
-			free(cur);
-			pom_oom(strlen(path) + strlen(buf->d_name) + 2);
-			free(buf);
-			regfree(&preg);
-			closedir(dir);
+	if (r->mf) {
+		datalink_type = r->mf->datalink;
+		if (input_pcap_mmap_set_filter(r->mf, filter) != POM_OK)
+			goto err;
+	} else {
+		char errbuf[PCAP_ERRBUF_SIZE + 1] = { 0 };
+		r->p = input_pcap_open_offline(priv, f->full_path, &r->decomp, errbuf);
+		if (!r->p) {
+			pomlog(POMLOG_ERR "Error opening file %s for reading : %s", f->full_path, errbuf);
 			return POM_ERR;
 		}
-		strcpy(cur->full_path, path);
-		if (*cur->full_path && cur->full_path[strlen(cur->full_path) - 1] != '/')
-			strcat(cur->full_path, "/");
-		cur->filename = cur->full_path + strlen(cur->full_path);
-		strcat(cur->full_path, buf->d_name);
+		datalink_type = pcap_datalink(r->p);
+		if (input_pcap_set_filter(r->p, filter) != POM_OK)
+			goto err;
+	}
 
-		// Get the time of the first packet
-		pcap_t *p = pcap_open_offline(cur->full_path, errbuf);
-		if (!p) {
-			cur->next = priv->tpriv.dir.files;
-			priv->tpriv.dir.files = cur; // Add at the begning in order not to process it again
-			pomlog(POMLOG_WARN "Unable to open file %s : %s", cur->full_path, errbuf);
-			continue;
-		}
-	
-		if (input_pcap_set_filter(priv->p, PTYPE_STRING_GETVAL(priv->p_filter)) != POM_OK) {
-			cur->next = priv->tpriv.dir.files;
-			priv->tpriv.dir.files = cur; // Add at the begning in order not to process it again
-			pomlog(POMLOG_WARN "Could not set filter on file %s", cur->full_path);
-			continue;
-		}
+	if (datalink_type != priv->datalink_type) {
+		pomlog(POMLOG_WARN "Skipping file %s as it doesn't have the same datalink type as the previous ones", f->filename);
+		goto err;
+	}
 
-		const u_char *next_pkt;
-		struct pcap_pkthdr *phdr;
+	r->file = f;
 
-		int result = pcap_next_ex(p, &phdr, &next_pkt);
+	return POM_OK;
 
-		if (result <= 0) {
-			cur->next = priv->tpriv.dir.files;
-			priv->tpriv.dir.files = cur; // Add at the begning in order not to process it again
-			pomlog(POMLOG_WARN "Could not read first packet from file %s", cur->full_path);
-			free(cur->full_path);
-			pcap_close(p);
-			continue;
-		}
+err:
+	input_pcap_dir_reader_close(r);
+	return POM_ERR;
+}
 
-		cur->first_pkt = pom_timeval_to_ptime(phdr->ts);
-		pcap_close(p);
+static int input_pcap_dir_reader_next(struct input_pcap_dir_reader *r, struct packet **pkt) {
 
-		// Add the packet at the right position
-		tmp = priv->tpriv.dir.files;
+	struct pcap_pkthdr *phdr, mhdr;
+	const u_char *data;
+	int res;
 
-		if (!tmp || (tmp && (cur->first_pkt < tmp->first_pkt))) {
-			// Add at the begining
-			cur->next = priv->tpriv.dir.files;
-			priv->tpriv.dir.files = cur;
+	if (r->mf) {
+		phdr = &mhdr;
+		res = input_pcap_mmap_next(r->mf, phdr, &data);
+	} else {
+		res = pcap_next_ex(r->p, &phdr, &data);
+	}
 
-		} else {
-			while (tmp->next) {
-				if (cur->first_pkt < tmp->next->first_pkt) {
-					// Add in the middle
-					cur->next = tmp->next;
-					tmp->next = cur;
-					break;
-				}
-				tmp = tmp->next;
-			}
+	if (res == -1)
+		pomlog(POMLOG_WARN "Error while reading packet from file %s : %s. Moving on the next file ...", r->file->filename, (r->mf ? input_pcap_mmap_geterr(r->mf) : pcap_geterr(r->p)));
 
-			if (!tmp->next) {
-				// Add at the end
-				tmp->next = cur;
-			}
+	if (res <= 0)
+		return res;
+
+	*pkt = input_pcap_packet_alloc(r->input, r->mf, phdr, data);
+	if (!*pkt)
+		return -1;
+
+	return 1;
+}
+
+static void input_pcap_dir_reader_close(struct input_pcap_dir_reader *r) {
+
+	if (r->mf) {
+		input_pcap_mmap_release(r->mf);
+		r->mf = NULL;
+	}
+
+	if (r->p) {
+		input_pcap_close_offline(r->p, r->decomp);
+		r->p = NULL;
+		r->decomp = NULL;
+	}
+
+	r->file = NULL;
+}
+
+static void *input_pcap_dir_reader_thread(void *priv) {
+
+	struct input_pcap_dir_reader *r = priv;
+	struct input_pcap_priv *p = r->input->priv;
+	struct input_pcap_dir_priv *dp = &p->tpriv.dir;
+
+	// Decode the packets of the file ahead of the merge
+
+	while (1) {
+		struct packet *pkt = NULL;
+		int res = input_pcap_dir_reader_next(r, &pkt);
+
+		pom_mutex_lock(&r->lock);
+
+		while (res > 0 && r->queue_count >= INPUT_PCAP_DIR_READER_QUEUE && dp->readers_run)
+			pthread_cond_wait(&r->cond, &r->lock);
+
+		if (res <= 0 || !dp->readers_run) {
+			if (pkt)
+				packet_release(pkt);
+			r->done = 1;
+			pthread_cond_broadcast(&r->cond);
+			pom_mutex_unlock(&r->lock);
+			break;
 		}
 
+		r->queue[(r->queue_head + r->queue_count) % INPUT_PCAP_DIR_READER_QUEUE] = pkt;
+		r->queue_count++;
 
-		pomlog(POMLOG_DEBUG "Added file %s to the list", cur->full_path);
-		tot_files++;
+		// The input thread only waits when the queue is empty
+		if (r->queue_count == 1)
+			pthread_cond_broadcast(&r->cond);
 
+		pom_mutex_unlock(&r->lock);
 	}
 
-	regfree(&preg);
-	free(buf);
+	return NULL;
+}
 
-	closedir(dir);
+static void *input_pcap_dir_shard_thread(void *priv) {
 
-	if (priv->tpriv.dir.interrupt_scan)
-		return 0;
+	struct input_pcap_dir_reader *r = priv;
+	struct input_pcap_priv *p = r->input->priv;
+	struct input_pcap_dir_priv *dp = &p->tpriv.dir;
 
-	return tot_files;
+	// Read whole files and queue their packets to our own set of processing threads
+
+	while (dp->readers_run) {
 
+		pom_mutex_lock(&dp->readers_lock);
+		struct input_pcap_dir_file *f = input_pcap_dir_next_file(dp);
+		pom_mutex_unlock(&dp->readers_lock);
+
+		if (!f) // No more file
+			break;
+
+		if (input_pcap_dir_reader_open(p, r, f) != POM_OK)
+			continue;
+
+		pomlog("Reading file %s in shard %u", f->filename, r->id);
+
+		struct packet *pkt = NULL;
+		while (dp->readers_run && input_pcap_dir_reader_next(r, &pkt) > 0) {
+			if (core_queue_packet_group(pkt, 0, r->id, dp->reader_count) != POM_OK)
+				break;
+		}
+
+		input_pcap_dir_reader_close(r);
+	}
+
+	pom_mutex_lock(&dp->readers_lock);
+	dp->readers_done++;
+	pthread_cond_broadcast(&dp->readers_cond);
+	pom_mutex_unlock(&dp->readers_lock);
+
+	return NULL;
 }
 
-static int input_pcap_dir_open_next(struct input_pcap_priv *p) {
+static int input_pcap_dir_read_parallel(struct input *i) {
 
+	struct input_pcap_priv *p = i->priv;
 	struct input_pcap_dir_priv *dp = &p->tpriv.dir;
 
-	int rescanned = 0;
-	do {
-		if (!dp->cur_file->next) { // No more file
-			if (!rescanned) {
-				// Rescan the directory for possible new files
-				pomlog(POMLOG_INFO "Rescanning directory %s for pcap files ...", PTYPE_STRING_GETVAL(dp->p_dir));
-				int new_found = input_pcap_dir_browse(p);
-				if (dp->interrupt_scan) {
-					dp->cur_file = NULL;
-					return POM_OK;
-				}
-				if (new_found == POM_ERR)
-					return POM_ERR;
-				pomlog(POMLOG_INFO "Found %u new files", new_found);
-				rescanned = 1;
+	if (!dp->readers && input_pcap_dir_readers_start(i) != POM_OK)
+		return POM_ERR;
+
+	if (dp->shards)
+		return input_pcap_dir_read_shards(i);
+
+	return input_pcap_dir_read_merge(i);
+}
+
+static int input_pcap_dir_read_merge(struct input *i) {
+
+	struct input_pcap_priv *p = i->priv;
+	struct input_pcap_dir_priv *dp = &p->tpriv.dir;
+
+	unsigned int n;
+	for (n = 0; n < INPUT_PCAP_DIR_MERGE_BATCH; n++) {
+
+		if (input_pcap_dir_readers_fill(i) != POM_OK)
+			return POM_ERR;
+
+		// Find the reader with the oldest packet
+		struct input_pcap_dir_reader *min = NULL;
+		unsigned int j, active = 0, retired = 0;
+		for (j = 0; j < dp->reader_count; j++) {
+			struct input_pcap_dir_reader *r = &dp->readers[j];
+			if (!r->file)
 				continue;
-			} else {
-				dp->cur_file = NULL;
+
+			pom_mutex_lock(&r->lock);
+			while (!r->queue_count && !r->done && dp->readers_run)
+				pthread_cond_wait(&r->cond, &r->lock);
+			unsigned int queue_count = r->queue_count;
+			pom_mutex_unlock(&r->lock);
+
+			if (!dp->readers_run)
 				return POM_OK;
+
+			if (!queue_count) {
+				// This file is over, the next one will take its slot
+				if (__sync_fetch_and_and(&r->thread_running, 0) && pthread_join(r->thread, NULL))
+					pomlog(POMLOG_WARN "Error while joining a reader thread : %s", pom_strerror(errno));
+				pom_mutex_lock(&dp->readers_lock);
+				input_pcap_dir_reader_close(r);
+				pom_mutex_unlock(&dp->readers_lock);
+				retired++;
+				continue;
 			}
+
+			active++;
+			if (!min || r->queue[r->queue_head]->ts < min->queue[min->queue_head]->ts)
+				min = r;
 		}
 
-		dp->cur_file = dp->cur_file->next;
+		// A new file may start before the current packets
+		if (retired)
+			continue;
 
+		if (!active) // No more file
+			return input_stop(i);
 
-		char errbuf[PCAP_ERRBUF_SIZE + 1] = { 0 };
-		p->p = pcap_open_offline(dp->cur_file->full_path, errbuf);
-		if (!p->p || input_pcap_set_filter(p->p, PTYPE_STRING_GETVAL(p->p_filter)) != POM_OK) {
-			pomlog(POMLOG_ERR "Error while opening next file %s in the directory : %s. Skipping", dp->cur_file->filename, errbuf);
-			continue;
-		}
+		pom_mutex_lock(&min->lock);
+		struct packet *pkt = min->queue[min->queue_head];
+		min->queue_head = (min->queue_head + 1) % INPUT_PCAP_DIR_READER_QUEUE;
+		min->queue_count--;
+		// The reader only waits when the queue is full
+		if (min->queue_count == INPUT_PCAP_DIR_READER_QUEUE - 1)
+			pthread_cond_broadcast(&min->cond);
+		pom_mutex_unlock(&min->lock);
 
-		if (input_pcap_set_filter(p->p, PTYPE_STRING_GETVAL(p->p_filter)) != POM_OK) {
-			pomlog(POMLOG_ERR "Error while setting filter on file %s", dp->cur_file->filename);
-			continue;
-		}
+		if (core_queue_packet(pkt, 0, 0) != POM_OK)
+			return POM_ERR;
+	}
 
-		// Make sure this file has the same datalink as the previous one
-		if (pcap_datalink(p->p) == p->datalink_type)
-			break;
+	return POM_OK;
+}
 
-		pcap_close(p->p);
-		p->p = NULL;
-		pomlog(POMLOG_WARN "Skipping file %s as it doesn't have the same datalink type as the previous ones", dp->cur_file->filename);
+static int input_pcap_dir_read_shards(struct input *i) {
 
-	} while (1);
+	struct input_pcap_priv *p = i->priv;
+	struct input_pcap_dir_priv *dp = &p->tpriv.dir;
 
-	pomlog("Reading file %s", dp->cur_file->filename);
+	// The shard threads do all the work, wait for them to be done
+	pom_mutex_lock(&dp->readers_lock);
+	while (dp->readers_done < dp->reader_count && dp->readers_run)
+		pthread_cond_wait(&dp->readers_cond, &dp->readers_lock);
+	int done = (dp->readers_done >= dp->reader_count);
+	pom_mutex_unlock(&dp->readers_lock);
+
+	if (done)
+		return input_stop(i);
 
 	return POM_OK;
 }
@@ -745,10 +2300,63 @@ static int input_pcap_dir_open_next(struct input_pcap_priv *p) {
  * common input pcap functions
  */
 
+static struct packet *input_pcap_packet_alloc(struct input *i, struct input_pcap_mmap_file *mf, struct pcap_pkthdr *phdr, const u_char *data) {
+
+	struct input_pcap_priv *p = i->priv;
+
+	struct packet *pkt = packet_alloc();
+	if (!pkt)
+		return NULL;
+
+	if (mf) {
+		// The packet points directly into the mapping
+		input_pcap_mmap_ref(mf);
+		pkt->buff = (void *) data + p->skip_offset;
+		pkt->len = phdr->caplen - p->skip_offset;
+		pkt->buff_release = input_pcap_mmap_release;
+		pkt->buff_release_priv = mf;
+	} else {
+		if (packet_buffer_alloc(pkt, phdr->caplen - p->skip_offset, p->align_offset) != POM_OK) {
+			packet_release(pkt);
+			return NULL;
+		}
+		memcpy(pkt->buff, data + p->skip_offset, phdr->caplen - p->skip_offset);
+	}
+
+	pkt->input = i;
+	pkt->datalink = p->datalink_proto;
+	pkt->ts = pom_timeval_to_ptime(phdr->ts);
+
+	return pkt;
+}
+
+static int input_pcap_offline_next(struct input_pcap_priv *p, struct pcap_pkthdr **phdr, struct pcap_pkthdr *mhdr, const u_char **data) {
+
+	if (p->mf) {
+		*phdr = mhdr;
+		return input_pcap_mmap_next(p->mf, mhdr, data);
+	}
+
+	return pcap_next_ex(p->p, phdr, data);
+}
+
 static int input_pcap_read(struct input *i) {
 
 	struct input_pcap_priv *p = i->priv;
 
+	if (p->type == input_pcap_type_interface && p->tpriv.iface.bpf_auto && p->tpriv.iface.bpf_auto_serial != proto_listened_serial_get() && time(NULL) >= p->tpriv.iface.bpf_auto_retry) {
+		// Listeners changed, keep capturing with the previous filter if the new one can't be set
+		if (input_pcap_interface_filter_update(p) != POM_OK) {
+			p->tpriv.iface.bpf_auto_retry = time(NULL) + INPUT_PCAP_BPF_AUTO_RETRY;
+			pomlog(POMLOG_WARN "Unable to update the filter of input %s, trying again in %u seconds", i->name, INPUT_PCAP_BPF_AUTO_RETRY);
+		}
+	}
+
+#ifdef INPUT_PCAP_HAVE_TPACKET
+	if (p->type == input_pcap_type_interface && p->tpriv.iface.rings)
+		return input_pcap_tpacket_read(i);
+#endif
+
 	if (p->type == input_pcap_type_dir && !p->tpriv.dir.files) {
 		if (input_pcap_dir_open(i) != POM_OK) {
 			// Don't error out if the scan was interrupted
@@ -758,10 +2366,13 @@ static int input_pcap_read(struct input *i) {
 		}
 	}
 
-	struct pcap_pkthdr *phdr;
+	if (p->type == input_pcap_type_dir && *PTYPE_UINT32_GETVAL(p->tpriv.dir.p_parallel) > 1)
+		return input_pcap_dir_read_parallel(i);
+
+	struct pcap_pkthdr *phdr, mhdr;
 	const u_char *data;
-	int result = pcap_next_ex(p->p, &phdr, &data);
-	if (phdr->len > phdr->caplen && !p->warning) {
+	int result = input_pcap_offline_next(p, &phdr, &mhdr, &data);
+	if (result > 0 && phdr->len > phdr->caplen && !p->warning) {
 		pomlog(POMLOG_WARN "Warning, some packets were truncated at capture time on input %s", i->name);
 		p->warning = 1;
 	}
@@ -771,10 +2382,9 @@ static int input_pcap_read(struct input *i) {
 		if (p->type == input_pcap_type_dir) {
 
 			if (result != -2)
-				pomlog(POMLOG_WARN "Error while reading packet from file : %s. Moving on the next file ...", pcap_geterr(p->p), p->tpriv.dir.cur_file->filename);
-			
-			pcap_close(p->p);
-			p->p = NULL;
+				pomlog(POMLOG_WARN "Error while reading packet from file %s : %s. Moving on the next file ...", p->tpriv.dir.cur_file->filename, input_pcap_offline_geterr(p));
+
+			input_pcap_offline_close(p);
 			p->warning = 0;
 
 			if (input_pcap_dir_open_next(p) != POM_OK)
@@ -785,7 +2395,7 @@ static int input_pcap_read(struct input *i) {
 				return input_stop(i);
 			}
 
-			result = pcap_next_ex(p->p, &phdr, &data);
+			result = input_pcap_offline_next(p, &phdr, &mhdr, &data);
 			if (result < 0) {
 				pomlog(POMLOG_ERR "Error while reading first packet of new file");
 				return POM_ERR;
@@ -794,7 +2404,7 @@ static int input_pcap_read(struct input *i) {
 			if (result == -2) // EOF
 				return input_stop(i);
 
-			pomlog(POMLOG_ERR "Error while reading file : %s", pcap_geterr(p->p));
+			pomlog(POMLOG_ERR "Error while reading file : %s", input_pcap_offline_geterr(p));
 			return POM_ERR;
 		}
 	}
@@ -802,20 +2412,10 @@ static int input_pcap_read(struct input *i) {
 	if (result == 0) // Timeout
 		return POM_OK;
 
-	struct packet *pkt = packet_alloc();
+	struct packet *pkt = input_pcap_packet_alloc(i, p->mf, phdr, data);
 	if (!pkt)
 		return POM_ERR;
 
-	if (packet_buffer_alloc(pkt, phdr->caplen - p->skip_offset, p->align_offset) != POM_OK) {
-		packet_release(pkt);
-		return POM_ERR;
-	}
-
-	pkt->input = i;
-	pkt->datalink = p->datalink_proto;
-	pkt->ts = pom_timeval_to_ptime(phdr->ts);
-	memcpy(pkt->buff, data + p->skip_offset, phdr->caplen - p->skip_offset);
-
 	unsigned int flags = 0, affinity = 0;
 
 	if (p->type == input_pcap_type_interface)
@@ -837,7 +2437,12 @@ static int input_pcap_close(struct input *i) {
 	struct input_pcap_priv *priv = i->priv;
 
 
-	if (priv->type == input_pcap_type_interface) {
+#ifdef INPUT_PCAP_HAVE_TPACKET
+	if (priv->type == input_pcap_type_interface && priv->tpriv.iface.rings)
+		input_pcap_tpacket_close(priv);
+#endif
+
+	if (priv->type == input_pcap_type_interface && priv->p) {
 		struct pcap_stat ps;
 		char *iface = PTYPE_STRING_GETVAL(priv->tpriv.iface.p_interface);
 		if (!pcap_stats(priv->p, &ps)) {
@@ -845,16 +2450,16 @@ static int input_pcap_close(struct input *i) {
 		}
 	}
 
-	if (priv->p) {
-		pcap_close(priv->p);
-		priv->p = NULL;
-	}
+	input_pcap_offline_close(priv);
 
 	priv->datalink_proto = NULL;
 	priv->align_offset = 0;
 	priv->skip_offset = 0;
 
 	if (priv->type == input_pcap_type_dir) {
+		input_pcap_dir_readers_stop(priv);
+		input_pcap_dir_readers_cleanup(priv);
+
 		struct input_pcap_dir_priv *dp = &priv->tpriv.dir;
 		while (dp->files) {
 			struct input_pcap_dir_file *tmp = dp->files;
@@ -871,13 +2476,16 @@ static int input_pcap_cleanup(struct input *i) {
 
 	struct input_pcap_priv *priv;
 	priv = i->priv;
-	if (priv->p)
-		pcap_close(priv->p);
+	input_pcap_offline_close(priv);
 	switch (priv->type) {
 		case input_pcap_type_interface:
 			ptype_cleanup(priv->tpriv.iface.p_interface);
 			ptype_cleanup(priv->tpriv.iface.p_promisc);
 			ptype_cleanup(priv->tpriv.iface.p_buff_size);
+			ptype_cleanup(priv->tpriv.iface.p_capture_mode);
+			ptype_cleanup(priv->tpriv.iface.p_block_size);
+			ptype_cleanup(priv->tpriv.iface.p_fanout);
+			ptype_cleanup(priv->tpriv.iface.p_bpf_auto);
 			break;
 		case input_pcap_type_file:
 			ptype_cleanup(priv->tpriv.file.p_file);
@@ -885,10 +2493,15 @@ static int input_pcap_cleanup(struct input *i) {
 		case input_pcap_type_dir:
 			ptype_cleanup(priv->tpriv.dir.p_dir);
 			ptype_cleanup(priv->tpriv.dir.p_match);
+			ptype_cleanup(priv->tpriv.dir.p_parallel);
+			ptype_cleanup(priv->tpriv.dir.p_mode);
+			ptype_cleanup(priv->tpriv.dir.p_use_index);
 			break;
 
 	}
 	ptype_cleanup(priv->p_filter);
+	if (priv->p_zero_copy)
+		ptype_cleanup(priv->p_zero_copy);
 	free(priv);
 
 	return POM_OK;
@@ -898,8 +2511,11 @@ static int input_pcap_cleanup(struct input *i) {
 static int input_pcap_interrupt(struct input *i) {
 
 	struct input_pcap_priv *priv = i->priv;
-	if (priv->type == input_pcap_type_dir)
+	if (priv->type == input_pcap_type_dir) {
 		priv->tpriv.dir.interrupt_scan = 1;
+		// Stop the reader threads while the processing threads can still drain the queues
+		input_pcap_dir_readers_stop(priv);
+	}
 
 	if (priv->p)
 		pcap_breakloop(priv->p);
@@ -21,10 +21,53 @@
 #ifndef __INPUT_PCAP_H__
 #define __INPUT_PCAP_H__
 
+#include "../../../config.h"
+
 #include <pcap.h>
 
+#include "input_pcap_mmap.h"
+#include "input_pcap_decomp.h"
+
+#include <pthread.h>
+#include <sys/types.h>
+#include <uthash.h>
+
+#ifdef HAVE_LINUX_IF_PACKET_H
+#include <linux/if_packet.h>
+#ifdef TPACKET3_HDRLEN
+#define INPUT_PCAP_HAVE_TPACKET
+#endif
+#endif
+
 #define INPUT_PCAP_SNAPLEN_MAX 65535
 
+#define INPUT_PCAP_CAPTURE_MODE_PCAP	"pcap"
+#define INPUT_PCAP_CAPTURE_MODE_TPACKET	"tpacket_v3"
+
+#define INPUT_PCAP_TPACKET_FRAME_SIZE	2048
+#define INPUT_PCAP_TPACKET_BLOCK_TIMEOUT	64 // Max time in ms before the kernel hands us a partially filled block
+#define INPUT_PCAP_TPACKET_POLL_TIMEOUT	200 // Timeout in ms when waiting for a block
+#define INPUT_PCAP_TPACKET_BUSY_WAIT	1000 // Time in usec to wait when the next block is still being processed or not filled yet
+#define INPUT_PCAP_TPACKET_FANOUT_MAX	64
+
+#define INPUT_PCAP_ETHER_ADDRS_LEN	12 // Destination and source addresses, followed by the 802.1Q tag
+#define INPUT_PCAP_VLAN_TAG_LEN		4
+
+// Always let through by the automatic filter : IPv4 fragments, IPv6 with extension headers and tunnels
+#define INPUT_PCAP_BPF_AUTO_ALWAYS	"(ip[6:2] & 0x1fff != 0) or (ip6 and ip6[6] != 6 and ip6[6] != 17) or ip proto 4 or ip proto 41 or ip proto 47 or ether proto 0x8864"
+#define INPUT_PCAP_BPF_AUTO_TERM_MAX	48 // Maximum length of the term matching one number
+#define INPUT_PCAP_BPF_AUTO_RETRY	5 // Seconds before trying again to set a filter that was refused
+
+#define INPUT_PCAP_DIR_INDEX_FILE	".pom-ng-pcap-index"
+#define INPUT_PCAP_DIR_INDEX_HEADER	"# pom-ng pcap index 1"
+
+#define INPUT_PCAP_DIR_MODE_MERGE	"merge"
+#define INPUT_PCAP_DIR_MODE_SHARDS	"shards"
+
+#define INPUT_PCAP_DIR_PARALLEL_MAX	32
+#define INPUT_PCAP_DIR_READER_QUEUE	256 // Packets decoded ahead by each reader thread in merge mode
+#define INPUT_PCAP_DIR_MERGE_BATCH	64 // Packets merged for each call to read()
+
 enum input_pcap_type {
 	input_pcap_type_interface,
 	input_pcap_type_file,
@@ -32,11 +75,51 @@ enum input_pcap_type {
 
 };
 
+#ifdef INPUT_PCAP_HAVE_TPACKET
+
+struct input_pcap_tpacket_ring;
+
+struct input_pcap_tpacket_block {
+	struct input_pcap_tpacket_ring *ring;
+	struct tpacket_block_desc *desc;
+	volatile unsigned int refcount; // One per packet still being processed and one for the input while it walks the block
+	volatile int in_use; // Block was handed to us by the kernel and wasn't given back yet
+};
+
+struct input_pcap_tpacket_ring {
+	int fd;
+	void *map;
+	size_t map_size;
+	unsigned int block_size, block_count;
+	unsigned int cur_block;
+	volatile unsigned int refcount; // One for the input and one per block in use
+	struct input_pcap_tpacket_block *blocks;
+	struct input *input;
+	unsigned int id; // Index of the ring in the fanout group
+	pthread_t thread; // Reader thread for all the rings but the first one
+};
+
+#endif
+
 struct input_pcap_interface_priv {
 	struct ptype *p_interface;
 	struct ptype *p_promisc;
 	struct ptype *p_buff_size;
+	struct ptype *p_capture_mode;
+	struct ptype *p_block_size;
+	struct ptype *p_fanout;
+	struct ptype *p_bpf_auto;
 	struct registry_perf *perf_dropped;
+	int bpf_auto; // Value of p_bpf_auto when the input was opened
+	uint32_t bpf_auto_serial; // Serial of the listened numbers the current filter was built from
+	time_t bpf_auto_retry; // Don't try to update the filter before this time
+#ifdef INPUT_PCAP_HAVE_TPACKET
+	struct input_pcap_tpacket_ring **rings;
+	unsigned int ring_count;
+	char *bpf_cur; // Filter attached to the rings
+	volatile int readers_run, readers_error;
+	uint64_t tpacket_dropped;
+#endif
 };
 
 struct input_pcap_file_priv {
@@ -47,20 +130,63 @@ struct input_pcap_file_priv {
 struct input_pcap_dir_file {
 	char *filename, *full_path;
 	ptime first_pkt;
+	off_t size;
+	time_t mtime;
 	struct input_pcap_dir_file *prev, *next;
 };
 
+struct input_pcap_dir_index_entry {
+	char *filename;
+	ptime first_pkt;
+	off_t size;
+	time_t mtime;
+	UT_hash_handle hh;
+};
+
+struct input_pcap_dir_reader {
+	struct input *input;
+	unsigned int id;
+	pthread_t thread;
+	int thread_running;
+
+	struct input_pcap_dir_file *file; // File being read, NULL if the slot is free
+	pcap_t *p;
+	struct input_pcap_mmap_file *mf;
+	struct input_pcap_decomp *decomp;
+
+	// Merge mode only, packets decoded and waiting to be merged
+	struct packet *queue[INPUT_PCAP_DIR_READER_QUEUE];
+	unsigned int queue_head, queue_count;
+	int done; // No more packets will be queued
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+};
+
 struct input_pcap_dir_priv {
 	struct ptype *p_dir;
 	struct ptype *p_match;
+	struct ptype *p_parallel;
+	struct ptype *p_mode;
+	struct ptype *p_use_index;
 	struct input_pcap_dir_file *files;
 	struct input_pcap_dir_file *cur_file;
 	unsigned int interrupt_scan;
+
+	// Parallel reading
+	struct input_pcap_dir_reader *readers;
+	unsigned int reader_count;
+	int shards;
+	volatile int readers_run;
+	unsigned int readers_done;
+	pthread_mutex_t readers_lock;
+	pthread_cond_t readers_cond;
 };
 
 struct input_pcap_priv {
 
 	pcap_t *p;
+	struct input_pcap_mmap_file *mf; // Used instead of p when reading files with zero_copy
+	struct input_pcap_decomp *decomp; // Feeding p when reading a compressed file
 	enum input_pcap_type type;
 	union {
 		struct input_pcap_interface_priv iface;
@@ -69,6 +195,10 @@ struct input_pcap_priv {
 	} tpriv;
 
 	struct ptype *p_filter;
+	struct ptype *p_zero_copy;
+
+	struct registry_perf *perf_compressed;
+	struct registry_perf *perf_uncompressed;
 
 	struct proto *datalink_proto;
 	int datalink_type;
@@ -81,10 +211,40 @@ static int input_pcap_mod_register(struct mod_reg *mod);
 static int input_pcap_mod_unregister();
 
 static int input_pcap_common_open(struct input *i);
+static int input_pcap_set_datalink(struct input *i, int datalink_type);
+static int input_pcap_set_filter(pcap_t *p, char *filter);
+static int input_pcap_replace_filter(pcap_t *p, char *filter);
+
+static int input_pcap_offline_init(struct input *i);
+static int input_pcap_offline_open(struct input_pcap_priv *p, char *filename);
+static int input_pcap_offline_set_filter(struct input_pcap_priv *p);
+static int input_pcap_offline_datalink(struct input_pcap_priv *p);
+static char *input_pcap_offline_geterr(struct input_pcap_priv *p);
+static int input_pcap_offline_next(struct input_pcap_priv *p, struct pcap_pkthdr **phdr, struct pcap_pkthdr *mhdr, const u_char **data);
+static void input_pcap_offline_close(struct input_pcap_priv *p);
+static pcap_t *input_pcap_open_offline(struct input_pcap_priv *priv, char *filename, struct input_pcap_decomp **decomp, char *errbuf);
+static void input_pcap_close_offline(pcap_t *p, struct input_pcap_decomp *decomp);
 
 static int input_pcap_interface_perf_dropped(uint64_t *value, void *priv);
 static int input_pcap_interface_init(struct input *i);
 static int input_pcap_interface_open(struct input *i);
+static char *input_pcap_interface_filter_build(struct input_pcap_priv *p, uint32_t *serial);
+static int input_pcap_interface_filter_update(struct input_pcap_priv *p);
+
+#ifdef INPUT_PCAP_HAVE_TPACKET
+static int input_pcap_tpacket_open(struct input *i);
+static int input_pcap_tpacket_compile_filter(int datalink_type, char *filter, struct bpf_program *fp);
+static int input_pcap_tpacket_set_filter(struct input_pcap_priv *p, char *filter);
+static void input_pcap_tpacket_restore_filter(struct input_pcap_priv *p, unsigned int count);
+static struct input_pcap_tpacket_ring *input_pcap_tpacket_ring_open(struct input *i, unsigned int id, unsigned int ifindex, unsigned int block_size, unsigned int block_count, struct bpf_program *fp, int fanout_id);
+static int input_pcap_tpacket_read(struct input *i);
+static int input_pcap_tpacket_ring_read(struct input *i, struct input_pcap_tpacket_ring *r);
+static void *input_pcap_tpacket_reader_thread(void *priv);
+static void input_pcap_tpacket_block_release(void *priv);
+static void input_pcap_tpacket_ring_release(struct input_pcap_tpacket_ring *r);
+static int input_pcap_tpacket_update_dropped(struct input_pcap_priv *p);
+static void input_pcap_tpacket_close(struct input_pcap_priv *p);
+#endif
 
 static int input_pcap_file_init(struct input *i);
 static int input_pcap_file_open(struct input *i);
@@ -93,7 +253,24 @@ static int input_pcap_dir_init(struct input *i);
 static int input_pcap_dir_open(struct input *i);
 static int input_pcap_dir_browse(struct input_pcap_priv *priv);
 static int input_pcap_dir_open_next(struct input_pcap_priv *p);
+static struct input_pcap_dir_file *input_pcap_dir_next_file(struct input_pcap_dir_priv *dp);
+static struct input_pcap_dir_index_entry *input_pcap_dir_index_load(char *path);
+static int input_pcap_dir_index_save(struct input_pcap_priv *priv, char *path);
+static void input_pcap_dir_index_cleanup(struct input_pcap_dir_index_entry *index);
+static int input_pcap_dir_readers_start(struct input *i);
+static int input_pcap_dir_readers_fill(struct input *i);
+static void input_pcap_dir_readers_stop(struct input_pcap_priv *p);
+static void input_pcap_dir_readers_cleanup(struct input_pcap_priv *p);
+static int input_pcap_dir_reader_open(struct input_pcap_priv *priv, struct input_pcap_dir_reader *r, struct input_pcap_dir_file *f);
+static int input_pcap_dir_reader_next(struct input_pcap_dir_reader *r, struct packet **pkt);
+static void input_pcap_dir_reader_close(struct input_pcap_dir_reader *r);
+static void *input_pcap_dir_reader_thread(void *priv);
+static void *input_pcap_dir_shard_thread(void *priv);
+static int input_pcap_dir_read_parallel(struct input *i);
+static int input_pcap_dir_read_merge(struct input *i);
+static int input_pcap_dir_read_shards(struct input *i);
 
+static struct packet *input_pcap_packet_alloc(struct input *i, struct input_pcap_mmap_file *mf, struct pcap_pkthdr *phdr, const u_char *data);
 static int input_pcap_read(struct input *i);
 static int input_pcap_close(struct input *i);
 static int input_pcap_cleanup(struct input *i);
@@ -0,0 +1,432 @@
+/*
+ *  This file is part of pom-ng.
+ *  Copyright (C) 2015 Guy Martin <gmsoft@tuxicoman.be>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+#include <pom-ng/base.h>
+#include "input_pcap_decomp.h"
+
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#ifdef HAVE_LZ4
+#include <lz4frame.h>
+#endif
+
+enum input_pcap_decomp_type input_pcap_decomp_detect(char *filename) {
+
+	int fd = open(filename, O_RDONLY);
+	if (fd == -1)
+		return input_pcap_decomp_none;
+
+	unsigned char magic[4] = { 0 };
+	ssize_t len = read(fd, magic, sizeof(magic));
+	close(fd);
+
+	if (len >= 2 && magic[0] == 0x1f && magic[1] == 0x8b)
+		return input_pcap_decomp_gzip;
+
+	if (len < 4)
+		return input_pcap_decomp_none;
+
+	if (magic[0] == 0x28 && magic[1] == 0xb5 && magic[2] == 0x2f && magic[3] == 0xfd)
+		return input_pcap_decomp_zstd;
+
+	if (magic[0] == 0x04 && magic[1] == 0x22 && magic[2] == 0x4d && magic[3] == 0x18)
+		return input_pcap_decomp_lz4;
+
+	return input_pcap_decomp_none;
+}
+
+char *input_pcap_decomp_type_name(enum input_pcap_decomp_type type) {
+
+	switch (type) {
+		case input_pcap_decomp_gzip:
+			return "gzip";
+		case input_pcap_decomp_zstd:
+			return "zstd";
+		case input_pcap_decomp_lz4:
+			return "lz4";
+		default:
+			break;
+	}
+
+	return "none";
+}
+
+static ssize_t input_pcap_decomp_read(struct input_pcap_decomp *d, unsigned char *buff) {
+
+	ssize_t len;
+	do {
+		len = read(d->in_fd, buff, INPUT_PCAP_DECOMP_IN_BUFF_SIZE);
+	} while (len == -1 && errno == EINTR);
+
+	if (len < 0) {
+		pomlog(POMLOG_ERR "Error while reading file %s : %s", d->filename, pom_strerror(errno));
+		return -1;
+	}
+
+	registry_perf_inc(d->perf_compressed, len);
+
+	return len;
+}
+
+static int input_pcap_decomp_write(struct input_pcap_decomp *d, unsigned char *buff, size_t len) {
+
+	registry_perf_inc(d->perf_uncompressed, len);
+
+	while (len) {
+		// The reader may go away at any time, don't get killed by SIGPIPE
+		ssize_t res = send(d->out_fd, buff, len, MSG_NOSIGNAL);
+		if (res < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno != EPIPE && errno != ECONNRESET)
+				pomlog(POMLOG_ERR "Error while passing decompressed data of file %s : %s", d->filename, pom_strerror(errno));
+			return POM_ERR;
+		}
+		buff += res;
+		len -= res;
+	}
+
+	return POM_OK;
+}
+
+#ifdef HAVE_ZLIB
+
+static int input_pcap_decomp_run_gzip(struct input_pcap_decomp *d, unsigned char *in, unsigned char *out) {
+
+	z_stream z;
+	memset(&z, 0, sizeof(z_stream));
+
+	// Automatic gzip header detection
+	if (inflateInit2(&z, 15 + 32) != Z_OK) {
+		pomlog(POMLOG_ERR "Unable to initialize zlib for file %s", d->filename);
+		return POM_ERR;
+	}
+
+	int res = POM_OK;
+
+	while (1) {
+		ssize_t len = input_pcap_decomp_read(d, in);
+		if (len < 0) {
+			res = POM_ERR;
+			break;
+		} else if (!len) {
+			break;
+		}
+
+		z.next_in = in;
+		z.avail_in = len;
+
+		do {
+			z.next_out = out;
+			z.avail_out = INPUT_PCAP_DECOMP_OUT_BUFF_SIZE;
+
+			int zres = inflate(&z, Z_NO_FLUSH);
+			if (zres != Z_OK && zres != Z_STREAM_END && zres != Z_BUF_ERROR) {
+				pomlog(POMLOG_ERR "Error while decompressing file %s : %s", d->filename, (z.msg ? z.msg : "unknown error"));
+				res = POM_ERR;
+				goto end;
+			}
+
+			size_t out_len = INPUT_PCAP_DECOMP_OUT_BUFF_SIZE - z.avail_out;
+			if (out_len && input_pcap_decomp_write(d, out, out_len) != POM_OK) {
+				res = POM_ERR;
+				goto end;
+			}
+
+			if (zres == Z_STREAM_END) {
+				// There might be more gzip members after this one
+				inflateReset(&z);
+			} else if (zres == Z_BUF_ERROR) {
+				// Need more input
+				break;
+			}
+
+		} while (z.avail_in || !z.avail_out);
+	}
+
+end:
+	inflateEnd(&z);
+
+	return res;
+}
+
+#endif
+
+#ifdef HAVE_ZSTD
+
+static int input_pcap_decomp_run_zstd(struct input_pcap_decomp *d, unsigned char *in, unsigned char *out) {
+
+	ZSTD_DStream *zds = ZSTD_createDStream();
+	if (!zds) {
+		pomlog(POMLOG_ERR "Unable to initialize zstd for file %s", d->filename);
+		return POM_ERR;
+	}
+
+	size_t zres = ZSTD_initDStream(zds);
+	if (ZSTD_isError(zres)) {
+		pomlog(POMLOG_ERR "Unable to initialize zstd for file %s : %s", d->filename, ZSTD_getErrorName(zres));
+		ZSTD_freeDStream(zds);
+		return POM_ERR;
+	}
+
+	int res = POM_OK;
+
+	while (1) {
+		ssize_t len = input_pcap_decomp_read(d, in);
+		if (len < 0) {
+			res = POM_ERR;
+			break;
+		} else if (!len) {
+			break;
+		}
+
+		ZSTD_inBuffer zin = { in, len, 0 };
+		ZSTD_outBuffer zout;
+
+		do {
+			zout.dst = out;
+			zout.size = INPUT_PCAP_DECOMP_OUT_BUFF_SIZE;
+			zout.pos = 0;
+
+			zres = ZSTD_decompressStream(zds, &zout, &zin);
+			if (ZSTD_isError(zres)) {
+				pomlog(POMLOG_ERR "Error while decompressing file %s : %s", d->filename, ZSTD_getErrorName(zres));
+				res = POM_ERR;
+				goto end;
+			}
+
+			if (zout.pos && input_pcap_decomp_write(d, out, zout.pos) != POM_OK) {
+				res = POM_ERR;
+				goto end;
+			}
+
+		} while (zin.pos < zin.size || zout.pos == zout.size);
+	}
+
+end:
+	ZSTD_freeDStream(zds);
+
+	return res;
+}
+
+#endif
+
+#ifdef HAVE_LZ4
+
+static int input_pcap_decomp_run_lz4(struct input_pcap_decomp *d, unsigned char *in, unsigned char *out) {
+
+	LZ4F_decompressionContext_t ctx;
+	LZ4F_errorCode_t err = LZ4F_createDecompressionContext(&ctx, LZ4F_VERSION);
+	if (LZ4F_isError(err)) {
+		pomlog(POMLOG_ERR "Unable to initialize lz4 for file %s : %s", d->filename, LZ4F_getErrorName(err));
+		return POM_ERR;
+	}
+
+	int res = POM_OK;
+
+	while (1) {
+		ssize_t len = input_pcap_decomp_read(d, in);
+		if (len < 0) {
+			res = POM_ERR;
+			break;
+		} else if (!len) {
+			break;
+		}
+
+		size_t pos = 0, out_len;
+
+		do {
+			size_t in_len = len - pos;
+			out_len = INPUT_PCAP_DECOMP_OUT_BUFF_SIZE;
+
+			size_t lres = LZ4F_decompress(ctx, out, &out_len, in + pos, &in_len, NULL);
+			if (LZ4F_isError(lres)) {
+				pomlog(POMLOG_ERR "Error while decompressing file %s : %s", d->filename, LZ4F_getErrorName(lres));
+				res = POM_ERR;
+				goto end;
+			}
+			pos += in_len;
+
+			if (out_len && input_pcap_decomp_write(d, out, out_len) != POM_OK) {
+				res = POM_ERR;
+				goto end;
+			}
+
+		} while (pos < len || out_len == INPUT_PCAP_DECOMP_OUT_BUFF_SIZE);
+	}
+
+end:
+	LZ4F_freeDecompressionContext(ctx);
+
+	return res;
+}
+
+#endif
+
+static void *input_pcap_decomp_thread(void *priv) {
+
+	struct input_pcap_decomp *d = priv;
+
+	unsigned char *in = malloc(INPUT_PCAP_DECOMP_IN_BUFF_SIZE);
+	unsigned char *out = malloc(INPUT_PCAP_DECOMP_OUT_BUFF_SIZE);
+
+	if (!in || !out) {
+		pom_oom(INPUT_PCAP_DECOMP_IN_BUFF_SIZE + INPUT_PCAP_DECOMP_OUT_BUFF_SIZE);
+		goto end;
+	}
+
+	switch (d->type) {
+#ifdef HAVE_ZLIB
+		case input_pcap_decomp_gzip:
+			input_pcap_decomp_run_gzip(d, in, out);
+			break;
+#endif
+#ifdef HAVE_ZSTD
+		case input_pcap_decomp_zstd:
+			input_pcap_decomp_run_zstd(d, in, out);
+			break;
+#endif
+#ifdef HAVE_LZ4
+		case input_pcap_decomp_lz4:
+			input_pcap_decomp_run_lz4(d, in, out);
+			break;
+#endif
+		default:
+			break;
+	}
+
+end:
+	free(in);
+	free(out);
+
+	// The reader will see the end of the file
+	close(d->out_fd);
+	d->out_fd = -1;
+
+	return NULL;
+}
+
+FILE *input_pcap_decomp_open(char *filename, enum input_pcap_decomp_type type, struct registry_perf *perf_compressed, struct registry_perf *perf_uncompressed, struct input_pcap_decomp **res) {
+
+	switch (type) {
+#ifdef HAVE_ZLIB
+		case input_pcap_decomp_gzip:
+#endif
+#ifdef HAVE_ZSTD
+		case input_pcap_decomp_zstd:
+#endif
+#ifdef HAVE_LZ4
+		case input_pcap_decomp_lz4:
+#endif
+			break;
+		default:
+			pomlog(POMLOG_ERR "Cannot read file %s : %s support was not compiled in", filename, input_pcap_decomp_type_name(type));
+			return NULL;
+	}
+
+	struct input_pcap_decomp *d = malloc(sizeof(struct input_pcap_decomp));
+	if (!d) {
+		pom_oom(sizeof(struct input_pcap_decomp));
+		return NULL;
+	}
+	memset(d, 0, sizeof(struct input_pcap_decomp));
+	d->type = type;
+	d->out_fd = -1;
+	d->perf_compressed = perf_compressed;
+	d->perf_uncompressed = perf_uncompressed;
+
+	d->filename = strdup(filename);
+	if (!d->filename) {
+		pom_oom(strlen(filename) + 1);
+		free(d);
+		return NULL;
+	}
+
+	d->in_fd = open(filename, O_RDONLY);
+	if (d->in_fd == -1) {
+		pomlog(POMLOG_ERR "Error opening file %s for reading : %s", filename, pom_strerror(errno));
+		goto err;
+	}
+	posix_fadvise(d->in_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+	// The decompressed data is passed to the reader over a socket pair
+	int sv[2];
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv)) {
+		pomlog(POMLOG_ERR "Error while creating the socket pair for file %s : %s", filename, pom_strerror(errno));
+		goto err;
+	}
+
+	int buff_size = INPUT_PCAP_DECOMP_SOCK_BUFF_SIZE;
+	if (setsockopt(sv[1], SOL_SOCKET, SO_SNDBUF, &buff_size, sizeof(buff_size)) || setsockopt(sv[0], SOL_SOCKET, SO_RCVBUF, &buff_size, sizeof(buff_size)))
+		pomlog(POMLOG_DEBUG "Unable to increase the socket buffer size : %s", pom_strerror(errno));
+
+	FILE *f = fdopen(sv[0], "r");
+	if (!f) {
+		pomlog(POMLOG_ERR "Error while opening the decompressed stream of file %s : %s", filename, pom_strerror(errno));
+		close(sv[0]);
+		close(sv[1]);
+		goto err;
+	}
+	setvbuf(f, NULL, _IOFBF, INPUT_PCAP_DECOMP_IN_BUFF_SIZE);
+
+	d->out_fd = sv[1];
+
+	if (pthread_create(&d->thread, NULL, input_pcap_decomp_thread, d)) {
+		pomlog(POMLOG_ERR "Unable to start the decompression thread for file %s : %s", filename, pom_strerror(errno));
+		fclose(f);
+		close(d->out_fd);
+		goto err;
+	}
+
+	*res = d;
+
+	return f;
+
+err:
+	if (d->in_fd != -1)
+		close(d->in_fd);
+	free(d->filename);
+	free(d);
+	return NULL;
+}
+
+void input_pcap_decomp_close(struct input_pcap_decomp *d) {
+
+	// The reader must have closed its stream already so the thread doesn't block on it
+
+	if (pthread_join(d->thread, NULL))
+		pomlog(POMLOG_WARN "Error while joining the decompression thread : %s", pom_strerror(errno));
+
+	close(d->in_fd);
+	free(d->filename);
+	free(d);
+}
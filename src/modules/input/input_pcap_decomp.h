@@ -0,0 +1,59 @@
+/*
+ *  This file is part of pom-ng.
+ *  Copyright (C) 2015 Guy Martin <gmsoft@tuxicoman.be>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+
+#ifndef __INPUT_PCAP_DECOMP_H__
+#define __INPUT_PCAP_DECOMP_H__
+
+#include "../../../config.h"
+
+#include <pom-ng/registry.h>
+#include <pthread.h>
+#include <stdio.h>
+
+#define INPUT_PCAP_DECOMP_IN_BUFF_SIZE	(1024 * 1024)
+#define INPUT_PCAP_DECOMP_OUT_BUFF_SIZE	(4 * 1024 * 1024)
+#define INPUT_PCAP_DECOMP_SOCK_BUFF_SIZE	(4 * 1024 * 1024)
+
+enum input_pcap_decomp_type {
+	input_pcap_decomp_none = 0,
+	input_pcap_decomp_gzip,
+	input_pcap_decomp_zstd,
+	input_pcap_decomp_lz4,
+};
+
+struct input_pcap_decomp {
+
+	char *filename;
+	enum input_pcap_decomp_type type;
+	int in_fd;
+	int out_fd; // Our end of the socket pair, the reader has the other one
+	pthread_t thread;
+
+	struct registry_perf *perf_compressed;
+	struct registry_perf *perf_uncompressed;
+};
+
+enum input_pcap_decomp_type input_pcap_decomp_detect(char *filename);
+char *input_pcap_decomp_type_name(enum input_pcap_decomp_type type);
+FILE *input_pcap_decomp_open(char *filename, enum input_pcap_decomp_type type, struct registry_perf *perf_compressed, struct registry_perf *perf_uncompressed, struct input_pcap_decomp **res);
+void input_pcap_decomp_close(struct input_pcap_decomp *d);
+
+#endif
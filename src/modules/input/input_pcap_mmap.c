@@ -0,0 +1,470 @@
+/*
+ *  This file is part of pom-ng.
+ *  Copyright (C) 2015 Guy Martin <gmsoft@tuxicoman.be>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+#include <pom-ng/base.h>
+#include "input_pcap_mmap.h"
+
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+static uint16_t input_pcap_mmap_read16(struct input_pcap_mmap_file *f, const unsigned char *ptr) {
+
+	uint16_t res;
+	memcpy(&res, ptr, sizeof(res));
+	return (f->swapped ? __builtin_bswap16(res) : res);
+}
+
+static uint32_t input_pcap_mmap_read32(struct input_pcap_mmap_file *f, const unsigned char *ptr) {
+
+	uint32_t res;
+	memcpy(&res, ptr, sizeof(res));
+	return (f->swapped ? __builtin_bswap32(res) : res);
+}
+
+static int input_pcap_mmap_linktype_to_dlt(uint32_t linktype) {
+
+	// Upper bits may contain the FCS length
+	linktype &= 0xffff;
+
+	if (linktype == INPUT_PCAP_MMAP_LINKTYPE_RAW)
+		return DLT_RAW;
+
+	return linktype;
+}
+
+static int input_pcap_mmap_parse_pcap_hdr(struct input_pcap_mmap_file *f) {
+
+	if (f->size < INPUT_PCAP_MMAP_PCAP_HDR_LEN)
+		return POM_ERR;
+
+	uint32_t magic;
+	memcpy(&magic, f->map, sizeof(magic));
+
+	switch (magic) {
+		case INPUT_PCAP_MMAP_MAGIC_USEC:
+			break;
+		case INPUT_PCAP_MMAP_MAGIC_NSEC:
+			f->nsec = 1;
+			break;
+		case INPUT_PCAP_MMAP_MAGIC_USEC_SWAPPED:
+			f->swapped = 1;
+			break;
+		case INPUT_PCAP_MMAP_MAGIC_NSEC_SWAPPED:
+			f->swapped = 1;
+			f->nsec = 1;
+			break;
+		default:
+			return POM_ERR;
+	}
+
+	f->format = input_pcap_mmap_format_pcap;
+	f->snaplen = input_pcap_mmap_read32(f, f->map + 16);
+	f->datalink = input_pcap_mmap_linktype_to_dlt(input_pcap_mmap_read32(f, f->map + 20));
+	f->offset = INPUT_PCAP_MMAP_PCAP_HDR_LEN;
+
+	return POM_OK;
+}
+
+static int input_pcap_mmap_parse_shb(struct input_pcap_mmap_file *f, size_t offset) {
+
+	// Section header block, it sets the byte order for the whole section
+
+	if (offset + 28 > f->size)
+		return POM_ERR;
+
+	uint32_t byte_order;
+	memcpy(&byte_order, f->map + offset + 8, sizeof(byte_order));
+	if (byte_order == INPUT_PCAP_MMAP_PCAPNG_BYTE_ORDER) {
+		f->swapped = 0;
+	} else if (byte_order == __builtin_bswap32(INPUT_PCAP_MMAP_PCAPNG_BYTE_ORDER)) {
+		f->swapped = 1;
+	} else {
+		return POM_ERR;
+	}
+
+	// Interface IDs are local to the section
+	f->iface_count = 0;
+
+	return POM_OK;
+}
+
+static int input_pcap_mmap_parse_idb(struct input_pcap_mmap_file *f, const unsigned char *block, uint32_t block_len) {
+
+	// Interface description block
+	if (block_len < 20) {
+		snprintf(f->errbuf, PCAP_ERRBUF_SIZE, "Invalid interface description block");
+		return POM_ERR;
+	}
+
+	struct input_pcap_mmap_iface *ifaces = realloc(f->ifaces, sizeof(struct input_pcap_mmap_iface) * (f->iface_count + 1));
+	if (!ifaces) {
+		pom_oom(sizeof(struct input_pcap_mmap_iface) * (f->iface_count + 1));
+		snprintf(f->errbuf, PCAP_ERRBUF_SIZE, "Not enough memory");
+		return POM_ERR;
+	}
+	f->ifaces = ifaces;
+
+	struct input_pcap_mmap_iface *iface = &f->ifaces[f->iface_count];
+	memset(iface, 0, sizeof(struct input_pcap_mmap_iface));
+	iface->datalink = input_pcap_mmap_linktype_to_dlt(input_pcap_mmap_read16(f, block + 8));
+	iface->snaplen = input_pcap_mmap_read32(f, block + 12);
+	iface->ts_units = 1000000;
+
+	// Look for the timestamp resolution
+	const unsigned char *opt = block + 16, *opt_end = block + block_len - 4;
+	while (opt + 4 <= opt_end) {
+		uint16_t code = input_pcap_mmap_read16(f, opt);
+		uint16_t len = input_pcap_mmap_read16(f, opt + 2);
+		if (!code || opt + 4 + len > opt_end)
+			break;
+
+		if (code == INPUT_PCAP_MMAP_PCAPNG_OPT_TSRESOL && len >= 1) {
+			uint8_t resol = opt[4];
+			unsigned int exp = resol & 0x7f;
+			if (resol & 0x80) {
+				iface->ts_units = (exp < 64 ? (1ULL << exp) : 0);
+			} else {
+				iface->ts_units = 1;
+				while (exp-- && iface->ts_units < 10000000000000000000ULL)
+					iface->ts_units *= 10;
+			}
+			if (!iface->ts_units) {
+				snprintf(f->errbuf, PCAP_ERRBUF_SIZE, "Unsupported timestamp resolution");
+				return POM_ERR;
+			}
+		}
+
+		opt += 4 + ((len + 3) & ~3);
+	}
+
+	// Packets are handed to a single datalink protocol
+	if (!f->iface_count && f->datalink == -1)
+		f->datalink = iface->datalink;
+
+	f->iface_count++;
+
+	return POM_OK;
+}
+
+struct input_pcap_mmap_file *input_pcap_mmap_open(char *filename) {
+
+	struct input_pcap_mmap_file *f = malloc(sizeof(struct input_pcap_mmap_file));
+	if (!f) {
+		pom_oom(sizeof(struct input_pcap_mmap_file));
+		return NULL;
+	}
+	memset(f, 0, sizeof(struct input_pcap_mmap_file));
+	f->map = MAP_FAILED;
+	f->datalink = -1;
+	f->refcount = 1;
+
+	f->filename = strdup(filename);
+	if (!f->filename) {
+		pom_oom(strlen(filename) + 1);
+		free(f);
+		return NULL;
+	}
+
+	f->fd = open(filename, O_RDONLY);
+	if (f->fd == -1) {
+		pomlog(POMLOG_ERR "Error opening file %s for reading : %s", filename, pom_strerror(errno));
+		goto err;
+	}
+
+	struct stat st;
+	if (fstat(f->fd, &st)) {
+		pomlog(POMLOG_ERR "Error while getting the size of file %s : %s", filename, pom_strerror(errno));
+		goto err;
+	}
+
+	f->size = st.st_size;
+	if (f->size < INPUT_PCAP_MMAP_PCAP_HDR_LEN) {
+		pomlog(POMLOG_ERR "File %s is too small to be a pcap file", filename);
+		goto err;
+	}
+
+	f->map = mmap(NULL, f->size, PROT_READ, MAP_SHARED, f->fd, 0);
+	if (f->map == MAP_FAILED) {
+		pomlog(POMLOG_ERR "Error while mapping file %s : %s", filename, pom_strerror(errno));
+		goto err;
+	}
+
+	// We read the file only once from the start to the end
+	if (madvise(f->map, f->size, MADV_SEQUENTIAL))
+		pomlog(POMLOG_DEBUG "Error while setting sequential access on file %s : %s", filename, pom_strerror(errno));
+
+	uint32_t magic;
+	memcpy(&magic, f->map, sizeof(magic));
+
+	if (magic == INPUT_PCAP_MMAP_PCAPNG_SHB) {
+		f->format = input_pcap_mmap_format_pcapng;
+		if (input_pcap_mmap_parse_shb(f, 0) != POM_OK) {
+			pomlog(POMLOG_ERR "Invalid pcapng section header in file %s", filename);
+			goto err;
+		}
+
+		// The datalink comes from the first interface description block
+		const unsigned char *data = NULL;
+		struct pcap_pkthdr phdr;
+		if (input_pcap_mmap_next(f, &phdr, &data) == -1) {
+			pomlog(POMLOG_ERR "Error while reading file %s : %s", filename, f->errbuf);
+			goto err;
+		}
+
+		if (f->datalink == -1) {
+			pomlog(POMLOG_ERR "No interface description found in file %s", filename);
+			goto err;
+		}
+
+		// Read the packets from the begining as there might be multiple sections
+		f->offset = 0;
+		f->iface_count = 0;
+
+	} else if (input_pcap_mmap_parse_pcap_hdr(f) != POM_OK) {
+		pomlog(POMLOG_ERR "File %s is not a pcap or pcapng file", filename);
+		goto err;
+	}
+
+	return f;
+
+err:
+	input_pcap_mmap_release(f);
+	return NULL;
+}
+
+int input_pcap_mmap_set_filter(struct input_pcap_mmap_file *f, char *filter) {
+
+	if (f->has_filter) {
+		pcap_freecode(&f->filter);
+		f->has_filter = 0;
+	}
+
+	if (!filter || !strlen(filter))
+		return POM_OK;
+
+	pcap_t *p = pcap_open_dead(f->datalink, (f->snaplen ? f->snaplen : 65535));
+	if (!p) {
+		pomlog(POMLOG_ERR "Unable to compile BPF filter \"%s\"", filter);
+		return POM_ERR;
+	}
+
+	if (pcap_compile(p, &f->filter, filter, 1, PCAP_NETMASK_UNKNOWN) == -1) {
+		pomlog(POMLOG_ERR "Unable to compile BPF filter \"%s\" : %s", filter, pcap_geterr(p));
+		pcap_close(p);
+		return POM_ERR;
+	}
+	pcap_close(p);
+
+	f->has_filter = 1;
+
+	return POM_OK;
+}
+
+static int input_pcap_mmap_next_pcap(struct input_pcap_mmap_file *f, struct pcap_pkthdr *phdr, const unsigned char **data) {
+
+	if (f->offset == f->size)
+		return -2;
+
+	if (f->offset + INPUT_PCAP_MMAP_PCAP_REC_HDR_LEN > f->size) {
+		snprintf(f->errbuf, PCAP_ERRBUF_SIZE, "Truncated packet header at offset %zu", f->offset);
+		return -1;
+	}
+
+	const unsigned char *hdr = f->map + f->offset;
+	uint32_t sec = input_pcap_mmap_read32(f, hdr);
+	uint32_t frac = input_pcap_mmap_read32(f, hdr + 4);
+	uint32_t caplen = input_pcap_mmap_read32(f, hdr + 8);
+	uint32_t len = input_pcap_mmap_read32(f, hdr + 12);
+
+	if (f->offset + INPUT_PCAP_MMAP_PCAP_REC_HDR_LEN + caplen > f->size) {
+		snprintf(f->errbuf, PCAP_ERRBUF_SIZE, "Truncated packet at offset %zu", f->offset);
+		return -1;
+	}
+
+	phdr->ts.tv_sec = sec;
+	phdr->ts.tv_usec = (f->nsec ? frac / 1000 : frac);
+	phdr->caplen = caplen;
+	phdr->len = len;
+	*data = hdr + INPUT_PCAP_MMAP_PCAP_REC_HDR_LEN;
+
+	f->offset += INPUT_PCAP_MMAP_PCAP_REC_HDR_LEN + caplen;
+
+	return 1;
+}
+
+static int input_pcap_mmap_next_pcapng(struct input_pcap_mmap_file *f, struct pcap_pkthdr *phdr, const unsigned char **data) {
+
+	while (1) {
+		if (f->offset == f->size)
+			return -2;
+
+		if (f->offset + 12 > f->size) {
+			snprintf(f->errbuf, PCAP_ERRBUF_SIZE, "Truncated block header at offset %zu", f->offset);
+			return -1;
+		}
+
+		const unsigned char *block = f->map + f->offset;
+
+		uint32_t type;
+		memcpy(&type, block, sizeof(type));
+		if (type == INPUT_PCAP_MMAP_PCAPNG_SHB && input_pcap_mmap_parse_shb(f, f->offset) != POM_OK) {
+			snprintf(f->errbuf, PCAP_ERRBUF_SIZE, "Invalid section header at offset %zu", f->offset);
+			return -1;
+		}
+		type = input_pcap_mmap_read32(f, block);
+
+		uint32_t block_len = input_pcap_mmap_read32(f, block + 4);
+		if (block_len < 12 || block_len % 4 || f->offset + block_len > f->size) {
+			snprintf(f->errbuf, PCAP_ERRBUF_SIZE, "Invalid block length at offset %zu", f->offset);
+			return -1;
+		}
+
+		f->offset += block_len;
+
+		uint32_t iface_id = 0, caplen = 0, len = 0;
+		uint64_t ts = 0;
+		const unsigned char *pkt_data = NULL;
+
+		switch (type) {
+			case INPUT_PCAP_MMAP_PCAPNG_IDB:
+				if (input_pcap_mmap_parse_idb(f, block, block_len) != POM_OK)
+					return -1;
+				continue;
+
+			case INPUT_PCAP_MMAP_PCAPNG_EPB:
+				if (block_len < 32)
+					goto invalid;
+				iface_id = input_pcap_mmap_read32(f, block + 8);
+				ts = ((uint64_t) input_pcap_mmap_read32(f, block + 12) << 32) | input_pcap_mmap_read32(f, block + 16);
+				caplen = input_pcap_mmap_read32(f, block + 20);
+				len = input_pcap_mmap_read32(f, block + 24);
+				pkt_data = block + 28;
+				if (caplen > block_len - 32)
+					goto invalid;
+				break;
+
+			case INPUT_PCAP_MMAP_PCAPNG_SPB:
+				if (block_len < 16)
+					goto invalid;
+				len = input_pcap_mmap_read32(f, block + 8);
+				caplen = block_len - 16;
+				if (caplen > len)
+					caplen = len;
+				pkt_data = block + 12;
+				break;
+
+			case INPUT_PCAP_MMAP_PCAPNG_PB:
+				if (block_len < 32)
+					goto invalid;
+				iface_id = input_pcap_mmap_read16(f, block + 8);
+				ts = ((uint64_t) input_pcap_mmap_read32(f, block + 12) << 32) | input_pcap_mmap_read32(f, block + 16);
+				caplen = input_pcap_mmap_read32(f, block + 20);
+				len = input_pcap_mmap_read32(f, block + 24);
+				pkt_data = block + 28;
+				if (caplen > block_len - 32)
+					goto invalid;
+				break;
+
+			default:
+				// Skip the blocks we don't care about
+				continue;
+		}
+
+		if (iface_id >= f->iface_count) {
+			snprintf(f->errbuf, PCAP_ERRBUF_SIZE, "Packet with unknown interface %u at offset %zu", iface_id, f->offset - block_len);
+			return -1;
+		}
+
+		struct input_pcap_mmap_iface *iface = &f->ifaces[iface_id];
+		if (iface->datalink != f->datalink) {
+			pomlog(POMLOG_DEBUG "Skipping packet from interface %u in file %s as its datalink differs from the first interface", iface_id, f->filename);
+			continue;
+		}
+
+		if (type == INPUT_PCAP_MMAP_PCAPNG_SPB && iface->snaplen && caplen > iface->snaplen)
+			caplen = iface->snaplen;
+
+		phdr->ts.tv_sec = ts / iface->ts_units;
+		phdr->ts.tv_usec = ((ts % iface->ts_units) * 1000000ULL) / iface->ts_units;
+		phdr->caplen = caplen;
+		phdr->len = len;
+		*data = pkt_data;
+
+		return 1;
+	}
+
+invalid:
+	snprintf(f->errbuf, PCAP_ERRBUF_SIZE, "Invalid packet block at offset %zu", f->offset);
+	return -1;
+}
+
+int input_pcap_mmap_next(struct input_pcap_mmap_file *f, struct pcap_pkthdr *phdr, const unsigned char **data) {
+
+	// Same return values as pcap_next_ex()
+
+	while (1) {
+		int res;
+		if (f->format == input_pcap_mmap_format_pcapng)
+			res = input_pcap_mmap_next_pcapng(f, phdr, data);
+		else
+			res = input_pcap_mmap_next_pcap(f, phdr, data);
+
+		if (res != 1)
+			return res;
+
+		if (!f->has_filter || pcap_offline_filter(&f->filter, phdr, *data))
+			return 1;
+	}
+
+	return -1;
+}
+
+char *input_pcap_mmap_geterr(struct input_pcap_mmap_file *f) {
+
+	return f->errbuf;
+}
+
+void input_pcap_mmap_ref(struct input_pcap_mmap_file *f) {
+
+	__sync_fetch_and_add(&f->refcount, 1);
+}
+
+void input_pcap_mmap_release(void *priv) {
+
+	struct input_pcap_mmap_file *f = priv;
+
+	if (__sync_sub_and_fetch(&f->refcount, 1))
+		return;
+
+	// Last packet pointing into the mapping is gone
+	if (f->map != MAP_FAILED)
+		munmap(f->map, f->size);
+	if (f->fd != -1)
+		close(f->fd);
+	if (f->has_filter)
+		pcap_freecode(&f->filter);
+	free(f->ifaces);
+	free(f->filename);
+	free(f);
+}
@@ -0,0 +1,88 @@
+/*
+ *  This file is part of pom-ng.
+ *  Copyright (C) 2015 Guy Martin <gmsoft@tuxicoman.be>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+
+#ifndef __INPUT_PCAP_MMAP_H__
+#define __INPUT_PCAP_MMAP_H__
+
+#include <pcap.h>
+
+#define INPUT_PCAP_MMAP_MAGIC_USEC		0xa1b2c3d4
+#define INPUT_PCAP_MMAP_MAGIC_NSEC		0xa1b23c4d
+#define INPUT_PCAP_MMAP_MAGIC_USEC_SWAPPED	0xd4c3b2a1
+#define INPUT_PCAP_MMAP_MAGIC_NSEC_SWAPPED	0x4d3cb2a1
+
+#define INPUT_PCAP_MMAP_PCAPNG_SHB		0x0a0d0d0a
+#define INPUT_PCAP_MMAP_PCAPNG_IDB		0x00000001
+#define INPUT_PCAP_MMAP_PCAPNG_PB		0x00000002 // Obsolete packet block
+#define INPUT_PCAP_MMAP_PCAPNG_SPB		0x00000003
+#define INPUT_PCAP_MMAP_PCAPNG_EPB		0x00000006
+#define INPUT_PCAP_MMAP_PCAPNG_BYTE_ORDER	0x1a2b3c4d
+#define INPUT_PCAP_MMAP_PCAPNG_OPT_TSRESOL	9
+
+#define INPUT_PCAP_MMAP_PCAP_HDR_LEN		24
+#define INPUT_PCAP_MMAP_PCAP_REC_HDR_LEN	16
+
+// LINKTYPE_RAW doesn't match DLT_RAW on all platforms
+#define INPUT_PCAP_MMAP_LINKTYPE_RAW		101
+
+enum input_pcap_mmap_format {
+	input_pcap_mmap_format_pcap,
+	input_pcap_mmap_format_pcapng,
+};
+
+struct input_pcap_mmap_iface {
+	int datalink;
+	unsigned int snaplen;
+	uint64_t ts_units; // Timestamp units per second
+};
+
+struct input_pcap_mmap_file {
+
+	char *filename;
+	int fd;
+	unsigned char *map;
+	size_t size, offset;
+
+	enum input_pcap_mmap_format format;
+	int swapped;
+	int datalink;
+	unsigned int snaplen;
+	int nsec; // Classic pcap file with nanosecond timestamps
+
+	struct input_pcap_mmap_iface *ifaces;
+	unsigned int iface_count;
+
+	struct bpf_program filter;
+	int has_filter;
+
+	char errbuf[PCAP_ERRBUF_SIZE + 1];
+
+	volatile unsigned int refcount; // One for the reader and one per packet pointing into the mapping
+};
+
+struct input_pcap_mmap_file *input_pcap_mmap_open(char *filename);
+int input_pcap_mmap_set_filter(struct input_pcap_mmap_file *f, char *filter);
+int input_pcap_mmap_next(struct input_pcap_mmap_file *f, struct pcap_pkthdr *phdr, const unsigned char **data);
+char *input_pcap_mmap_geterr(struct input_pcap_mmap_file *f);
+void input_pcap_mmap_ref(struct input_pcap_mmap_file *f);
+void input_pcap_mmap_release(void *priv);
+
+#endif
@@ -21,6 +21,7 @@
 #include <pom-ng/ptype.h>
 #include <pom-ng/proto.h>
 #include <pom-ng/conntrack.h>
+#include <pom-ng/defrag.h>
 #include <pom-ng/ptype_ipv4.h>
 #include <pom-ng/ptype_uint8.h>
 #include <pom-ng/ptype_uint32.h>
@@ -34,9 +35,9 @@
 #define IP_MORE_FRAG 0x2000
 #define IP_OFFSET_MASK 0x1fff
 
-static struct ptype *param_frag_timeout = NULL, *param_conntrack_timeout = NULL;
+static struct ptype *param_conntrack_timeout = NULL;
 
-static struct registry_perf *perf_frags = NULL, *perf_frags_dropped = NULL, *perf_reassembled_pkts = NULL;
+static struct defrag *proto_ipv4_defrag = NULL;
 
 struct mod_reg_info* proto_ipv4_reg_info() {
 
@@ -77,7 +78,6 @@ static int proto_ipv4_mod_register(struct mod_reg *mod) {
 	ct_info.default_table_size = 65535;
 	ct_info.fwd_pkt_field_id = proto_ipv4_field_src;
 	ct_info.rev_pkt_field_id = proto_ipv4_field_dst;
-	ct_info.cleanup_handler = proto_ipv4_conntrack_cleanup;
 	proto_ipv4.ct_info = &ct_info;
 	
 	proto_ipv4.init = proto_ipv4_init;
@@ -98,35 +98,24 @@ static int proto_ipv4_init(struct proto *proto, struct registry_instance *i) {
 		proto_number_register("ppp", 0x21, proto) != POM_OK)
 		return POM_ERR;
 
-	perf_frags = registry_instance_add_perf(i, "fragments", registry_perf_type_counter, "Number of fragments received", "pkts");
-	perf_frags_dropped = registry_instance_add_perf(i, "dropped_fragments", registry_perf_type_counter, "Number of fragments dropped", "pkts");
-	perf_reassembled_pkts = registry_instance_add_perf(i, "reassembled_pkts", registry_perf_type_counter, "Number of reassembled packets", "pkts");
-
-	if (!perf_frags || !perf_frags_dropped || !perf_reassembled_pkts)
-		return POM_ERR;
-
-	param_frag_timeout = ptype_alloc_unit("uint32", "seconds");
-	if (!param_frag_timeout)
+	proto_ipv4_defrag = defrag_alloc(proto, i);
+	if (!proto_ipv4_defrag)
 		return POM_ERR;
 
 	param_conntrack_timeout = ptype_alloc_unit("uint32", "seconds");
 	if (!param_conntrack_timeout)
-		return POM_ERR;
-
-	struct registry_param *p = registry_new_param("fragment_timeout", "60", param_frag_timeout, "Timeout for incomplete ipv4 fragments", 0);
-	if (proto_add_param(proto, p) != POM_OK)
 		goto err;
 
-	p = registry_new_param("conntrack_timeout", "7200", param_conntrack_timeout, "Timeout for ipv4 connections", 0);
+	struct registry_param *p = registry_new_param("conntrack_timeout", "7200", param_conntrack_timeout, "Timeout for ipv4 connections", 0);
 	if (proto_add_param(proto, p) != POM_OK)
 		goto err;
 
 	return POM_OK;
 
 err:
-	if (param_frag_timeout) {
-		ptype_cleanup(param_frag_timeout);
-		param_frag_timeout = NULL;
+	if (proto_ipv4_defrag) {
+		defrag_cleanup(proto_ipv4_defrag);
+		proto_ipv4_defrag = NULL;
 	}
 	if (param_conntrack_timeout) {
 		ptype_cleanup(param_conntrack_timeout);
@@ -209,170 +198,33 @@ static int proto_ipv4_process(void *proto_priv, struct packet *p, struct proto_p
 		return PROTO_INVALID;
 	}
 
-	// Account for one more fragment
-	registry_perf_inc(perf_frags, 1);
-
-	struct proto_ipv4_fragment *tmp = s->ce->priv;
-
-	// Let's find the right buffer
-	for (; tmp && tmp->id != hdr->ip_id; tmp = tmp->next);
-
-	if (!tmp) {
-		// Buffer not found, create it
-		tmp = malloc(sizeof(struct proto_ipv4_fragment));
-		if (!tmp) {
-			pom_oom(sizeof(struct proto_ipv4_fragment));
-			conntrack_unlock(s->ce);
-			return PROTO_ERR;
-		}
-		memset(tmp, 0, sizeof(struct proto_ipv4_fragment));
-
-		tmp->t = conntrack_timer_alloc(s->ce, proto_ipv4_fragment_cleanup, tmp);
-		if (!tmp->t) {
-			conntrack_unlock(s->ce);
-			free(tmp);
-			return PROTO_ERR;
-		}
-		
-		tmp->id = hdr->ip_id;
-
-		if (!s_next->proto) {
-			// Set processed flag so no attempt to process this will be done
-			tmp->flags |= PROTO_IPV4_FLAG_PROCESSED;
-			conntrack_unlock(s->ce);
-			conntrack_timer_cleanup(tmp->t);
-			free(tmp);
-			return PROTO_STOP;
-		}
-
-		tmp->multipart = packet_multipart_alloc(s_next->proto, 0, 0);
-		if (!tmp->multipart) {
-			conntrack_unlock(s->ce);
-			conntrack_timer_cleanup(tmp->t);
-			free(tmp);
-			return PROTO_ERR;
-		}
-
-		tmp->next = s->ce->priv;
-		if (tmp->next)
-			tmp->next->prev = tmp;
-		s->ce->priv = tmp;
-	}
-
-	// Fragment was already handled
-	if (tmp->flags & PROTO_IPV4_FLAG_PROCESSED) {
-		conntrack_unlock(s->ce);
-		registry_perf_inc(perf_frags_dropped, 1);
-		return PROTO_STOP;
-	}
-	
-	// Add the fragment
-	if (packet_multipart_add_packet(tmp->multipart, p, offset, frag_size, (s->pload - (void*)p->buff) + (hdr->ip_hl * 4)) != POM_OK) {
-		conntrack_unlock(s->ce);
-		packet_multipart_cleanup(tmp->multipart);
-		conntrack_timer_cleanup(tmp->t);
-		free(tmp);
-		return PROTO_ERR;
-	}
-	tmp->count++;
-
-	// Schedule the timeout for the fragment
-	uint32_t *frag_timeout = PTYPE_UINT32_GETVAL(param_frag_timeout);
-	conntrack_timer_queue(tmp->t, *frag_timeout, p->ts);
-
-
-	if (!(frag_off & IP_MORE_FRAG))
-		tmp->flags |= PROTO_IPV4_FLAG_GOT_LAST;
-
-	struct packet_multipart *m = NULL;
-
-	if ((tmp->flags & PROTO_IPV4_FLAG_GOT_LAST) && !tmp->multipart->gaps) {
-		tmp->flags |= PROTO_IPV4_FLAG_PROCESSED;
-		m = tmp->multipart;
-		tmp->multipart = NULL;
-	}
-
-
-
 	conntrack_unlock(s->ce);
-	
-	if (m) {
-		int res = packet_multipart_process(m, stack, stack_index + 1);
-		if (res == PROTO_ERR) {
-			return PROTO_ERR;
-		} else if (res == PROTO_INVALID) {
-			registry_perf_inc(perf_frags_dropped, tmp->count);
-		} else {
-			registry_perf_inc(perf_reassembled_pkts, 1);
-		}
-	}
-
-	return PROTO_STOP; // Stop processing the packet
-
-}
-
-static int proto_ipv4_fragment_cleanup(struct conntrack_entry *ce, void *priv, ptime now) {
-
-	struct proto_ipv4_fragment *f = priv;
-
-	// Remove the frag from the conntrack
-	if (f->prev)
-		f->prev->next = f->next;
-	else
-		ce->priv = f->next;
 
-	if (f->next)
-		f->next->prev = f->prev;
-
-	conntrack_unlock(ce);
-
-
-	if (!(f->flags & PROTO_IPV4_FLAG_PROCESSED)) {
-		registry_perf_inc(perf_frags_dropped, f->count);
-	}
-
-	if (f->multipart)
-		packet_multipart_cleanup(f->multipart);
-	
-	if (f->t)
-		conntrack_timer_cleanup(f->t);
-	
-	free(f);
-
-	return POM_OK;
-
-}
-
-static int proto_ipv4_conntrack_cleanup(void *ce_priv) {
-
-	struct proto_ipv4_fragment *frag_list = ce_priv;
-
-	while (frag_list) {
-		struct proto_ipv4_fragment *f = frag_list;
-		frag_list = f->next;
-
-		if (!(f->flags & PROTO_IPV4_FLAG_PROCESSED)) {
-			registry_perf_inc(perf_frags_dropped, f->count);
-		}
+	// Don't bother reassembling unsupported protocols
+	if (!s_next->proto)
+		return PROTO_STOP;
 
-		if (f->multipart)
-			packet_multipart_cleanup(f->multipart);
-		
-		if (f->t)
-			conntrack_timer_cleanup(f->t);
-		
-		free(f);
+	struct defrag_fragment f = { 0 };
+	f.src = &hdr->ip_src;
+	f.dst = &hdr->ip_dst;
+	f.addr_len = sizeof(struct in_addr);
+	f.id = hdr->ip_id;
+	f.proto = hdr->ip_p;
+	f.parent = stack[stack_index - 1].ce;
+	f.offset = offset;
+	f.data = s_next->pload;
+	f.len = frag_size;
+	f.more = frag_off & IP_MORE_FRAG;
 
-	}
+	return defrag_process(proto_ipv4_defrag, &f, p, stack, stack_index);
 
-	return POM_OK;
 }
 
 static int proto_ipv4_cleanup(void *proto_priv) {
 
 	int res = POM_OK;
 
-	res += ptype_cleanup(param_frag_timeout);
+	res += defrag_cleanup(proto_ipv4_defrag);
 	res += ptype_cleanup(param_conntrack_timeout);
 
 	return res;
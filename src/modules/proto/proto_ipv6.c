@@ -21,6 +21,7 @@
 #include <pom-ng/ptype.h>
 #include <pom-ng/proto.h>
 #include <pom-ng/conntrack.h>
+#include <pom-ng/defrag.h>
 #include <pom-ng/ptype_ipv6.h>
 #include <pom-ng/ptype_uint8.h>
 #include <pom-ng/ptype_uint32.h>
@@ -33,9 +34,9 @@
 
 #include <netinet/ip6.h>
 
-static struct ptype *param_frag_timeout = NULL, *param_conntrack_timeout = NULL;
+static struct ptype *param_conntrack_timeout = NULL;
 
-static struct registry_perf *perf_frags = NULL, *perf_frags_dropped = NULL, *perf_reassembled_pkts = NULL;
+static struct defrag *proto_ipv6_defrag = NULL;
 
 struct mod_reg_info* proto_ipv6_reg_info() {
 
@@ -73,7 +74,6 @@ static int proto_ipv6_mod_register(struct mod_reg *mod) {
 	ct_info.default_table_size = 32768;
 	ct_info.fwd_pkt_field_id = proto_ipv6_field_src;
 	ct_info.rev_pkt_field_id = proto_ipv6_field_dst;
-	ct_info.cleanup_handler = proto_ipv6_conntrack_cleanup;
 	proto_ipv6.ct_info = &ct_info;
 	
 	proto_ipv6.init = proto_ipv6_init;
@@ -96,25 +96,14 @@ static int proto_ipv6_init(struct proto *proto, struct registry_instance *i) {
 
 	struct registry_param *p = NULL;
 
-	perf_frags = registry_instance_add_perf(i, "fragments", registry_perf_type_counter, "Number of fragments received", "pkts");
-	perf_frags_dropped = registry_instance_add_perf(i, "dropped_fragments", registry_perf_type_counter, "Number of fragments dropped", "pkts");
-	perf_reassembled_pkts = registry_instance_add_perf(i, "reassembled_pkts", registry_perf_type_counter, "Number of reassembled packets", "pkts");
-
-	if (!perf_frags || !perf_frags_dropped || !perf_reassembled_pkts)
+	proto_ipv6_defrag = defrag_alloc(proto, i);
+	if (!proto_ipv6_defrag)
 		return POM_ERR;
 
-	param_frag_timeout = ptype_alloc_unit("uint32", "seconds");
-	if (!param_frag_timeout)
-		goto err;
-
 	param_conntrack_timeout = ptype_alloc_unit("uint32", "seconds");
 	if (!param_conntrack_timeout)
 		goto err;
 
-	p = registry_new_param("fragment_timeout", "60", param_frag_timeout, "Timeout for incomplete ipv6 fragments", 0);
-	if (proto_add_param(proto, p) != POM_OK)
-		goto err;
-
 	p = registry_new_param("conntrack_timeout", "7200", param_conntrack_timeout, "Timeout for ipv6 connections", 0);
 	if (proto_add_param(proto, p) != POM_OK)
 		goto err;
@@ -126,9 +115,9 @@ err:
 	if (p)
 		registry_cleanup_param(p);
 
-	if (param_frag_timeout) {
-		ptype_cleanup(param_frag_timeout);
-		param_frag_timeout = NULL;
+	if (proto_ipv6_defrag) {
+		defrag_cleanup(proto_ipv6_defrag);
+		proto_ipv6_defrag = NULL;
 	}
 	if (param_conntrack_timeout) {
 		ptype_cleanup(param_conntrack_timeout);
@@ -142,111 +131,34 @@ static int proto_ipv6_process_fragment(struct packet *p, struct proto_process_st
 	struct proto_process_stack *s = &stack[stack_index];
 	struct proto_process_stack *s_next = &stack[stack_index + 1];
 
-	struct proto_ipv6_fragment *tmp = s->ce->priv;
-
+	struct ip6_hdr *hdr = s->pload;
 	struct ip6_frag *fhdr = s_next->pload;
-	uint8_t nxthdr = fhdr->ip6f_nxt;
 
-	void *frag_data = s_next->pload + sizeof(struct ip6_frag);
-	size_t frag_len = s_next->plen - sizeof(struct ip6_frag);
+	// We need to unlock the conntrack to avoid a deadlock when processing packets
+	conntrack_unlock(s->ce);
+
+	if (s_next->plen < sizeof(struct ip6_frag))
+		return PROTO_INVALID;
 
 	s_next->proto = proto_get_by_number(s->proto, fhdr->ip6f_nxt);
 
-	registry_perf_inc(perf_frags, 1);
-
 	// Don't bother processing unsupported protocols
-	if (!s_next->proto) {
-		conntrack_unlock(s->ce);
-		return PROTO_STOP;
-	}
-
-	uint16_t frag_offset = ntohs(fhdr->ip6f_offlg & IP6F_OFF_MASK);
-	int frag_more = fhdr->ip6f_offlg & IP6F_MORE_FRAG;
-
-	// Let's find the right buffer
-	for (; tmp && !(tmp->id == fhdr->ip6f_ident && tmp->nxthdr == nxthdr); tmp = tmp->next);
-
-	if (!tmp) {
-		// Buffer not found, create it
-		tmp = malloc(sizeof(struct proto_ipv6_fragment));
-		if (!tmp) {
-			pom_oom(sizeof(struct proto_ipv6_fragment));
-			conntrack_unlock(s->ce);
-			return PROTO_ERR;
-		}
-		memset(tmp, 0, sizeof(struct proto_ipv6_fragment));
-
-		tmp->t = conntrack_timer_alloc(s->ce, proto_ipv6_fragment_cleanup, tmp);
-		if (!tmp->t) {
-			free(tmp);
-			conntrack_unlock(s->ce);
-			return PROTO_ERR;
-		}
-		
-		tmp->id = fhdr->ip6f_ident;
-		tmp->nxthdr = nxthdr;
-		tmp->multipart = packet_multipart_alloc(s_next->proto, 0, 0);
-		if (!tmp->multipart) {
-			conntrack_timer_cleanup(tmp->t);
-			free(tmp);
-			conntrack_unlock(s->ce);
-			return PROTO_ERR;
-		}
-
-		tmp->next = s->ce->priv;
-		if (tmp->next)
-			tmp->next->prev = tmp;
-		s->ce->priv = tmp;
-	}
-
-	// Fragment was already handled
-	if (tmp->flags & PROTO_IPV6_FLAG_PROCESSED) {
-		registry_perf_inc(perf_frags_dropped, 1);
-		conntrack_unlock(s->ce);
+	if (!s_next->proto)
 		return PROTO_STOP;
-	}
-	
-	// Add the fragment
-	if (packet_multipart_add_packet(tmp->multipart, p, frag_offset, frag_len, frag_data - p->buff) != POM_OK) {
-		packet_multipart_cleanup(tmp->multipart);
-		conntrack_timer_cleanup(tmp->t);
-		free(tmp);
-		conntrack_unlock(s->ce);
-		return PROTO_ERR;
-	}
-	tmp->count++;
-
-	// Schedule the timeout for the fragment
-	uint32_t *frag_timeout = PTYPE_UINT32_GETVAL(param_frag_timeout);
-	conntrack_timer_queue(tmp->t, *frag_timeout, p->ts);
-
 
-	if (!frag_more)
-		tmp->flags |= PROTO_IPV6_FLAG_GOT_LAST;
+	struct defrag_fragment f = { 0 };
+	f.src = &hdr->ip6_src;
+	f.dst = &hdr->ip6_dst;
+	f.addr_len = sizeof(struct in6_addr);
+	f.id = fhdr->ip6f_ident;
+	f.proto = fhdr->ip6f_nxt;
+	f.parent = stack[stack_index - 1].ce;
+	f.offset = ntohs(fhdr->ip6f_offlg & IP6F_OFF_MASK);
+	f.data = s_next->pload + sizeof(struct ip6_frag);
+	f.len = s_next->plen - sizeof(struct ip6_frag);
+	f.more = fhdr->ip6f_offlg & IP6F_MORE_FRAG;
 
-	struct packet_multipart *m = NULL;
-
-	if ((tmp->flags & PROTO_IPV6_FLAG_GOT_LAST) && !tmp->multipart->gaps) {
-		tmp->flags |= PROTO_IPV6_FLAG_PROCESSED;
-		m = tmp->multipart;
-		tmp->multipart = NULL;
-	}
-
-
-	// We need to unlock the conntrack to avoid a deadlock when processing packets
-	conntrack_unlock(s->ce);
-
-	if (m) {
-		int res = packet_multipart_process(m, stack, stack_index + 1);
-		if (res == PROTO_ERR) {
-			return PROTO_ERR;
-		} else if (res == PROTO_INVALID) {
-			registry_perf_inc(perf_frags_dropped, tmp->count);
-		} else {
-			registry_perf_inc(perf_reassembled_pkts, 1);
-		}
-	}
-	return PROTO_STOP; // Stop processing the packet
+	return defrag_process(proto_ipv6_defrag, &f, p, stack, stack_index);
 
 }
 
@@ -325,67 +237,11 @@ static int proto_ipv6_process(void *proto_priv, struct packet *p, struct proto_p
 	return res;
 }
 
-static int proto_ipv6_fragment_cleanup(struct conntrack_entry *ce, void *priv, ptime now) {
-
-	struct proto_ipv6_fragment *f = priv;
-
-	// Remove the frag from the conntrack
-	if (f->prev)
-		f->prev->next = f->next;
-	else
-		ce->priv = f->next;
-
-	if (f->next)
-		f->next->prev = f->prev;
-
-	conntrack_unlock(ce);
-
-	if (!(f->flags & PROTO_IPV6_FLAG_PROCESSED)) {
-		registry_perf_inc(perf_frags_dropped, f->count);
-	}
-
-	if (f->multipart)
-		packet_multipart_cleanup(f->multipart);
-	
-	if (f->t)
-		conntrack_timer_cleanup(f->t);
-	
-	free(f);
-
-	return POM_OK;
-
-}
-
-static int proto_ipv6_conntrack_cleanup(void *ce_priv) {
-
-	struct proto_ipv6_fragment *frag_list = ce_priv;
-
-	while (frag_list) {
-		struct proto_ipv6_fragment *f = frag_list;
-		frag_list = f->next;
-
-		if (!(f->flags & PROTO_IPV6_FLAG_PROCESSED)) {
-			registry_perf_inc(perf_frags_dropped, f->count);
-		}
-
-		if (f->multipart)
-			packet_multipart_cleanup(f->multipart);
-		
-		if (f->t)
-			conntrack_timer_cleanup(f->t);
-		
-		free(f);
-
-	}
-
-	return POM_OK;
-}
-
 static int proto_ipv6_cleanup(void *proto_priv) {
 
 	int res = POM_OK;
 
-	res += ptype_cleanup(param_frag_timeout);
+	res += defrag_cleanup(proto_ipv6_defrag);
 	res += ptype_cleanup(param_conntrack_timeout);
 
 	return res;
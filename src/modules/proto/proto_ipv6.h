@@ -24,10 +24,6 @@
 #include <stdint.h>
 #include <pom-ng/proto.h>
 
-#define PROTO_IPV6_FLAG_GOT_LAST	0x1
-#define PROTO_IPV6_FLAG_PROCESSED	0x2
-
-
 #define PROTO_IPV6_FIELD_NUM 4
 
 enum proto_ipv6_fields {
@@ -37,24 +33,10 @@ enum proto_ipv6_fields {
 
 };
 
-struct proto_ipv6_fragment {
-
-	uint32_t id;
-	unsigned int count;
-	struct packet_multipart *multipart;
-	unsigned int flags;
-	struct conntrack_timer *t;
-	struct proto_ipv6_fragment *prev, *next;
-	uint8_t nxthdr;
-};
-
-
 struct mod_reg_info* proto_ipv6_reg_info();
 static int proto_ipv6_init(struct proto *proto, struct registry_instance *i);
 static int proto_ipv6_mod_register(struct mod_reg *mod);
 static int proto_ipv6_process(void *proto_priv, struct packet *p, struct proto_process_stack *stack, unsigned int stack_index);
-static int proto_ipv6_fragment_cleanup(struct conntrack_entry *ce, void *priv, ptime now);
-static int proto_ipv6_conntrack_cleanup(void *ce_priv);
 static int proto_ipv6_cleanup(void *proto_priv);
 static int proto_ipv6_mod_unregister();
 
@@ -64,6 +64,8 @@ static int proto_tftp_mod_register(struct mod_reg *mod) {
 	ct_info.default_table_size = 1; // No hashing done here
 	ct_info.cleanup_handler = proto_tftp_conntrack_cleanup;
 	proto_tftp.ct_info = &ct_info;
+	// Transfers happen on ports negotiated in the requests
+	proto_tftp.flags = PROTO_REG_FLAG_EXPECTATIONS;
 
 	proto_tftp.init = proto_tftp_init;
 	proto_tftp.process = proto_tftp_process;
@@ -58,6 +58,7 @@ int ptype_bool_mod_register(struct mod_reg *mod) {
 	pt_bool.unserialize = ptype_bool_parse;
 	pt_bool.copy = ptype_bool_copy;
 	pt_bool.value_size = ptype_bool_value_size;
+	pt_bool.fixed_size = sizeof(char);
 
 	pt_bool.ops = PTYPE_OP_ALL;
 
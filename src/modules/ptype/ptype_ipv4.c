@@ -58,6 +58,7 @@ int ptype_ipv4_mod_register(struct mod_reg *mod) {
 	pt_ipv4.unserialize = ptype_ipv4_parse;
 	pt_ipv4.copy = ptype_ipv4_copy;
 	pt_ipv4.value_size = ptype_ipv4_value_size;
+	pt_ipv4.fixed_size = sizeof(struct ptype_ipv4_val);
 
 	pt_ipv4.ops = PTYPE_OP_ALL;
 
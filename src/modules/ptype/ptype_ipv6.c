@@ -55,6 +55,7 @@ int ptype_ipv6_mod_register(struct mod_reg *mod) {
 	pt_ipv6.unserialize = ptype_ipv6_parse;
 	pt_ipv6.copy = ptype_ipv6_copy;
 	pt_ipv6.value_size = ptype_ipv6_value_size;
+	pt_ipv6.fixed_size = sizeof(struct ptype_ipv6_val);
 
 	pt_ipv6.ops = PTYPE_OP_ALL;
 
@@ -58,6 +58,7 @@ int ptype_mac_mod_register(struct mod_reg *mod) {
 	pt_mac.unserialize = ptype_mac_parse;
 	pt_mac.copy = ptype_mac_copy;
 	pt_mac.value_size = ptype_mac_value_size;
+	pt_mac.fixed_size = sizeof(struct ptype_mac_val);
 
 	pt_mac.ops = PTYPE_OP_EQ;
 
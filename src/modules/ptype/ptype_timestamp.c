@@ -57,6 +57,7 @@ int ptype_timestamp_mod_register(struct mod_reg *mod) {
 	pt_timestamp.unserialize = ptype_timestamp_unserialize;
 	pt_timestamp.copy = ptype_timestamp_copy;
 	pt_timestamp.value_size = ptype_timestamp_value_size;
+	pt_timestamp.fixed_size = sizeof(ptime);
 
 	pt_timestamp.ops = PTYPE_OP_ALL;
 
@@ -56,6 +56,7 @@ int ptype_uint16_mod_register(struct mod_reg *mod) {
 	pt_u16.unserialize = ptype_uint16_parse;
 	pt_u16.copy = ptype_uint16_copy;
 	pt_u16.value_size = ptype_uint16_value_size;
+	pt_u16.fixed_size = sizeof(uint16_t);
 
 	pt_u16.ops = PTYPE_OP_ALL;
 
@@ -56,6 +56,7 @@ int ptype_uint32_mod_register(struct mod_reg *mod) {
 	pt_u32.unserialize = ptype_uint32_parse;
 	pt_u32.copy = ptype_uint32_copy;
 	pt_u32.value_size = ptype_uint32_value_size;
+	pt_u32.fixed_size = sizeof(uint32_t);
 
 	pt_u32.ops = PTYPE_OP_ALL;
 
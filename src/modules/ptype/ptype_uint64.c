@@ -57,6 +57,7 @@ int ptype_uint64_mod_register(struct mod_reg *mod) {
 	pt_u64.unserialize = ptype_uint64_parse;
 	pt_u64.copy = ptype_uint64_copy;
 	pt_u64.value_size = ptype_uint64_value_size;
+	pt_u64.fixed_size = sizeof(uint64_t);
 
 	pt_u64.ops = PTYPE_OP_ALL;
 
@@ -56,6 +56,7 @@ int ptype_uint8_mod_register(struct mod_reg *mod) {
 	pt_u8.unserialize = ptype_uint8_parse;
 	pt_u8.copy = ptype_uint8_copy;
 	pt_u8.value_size = ptype_uint8_value_size;
+	pt_u8.fixed_size = sizeof(uint8_t);
 
 	pt_u8.ops = PTYPE_OP_ALL;
 
@@ -26,6 +26,7 @@
 #include "main.h"
 #include "core.h"
 #include "filter.h"
+#include "ptype.h"
 
 #if 0
 #define debug_stream_parser(x ...) pomlog(POMLOG_DEBUG "stream_parser: " x)
@@ -45,18 +46,265 @@
 
 static struct registry_perf *perf_pkt_buff = NULL;
 static struct registry_perf *perf_pkt_in_use = NULL;
+static struct registry_perf *perf_pkt_slab = NULL;
+
+// Slab caches, one per thread allocating packets
+static pthread_key_t packet_slab_key;
+static __thread struct packet_slab_cache *packet_slab_cache = NULL;
+static struct packet_slab_cache *packet_slab_caches = NULL;
+static pthread_mutex_t packet_slab_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void packet_slab_thread_exit(void *priv) {
+
+	// Objects from this cache might still be in use, leave it to the next thread
+	struct packet_slab_cache *cache = priv;
+	pom_mutex_lock(&packet_slab_lock);
+	cache->owned = 0;
+	pom_mutex_unlock(&packet_slab_lock);
+}
+
+static struct packet_slab_cache *packet_slab_get_cache() {
+
+	if (packet_slab_cache)
+		return packet_slab_cache;
+
+	struct packet_slab_cache *cache = NULL;
+
+	// Adopt the cache of a thread that exited if any
+	pom_mutex_lock(&packet_slab_lock);
+	for (cache = packet_slab_caches; cache && cache->owned; cache = cache->next);
+
+	if (!cache) {
+		cache = malloc(sizeof(struct packet_slab_cache));
+		if (!cache) {
+			pom_mutex_unlock(&packet_slab_lock);
+			pom_oom(sizeof(struct packet_slab_cache));
+			return NULL;
+		}
+		memset(cache, 0, sizeof(struct packet_slab_cache));
+
+		unsigned int i;
+		cache->classes[0].obj_size = sizeof(struct packet_slab_obj) + sizeof(struct packet);
+		for (i = 1; i < PACKET_SLAB_CLASS_COUNT; i++)
+			cache->classes[i].obj_size = sizeof(struct packet_slab_obj) + sizeof(struct packet_buffer) + PACKET_SLAB_CLASS_PAYLOAD(i) + (2 * PACKET_BUFFER_ALIGNMENT);
+
+		// Keep the objects aligned in the chunks
+		for (i = 0; i < PACKET_SLAB_CLASS_COUNT; i++)
+			cache->classes[i].obj_size = (cache->classes[i].obj_size + sizeof(void*) - 1) & ~(sizeof(void*) - 1);
+
+		cache->next = packet_slab_caches;
+		packet_slab_caches = cache;
+	}
+	cache->owned = 1;
+	pom_mutex_unlock(&packet_slab_lock);
+
+	pthread_setspecific(packet_slab_key, cache);
+	packet_slab_cache = cache;
+
+	return cache;
+}
+
+static int packet_slab_grow(struct packet_slab_cache *cache, unsigned int class_id) {
+
+	struct packet_slab_class *cls = &cache->classes[class_id];
+
+	unsigned int count = PACKET_SLAB_CHUNK_SIZE / cls->obj_size;
+	if (!count)
+		count = 1;
+
+	size_t size = sizeof(struct packet_slab_chunk) + (count * cls->obj_size);
+	struct packet_slab_chunk *chunk = malloc(size);
+	if (!chunk) {
+		pom_oom(size);
+		return POM_ERR;
+	}
+	memset(chunk, 0, sizeof(struct packet_slab_chunk));
+	chunk->size = size;
+	chunk->cache = cache;
+	chunk->class_id = class_id;
+	chunk->count = count;
+
+	chunk->next = cache->chunks;
+	if (chunk->next)
+		chunk->next->prev = chunk;
+	cache->chunks = chunk;
+
+	void *pos = (void*)chunk + sizeof(struct packet_slab_chunk);
+	unsigned int i;
+	for (i = 0; i < count; i++) {
+		struct packet_slab_obj *obj = pos + (i * cls->obj_size);
+		obj->chunk = chunk;
+		obj->prev = NULL;
+		obj->next = cls->free;
+		if (obj->next)
+			obj->next->prev = obj;
+		cls->free = obj;
+	}
+	cls->empty++;
+
+	registry_perf_inc(perf_pkt_slab, size);
+
+	return POM_OK;
+}
+
+static void packet_slab_chunk_free(struct packet_slab_cache *cache, struct packet_slab_chunk *chunk) {
+
+	struct packet_slab_class *cls = &cache->classes[chunk->class_id];
+
+	// All the objects of the chunk are in the free list
+	void *pos = (void*)chunk + sizeof(struct packet_slab_chunk);
+	unsigned int i;
+	for (i = 0; i < chunk->count; i++) {
+		struct packet_slab_obj *obj = pos + (i * cls->obj_size);
+		if (obj->prev)
+			obj->prev->next = obj->next;
+		else
+			cls->free = obj->next;
+		if (obj->next)
+			obj->next->prev = obj->prev;
+	}
+
+	if (chunk->prev)
+		chunk->prev->next = chunk->next;
+	else
+		cache->chunks = chunk->next;
+	if (chunk->next)
+		chunk->next->prev = chunk->prev;
+
+	registry_perf_dec(perf_pkt_slab, chunk->size);
+	free(chunk);
+}
+
+static void packet_slab_put(struct packet_slab_cache *cache, struct packet_slab_obj *obj) {
+
+	struct packet_slab_chunk *chunk = obj->chunk;
+	struct packet_slab_class *cls = &cache->classes[chunk->class_id];
+
+	obj->prev = NULL;
+	obj->next = cls->free;
+	if (obj->next)
+		obj->next->prev = obj;
+	cls->free = obj;
+
+	if (--chunk->used)
+		return;
+
+	// Keep a few unused chunks to absorb bursts, give the others back
+	if (cls->empty < PACKET_SLAB_EMPTY_MAX) {
+		cls->empty++;
+		return;
+	}
+
+	packet_slab_chunk_free(cache, chunk);
+}
+
+static void packet_slab_drain(struct packet_slab_cache *cache, struct packet_slab_class *cls) {
+
+	// Take back everything that the other threads released
+	struct packet_slab_obj *obj = __sync_lock_test_and_set(&cls->remote_free, NULL);
+	while (obj) {
+		struct packet_slab_obj *next = obj->next;
+		packet_slab_put(cache, obj);
+		obj = next;
+	}
+}
+
+static void *packet_slab_alloc(unsigned int class_id) {
+
+	struct packet_slab_cache *cache = packet_slab_get_cache();
+	if (!cache)
+		return NULL;
+
+	struct packet_slab_class *cls = &cache->classes[class_id];
+
+	// Objects usually come back from the processing threads
+	if (cls->remote_free)
+		packet_slab_drain(cache, cls);
+
+	if (!cls->free && packet_slab_grow(cache, class_id) != POM_OK)
+		return NULL;
+
+	struct packet_slab_obj *obj = cls->free;
+	cls->free = obj->next;
+	if (cls->free)
+		cls->free->prev = NULL;
+
+	if (!obj->chunk->used++)
+		cls->empty--;
+
+	return (void*)obj + sizeof(struct packet_slab_obj);
+}
+
+static void packet_slab_release(void *ptr) {
+
+	struct packet_slab_obj *obj = ptr - sizeof(struct packet_slab_obj);
+	struct packet_slab_cache *cache = obj->chunk->cache;
+
+	if (cache == packet_slab_cache) {
+		packet_slab_put(cache, obj);
+		return;
+	}
+
+	// Owned by another thread, only the owner takes objects out of that list
+	struct packet_slab_class *cls = &cache->classes[obj->chunk->class_id];
+	struct packet_slab_obj *head;
+	do {
+		head = cls->remote_free;
+		obj->next = head;
+	} while (!__sync_bool_compare_and_swap(&cls->remote_free, head, obj));
+}
+
+void packet_slab_trim() {
+
+	// Give back the unused chunks of this thread's cache
+	if (!packet_slab_cache)
+		return;
+
+	unsigned int i;
+	for (i = 0; i < PACKET_SLAB_CLASS_COUNT; i++)
+		packet_slab_drain(packet_slab_cache, &packet_slab_cache->classes[i]);
+}
 
 int packet_init() {
 	perf_pkt_buff = core_add_perf("pkt_buff", registry_perf_type_gauge, "Number of bytes used by packets", "bytes");
 	perf_pkt_in_use = core_add_perf("pkt_in_use", registry_perf_type_gauge, "Number of packets in use", "pkts");
+	perf_pkt_slab = core_add_perf("pkt_slab", registry_perf_type_gauge, "Number of bytes reserved by the packet slabs", "bytes");
 
-	if (!perf_pkt_buff || !perf_pkt_in_use)
+	if (!perf_pkt_buff || !perf_pkt_in_use || !perf_pkt_slab)
 		return POM_ERR;
+
+	int res = pthread_key_create(&packet_slab_key, packet_slab_thread_exit);
+	if (res) {
+		pomlog(POMLOG_ERR "Error while creating the packet slab key : %s", pom_strerror(res));
+		return POM_ERR;
+	}
+
+	return POM_OK;
+}
+
+int packet_cleanup() {
+
+	// All the packets must have been released by now
+	pthread_key_delete(packet_slab_key);
+
+	while (packet_slab_caches) {
+		struct packet_slab_cache *cache = packet_slab_caches;
+		packet_slab_caches = cache->next;
+
+		while (cache->chunks) {
+			struct packet_slab_chunk *chunk = cache->chunks;
+			cache->chunks = chunk->next;
+			registry_perf_dec(perf_pkt_slab, chunk->size);
+			free(chunk);
+		}
+		free(cache);
+	}
+
 	return POM_OK;
 }
 
 // Packet info pool stuff
-static __thread struct packet_info **packet_info_pool;
+static __thread struct packet_info_pool *packet_info_pool;
 
 int packet_buffer_alloc(struct packet *pkt, size_t size, size_t align_offset) {
 
@@ -65,18 +313,32 @@ int packet_buffer_alloc(struct packet *pkt, size_t size, size_t align_offset) {
 		return POM_ERR;
 	}
 
+	// Find the smallest class that fits
+	unsigned int class_id;
+	for (class_id = 1; class_id < PACKET_SLAB_CLASS_COUNT && PACKET_SLAB_CLASS_PAYLOAD(class_id) < size; class_id++);
+
 	size_t tot_size = size + align_offset + PACKET_BUFFER_ALIGNMENT + sizeof(struct packet_buffer);
 
-	struct packet_buffer *pb = malloc(tot_size);
-	if (!pb) {
-		pom_oom(tot_size);
-		return POM_ERR;
+	struct packet_buffer *pb = NULL;
+	if (class_id < PACKET_SLAB_CLASS_COUNT) {
+		pb = packet_slab_alloc(class_id);
+		if (!pb)
+			return POM_ERR;
+		tot_size = packet_slab_cache->classes[class_id].obj_size - sizeof(struct packet_slab_obj);
+	} else {
+		// Too big for the slabs
+		pb = malloc(tot_size);
+		if (!pb) {
+			pom_oom(tot_size);
+			return POM_ERR;
+		}
 	}
-	memset(pb, 0, tot_size);
 
+	// The buffer is not zeroed, the caller must fill all of it
 	pb->base_buff = (void*)pb + sizeof(struct packet_buffer);
 	pb->aligned_buff = (void*) (((long)pb->base_buff & ~(PACKET_BUFFER_ALIGNMENT - 1)) + PACKET_BUFFER_ALIGNMENT + align_offset);
 	pb->buff_size = tot_size;
+	pb->class_id = class_id;
 
 	pkt->pkt_buff = pb;
 	pkt->len = size;
@@ -91,13 +353,19 @@ int packet_buffer_alloc(struct packet *pkt, size_t size, size_t align_offset) {
 void packet_buffer_release(struct packet_buffer *pb) {
 
 	registry_perf_dec(perf_pkt_buff, pb->buff_size);
-	free(pb);
+
+	if (pb->class_id < PACKET_SLAB_CLASS_COUNT)
+		packet_slab_release(pb);
+	else
+		free(pb);
 }
 
 
 struct packet *packet_alloc() {
 
-	struct packet *tmp = malloc(sizeof(struct packet));
+	struct packet *tmp = packet_slab_alloc(0);
+	if (!tmp)
+		return NULL;
 	memset(tmp, 0, sizeof(struct packet));
 
 	// Init the refcount
@@ -155,9 +423,11 @@ int packet_release(struct packet *p) {
 	
 	if (p->pkt_buff)
 		packet_buffer_release(p->pkt_buff);
+	else if (p->buff_release)
+		p->buff_release(p->buff_release_priv);
 
 	registry_perf_dec(perf_pkt_in_use, 1);
-	free(p);
+	packet_slab_release(p);
 
 	return POM_OK;
 }
@@ -166,7 +436,7 @@ int packet_info_pool_init() {
 
 	unsigned int proto_count = proto_get_count();
 
-	size_t size = sizeof(struct packet_info*) * proto_count;
+	size_t size = sizeof(struct packet_info_pool) * proto_count;
 
 	packet_info_pool = malloc(size);
 	if (!packet_info_pool) {
@@ -178,47 +448,129 @@ int packet_info_pool_init() {
 	return POM_OK;
 }
 
+static int packet_info_pool_layout(struct proto *p, struct packet_info_pool *pool) {
+
+	struct proto_pkt_field *fields = p->info->pkt_fields;
+	unsigned int i, count;
+	for (count = 0; fields[count].name; count++);
+
+	// Block layout : struct packet_info, fields_value, the ptypes and then the fixed size values
+	size_t values_offset = sizeof(struct packet_info) + (sizeof(struct ptype*) * (count + 1)) + (sizeof(struct ptype) * count);
+	values_offset = PACKET_INFO_ALIGN(values_offset);
+
+	size_t size = sizeof(size_t) * count;
+	size_t *offsets = malloc(size);
+	if (!offsets) {
+		pom_oom(size);
+		return POM_ERR;
+	}
+
+	size_t values_size = 0;
+	for (i = 0; i < count; i++) {
+		size_t fixed_size = ptype_get_fixed_size(fields[i].value_type);
+		if (!fixed_size) {
+			offsets[i] = 0;
+			continue;
+		}
+		offsets[i] = values_offset + values_size;
+		values_size += PACKET_INFO_ALIGN(fixed_size);
+	}
+
+	// Keep the initial values so new blocks get them with a single copy
+	void *values = NULL;
+	if (values_size) {
+		values = malloc(values_size);
+		if (!values) {
+			pom_oom(values_size);
+			free(offsets);
+			return POM_ERR;
+		}
+		memset(values, 0, values_size);
+
+		for (i = 0; i < count; i++) {
+			if (!offsets[i])
+				continue;
+			struct ptype *tmp = ptype_alloc_from_type(fields[i].value_type);
+			if (!tmp) {
+				free(values);
+				free(offsets);
+				return POM_ERR;
+			}
+			memcpy(values + offsets[i] - values_offset, tmp->value, ptype_get_fixed_size(fields[i].value_type));
+			ptype_cleanup(tmp);
+		}
+	}
+
+	pool->field_count = count;
+	pool->size = values_offset + values_size;
+	pool->values_offset = values_offset;
+	pool->values = values;
+	pool->offsets = offsets;
+
+	debug_info_pool("Layout for proto %s : %u fields, %zu bytes", p->info->name, count, pool->size);
+
+	return POM_OK;
+}
+
+static void packet_info_pool_free(struct packet_info_pool *pool, struct packet_info *info) {
+
+	unsigned int i;
+	for (i = 0; i < pool->field_count; i++)
+		ptype_cleanup_inline(info->fields_value[i], (pool->offsets[i] != 0));
+
+	free(info);
+}
+
 struct packet_info *packet_info_pool_get(struct proto *p) {
 
 	struct packet_info *info = NULL;
 
-	struct packet_info **pool = &packet_info_pool[p->id];
+	struct packet_info_pool *pool = &packet_info_pool[p->id];
 
-	if (*pool) {
+	if (pool->unused) {
 		// We can reuse the old one
-		info = *pool;
-		*pool = (*pool)->next;
+		info = pool->unused;
+		pool->unused = info->next;
 		
 		debug_info_pool("Used info %p for proto %s", info, p->info->name);
-	} else {
-		// Allocate new packet_info
-		info = malloc(sizeof(struct packet_info));
-		if (!info) {
-			pom_oom(sizeof(struct packet_info));
+		return info;
+	}
+
+	if (!pool->offsets && packet_info_pool_layout(p, pool) != POM_OK)
+		return NULL;
+
+	// Allocate a new packet_info with all its fields in the same block
+	info = malloc(pool->size);
+	if (!info) {
+		pom_oom(pool->size);
+		return NULL;
+	}
+	memset(info, 0, pool->values_offset);
+	if (pool->values)
+		memcpy((void*)info + pool->values_offset, pool->values, pool->size - pool->values_offset);
+
+	struct proto_pkt_field *fields = p->info->pkt_fields;
+	info->fields_value = (void*)info + sizeof(struct packet_info);
+	struct ptype *ptypes = (void*)info->fields_value + (sizeof(struct ptype*) * (pool->field_count + 1));
+
+	unsigned int i;
+	for (i = 0; i < pool->field_count; i++) {
+		info->fields_value[i] = &ptypes[i];
+
+		// Variable size values are still allocated separately
+		void *value = (pool->offsets[i] ? (void*)info + pool->offsets[i] : NULL);
+		if (ptype_init_inline(fields[i].value_type, &ptypes[i], value) != POM_OK) {
+			// Only cleanup what was allocated so far
+			unsigned int count = pool->field_count;
+			pool->field_count = i;
+			packet_info_pool_free(pool, info);
+			pool->field_count = count;
 			return NULL;
 		}
-		memset(info, 0, sizeof(struct packet_info));
-		struct proto_pkt_field *fields = p->info->pkt_fields;
-		int i;
-		for (i = 0; fields[i].name; i++);
-
-		info->fields_value = malloc(sizeof(struct ptype*) * (i + 1));
-		memset(info->fields_value, 0, sizeof(struct ptype*) * (i + 1));
-
-		for (; i--; ){
-			info->fields_value[i] = ptype_alloc_from_type(fields[i].value_type);
-			if (!info->fields_value[i]) {
-				i++;
-				for (; fields[i].name; i++)
-					ptype_cleanup(info->fields_value[i]);
-				free(info);
-				return NULL;
-			}
-		}
-
-		debug_info_pool("Allocated info %p for proto %s", info, p->info->name);
 	}
 
+	debug_info_pool("Allocated info %p for proto %s", info, p->info->name);
+
 	return info;
 }
 
@@ -232,7 +584,7 @@ struct packet_info *packet_info_pool_clone(struct proto *p, struct packet_info *
 	int i;
 	for (i = 0; fields[i].name; i++) {
 		if (ptype_copy(new_info->fields_value[i], info->fields_value[i]) != POM_OK) {
-			packet_info_pool_release(new_info, p->id);
+			packet_info_pool_release(new_info, p);
 			return NULL;
 		}
 	}
@@ -241,43 +593,59 @@ struct packet_info *packet_info_pool_clone(struct proto *p, struct packet_info *
 }
 
 
-int packet_info_pool_release(struct packet_info *info, unsigned int protocol_id) {
+int packet_info_pool_release(struct packet_info *info, struct proto *p) {
 
 	if (!info)
 		return POM_OK;
 
-	info->next = packet_info_pool[protocol_id];
-	packet_info_pool[protocol_id] = info;
+	// The info may come from another thread's pool, make sure this one
+	// knows the layout so the variable size values get freed on trim
+	struct packet_info_pool *pool = &packet_info_pool[p->id];
+	if (!pool->offsets && packet_info_pool_layout(p, pool) != POM_OK)
+		return POM_ERR;
+
+	info->next = pool->unused;
+	pool->unused = info;
 
 
 	return POM_OK;
 }
 
 
-int packet_info_pool_cleanup() {
+int packet_info_pool_trim() {
 
 	unsigned int proto_count = proto_get_count();
 
 	unsigned int i;
-	
+
 	for (i = 0; i < proto_count; i++) {
 
-		struct packet_info *pool = packet_info_pool[i];
-		
-		while (pool) {
+		struct packet_info_pool *pool = &packet_info_pool[i];
+
+		while (pool->unused) {
+			struct packet_info *tmp = pool->unused;
+			pool->unused = tmp->next;
+			packet_info_pool_free(pool, tmp);
+		}
+	}
 
-			struct packet_info *tmp = pool;
+	return POM_OK;
+}
 
-			int j;
-			for (j = 0; tmp->fields_value[j]; j++)
-				ptype_cleanup(tmp->fields_value[j]);
+int packet_info_pool_cleanup() {
 
-			free(tmp->fields_value);
+	unsigned int proto_count = proto_get_count();
 
-			pool = tmp->next;
-			free(tmp);
-			
-		}
+	unsigned int i;
+
+	packet_info_pool_trim();
+
+	for (i = 0; i < proto_count; i++) {
+
+		struct packet_info_pool *pool = &packet_info_pool[i];
+
+		free(pool->values);
+		free(pool->offsets);
 	}
 
 	free(packet_info_pool);
@@ -441,6 +809,8 @@ int packet_multipart_process(struct packet_multipart *multipart, struct proto_pr
 		return PROTO_ERR;
 	}
 
+	// The buffer isn't zeroed, clear what the parts don't cover
+	size_t pos = 0;
 	struct packet_multipart_pkt *tmp = multipart->head;
 	for (; tmp; tmp = tmp->next) {
 		if (tmp->offset + tmp->len > multipart->cur) {
@@ -449,8 +819,14 @@ int packet_multipart_process(struct packet_multipart *multipart, struct proto_pr
 			packet_multipart_cleanup(multipart);
 			return PROTO_INVALID;
 		}
+		if (tmp->offset > pos)
+			memset(p->buff + pos, 0, tmp->offset - pos);
 		memcpy(p->buff + tmp->offset, tmp->pkt->buff + tmp->pkt_buff_offset, tmp->len);
+		if (tmp->offset + tmp->len > pos)
+			pos = tmp->offset + tmp->len;
 	}
+	if (pos < multipart->cur)
+		memset(p->buff + pos, 0, multipart->cur - pos);
 
 	p->ts = multipart->tail->pkt->ts;
 	
@@ -687,6 +1063,7 @@ int packet_filter_prop_compile(struct filter *f, char *prop_str, struct filter_v
 
 	v->type = filter_value_type_prop;
 	v->val.prop.priv = prop;
+	v->val.prop.base = proto;
 	prop->proto = proto;
 
 	if (dot) {
@@ -700,6 +1077,7 @@ int packet_filter_prop_compile(struct filter *f, char *prop_str, struct filter_v
 			return POM_ERR;
 		}
 		prop->field_id = field_id;
+		v->val.prop.id = field_id;
 		prop->pt_reg = proto->info->pkt_fields[field_id].value_type;
 
 		if (filter_ptype_is_integer(prop->pt_reg)) {
@@ -713,23 +1091,34 @@ int packet_filter_prop_compile(struct filter *f, char *prop_str, struct filter_v
 	} else {
 		// We'll output the proto name
 		v->val.prop.out_type = filter_value_type_string;
+		v->val.prop.id = -1;
 		prop->field_id = -1;
 	}
 
 	return POM_OK;
 }
 
-int packet_filter_prop_get_val(struct filter_value *inval, struct filter_value *outval, void *obj) {
+int packet_filter_prop_resolve(void **bases, void **objs, unsigned int count, void *obj) {
 
+	// Find the stack entry of each proto used by the filter in a single pass
 	struct proto_process_stack *stack = obj;
-	struct packet_filter_prop *prop = inval->val.prop.priv;
 
+	unsigned int i, j;
+	for (j = CORE_PROTO_STACK_START; j <= CORE_PROTO_STACK_MAX && stack[j].proto; j++) {
+		for (i = 0; i < count; i++) {
+			if (bases[i] == stack[j].proto && !objs[i])
+				objs[i] = &stack[j];
+		}
+	}
+
+	return POM_OK;
+}
 
-	unsigned int j;
-	for (j = CORE_PROTO_STACK_START; j <= CORE_PROTO_STACK_MAX && stack[j].proto && stack[j].proto != prop->proto; j++);
+int packet_filter_prop_get_val(struct filter_value *inval, struct filter_value *outval, void *obj) {
 
-	if (!stack[j].proto)
-		return POM_OK;
+	// The object is the stack entry of the proto
+	struct proto_process_stack *s = obj;
+	struct packet_filter_prop *prop = inval->val.prop.priv;
 
 	if (prop->field_id == -1) {
 		outval->val.string = prop->proto->info->name;
@@ -737,7 +1126,7 @@ int packet_filter_prop_get_val(struct filter_value *inval, struct filter_value *
 		return POM_OK;
 	}
 
-	struct ptype *out_ptype = stack[j].pkt_info->fields_value[prop->field_id];
+	struct ptype *out_ptype = s->pkt_info->fields_value[prop->field_id];
 
 	if (!out_ptype)
 		return POM_OK;
@@ -754,7 +1143,7 @@ void packet_filter_prop_cleanup(void *prop) {
 
 struct filter *packet_filter_compile(char *filter_expr) {
 
-	struct filter *f = filter_alloc(packet_filter_prop_compile, NULL, packet_filter_prop_get_val, packet_filter_prop_cleanup);
+	struct filter *f = filter_alloc(packet_filter_prop_compile, NULL, packet_filter_prop_get_val, packet_filter_prop_resolve, packet_filter_prop_cleanup);
 	if (!f)
 		return NULL;
 	if (filter_compile(filter_expr, f) != POM_OK) {
@@ -28,16 +28,65 @@
 
 #define PACKET_BUFFER_ALIGNMENT 4
 
+// Class 0 holds struct packet, the others hold buffers with a payload from 64 bytes up to 64KB
+#define PACKET_SLAB_CLASS_COUNT		12
+#define PACKET_SLAB_CLASS_PAYLOAD(x)	(32 << (x))
+#define PACKET_SLAB_CHUNK_SIZE		(256 * 1024)
+#define PACKET_SLAB_EMPTY_MAX		1 // Unused chunks kept by each class, the others are freed
+
 struct packet_buffer {
 
 	void *base_buff;
 	void *aligned_buff;
 	size_t buff_size;
+	unsigned int class_id; // PACKET_SLAB_CLASS_COUNT if not allocated from a slab
 
 	// The actual data will be after this
 	
 };
 
+struct packet_slab_obj {
+	struct packet_slab_obj *next, *prev; // Only next is used in the remote free list
+	struct packet_slab_chunk *chunk;
+
+	// The object will be after this
+};
+
+struct packet_slab_chunk {
+	struct packet_slab_chunk *next, *prev;
+	struct packet_slab_cache *cache;
+	unsigned int class_id;
+	unsigned int count; // Number of objects in the chunk
+	unsigned int used; // Number of objects not in the free list of the class
+	size_t size;
+};
+
+struct packet_slab_class {
+	size_t obj_size;
+	struct packet_slab_obj *free; // Only used by the owner thread
+	struct packet_slab_obj *remote_free; // Objects released by other threads
+	unsigned int empty; // Number of chunks without any object in use
+};
+
+struct packet_slab_cache {
+	struct packet_slab_class classes[PACKET_SLAB_CLASS_COUNT];
+	struct packet_slab_chunk *chunks;
+	int owned; // A thread is using this cache
+	struct packet_slab_cache *next;
+};
+
+#define PACKET_INFO_ALIGN(x)	(((x) + 7) & ~7)
+
+// Per protocol pool of packet_info along with the layout of their block
+struct packet_info_pool {
+	struct packet_info *unused;
+	unsigned int field_count;
+	size_t size; // Total size of a block
+	size_t values_offset; // Where the fixed size values start
+	size_t *offsets; // Offset of each fixed size value, 0 for separately allocated ones
+	void *values; // Initial fixed size values
+};
+
 struct packet_stream_parser {
 	size_t max_line_size;
 	char *buff;
@@ -55,14 +104,17 @@ struct packet_filter_prop {
 };
 
 int packet_init();
+int packet_cleanup();
 
 void packet_buffer_release(struct packet_buffer *pb);
+void packet_slab_trim();
 
 struct packet_info *packet_info_pool_get(struct proto *p);
 struct packet_info *packet_info_pool_clone(struct proto *p, struct packet_info *info);
 int packet_pool_cleanup();
 int packet_info_pool_init();
-int packet_info_pool_release(struct packet_info *info, unsigned int protocol_id);
+int packet_info_pool_release(struct packet_info *info, struct proto *p);
+int packet_info_pool_trim();
 int packet_info_pool_cleanup();
 
 #endif
@@ -1692,7 +1692,7 @@ void pload_filter_prop_cleanup(void *prop) {
 
 struct filter *pload_filter_compile(char *filter_expr) {
 
-	struct filter *f = filter_alloc(pload_filter_prop_compile, NULL, pload_filter_prop_get_val, pload_filter_prop_cleanup);
+	struct filter *f = filter_alloc(pload_filter_prop_compile, NULL, pload_filter_prop_get_val, NULL, pload_filter_prop_cleanup);
 	if (!f)
 		return NULL;
 	if (filter_compile(filter_expr, f) != POM_OK) {
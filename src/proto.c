@@ -25,6 +25,8 @@
 #include "main.h"
 #include "mod.h"
 #include "core.h"
+#include "event.h"
+#include "filter.h"
 #include <pom-ng/filter.h>
 
 
@@ -40,6 +42,12 @@ static struct registry_class *proto_registry_class = NULL;
 
 static struct proto_number_class *proto_number_class_head = NULL;
 
+// Numbers leading to the listened protocols, NULL if all the traffic is needed
+static pthread_mutex_t proto_listened_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct proto_listened_number *proto_listened_nums = NULL;
+static unsigned int proto_listened_count = 0;
+static uint32_t proto_listened_serial = 0;
+
 unsigned int proto_count = 0;
 
 int proto_init() {
@@ -107,8 +115,28 @@ int proto_register(struct proto_reg_info *reg_info) {
 		proto->perf_conn_cur = registry_instance_add_perf(proto->reg_instance, "conn_cur", registry_perf_type_gauge, "Current number of monitored connection", "connections");
 		proto->perf_conn_tot = registry_instance_add_perf(proto->reg_instance, "conn_tot", registry_perf_type_counter, "Total number of connections", "connections");
 		proto->perf_conn_hash_col = registry_instance_add_perf(proto->reg_instance, "conn_hash_col", registry_perf_type_counter, "Total number of conntrack hash collisions", "collisions");
+		proto->perf_conn_evicted = registry_instance_add_perf(proto->reg_instance, "conn_evicted", registry_perf_type_counter, "Total number of connections evicted to stay below the conntrack limits", "connections");
+		proto->perf_conn_evicted_weak = registry_instance_add_perf(proto->reg_instance, "conn_evicted_weak", registry_perf_type_counter, "Number of evicted connections which were half-open or without payload", "connections");
+
+		if (!proto->perf_conn_cur || !proto->perf_conn_tot || !proto->perf_conn_hash_col || !proto->perf_conn_evicted || !proto->perf_conn_evicted_weak)
+			goto err_conntrack;
 
-		if (!proto->perf_conn_cur || !proto->perf_conn_tot || !proto->perf_conn_hash_col)
+		proto->param_conntrack_max = ptype_alloc_unit("uint32", "connections");
+		if (!proto->param_conntrack_max)
+			goto err_conntrack;
+
+		struct registry_param *param = registry_new_param("conntrack_max", "0", proto->param_conntrack_max, "Maximum number of connections tracked for this protocol, 0 for no limit", REGISTRY_PARAM_FLAG_CLEANUP_VAL);
+		if (!param) {
+			ptype_cleanup(proto->param_conntrack_max);
+			goto err_conntrack;
+		}
+
+		if (registry_instance_add_param(proto->reg_instance, param) != POM_OK) {
+			registry_cleanup_param(param);
+			goto err_conntrack;
+		}
+
+		if (conntrack_table_add_perfs(proto->ct, proto->reg_instance) != POM_OK)
 			goto err_conntrack;
 
 	}
@@ -137,6 +165,8 @@ int proto_register(struct proto_reg_info *reg_info) {
 
 	pomlog(POMLOG_DEBUG "Proto %s registered", reg_info->name);
 
+	proto_listened_update();
+
 	return POM_OK;
 
 err_conntrack:
@@ -154,6 +184,85 @@ err_proto:
 
 }
 
+static struct proto_expectation **proto_expectation_get_list(struct proto *proto, struct ptype *value) {
+
+	if (!value || !proto->expectation_table)
+		return &proto->expectations;
+
+	return &proto->expectation_table[ptype_get_hash(value) & (PROTO_EXPECTATION_TABLE_SIZE - 1)];
+}
+
+// Return bit one if it matches in the forward direction and bit two for the reverse direction
+static int proto_expectation_match(struct proto_expectation *e, struct proto_process_stack *stack, unsigned int stack_index) {
+
+	int expt_dir = 3;
+
+	struct proto_expectation_stack *es = e->tail;
+	int stack_index_tmp = stack_index;
+	for (; es; es = es->prev, stack_index_tmp--) {
+
+		struct proto_process_stack *s_tmp = &stack[stack_index_tmp];
+
+		if (s_tmp->proto != es->proto)
+			return 0;
+
+		if (!es->fields[POM_DIR_FWD] && !es->fields[POM_DIR_REV]) {
+			// Nothing to match for this proto
+			continue;
+		}
+
+		struct ptype *fwd_value = s_tmp->pkt_info->fields_value[s_tmp->proto->info->ct_info->fwd_pkt_field_id];
+		struct ptype *rev_value = s_tmp->pkt_info->fields_value[s_tmp->proto->info->ct_info->rev_pkt_field_id];
+
+		if (expt_dir & 1) {
+			if ((es->fields[POM_DIR_FWD] && !ptype_compare_val(PTYPE_OP_EQ, es->fields[POM_DIR_FWD], fwd_value)) ||
+				(es->fields[POM_DIR_REV] && !ptype_compare_val(PTYPE_OP_EQ, es->fields[POM_DIR_REV], rev_value))) {
+				expt_dir &= ~1; // It doesn't match in the forward direction
+			}
+		}
+
+		if (expt_dir & 2) {
+			if ((es->fields[POM_DIR_FWD] && !ptype_compare_val(PTYPE_OP_EQ, es->fields[POM_DIR_FWD], rev_value)) ||
+				(es->fields[POM_DIR_REV] && !ptype_compare_val(PTYPE_OP_EQ, es->fields[POM_DIR_REV], fwd_value))) {
+				expt_dir &= ~2;
+			}
+		}
+
+		if (!expt_dir)
+			break;
+	}
+
+	return expt_dir;
+}
+
+// Find the lists which may contain expectations matching this packet
+static unsigned int proto_expectation_get_lists(struct proto *proto, struct proto_process_stack *s, struct proto_expectation **lists[3]) {
+
+	unsigned int count = 0;
+	lists[count++] = &proto->expectations;
+
+	if (!proto->expectation_table || !proto->info->ct_info)
+		return count;
+
+	struct conntrack_info *ct_info = proto->info->ct_info;
+	struct ptype *fwd_value = s->pkt_info->fields_value[ct_info->fwd_pkt_field_id];
+	struct ptype *rev_value = NULL;
+	if (ct_info->rev_pkt_field_id != CONNTRACK_PKT_FIELD_NONE)
+		rev_value = s->pkt_info->fields_value[ct_info->rev_pkt_field_id];
+
+	// The value used to index the expectation can match either field of the packet
+	if (fwd_value)
+		lists[count++] = proto_expectation_get_list(proto, fwd_value);
+
+	if (rev_value) {
+		struct proto_expectation **list = proto_expectation_get_list(proto, rev_value);
+		if (count < 2 || list != lists[1])
+			lists[count++] = list;
+	}
+
+	return count;
+}
+
 int proto_process(struct packet *p, struct proto_process_stack *stack, unsigned int stack_index) {
 
 	struct proto_process_stack *s = &stack[stack_index];
@@ -174,60 +283,27 @@ int proto_process(struct packet *p, struct proto_process_stack *stack, unsigned
 
 	// Process the expectations !
 	pom_rwlock_rlock(&proto->expectation_lock);
-	struct proto_expectation *e = NULL;
-	for (e = proto->expectations; e; e = e->next) {
 
-		if (e->flags & PROTO_EXPECTATION_FLAG_MATCHED) {
-			// Another thread already matched the expectation, continue
-			continue;
-		}
-		
-		// Bit one means it matches the forward direction
-		// Bit two means it matches the reverse direction
-
-		int expt_dir = 3;
-
-		struct proto_expectation_stack *es = e->tail;
-		int stack_index_tmp = stack_index;
-		while (es) {
+	if (!proto->expectation_count) {
+		pom_rwlock_unlock(&proto->expectation_lock);
+		return POM_OK;
+	}
 
-			struct proto_process_stack *s_tmp = &stack[stack_index_tmp];
+	struct proto_expectation **lists[3];
+	unsigned int list_count = proto_expectation_get_lists(proto, s, lists), i;
 
-			if (s_tmp->proto != es->proto) {
-				expt_dir = 0;
-				break;
-			}
+	struct proto_expectation *e = NULL;
+	for (i = 0; i < list_count; i++) {
+		for (e = *lists[i]; e; e = e->next) {
 
-			if (!es->fields[POM_DIR_FWD] && !es->fields[POM_DIR_REV]) {
-				// Nothing to match for this proto
+			if (e->flags & PROTO_EXPECTATION_FLAG_MATCHED) {
+				// Another thread already matched the expectation, continue
 				continue;
 			}
 
-			struct ptype *fwd_value = s_tmp->pkt_info->fields_value[s_tmp->proto->info->ct_info->fwd_pkt_field_id];
-			struct ptype *rev_value = s_tmp->pkt_info->fields_value[s_tmp->proto->info->ct_info->rev_pkt_field_id];
-
-			if (expt_dir & 1) {
-				if ((es->fields[POM_DIR_FWD] && !ptype_compare_val(PTYPE_OP_EQ, es->fields[POM_DIR_FWD], fwd_value)) ||
-					(es->fields[POM_DIR_REV] && !ptype_compare_val(PTYPE_OP_EQ, es->fields[POM_DIR_REV], rev_value))) {
-					expt_dir &= ~1; // It doesn't match in the forward direction
-				}
-			}
-
-			if (expt_dir & 2) {
-				if ((es->fields[POM_DIR_FWD] && !ptype_compare_val(PTYPE_OP_EQ, es->fields[POM_DIR_FWD], rev_value)) ||
-					(es->fields[POM_DIR_REV] && !ptype_compare_val(PTYPE_OP_EQ, es->fields[POM_DIR_REV], fwd_value))) {
-					expt_dir &= ~2;
-				}
-			}
-
-			if (!expt_dir)
-				break;
-
-			es = es->prev;
-			stack_index_tmp--;
-		}
+			if (!proto_expectation_match(e, stack, stack_index))
+				continue;
 
-		if (expt_dir) {
 			// It matched
 			if (!(__sync_fetch_and_or(&e->flags, PROTO_EXPECTATION_FLAG_MATCHED) & PROTO_EXPECTATION_FLAG_MATCHED)) {
 				// Something matched
@@ -245,65 +321,75 @@ int proto_process(struct packet *p, struct proto_process_stack *stack, unsigned
 
 	// Relock with write access
 	pom_rwlock_wlock(&proto->expectation_lock);
-	e = proto->expectations;
-	while (e) {
 
-		struct proto_expectation *cur = e;
-		e = e->next;
+	// The table might have been allocated in between
+	list_count = proto_expectation_get_lists(proto, s, lists);
 
-		if (!(cur->flags & PROTO_EXPECTATION_FLAG_MATCHED))
-			continue;
+	for (i = 0; i < list_count; i++) {
+		e = *lists[i];
+		while (e) {
 
-		// Remove the expectation from the conntrack
-		if (cur->next)
-			cur->next->prev = cur->prev;
-		if (cur->prev)
-			cur->prev->next = cur->next;
-		else
-			proto->expectations = cur->next;
+			struct proto_expectation *cur = e;
+			e = e->next;
 
-		// Remove matched and queued flags
-		__sync_fetch_and_and(&cur->flags, ~(PROTO_EXPECTATION_FLAG_MATCHED | PROTO_EXPECTATION_FLAG_QUEUED));
+			if (!(cur->flags & PROTO_EXPECTATION_FLAG_MATCHED))
+				continue;
 
-		struct proto_process_stack *s_next = &stack[stack_index + 1];
-		s_next->proto = cur->proto;
+			// Remove the expectation from the list
+			if (cur->next)
+				cur->next->prev = cur->prev;
+			if (cur->prev)
+				cur->prev->next = cur->next;
+			else
+				*cur->list = cur->next;
+			cur->next = NULL;
+			cur->prev = NULL;
+			cur->list = NULL;
+			proto->expectation_count--;
 
-		if (conntrack_get_unique_from_parent(stack, stack_index + 1) != POM_OK) {
-			proto_expectation_cleanup(cur);
-			continue;
-		}
+			// Remove matched and queued flags
+			__sync_fetch_and_and(&cur->flags, ~(PROTO_EXPECTATION_FLAG_MATCHED | PROTO_EXPECTATION_FLAG_QUEUED));
 
-		if (!s_next->ce->priv) {
-			s_next->ce->priv = cur->priv;
-			// Prevent cleanup of private data while cleaning the expectation
-			cur->priv = NULL;
-		}
+			struct proto_process_stack *s_next = &stack[stack_index + 1];
+			s_next->proto = cur->proto;
 
-
-		if (cur->session) {
-			if (conntrack_session_bind(s_next->ce, cur->session)) {
+			if (conntrack_get_unique_from_parent(stack, stack_index + 1) != POM_OK) {
 				proto_expectation_cleanup(cur);
 				continue;
 			}
-		}
 
-		registry_perf_dec(cur->proto->perf_expt_pending, 1);
-		registry_perf_inc(cur->proto->perf_expt_matched, 1);
+			if (!s_next->ce->priv) {
+				s_next->ce->priv = cur->priv;
+				// Prevent cleanup of private data while cleaning the expectation
+				cur->priv = NULL;
+			}
 
-		if (cur->match_callback) {
-			// Call the callback with the conntrack locked
-			cur->match_callback(cur, cur->callback_priv, s_next->ce);
-			// Nullify callback_priv so it doesn't get cleaned up
-			cur->callback_priv = NULL;
-		}
 
-		if (cur->expiry) {
-			// The expectation was added using 'add_and_cleanup' function
-			proto_expectation_cleanup(cur);
-		}
+			if (cur->session) {
+				if (conntrack_session_bind(s_next->ce, cur->session)) {
+					proto_expectation_cleanup(cur);
+					continue;
+				}
+			}
+
+			registry_perf_dec(cur->proto->perf_expt_pending, 1);
+			registry_perf_inc(cur->proto->perf_expt_matched, 1);
+
+			if (cur->match_callback) {
+				// Call the callback with the conntrack locked
+				cur->match_callback(cur, cur->callback_priv, s_next->ce);
+				// Nullify callback_priv so it doesn't get cleaned up
+				cur->callback_priv = NULL;
+			}
+
+			if (cur->expiry) {
+				// The expectation was added using 'add_and_cleanup' function
+				proto_expectation_cleanup(cur);
+			}
 
-		conntrack_unlock(s_next->ce);
+			conntrack_unlock(s_next->ce);
 
+		}
 	}
 	pom_rwlock_unlock(&proto->expectation_lock);
 
@@ -320,11 +406,22 @@ int proto_process_pload_listeners(struct packet *p, struct proto_process_stack *
 	struct proto *proto = s->proto;
 
 	if (proto && s_next->plen) {
-		
+
+		// Evaluate the filters of all the listeners at once when possible
+		struct filter_set *fs = proto->payload_filters;
+		uint64_t matches[fs ? FILTER_SET_WORDS(fs->count) : 1];
+		if (fs && filter_set_match(fs, stack, matches) != POM_OK)
+			pomlog(POMLOG_WARN "Error while matching payload listeners filters");
+
 		struct proto_packet_listener *l;
-		for (l = proto->payload_listeners; l; l = l->next) {
-			if (l->filter && packet_filter_match(l->filter, stack) != FILTER_MATCH_YES)
+		unsigned int i;
+		for (l = proto->payload_listeners, i = 0; l; l = l->next, i++) {
+			if (fs) {
+				if (!FILTER_SET_ISSET(matches, i))
+					continue;
+			} else if (l->filter && packet_filter_match(l->filter, stack) != FILTER_MATCH_YES) {
 				continue;
+			}
 			if (l->process(l->object, p, stack, stack_index + 1) != POM_OK) {
 				pomlog(POMLOG_WARN "Warning payload listener failed");
 				// FIXME remove listener from the list ?
@@ -346,10 +443,20 @@ int proto_post_process(struct packet *p, struct proto_process_stack *s, unsigned
 		return PROTO_ERR;
 
 	// Process the listeners after the whole stack has been processed
+	struct filter_set *fs = proto->packet_filters;
+	uint64_t matches[fs ? FILTER_SET_WORDS(fs->count) : 1];
+	if (fs && filter_set_match(fs, s, matches) != POM_OK)
+		pomlog(POMLOG_WARN "Error while matching packet listeners filters");
+
 	struct proto_packet_listener *l;
-	for (l = proto->packet_listeners; l; l = l->next) {
-		if (l->filter && packet_filter_match(l->filter, s) != FILTER_MATCH_YES)
+	unsigned int i;
+	for (l = proto->packet_listeners, i = 0; l; l = l->next, i++) {
+		if (fs) {
+			if (!FILTER_SET_ISSET(matches, i))
+				continue;
+		} else if (l->filter && packet_filter_match(l->filter, s) != FILTER_MATCH_YES) {
 			continue;
+		}
 		if (l->process(l->object, p, s, stack_index) != POM_OK) {
 			pomlog(POMLOG_WARN "Warning packet listener failed");
 			// FIXME remove listener from the list ?
@@ -390,8 +497,18 @@ int proto_unregister(char *name) {
 
 	mod_refcount_dec(proto->info->mod);
 
+	if (proto->expectation_table)
+		free(proto->expectation_table);
+
+	if (proto->packet_filters)
+		filter_set_cleanup(proto->packet_filters);
+	if (proto->payload_filters)
+		filter_set_cleanup(proto->payload_filters);
+
 	free(proto);
 
+	proto_listened_update();
+
 	return POM_OK;
 }
 
@@ -409,10 +526,16 @@ int proto_finish() {
 
 	// Cleanup the expectations first
 	for (proto = proto_head; proto; proto = proto->next) {
-		while (proto->expectations) {
-			struct proto_expectation *e = proto->expectations;
-			proto->expectations = e->next;
-			proto_expectation_cleanup(e);
+		while (proto->expectations)
+			proto_expectation_cleanup(proto->expectations);
+
+		if (!proto->expectation_table)
+			continue;
+
+		unsigned int i;
+		for (i = 0; i < PROTO_EXPECTATION_TABLE_SIZE; i++) {
+			while (proto->expectation_table[i])
+				proto_expectation_cleanup(proto->expectation_table[i]);
 		}
 	}
 
@@ -444,6 +567,8 @@ int proto_cleanup() {
 		if (res)
 			pomlog(POMLOG_ERR "Error while destroying the listners lock : %s", pom_strerror(res));
 
+		if (proto->expectation_table)
+			free(proto->expectation_table);
 
 		free(proto);
 	}
@@ -464,9 +589,58 @@ int proto_cleanup() {
 		free(cls);
 	}
 
+	// The listened numbers pointed to the classes
+	pom_mutex_lock(&proto_listened_lock);
+	free(proto_listened_nums);
+	proto_listened_nums = NULL;
+	proto_listened_count = 0;
+	pom_mutex_unlock(&proto_listened_lock);
+
 	return POM_OK;
 }
 
+static void proto_packet_listener_filters_update(struct proto *proto, unsigned int flags) {
+
+	struct proto_packet_listener *head = proto->packet_listeners;
+	struct filter_set **fs = &proto->packet_filters;
+	if (flags & PROTO_PACKET_LISTENER_PLOAD_ONLY) {
+		head = proto->payload_listeners;
+		fs = &proto->payload_filters;
+	}
+
+	if (*fs) {
+		filter_set_cleanup(*fs);
+		*fs = NULL;
+	}
+
+	// Only worth it if more than one listener has a filter
+	unsigned int count = 0, filter_count = 0;
+	struct proto_packet_listener *l;
+	for (l = head; l; l = l->next) {
+		count++;
+		if (l->filter)
+			filter_count++;
+	}
+
+	if (filter_count < 2)
+		return;
+
+	struct filter **filters = malloc(sizeof(struct filter *) * count);
+	if (!filters) {
+		pom_oom(sizeof(struct filter *) * count);
+		return;
+	}
+
+	unsigned int i;
+	for (l = head, i = 0; l; l = l->next, i++)
+		filters[i] = l->filter;
+
+	// Listeners filters are matched one by one if this fails
+	*fs = filter_set_compile(filters, count);
+
+	free(filters);
+}
+
 struct proto_packet_listener *proto_packet_listener_register(struct proto *proto, unsigned int flags, void *object, int (*process) (void *object, struct packet *p, struct proto_process_stack *s, unsigned int stack_index), struct filter *f) {
 
 	core_assert_is_paused();
@@ -497,6 +671,10 @@ struct proto_packet_listener *proto_packet_listener_register(struct proto *proto
 	else
 		proto->packet_listeners = l;
 
+	proto_packet_listener_filters_update(proto, l->flags);
+
+	proto_listened_update();
+
 	return l;
 }
 
@@ -519,6 +697,10 @@ int proto_packet_listener_unregister(struct proto_packet_listener *l) {
 			l->proto->packet_listeners = l->next;
 	}
 
+	proto_packet_listener_filters_update(l->proto, l->flags);
+
+	proto_listened_update();
+
 	free(l);
 
 	return POM_OK;
@@ -529,6 +711,8 @@ void proto_packet_listener_set_filter(struct proto_packet_listener *l, struct fi
 	core_assert_is_paused();
 
 	l->filter = f;
+
+	proto_packet_listener_filters_update(l->proto, l->flags);
 }
 
 
@@ -647,15 +831,10 @@ struct proto_expectation *proto_expectation_alloc_from_conntrack(struct conntrac
 	return e;
 }
 
-void proto_expectation_cleanup(struct proto_expectation *e) {
+// Called once the expiry handler is not running anymore
+static void proto_expectation_free(void *priv) {
 
-	if (!e)
-		return;
-
-	if (e->flags & PROTO_EXPECTATION_FLAG_QUEUED)
-		proto_expectation_remove(e);
-
-	debug_expectation("Cleaning up expectation %p", e);
+	struct proto_expectation *e = priv;
 
 	while (e->head) {
 		struct proto_expectation_stack *es = e->head;
@@ -686,6 +865,23 @@ void proto_expectation_cleanup(struct proto_expectation *e) {
 	free(e);
 }
 
+void proto_expectation_cleanup(struct proto_expectation *e) {
+
+	if (!e)
+		return;
+
+	if (e->flags & PROTO_EXPECTATION_FLAG_QUEUED)
+		proto_expectation_remove(e);
+
+	debug_expectation("Cleaning up expectation %p", e);
+
+	// The expiry handler might be running on another thread
+	if (e->expiry)
+		timer_release(e->expiry, proto_expectation_free, e);
+	else
+		proto_expectation_free(e);
+}
+
 int proto_expectation_set_field(struct proto_expectation *e, int stack_index, struct ptype *value, int direction) {
 
 	struct proto_expectation_stack *es = NULL;
@@ -765,13 +961,43 @@ int proto_expectation_add(struct proto_expectation *e) {
 	struct proto *proto = e->tail->proto;
 	pom_rwlock_wlock(&proto->expectation_lock);
 
+	if (!proto->expectation_table && proto->info->ct_info) {
+		size_t size = sizeof(struct proto_expectation *) * PROTO_EXPECTATION_TABLE_SIZE;
+		proto->expectation_table = malloc(size);
+		if (!proto->expectation_table) {
+			pom_rwlock_unlock(&proto->expectation_lock);
+			pom_oom(size);
+			return POM_ERR;
+		}
+		memset(proto->expectation_table, 0, size);
+
+		// Move the existing expectations to the table
+		struct proto_expectation *tmp = proto->expectations;
+		proto->expectations = NULL;
+		while (tmp) {
+			struct proto_expectation *cur = tmp;
+			tmp = tmp->next;
+			cur->list = proto_expectation_get_list(proto, (cur->tail->fields[POM_DIR_FWD] ? cur->tail->fields[POM_DIR_FWD] : cur->tail->fields[POM_DIR_REV]));
+			cur->prev = NULL;
+			cur->next = *cur->list;
+			if (cur->next)
+				cur->next->prev = cur;
+			*cur->list = cur;
+		}
+	}
+
 	__sync_fetch_and_or(&e->flags, PROTO_EXPECTATION_FLAG_QUEUED);
 
-	e->next = proto->expectations;
+	// Index the expectation on the value of its last layer
+	e->list = proto_expectation_get_list(proto, (e->tail->fields[POM_DIR_FWD] ? e->tail->fields[POM_DIR_FWD] : e->tail->fields[POM_DIR_REV]));
+
+	e->prev = NULL;
+	e->next = *e->list;
 	if (e->next)
 		e->next->prev = e;
 
-	proto->expectations = e;
+	*e->list = e;
+	proto->expectation_count++;
 
 	pom_rwlock_unlock(&proto->expectation_lock);
 
@@ -790,7 +1016,7 @@ int proto_expectation_remove(struct proto_expectation *e) {
 		return POM_ERR;
 	}
 
-	if (!e->next && !e->prev && proto->expectations != e) {
+	if (!e->list) {
 		// The expectation is not queued
 		pom_rwlock_unlock(&proto->expectation_lock);
 		return POM_OK;
@@ -801,7 +1027,12 @@ int proto_expectation_remove(struct proto_expectation *e) {
 	if (e->prev)
 		e->prev->next = e->next;
 	else
-		proto->expectations = e->next;
+		*e->list = e->next;
+
+	e->next = NULL;
+	e->prev = NULL;
+	e->list = NULL;
+	proto->expectation_count--;
 
 	__sync_fetch_and_and(&e->flags, ~PROTO_EXPECTATION_FLAG_QUEUED);
 
@@ -816,7 +1047,10 @@ int proto_expectation_timeout(void *priv, ptime now) {
 
 	struct proto_expectation *e = priv;
 
-	proto_expectation_remove(e);
+	// Whoever removed it from the list cleans it up
+	if (proto_expectation_remove(e) != POM_OK)
+		return POM_OK;
+
 	proto_expectation_cleanup(e);
 
 	return POM_OK;
@@ -888,6 +1122,8 @@ int proto_number_register(char *class, unsigned int proto_num, struct proto *p)
 		num->next->prev = num;
 	cls->nums = num;
 
+	proto_listened_update();
+
 	return POM_OK;
 }
 
@@ -926,10 +1162,117 @@ int proto_number_unregister(struct proto *p) {
 
 	}
 
+	proto_listened_update();
+
 	return POM_OK;
 
 }
 
+static int proto_is_listened(struct proto *proto) {
+
+	if (proto->packet_listeners || proto->payload_listeners)
+		return 1;
+
+	// Events of the protocols are registered with proto_<name> as their source
+	char source_name[256];
+	snprintf(source_name, sizeof(source_name), "proto_%s", proto->info->name);
+
+	return event_source_has_listener(source_name);
+}
+
+void proto_listened_update() {
+
+	struct proto_listened_number *nums = NULL;
+	unsigned int count = 0;
+
+	struct proto *proto;
+	for (proto = proto_head; proto; proto = proto->next) {
+
+		if (!proto_is_listened(proto))
+			continue;
+
+		// Its traffic can't be told apart by number
+		if (proto->info->flags & PROTO_REG_FLAG_EXPECTATIONS)
+			goto all;
+
+		unsigned int found = 0;
+		struct proto_number_class *cls;
+		for (cls = proto_number_class_head; cls; cls = cls->next) {
+			struct proto_number *num;
+			for (num = cls->nums; num; num = num->next) {
+				if (num->proto != proto)
+					continue;
+
+				struct proto_listened_number *new_nums = realloc(nums, sizeof(struct proto_listened_number) * (count + 1));
+				if (!new_nums) {
+					pom_oom(sizeof(struct proto_listened_number) * (count + 1));
+					goto all;
+				}
+				nums = new_nums;
+				nums[count].number_class = cls->name;
+				nums[count].val = num->val;
+				count++;
+				found++;
+			}
+		}
+
+		// Datalink or protocol only reached through expectations
+		if (!found)
+			goto all;
+	}
+
+	// Nothing listened, don't restrict anything either
+	if (!count)
+		goto all;
+
+	goto update;
+
+all:
+	free(nums);
+	nums = NULL;
+	count = 0;
+
+update:
+	pom_mutex_lock(&proto_listened_lock);
+	struct proto_listened_number *old_nums = proto_listened_nums;
+	proto_listened_nums = nums;
+	proto_listened_count = count;
+	__sync_add_and_fetch(&proto_listened_serial, 1);
+	pom_mutex_unlock(&proto_listened_lock);
+
+	free(old_nums);
+}
+
+int proto_listened_numbers_get(struct proto_listened_number **nums, unsigned int *count, uint32_t *serial) {
+
+	*nums = NULL;
+	*count = 0;
+
+	pom_mutex_lock(&proto_listened_lock);
+
+	*serial = proto_listened_serial;
+
+	if (proto_listened_nums) {
+		size_t size = sizeof(struct proto_listened_number) * proto_listened_count;
+		*nums = malloc(size);
+		if (!*nums) {
+			pom_mutex_unlock(&proto_listened_lock);
+			pom_oom(size);
+			return POM_ERR;
+		}
+		memcpy(*nums, proto_listened_nums, size);
+		*count = proto_listened_count;
+	}
+
+	pom_mutex_unlock(&proto_listened_lock);
+
+	return POM_OK;
+}
+
+uint32_t proto_listened_serial_get() {
+	return __sync_fetch_and_add(&proto_listened_serial, 0);
+}
+
 int proto_add_param(struct proto *proto, struct registry_param *p) {
 	
 	p->flags &= REGISTRY_PARAM_FLAG_PAUSE_PROCESSING;
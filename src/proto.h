@@ -32,6 +32,9 @@
 #define PROTO_EXPECTATION_FLAG_QUEUED	0x1
 #define PROTO_EXPECTATION_FLAG_MATCHED	0x2
 
+// Number of buckets of the expectation table, must be a power of 2
+#define PROTO_EXPECTATION_TABLE_SIZE	1024
+
 struct proto {
 
 	struct proto_reg_info *info;
@@ -40,6 +43,7 @@ struct proto {
 	
 	/// Conntrack tables
 	struct conntrack_tables *ct;
+	struct ptype *param_conntrack_max;
 
 	struct registry_instance *reg_instance;
 
@@ -47,9 +51,13 @@ struct proto {
 
 	struct proto_packet_listener *packet_listeners;
 	struct proto_packet_listener *payload_listeners;
+	struct filter_set *packet_filters; // Filters of the packet listeners, evaluated together
+	struct filter_set *payload_filters;
 
 	pthread_rwlock_t expectation_lock;
-	struct proto_expectation *expectations;
+	struct proto_expectation *expectations; // Expectations without a value to match on
+	struct proto_expectation **expectation_table; // Expectations indexed by the value of their last layer
+	unsigned int expectation_count;
 
 	struct proto_number_class *number_class;
 
@@ -58,6 +66,8 @@ struct proto {
 	struct registry_perf *perf_conn_cur;
 	struct registry_perf *perf_conn_tot;
 	struct registry_perf *perf_conn_hash_col;
+	struct registry_perf *perf_conn_evicted;
+	struct registry_perf *perf_conn_evicted_weak;
 	struct registry_perf *perf_expt_pending;
 	struct registry_perf *perf_expt_matched;
 
@@ -87,6 +97,7 @@ struct proto_expectation {
 	struct timer *expiry;
 	struct conntrack_session *session;
 	struct proto_expectation *prev, *next;
+	struct proto_expectation **list; // List where the expectation is queued
 	int flags;
 	void (*match_callback) (struct proto_expectation *e, void *callback_priv, struct conntrack_entry *ce);
 };
@@ -116,5 +127,6 @@ int proto_expectation_timeout(void *priv, ptime now);
 unsigned int proto_get_count();
 struct proto_number_class *proto_number_class_get(char *name);
 int proto_number_unregister(struct proto *p);
+void proto_listened_update();
 
 #endif
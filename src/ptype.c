@@ -384,6 +384,38 @@ size_t ptype_get_value_size(struct ptype *pt) {
 	return pt->type->info->value_size(pt);
 }
 
+size_t ptype_get_fixed_size(struct ptype_reg *type) {
+	return type->info->fixed_size;
+}
+
+int ptype_init_inline(struct ptype_reg *type, struct ptype *pt, void *value) {
+
+	memset(pt, 0, sizeof(struct ptype));
+	pt->type = type;
+
+	if (value) {
+		// The caller provides the storage and its initial value
+		pt->value = value;
+		return POM_OK;
+	}
+
+	if (type->info->alloc && type->info->alloc(pt) != POM_OK) {
+		pomlog(POMLOG_ERR "Ptype allocation failed");
+		return POM_ERR;
+	}
+
+	return POM_OK;
+}
+
+void ptype_cleanup_inline(struct ptype *pt, int inline_value) {
+
+	if (!inline_value && pt->type->info->cleanup)
+		pt->type->info->cleanup(pt);
+
+	if (pt->unit)
+		free(pt->unit);
+}
+
 uint32_t ptype_get_hash(struct ptype *pt) {
 
 	size_t size = pt->type->info->value_size(pt);
@@ -47,4 +47,11 @@ void ptype_reg_lock(int write);
 void ptype_reg_unlock();
 
 size_t ptype_get_value_size(struct ptype *pt);
+
+/// Size of the value of a ptype type if it's fixed, 0 otherwise
+size_t ptype_get_fixed_size(struct ptype_reg *type);
+/// Initialize a ptype embedded in another structure, with its value stored at value if provided
+int ptype_init_inline(struct ptype_reg *type, struct ptype *pt, void *value);
+/// Cleanup a ptype initialized with ptype_init_inline()
+void ptype_cleanup_inline(struct ptype *pt, int inline_value);
 #endif
@@ -0,0 +1,115 @@
+/*
+ *  This file is part of pom-ng.
+ *  Copyright (C) 2015 Guy Martin <gmsoft@tuxicoman.be>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+
+#ifndef __SIPHASH_H__
+#define __SIPHASH_H__
+
+#include <stdint.h>
+#include <string.h>
+
+/* SipHash-1-3 : one compression round per word and three finalization rounds.
+ * See https://131002.net/siphash/ for the reference implementation.
+ * The input can be fed in several parts, the result is the same as if
+ * the parts were hashed as a single buffer.
+ */
+
+struct siphash_key {
+	uint64_t k0, k1;
+};
+
+struct siphash_state {
+	uint64_t v0, v1, v2, v3;
+	uint64_t tail; // Bytes not yet processed
+	unsigned int tail_len;
+	uint64_t len;
+};
+
+#define SIPHASH_ROTL(x, b) (uint64_t)(((x) << (b)) | ((x) >> (64 - (b))))
+
+#define SIPHASH_ROUND(s) \
+{ \
+	s->v0 += s->v1; s->v1 = SIPHASH_ROTL(s->v1, 13); s->v1 ^= s->v0; s->v0 = SIPHASH_ROTL(s->v0, 32); \
+	s->v2 += s->v3; s->v3 = SIPHASH_ROTL(s->v3, 16); s->v3 ^= s->v2; \
+	s->v0 += s->v3; s->v3 = SIPHASH_ROTL(s->v3, 21); s->v3 ^= s->v0; \
+	s->v2 += s->v1; s->v1 = SIPHASH_ROTL(s->v1, 17); s->v1 ^= s->v2; s->v2 = SIPHASH_ROTL(s->v2, 32); \
+}
+
+static inline void siphash_init(struct siphash_state *s, const struct siphash_key *key) {
+
+	s->v0 = 0x736f6d6570736575ULL ^ key->k0;
+	s->v1 = 0x646f72616e646f6dULL ^ key->k1;
+	s->v2 = 0x6c7967656e657261ULL ^ key->k0;
+	s->v3 = 0x7465646279746573ULL ^ key->k1;
+	s->tail = 0;
+	s->tail_len = 0;
+	s->len = 0;
+}
+
+static inline void siphash_compress(struct siphash_state *s, uint64_t m) {
+
+	s->v3 ^= m;
+	SIPHASH_ROUND(s);
+	s->v0 ^= m;
+}
+
+static inline void siphash_update(struct siphash_state *s, const void *data, size_t len) {
+
+	const uint8_t *in = data;
+	s->len += len;
+
+	// Complete the pending word first
+	while (s->tail_len && len) {
+		s->tail |= (uint64_t) *in << (8 * s->tail_len);
+		in++;
+		len--;
+		if (++s->tail_len == 8) {
+			siphash_compress(s, s->tail);
+			s->tail = 0;
+			s->tail_len = 0;
+		}
+	}
+
+	for (; len >= 8; in += 8, len -= 8) {
+		uint64_t m;
+		memcpy(&m, in, sizeof(m));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+		m = __builtin_bswap64(m);
+#endif
+		siphash_compress(s, m);
+	}
+
+	for (; len; in++, len--)
+		s->tail |= (uint64_t) *in << (8 * s->tail_len++);
+}
+
+static inline uint64_t siphash_final(struct siphash_state *s) {
+
+	siphash_compress(s, s->tail | (s->len << 56));
+
+	s->v2 ^= 0xff;
+	SIPHASH_ROUND(s);
+	SIPHASH_ROUND(s);
+	SIPHASH_ROUND(s);
+
+	return s->v0 ^ s->v1 ^ s->v2 ^ s->v3;
+}
+
+#endif
@@ -30,6 +30,26 @@
 #define debug_stream(x ...)
 #endif
 
+static struct registry_perf *perf_stream_buff = NULL, *perf_stream_dupe = NULL, *perf_stream_gap = NULL, *perf_stream_budget_forced = NULL, *perf_stream_pending_drop = NULL;
+
+// Number of streams with packets queued, they share the global budget
+static unsigned int stream_buff_flows = 0;
+
+int stream_init() {
+
+	perf_stream_buff = core_add_perf("stream_buff", registry_perf_type_gauge, "Number of bytes queued by the streams", "bytes");
+	perf_stream_dupe = core_add_perf("stream_dupe", registry_perf_type_counter, "Number of duplicate bytes discarded by the streams", "bytes");
+	perf_stream_gap = core_add_perf("stream_gap", registry_perf_type_counter, "Number of missing bytes skipped by the streams", "bytes");
+	perf_stream_budget_forced = core_add_perf("stream_budget_forced", registry_perf_type_counter, "Number of times a stream was flushed to stay within the global buffer budget", "flushes");
+	perf_stream_pending_drop = core_add_perf("stream_pending_drop", registry_perf_type_counter, "Number of packets dropped because their stream had too much pending for the thread processing it", "pkts");
+
+	if (!perf_stream_buff || !perf_stream_dupe || !perf_stream_gap || !perf_stream_budget_forced || !perf_stream_pending_drop)
+		return POM_ERR;
+
+	return POM_OK;
+}
+
+
 struct stream* stream_alloc(uint32_t max_buff_size, struct conntrack_entry *ce, unsigned int flags, int (*handler) (struct conntrack_entry *ce, struct packet *p, struct proto_process_stack *stack, unsigned int stack_index)) {
 	
 	struct stream *res = malloc(sizeof(struct stream));
@@ -47,14 +67,18 @@ struct stream* stream_alloc(uint32_t max_buff_size, struct conntrack_entry *ce,
 		free(res);
 		return NULL;
 	}
-	if (pthread_mutex_init(&res->wait_lock, NULL)) {
-		pomlog(POMLOG_ERR "Error while initializing stream wait lock : %s", pom_strerror(errno));
+	if (pthread_mutex_init(&res->pending_lock, NULL)) {
+		pomlog(POMLOG_ERR "Error while initializing stream pending lock : %s", pom_strerror(errno));
+		pthread_mutex_destroy(&res->lock);
 		free(res);
 		return NULL;
 	}
 
 	res->flags = flags;
+	if (flags & STREAM_FLAG_PACKET_NO_COPY)
+		res->clone_flags = PACKET_FLAG_FORCE_NO_COPY;
 	res->handler = handler;
+	res->skip_rand = ((uint32_t) (uintptr_t) res) | 0x1;
 
 	debug_stream("thread %p, entry %p, allocated", pthread_self(), res);
 
@@ -71,12 +95,12 @@ int stream_set_timeout(struct stream *stream, unsigned int timeout) {
 int stream_cleanup(struct stream *stream) {
 
 
-	if (stream->wait_list_head) {
+	if (stream->pending_head) {
 		pomlog(POMLOG_ERR "Internal error, cleaning up stream while packets still present!");
 		return POM_ERR;
 	}
 
-	while (stream->head[0] || stream->head[1]) {
+	while (stream->head[POM_DIR_FWD][0] || stream->head[POM_DIR_REV][0]) {
 		if (stream_force_dequeue(stream) == POM_ERR) {
 			pomlog(POMLOG_ERR "Error while processing remaining packets in the stream");
 			break;
@@ -90,19 +114,11 @@ int stream_cleanup(struct stream *stream) {
 		pomlog(POMLOG_ERR "Error while destroying stream lock : %s", pom_strerror(res));
 	}
 
-	res = pthread_mutex_destroy(&stream->wait_lock);
+	res = pthread_mutex_destroy(&stream->pending_lock);
 	if (res){
-		pomlog(POMLOG_ERR "Error while destroying stream wait lock : %s", pom_strerror(res));
+		pomlog(POMLOG_ERR "Error while destroying stream pending lock : %s", pom_strerror(res));
 	}
 
-	while (stream->wait_list_unused) {
-		struct stream_thread_wait *tmp = stream->wait_list_unused;
-		stream->wait_list_unused = tmp->next;
-		if (pthread_cond_destroy(&tmp->cond))
-			pomlog(POMLOG_WARN "Error while destroying list condition");
-		free(tmp);
-	}
-	
 	free(stream);
 
 	debug_stream("thread %p, entry %p, released", pthread_self(), stream);
@@ -110,19 +126,6 @@ int stream_cleanup(struct stream *stream) {
 	return POM_OK;
 }
 
-static void stream_end_process_packet(struct stream *stream) {
-
-	conntrack_delayed_cleanup(stream->ce, stream->timeout, stream->last_ts);
-
-	pom_mutex_unlock(&stream->lock);
-	pom_mutex_lock(&stream->wait_lock);
-	if (stream->wait_list_head) {
-		debug_stream("thread %p, entry %p : signaling thread %p", pthread_self(), stream, stream->wait_list_head->thread);
-		pthread_cond_broadcast(&stream->wait_list_head->cond);
-	}
-	pom_mutex_unlock(&stream->wait_lock);
-}
-
 static int stream_is_packet_old_dupe(struct stream *stream, struct stream_pkt *pkt, int direction) {
 
 	// Don't discard packets if there were not packets processed yet
@@ -161,6 +164,7 @@ static int stream_remove_dupe_bytes(struct stream *stream, struct stream_pkt *pk
 		pkt->stack[pkt->stack_index].plen -= dupe;
 		pkt->plen -= dupe;
 		pkt->seq += dupe;
+		registry_perf_inc(perf_stream_dupe, dupe);
 	}
 
 	return POM_OK;
@@ -210,132 +214,203 @@ static void stream_free_packet(struct stream_pkt *p) {
 	free(p);
 }
 
-int stream_process_packet(struct stream *stream, struct packet *pkt, struct proto_process_stack *stack, unsigned int stack_index, uint32_t seq, uint32_t ack) {
+static struct stream_pkt *stream_packet_backup(struct stream *stream, struct packet *pkt, struct proto_process_stack *stack, unsigned int stack_index, uint32_t seq, uint32_t ack) {
 
-	if (!stream || !pkt || !stack)
-		return PROTO_ERR;
+	struct stream_pkt *p = malloc(sizeof(struct stream_pkt));
+	if (!p) {
+		pom_oom(sizeof(struct stream_pkt));
+		return NULL;
+	}
+	memset(p, 0 , sizeof(struct stream_pkt));
 
-	debug_stream("thread %p, entry %p, packet %u.%06u, seq %u, ack %u : start", pthread_self(), stream, pom_ptime_sec(pkt->ts), pom_ptime_usec(pkt->ts), seq, ack);
+	p->pkt = packet_clone(pkt, stream->clone_flags);
+	if (!p->pkt) {
+		free(p);
+		return NULL;
+	}
+	p->stack = core_stack_backup(stack, pkt, p->pkt);
+	if (!p->stack) {
+		packet_release(p->pkt);
+		free(p);
+		return NULL;
+	}
 
-	struct proto_process_stack *cur_stack = &stack[stack_index];
-	int direction = cur_stack->direction;
+	p->plen = stack[stack_index].plen;
+	p->seq = seq;
+	p->ack = ack;
+	p->stack_index = stack_index;
 
-	int must_wait = 0;
+	return p;
+}
 
-	pom_mutex_lock(&stream->wait_lock);
+static void stream_buff_add(struct stream *stream, uint32_t len) {
 
-	int res = pthread_mutex_trylock(&stream->lock);
-	if (res == EBUSY) {
-		// Already locked, let's wait a bit
-		must_wait = 1;
-	} else if (res) {
-		pomlog(POMLOG_ERR "Error while locking packet stream lock : %s", pom_strerror(res));
-		abort();
-		return POM_ERR;
-	} else {
+	if (!len)
+		return;
 
-		// We got the processing lock. But was it really this thread's turn ?
+	if (!stream->cur_buff_size)
+		__sync_fetch_and_add(&stream_buff_flows, 1);
+	stream->cur_buff_size += len;
+	registry_perf_inc(perf_stream_buff, len);
+}
 
-		struct stream_thread_wait *tmp = stream->wait_list_head;
-		// A thread with a packet preceding ours is waiting
-		if (tmp && (tmp->ts < pkt->ts)) {
-			// No it wasn't, release it and signal the right thread
-			must_wait = 2;
-			pom_mutex_unlock(&stream->lock);
-			debug_stream("thread %p, entry %p : signaling thread %p", pthread_self(), stream, stream->wait_list_head->thread);
-			pthread_cond_broadcast(&stream->wait_list_head->cond);
-		} else {
-			// Yes it was. YAY !
-			pom_mutex_unlock(&stream->wait_lock);
-		}
+static void stream_buff_sub(struct stream *stream, uint32_t len) {
+
+	if (!len)
+		return;
+
+	stream->cur_buff_size -= len;
+	if (!stream->cur_buff_size)
+		__sync_fetch_and_sub(&stream_buff_flows, 1);
+	registry_perf_dec(perf_stream_buff, len);
+}
+
+static int stream_buff_over_budget(struct stream *stream) {
+
+	// When the streams use more than the global budget, the ones holding more than their fair share are flushed
+	uint64_t buff_max = core_get_stream_buff_max();
+	if (!buff_max || registry_perf_getval(perf_stream_buff) <= buff_max)
+		return 0;
+
+	unsigned int flows = stream_buff_flows;
+	if (!flows)
+		return 0;
+
+	return stream->cur_buff_size > buff_max / flows;
+}
+
+static int stream_pending_over_budget(struct stream *stream, uint32_t len) {
+
+	// Must be called with stream->pending_lock locked
+	// Only the thread processing the stream can flush it, the others can only drop what they would add
+
+	if (!len)
+		return 0;
+
+	uint32_t size = stream->cur_buff_size + stream->pending_buff_size + len;
+	if (size > stream->max_buff_size)
+		return 1;
+
+	uint64_t buff_max = core_get_stream_buff_max();
+	if (!buff_max || registry_perf_getval(perf_stream_buff) + len <= buff_max)
+		return 0;
+
+	unsigned int flows = stream_buff_flows;
+	if (!flows)
+		flows = 1;
+
+	return size > buff_max / flows;
+}
+
+static inline int stream_seq_cmp(uint32_t a, uint32_t b) {
+	return (int32_t) (a - b);
+}
+
+static unsigned int stream_queue_levels(struct stream *stream) {
+
+	// Xorshift, each additional level has a probability of 1/4
+	uint32_t x = stream->skip_rand;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	stream->skip_rand = x;
 
+	unsigned int levels = 1;
+	while (levels < STREAM_SKIP_LEVELS && !(x & 0x3)) {
+		levels++;
+		x >>= 2;
 	}
 
+	return levels;
+}
 
-	if (must_wait) {
+static struct stream_pkt *stream_queue_find(struct stream *stream, int direction, uint32_t seq, struct stream_pkt **update[STREAM_SKIP_LEVELS]) {
 
-		// Add ourself in the waiting list
-		struct stream_thread_wait *lst = NULL;
-		if (stream->wait_list_unused) {
-			lst = stream->wait_list_unused;
-			stream->wait_list_unused = lst->next;
-			lst->next = NULL;
-		} else {
-			lst = malloc(sizeof(struct stream_thread_wait));
-			if (!lst) {
-				pom_oom(sizeof(struct stream_thread_wait));
-				pom_mutex_unlock(&stream->wait_lock);
-				return POM_ERR;
-			}
-			memset(lst, 0, sizeof(struct stream_thread_wait));
-			
-			if (pthread_cond_init(&lst->cond, NULL)) {
-				pom_mutex_unlock(&stream->wait_lock);
-				pomlog(POMLOG_ERR "Error while initializing wait list condition : %s", pom_strerror(errno));
-				free(lst);
-				return POM_ERR;
-			}
+	// Find where a packet starting at seq goes in each level and return the last packet starting before it
+	struct stream_pkt *prev = NULL;
+	struct stream_pkt **link = stream->head[direction];
+
+	int i;
+	for (i = STREAM_SKIP_LEVELS - 1; i >= 0; i--) {
+		while (link[i] && stream_seq_cmp(link[i]->seq, seq) < 0) {
+			prev = link[i];
+			link = prev->next;
 		}
-		lst->ts = pkt->ts;
-		lst->thread = pthread_self();
+		update[i] = &link[i];
+	}
 
-		struct stream_thread_wait *tmp;
-		for (tmp = stream->wait_list_head; tmp && (tmp->ts < lst->ts); tmp = tmp->next);
-		if (tmp) {
+	return prev;
+}
 
-			lst->prev = tmp->prev;
-			if (lst->prev)
-				lst->prev->next = lst;
-			else
-				stream->wait_list_head = lst;
+static void stream_queue_insert(struct stream *stream, struct stream_pkt *p, struct stream_pkt **update[STREAM_SKIP_LEVELS]) {
 
-			lst->next = tmp;
-			lst->next->prev = lst;
-		} else {
-			lst->prev = stream->wait_list_tail;
-			if (lst->prev)
-				lst->prev->next = lst;
-			else
-				stream->wait_list_head = lst;
+	p->levels = stream_queue_levels(stream);
 
-			stream->wait_list_tail = lst;
-		}
+	unsigned int i;
+	for (i = 0; i < p->levels; i++) {
+		p->next[i] = *update[i];
+		*update[i] = p;
+	}
 
+	stream_buff_add(stream, p->plen);
+}
 
-		while (1) {
-			debug_stream("thread %p, entry %p, packet %u.%06u, seq %u, ack %u : waiting (%u)", pthread_self(), stream, pom_ptime_sec(pkt->ts), pom_ptime_usec(pkt->ts), seq, ack, must_wait);
-			if (pthread_cond_wait(&lst->cond, &stream->wait_lock)) {
-				pomlog(POMLOG_ERR "Error while waiting for the packet stream wait cond : %s", pom_strerror(errno));
-				abort();
-				return POM_ERR;
-			}
+static struct stream_pkt *stream_queue_pop(struct stream *stream, int direction) {
 
-			if (stream->wait_list_head != lst) {
-				// There is a small chance that another stream lock stream->wait_lock while pthread_cond_wait acquires it
-				// If we are not the right thread, then simply signal the right one and wait again for our turn
-				debug_stream("thread %p, entry %p, packet %u.%06u, seq %u, ack %u : wrong thread woke up", pthread_self(), stream, pom_ptime_sec(pkt->ts), pom_ptime_usec(pkt->ts), seq, ack);
-				pthread_cond_broadcast(&stream->wait_list_head->cond);
-				continue;
-			}
-			break;
-		}
+	struct stream_pkt *p = stream->head[direction][0];
+	if (!p)
+		return NULL;
 
-		tmp = stream->wait_list_head;
-		stream->wait_list_head = tmp->next;
-		if (stream->wait_list_head)
-			stream->wait_list_head->prev = NULL;
-		else
-			stream->wait_list_tail = NULL;
+	// The first packet is also the first one of each level it belongs to
+	unsigned int i;
+	for (i = 0; i < p->levels; i++)
+		stream->head[direction][i] = p->next[i];
 
-		tmp->next = stream->wait_list_unused;
-		tmp->prev = NULL;
-		stream->wait_list_unused = tmp;
+	stream_buff_sub(stream, p->plen);
 
-		pom_mutex_unlock(&stream->wait_lock);
-		pom_mutex_lock(&stream->lock);
+	return p;
+}
+
+static int stream_queue_trim(struct stream *stream, struct proto_process_stack *s, int direction, uint32_t *seq, struct stream_pkt **update[STREAM_SKIP_LEVELS]) {
+
+	// Remove the bytes already queued from the packet, returns 1 if nothing is left
+	struct stream_pkt *prev = stream_queue_find(stream, direction, *seq, update);
 
+	struct stream_pkt *next = *update[0];
+	if (next && next->seq == *seq && next->plen >= s->plen) {
+		registry_perf_inc(perf_stream_dupe, s->plen);
+		return 1;
 	}
 
+	if (!prev)
+		return 0;
+
+	uint32_t prev_end = prev->seq + prev->plen;
+	if (stream_seq_cmp(prev_end, *seq) <= 0)
+		return 0;
+
+	uint32_t dupe = prev_end - *seq;
+	if (dupe >= s->plen) {
+		registry_perf_inc(perf_stream_dupe, s->plen);
+		return 1;
+	}
+
+	s->pload += dupe;
+	s->plen -= dupe;
+	*seq += dupe;
+	registry_perf_inc(perf_stream_dupe, dupe);
+
+	// The packet starts further, find its new position
+	stream_queue_find(stream, direction, *seq, update);
+
+	return 0;
+}
+
+static int stream_process_locked(struct stream *stream, struct packet *pkt, struct proto_process_stack *stack, unsigned int stack_index, uint32_t seq, uint32_t ack) {
+
+	struct proto_process_stack *cur_stack = &stack[stack_index];
+	int direction = cur_stack->direction;
+
 	debug_stream("thread %p, entry %p, packet %u.%06u, seq %u, ack %u : start locked : cur_seq %u, rev_seq %u", pthread_self(), stream, pom_ptime_sec(pkt->ts), pom_ptime_usec(pkt->ts), seq, ack, stream->cur_seq[direction], stream->cur_seq[POM_DIR_REVERSE(direction)]);
 
 	// Update the stream flags
@@ -376,13 +451,12 @@ int stream_process_packet(struct stream *stream, struct packet *pkt, struct prot
 		if (cur_seq != seq) {
 			if (stream_is_packet_old_dupe(stream, &spkt, direction)) {
 				// cur_seq is after the end of the packet, discard it
-				stream_end_process_packet(stream);
+				registry_perf_inc(perf_stream_dupe, spkt.plen);
 				debug_stream("thread %p, entry %p, packet %u.%06u, seq %u, ack %u : discard", pthread_self(), stream, pom_ptime_sec(pkt->ts), pom_ptime_usec(pkt->ts), seq, ack);
 				return PROTO_OK;
 			}
 
 			if (stream_remove_dupe_bytes(stream, &spkt, direction) == POM_ERR) {
-				stream_end_process_packet(stream);
 				return PROTO_ERR;
 			}
 		}
@@ -399,7 +473,6 @@ int stream_process_packet(struct stream *stream, struct packet *pkt, struct prot
 
 			int res = stream->handler(stream->ce, pkt, stack, stack_index);
 			if (res == PROTO_ERR) {
-				stream_end_process_packet(stream);
 				return PROTO_ERR;
 			}
 
@@ -415,7 +488,6 @@ int stream_process_packet(struct stream *stream, struct packet *pkt, struct prot
 				debug_stream("thread %p, entry %p, packet %u.%06u, seq %u, ack %u : process additional", pthread_self(), stream, pom_ptime_sec(p->pkt->ts), pom_ptime_usec(p->pkt->ts), p->seq, p->ack);
 
 				if (stream->handler(stream->ce, p->pkt, p->stack, p->stack_index) == POM_ERR) {
-					stream_end_process_packet(stream);
 					return PROTO_ERR;
 				}
 
@@ -424,7 +496,6 @@ int stream_process_packet(struct stream *stream, struct packet *pkt, struct prot
 				stream_free_packet(p);
 			}
 
-			stream_end_process_packet(stream);
 			debug_stream("thread %p, entry %p, packet %u.%06u, seq %u, ack %u : done processed", pthread_self(), stream, pom_ptime_sec(pkt->ts), pom_ptime_usec(pkt->ts), seq, ack);
 			return res;
 		}
@@ -434,95 +505,212 @@ int stream_process_packet(struct stream *stream, struct packet *pkt, struct prot
 
 	// Queue the packet then
 
+	// Packets are kept in the stream order, retransmitted bytes don't need to be queued twice
+	struct stream_pkt **update[STREAM_SKIP_LEVELS];
+	seq = spkt.seq;
+	if (cur_stack->plen) {
+		if (stream_queue_trim(stream, cur_stack, direction, &seq, update)) {
+			debug_stream("thread %p, entry %p, packet %u.%06u, seq %u, ack %u : already queued", pthread_self(), stream, pom_ptime_sec(pkt->ts), pom_ptime_usec(pkt->ts), seq, ack);
+			return PROTO_OK;
+		}
+	} else {
+		stream_queue_find(stream, direction, seq, update);
+	}
+
 	debug_stream("thread %p, entry %p, packet %u.%06u, seq %u, ack %u : queue", pthread_self(), stream, pom_ptime_sec(pkt->ts), pom_ptime_usec(pkt->ts), seq, ack);
 
-	struct stream_pkt *p = malloc(sizeof(struct stream_pkt));
-	if (!p) {
-		pom_oom(sizeof(struct stream_pkt));
-		stream_end_process_packet(stream);
+	struct stream_pkt *p = stream_packet_backup(stream, pkt, stack, stack_index, seq, ack);
+	if (!p)
 		return PROTO_ERR;
-	}
-	memset(p, 0 , sizeof(struct stream_pkt));
 
+	stream_queue_insert(stream, p, update);
 
-	int flags = 0;
-	if (stream->flags & STREAM_FLAG_PACKET_NO_COPY)
-		flags = PACKET_FLAG_FORCE_NO_COPY;
-	p->pkt = packet_clone(pkt, flags);
-	if (!p->pkt) {
-		stream_end_process_packet(stream);
-		free(p);
-		return PROTO_ERR;
+	if (stream->cur_buff_size >= stream->max_buff_size) {
+		// Buffer overflow
+		debug_stream("thread %p, entry %p, packet %u.%06u, seq %u, ack %u : buffer overflow, forced dequeue", pthread_self(), stream, pom_ptime_sec(pkt->ts), pom_ptime_usec(pkt->ts), seq, ack);
+		if (stream_force_dequeue(stream) != POM_OK) {
+			return POM_ERR;
+		}
 	}
-	p->stack = core_stack_backup(stack, pkt, p->pkt);
-	if (!p->stack) {
-		stream_end_process_packet(stream);
-		packet_release(p->pkt);
-		free(p);
-		return PROTO_ERR;
+
+	while (stream_buff_over_budget(stream)) {
+		// Too much is buffered globally and this stream uses more than its share
+		debug_stream("thread %p, entry %p, packet %u.%06u, seq %u, ack %u : over the global budget, forced dequeue", pthread_self(), stream, pom_ptime_sec(pkt->ts), pom_ptime_usec(pkt->ts), seq, ack);
+		registry_perf_inc(perf_stream_budget_forced, 1);
+		if (stream_force_dequeue(stream) != POM_OK) {
+			return POM_ERR;
+		}
 	}
 
 
-	p->plen = cur_stack->plen;
-	p->seq = seq;
-	p->ack = ack;
-	p->stack_index = stack_index;
+	debug_stream("thread %p, entry %p, packet %u.%06u, seq %u, ack %u : done queued", pthread_self(), stream, pom_ptime_sec(pkt->ts), pom_ptime_usec(pkt->ts), seq, ack);
+	return PROTO_OK;
+}
 
+static void stream_start_seq_locked(struct stream *stream, unsigned int direction, uint32_t seq) {
 
-	if (!stream->tail[direction]) {
-		stream->head[direction] = p;
-		stream->tail[direction] = p;
-	} else { 
+	if (stream->flags & STREAM_FLAG_RUNNING) {
+		debug_stream("thread %p, entry %p : not accepting additional sequence update as the stream stared", pthread_self(), stream);
+		return;
+	}
 
-		struct stream_pkt *tmp = stream->tail[direction];
-		while ( tmp && 
-			((tmp->seq >= seq && tmp->seq - seq < STREAM_HALF_SEQ)
-			|| (tmp->seq <= seq && seq - tmp->seq > STREAM_HALF_SEQ))) {
+	int dir_flag = (direction == POM_DIR_FWD ? STREAM_FLAG_GOT_FWD_STARTSEQ : STREAM_FLAG_GOT_REV_STARTSEQ);
+	stream->flags |= dir_flag;
+	stream->cur_seq[direction] = seq;
 
-			tmp = tmp->prev;
+	debug_stream("thread %p, entry %p : start_seq for direction %u set to %u", pthread_self(), stream, direction, seq);
 
+	struct stream_pkt *p = NULL;
+	while ((p = stream_get_next(stream, &direction))) {
+
+		debug_stream("thread %p, entry %p, packet %u.%06u, seq %u, ack %u : process additional", pthread_self(), stream, pom_ptime_sec(p->pkt->ts), pom_ptime_usec(p->pkt->ts), p->seq, p->ack);
+		// Flag the stream as running
+		stream->flags |= STREAM_FLAG_RUNNING;
+
+		if (stream->handler(stream->ce, p->pkt, p->stack, p->stack_index) == PROTO_ERR) {
+			stream_free_packet(p);
+			return;
 		}
 
-		if (!tmp) {
-			// Packet goes at the begining of the list
-			p->next = stream->head[direction];
-			if (p->next)
-				p->next->prev = p;
-			else
-				stream->tail[direction] = p;
-			stream->head[direction] = p;
+		stream->cur_seq[direction] += p->plen;
 
-		} else {
-			// Insert the packet after the current one
-			p->next = tmp->next;
-			p->prev = tmp;
+		stream_free_packet(p);
+	}
+}
 
-			if (p->next)
-				p->next->prev = p;
-			else
-				stream->tail[direction] = p;
+static int stream_process_pending(struct stream *stream) {
 
-			tmp->next = p;
+	// Must be called with stream->pending_lock locked, returns with it unlocked
+	// Returns 0 if there was nothing to process
 
-		}
+	if (stream->pending_flags) {
+		unsigned int pending_flags = stream->pending_flags;
+		uint32_t pending_seq[POM_DIR_TOT] = { stream->pending_start_seq[POM_DIR_FWD], stream->pending_start_seq[POM_DIR_REV] };
+		stream->pending_flags = 0;
+		pom_mutex_unlock(&stream->pending_lock);
+
+		if (pending_flags & STREAM_FLAG_GOT_FWD_STARTSEQ)
+			stream_start_seq_locked(stream, POM_DIR_FWD, pending_seq[POM_DIR_FWD]);
+		if (pending_flags & STREAM_FLAG_GOT_REV_STARTSEQ)
+			stream_start_seq_locked(stream, POM_DIR_REV, pending_seq[POM_DIR_REV]);
+
+		return 1;
 	}
-	
-	stream->cur_buff_size += cur_stack->plen;
 
-	
-	if (stream->cur_buff_size >= stream->max_buff_size) {
-		// Buffer overflow
-		debug_stream("thread %p, entry %p, packet %u.%06u, seq %u, ack %u : buffer overflow, forced dequeue", pthread_self(), stream, pom_ptime_sec(pkt->ts), pom_ptime_usec(pkt->ts), seq, ack);
-		if (stream_force_dequeue(stream) != POM_OK) {
-			stream_end_process_packet(stream);
-			return POM_ERR;
+	struct stream_pkt *p = stream->pending_head;
+	if (!p) {
+		pom_mutex_unlock(&stream->pending_lock);
+		return 0;
+	}
+
+	stream->pending_head = p->next[0];
+	if (!stream->pending_head)
+		stream->pending_tail = NULL;
+	stream->pending_buff_size -= p->plen;
+	pom_mutex_unlock(&stream->pending_lock);
+
+	registry_perf_dec(perf_stream_buff, p->plen);
+
+	debug_stream("thread %p, entry %p, packet %u.%06u, seq %u, ack %u : process pending", pthread_self(), stream, pom_ptime_sec(p->pkt->ts), pom_ptime_usec(p->pkt->ts), p->seq, p->ack);
+
+	// Nobody is waiting for the result anymore
+	if (stream_process_locked(stream, p->pkt, p->stack, p->stack_index, p->seq, p->ack) == PROTO_ERR)
+		pomlog(POMLOG_ERR "Error while processing a pending packet of the stream");
+
+	stream_free_packet(p);
+
+	return 1;
+}
+
+static int stream_begin_process(struct stream *stream) {
+
+	// Returns 1 if this thread now owns the stream
+	// Returns 0 with stream->pending_lock locked if another thread does
+
+	pom_mutex_lock(&stream->pending_lock);
+
+	int res = pthread_mutex_trylock(&stream->lock);
+	if (res == EBUSY) {
+		return 0;
+	} else if (res) {
+		pomlog(POMLOG_ERR "Error while locking packet stream lock : %s", pom_strerror(res));
+		abort();
+	}
+
+	pom_mutex_unlock(&stream->pending_lock);
+
+	return 1;
+}
+
+static void stream_end_process_packet(struct stream *stream) {
+
+	// Process what the other threads left for us before giving up the stream
+	while (1) {
+		pom_mutex_lock(&stream->pending_lock);
+		if (!stream->pending_head && !stream->pending_flags)
+			break;
+		stream_process_pending(stream);
+	}
+
+	conntrack_delayed_cleanup(stream->ce, stream->timeout, stream->last_ts);
+
+	// Release the stream while holding pending_lock so no packet can be left behind
+	pom_mutex_unlock(&stream->lock);
+	pom_mutex_unlock(&stream->pending_lock);
+}
+
+int stream_process_packet(struct stream *stream, struct packet *pkt, struct proto_process_stack *stack, unsigned int stack_index, uint32_t seq, uint32_t ack) {
+
+	if (!stream || !pkt || !stack)
+		return PROTO_ERR;
+
+	debug_stream("thread %p, entry %p, packet %u.%06u, seq %u, ack %u : start", pthread_self(), stream, pom_ptime_sec(pkt->ts), pom_ptime_usec(pkt->ts), seq, ack);
+
+	if (!stream_begin_process(stream)) {
+
+		// Another thread is processing this stream, leave it the packet and move on
+		if (stream_pending_over_budget(stream, stack[stack_index].plen)) {
+			pom_mutex_unlock(&stream->pending_lock);
+			debug_stream("thread %p, entry %p, packet %u.%06u, seq %u, ack %u : too much pending, dropped", pthread_self(), stream, pom_ptime_sec(pkt->ts), pom_ptime_usec(pkt->ts), seq, ack);
+			registry_perf_inc(perf_stream_pending_drop, 1);
+			return PROTO_OK;
+		}
+
+		struct stream_pkt *p = stream_packet_backup(stream, pkt, stack, stack_index, seq, ack);
+		if (!p) {
+			pom_mutex_unlock(&stream->pending_lock);
+			return PROTO_ERR;
 		}
+
+		// Keep the pending packets in the order they were received
+		if (!stream->pending_tail || stream->pending_tail->pkt->ts <= pkt->ts) {
+			if (stream->pending_tail)
+				stream->pending_tail->next[0] = p;
+			else
+				stream->pending_head = p;
+			stream->pending_tail = p;
+		} else {
+			struct stream_pkt **tmp = &stream->pending_head;
+			while ((*tmp)->pkt->ts <= pkt->ts)
+				tmp = &(*tmp)->next[0];
+			p->next[0] = *tmp;
+			*tmp = p;
+		}
+		stream->pending_buff_size += p->plen;
+
+		pom_mutex_unlock(&stream->pending_lock);
+
+		registry_perf_inc(perf_stream_buff, p->plen);
+
+		debug_stream("thread %p, entry %p, packet %u.%06u, seq %u, ack %u : left to the owner", pthread_self(), stream, pom_ptime_sec(pkt->ts), pom_ptime_usec(pkt->ts), seq, ack);
+		return PROTO_OK;
 	}
 
+	int res = stream_process_locked(stream, pkt, stack, stack_index, seq, ack);
+
 	stream_end_process_packet(stream);
 
-	debug_stream("thread %p, entry %p, packet %u.%06u, seq %u, ack %u : done queued", pthread_self(), stream, pom_ptime_sec(pkt->ts), pom_ptime_usec(pkt->ts), seq, ack);
-	return PROTO_OK;
+	return res;
 }
 
 int stream_fill_gap(struct stream *stream, struct stream_pkt *p, uint32_t gap, int reverse_dir) {
@@ -588,20 +776,20 @@ int stream_force_dequeue(struct stream *stream) {
 
 	while (1) {
 
-		if (!stream->head[POM_DIR_FWD] && !stream->head[POM_DIR_REV])
+		if (!stream->head[POM_DIR_FWD][0] && !stream->head[POM_DIR_REV][0])
 			return POM_OK;
 
 
-		if (!stream->head[POM_DIR_FWD]) {
+		if (!stream->head[POM_DIR_FWD][0]) {
 			next_dir = POM_DIR_REV;
-		} else if (!stream->head[POM_DIR_REV]) {
+		} else if (!stream->head[POM_DIR_REV][0]) {
 			next_dir = POM_DIR_FWD;
 		} else {
 			// We have packets in both direction, lets see which one we'll process first
 			int i;
 			for (i = 0; i < POM_DIR_TOT; i++) {
 				int r = POM_DIR_REVERSE(i);
-				struct stream_pkt *a = stream->head[i], *b = stream->head[r];
+				struct stream_pkt *a = stream->head[i][0], *b = stream->head[r][0];
 				uint32_t end_seq = a->seq + a->plen;
 				if ((end_seq <= b->ack && b->ack - end_seq < STREAM_HALF_SEQ) ||
 					(b->ack > end_seq && end_seq - b->ack > STREAM_HALF_SEQ))
@@ -611,37 +799,32 @@ int stream_force_dequeue(struct stream *stream) {
 			if (i == POM_DIR_TOT) {
 				// There is a gap in both direction
 				// Process the first packet received
-				struct packet *a = stream->head[POM_DIR_FWD]->pkt, *b = stream->head[POM_DIR_REV]->pkt;
+				struct packet *a = stream->head[POM_DIR_FWD][0]->pkt, *b = stream->head[POM_DIR_REV][0]->pkt;
 				if (a->ts < b->ts) {
 					next_dir = POM_DIR_FWD;
 				} else {
 					next_dir = POM_DIR_REV;
 				}
-				debug_stream("thread %p, entry %p, packet %u.%06u, seq %u, ack %u : processing next by timestamp", pthread_self(), stream, pom_ptime_sec(stream->head[next_dir]->pkt->ts), pom_ptime_usec(stream->head[next_dir]->pkt->ts), stream->head[next_dir]->seq, stream->head[next_dir]->ack);
+				debug_stream("thread %p, entry %p, packet %u.%06u, seq %u, ack %u : processing next by timestamp", pthread_self(), stream, pom_ptime_sec(stream->head[next_dir][0]->pkt->ts), pom_ptime_usec(stream->head[next_dir][0]->pkt->ts), stream->head[next_dir][0]->seq, stream->head[next_dir][0]->ack);
 			} else {
 				next_dir = i;
 			}
 		}
 
-		p = stream->head[next_dir];
-		if (p->next)
-			p->next->prev = NULL;
-		else
-			stream->tail[next_dir] = NULL;
-		
-		stream->head[next_dir] = p->next;
-		stream->cur_buff_size -= p->plen;
-
+		p = stream_queue_pop(stream, next_dir);
 
 		if (stream_is_packet_old_dupe(stream, p, next_dir)) {
+			registry_perf_inc(perf_stream_dupe, p->plen);
 			stream_free_packet(p);
 		} else {
 			break;
 		}
 	}
 
-	if (stream_remove_dupe_bytes(stream, p, next_dir) == POM_ERR)
+	if (stream_remove_dupe_bytes(stream, p, next_dir) == POM_ERR) {
+		stream_free_packet(p);
 		return POM_ERR;
+	}
 
 	// Flag the stream as running
 	stream->flags |= STREAM_FLAG_RUNNING;
@@ -679,6 +862,7 @@ int stream_force_dequeue(struct stream *stream) {
 
 				// We were waiting for reverse
 				uint32_t rev_gap = p->ack - stream->cur_seq[next_rev_dir];
+				registry_perf_inc(perf_stream_gap, rev_gap);
 				res = stream_fill_gap(stream, p, rev_gap, 1);
 				stream->cur_seq[next_rev_dir] = p->ack;
 
@@ -688,6 +872,7 @@ int stream_force_dequeue(struct stream *stream) {
 
 	uint32_t gap = p->seq - stream->cur_seq[next_dir];
 	if (gap) {
+		registry_perf_inc(perf_stream_gap, gap);
 		if (res != PROTO_ERR)
 			res = stream_fill_gap(stream, p, gap, 0);
 	}
@@ -743,15 +928,18 @@ struct stream_pkt *stream_get_next(struct stream *stream, unsigned int *directio
 		*direction = dirs[i];
 		cur_dir = *direction;
 
-		while (stream->head[cur_dir]) {
+		while (stream->head[cur_dir][0]) {
 			
-			res = stream->head[cur_dir];
+			res = stream->head[cur_dir][0];
 
 			if (!stream_is_packet_next(stream, res, cur_dir)) {
 				res = NULL;
 				break;
 			}
 
+			// Dequeue the packet
+			stream_queue_pop(stream, cur_dir);
+
 			uint32_t cur_seq = stream->cur_seq[cur_dir];
 			uint32_t seq = res->seq;
 			// Check for duplicate bytes
@@ -759,27 +947,17 @@ struct stream_pkt *stream_get_next(struct stream *stream, unsigned int *directio
 
 				if (stream_is_packet_old_dupe(stream, res, cur_dir)) {
 					// Packet is a duplicate, remove it
-					stream->head[cur_dir] = res->next;
-					if (res->next) {
-						res->next->prev = NULL;
-					} else {
-						stream->tail[cur_dir] = NULL;
-					}
-
-					if (res->prev) {
-						pomlog(POMLOG_WARN "Dequeing packet which wasn't the first in the list. This shouldn't happen !");
-						res->prev->next = res->next;
-					}
-					
-					stream->cur_buff_size -= res->plen;
+					registry_perf_inc(perf_stream_dupe, res->plen);
 					stream_free_packet(res);
 					res = NULL;
 
 					// Next packet please
 					continue;
 				} else {
-					if (stream_remove_dupe_bytes(stream, res, cur_dir) == POM_ERR)
+					if (stream_remove_dupe_bytes(stream, res, cur_dir) == POM_ERR) {
+						stream_free_packet(res);
 						return NULL;
+					}
 
 				}
 			}
@@ -791,21 +969,6 @@ struct stream_pkt *stream_get_next(struct stream *stream, unsigned int *directio
 		
 	}
 
-	if (!res)
-		return NULL;
-
-	// Dequeue the packet
-	
-
-	stream->head[cur_dir] = res->next;
-	if (res->next) {
-		res->next->prev = res->prev;
-	} else {
-		stream->tail[cur_dir] = NULL;
-	}
-
-	stream->cur_buff_size -= res->plen;
-
 	return res;
 }
 
@@ -835,36 +998,15 @@ int stream_increase_seq(struct stream *stream, unsigned int direction, uint32_t
 
 int stream_set_start_seq(struct stream *stream, unsigned int direction, uint32_t seq) {
 
-	pom_mutex_lock(&stream->lock);
-
-	if (stream->flags & STREAM_FLAG_RUNNING) {
-		debug_stream("thread %p, entry %p : not accepting additional sequence update as the stream stared", pthread_self(), stream);
-		stream_end_process_packet(stream);
+	if (!stream_begin_process(stream)) {
+		// The thread processing the stream will apply it before its pending packets
+		stream->pending_start_seq[direction] = seq;
+		stream->pending_flags |= (direction == POM_DIR_FWD ? STREAM_FLAG_GOT_FWD_STARTSEQ : STREAM_FLAG_GOT_REV_STARTSEQ);
+		pom_mutex_unlock(&stream->pending_lock);
 		return POM_OK;
 	}
 
-	int dir_flag = (direction == POM_DIR_FWD ? STREAM_FLAG_GOT_FWD_STARTSEQ : STREAM_FLAG_GOT_REV_STARTSEQ);
-	stream->flags |= dir_flag;
-	stream->cur_seq[direction] = seq;
-
-	debug_stream("thread %p, entry %p : start_seq for direction %u set to %u", pthread_self(), stream, direction, seq);
-
-	struct stream_pkt *p = NULL;
-	while ((p = stream_get_next(stream, &direction))) {
-
-		debug_stream("thread %p, entry %p, packet %u.%06u, seq %u, ack %u : process additional", pthread_self(), stream, pom_ptime_sec(p->pkt->ts), pom_ptime_usec(p->pkt->ts), p->seq, p->ack);
-		// Flag the stream as running
-		stream->flags |= STREAM_FLAG_RUNNING;
-
-		if (stream->handler(stream->ce, p->pkt, p->stack, p->stack_index) == PROTO_ERR) {
-			stream_end_process_packet(stream);
-			return POM_ERR;
-		}
-
-		stream->cur_seq[direction] += p->plen;
-
-		stream_free_packet(p);
-	}
+	stream_start_seq_locked(stream, direction, seq);
 
 	stream_end_process_packet(stream);
 	return POM_OK;
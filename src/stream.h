@@ -37,6 +37,9 @@
 
 #define STREAM_GAP_STEP_MAX		2048
 
+// Queued packets are kept in a skip list ordered by sequence
+#define STREAM_SKIP_LEVELS		8
+
 struct stream_pkt {
 
 	struct packet *pkt;
@@ -44,15 +47,9 @@ struct stream_pkt {
 	uint32_t seq, ack, plen;
 	unsigned int stack_index;
 	unsigned int flags;
-	struct stream_pkt *prev, *next;
-
-};
+	unsigned int levels;
+	struct stream_pkt *next[STREAM_SKIP_LEVELS];
 
-struct stream_thread_wait {
-	ptime ts;
-	pthread_t thread;
-	pthread_cond_t cond;
-	struct stream_thread_wait *prev, *next;
 };
 
 struct stream {
@@ -60,17 +57,24 @@ struct stream {
 	uint32_t cur_seq[POM_DIR_TOT];
 	uint32_t cur_buff_size, max_buff_size;
 	unsigned int flags;
+	unsigned int clone_flags; // Flags used to clone the packets, doesn't change
 	unsigned int timeout;
-	struct stream_pkt *head[POM_DIR_TOT], *tail[POM_DIR_TOT];
+	struct stream_pkt *head[POM_DIR_TOT][STREAM_SKIP_LEVELS];
+	uint32_t skip_rand; // State of the generator used to pick the levels
 	int (*handler) (struct conntrack_entry *ce, struct packet *p, struct proto_process_stack *stack, unsigned int stack_index);
 	ptime last_ts;
 	struct conntrack_entry *ce;
-	pthread_mutex_t lock;
-
-	pthread_mutex_t wait_lock;
-	struct stream_thread_wait *wait_list_head, *wait_list_tail, *wait_list_unused;
+	pthread_mutex_t lock; // Held by the thread processing the stream
+
+	// Work left by the other threads to the one processing the stream
+	pthread_mutex_t pending_lock;
+	struct stream_pkt *pending_head, *pending_tail;
+	uint32_t pending_buff_size; // Counted in the global budget along with cur_buff_size
+	uint32_t pending_start_seq[POM_DIR_TOT];
+	unsigned int pending_flags;
 };
 
+int stream_init();
 int stream_timeout(struct conntrack_entry *ce, void *priv, ptime now);
 int stream_force_dequeue(struct stream *stream);
 int stream_fill_gap(struct stream *stream, struct stream_pkt *p, uint32_t gap, int reverse_dir);
@@ -34,298 +34,459 @@ static struct timer_sys *timer_sys_head = NULL, *timer_sys_tail = NULL;
 static pthread_mutex_t timer_sys_lock;
 
 
-static pthread_mutex_t timer_main_lock = PTHREAD_MUTEX_INITIALIZER;
-static struct timer_queue *timer_queues = NULL;
+// One wheel per processing thread and a shared one for the other threads
+static struct timer_wheel *timer_wheels = NULL;
+static unsigned int timer_wheel_count = 0;
+static __thread struct timer_wheel *timer_wheel_local = NULL;
 
-static struct registry_perf *perf_timer_processed = NULL;
-static struct registry_perf *perf_timer_queued = NULL;
 static struct registry_perf *perf_timer_allocated = NULL;
-static struct registry_perf *perf_timer_queues = NULL;
 
 int timers_init() {
 
-	perf_timer_processed = core_add_perf("timer_processed", registry_perf_type_counter, "Number of timers processeds", "timers");
-	perf_timer_queued = core_add_perf("timer_queued", registry_perf_type_gauge, "Number of timers queued", "timers");
 	perf_timer_allocated = core_add_perf("timer_allocated", registry_perf_type_gauge, "Number of timers allocated", "timers");
-	perf_timer_queues = core_add_perf("timer_queues", registry_perf_type_gauge, "Number of timer queues", "queues");
+	if (!perf_timer_allocated)
+		return POM_ERR;
 
-	if (!perf_timer_processed || !perf_timer_queued || !perf_timer_allocated || !perf_timer_queues)
+	unsigned int count = core_get_num_threads() + 1;
+	size_t size = sizeof(struct timer_wheel) * count;
+	timer_wheels = malloc(size);
+	if (!timer_wheels) {
+		pom_oom(size);
 		return POM_ERR;
+	}
+	memset(timer_wheels, 0, size);
+
+	for (timer_wheel_count = 0; timer_wheel_count < count; timer_wheel_count++) {
+		struct timer_wheel *w = &timer_wheels[timer_wheel_count];
+
+		char perf_processed[32], perf_queued[32];
+		if (timer_wheel_count < count - 1) {
+			snprintf(perf_processed, sizeof(perf_processed), "timer_processed_%u", timer_wheel_count);
+			snprintf(perf_queued, sizeof(perf_queued), "timer_queued_%u", timer_wheel_count);
+		} else {
+			strcpy(perf_processed, "timer_processed_shared");
+			strcpy(perf_queued, "timer_queued_shared");
+		}
+
+		w->perf_processed = core_add_perf(perf_processed, registry_perf_type_counter, "Number of timers processeds", "timers");
+		w->perf_queued = core_add_perf(perf_queued, registry_perf_type_gauge, "Number of timers queued", "timers");
+		if (!w->perf_processed || !w->perf_queued)
+			goto err;
+
+		if (pthread_mutex_init(&w->lock, NULL)) {
+			pomlog(POMLOG_ERR "Error while initializing the timer wheel lock : %s", pom_strerror(errno));
+			goto err;
+		}
+	}
 
 	return POM_OK;
+
+err:
+	while (timer_wheel_count--)
+		pthread_mutex_destroy(&timer_wheels[timer_wheel_count].lock);
+	timer_wheel_count = 0;
+	free(timer_wheels);
+	timer_wheels = NULL;
+	return POM_ERR;
 }
 
-int timers_process() {
+static struct timer_wheel *timer_wheel_get_local() {
 
+	if (timer_wheel_local)
+		return timer_wheel_local;
 
-	static int processing = 0;
+	// Not a processing thread
+	return &timer_wheels[timer_wheel_count - 1];
+}
 
-	int res = pthread_mutex_trylock(&timer_main_lock);
-	if (res == EBUSY) {
-		// Already locked, give up
-		return POM_OK;
-	} else if (res) {
-		// Something went wrong
-		pomlog(POMLOG_ERR "Error while trying to lock the main timer lock : %s", pom_strerror(res));
-		abort();
-		return POM_ERR;
-	}
+static void timer_wheel_add(struct timer_wheel *w, struct timer *t) {
 
-	// Another thread is already processing the timers, drop out
-	if (processing) {
-		pom_mutex_unlock(&timer_main_lock);
-		return POM_OK;
-	}
+	uint64_t tick = t->expires >> TIMER_WHEEL_TICK_SHIFT;
+	if (tick < w->cur)
+		tick = w->cur;
 
-	processing = 1;
+	uint64_t delta = tick - w->cur;
 
-	ptime now = core_get_clock();
+	// Find the level with the right granularity
+	unsigned int level;
+	for (level = 0; level < TIMER_WHEEL_LEVELS - 1 && delta >= (1ULL << (TIMER_WHEEL_SLOT_BITS * (level + 1))); level++);
 
-	struct timer_queue *tq;
-	tq = timer_queues;
-
-	while (tq) {
-		while (tq->head && (tq->head->expires < now)) {
-				
-			// Dequeue the timer
-			struct timer *tmp = tq->head;
-			tq->head = tq->head->next;
-			if (tq->head)
-				tq->head->prev = NULL;
-			else
-				tq->tail = NULL;
-
-			tmp->next = NULL;
-			tmp->prev = NULL;
-			tmp->queue = NULL;
-			pom_mutex_unlock(&timer_main_lock);
-			registry_perf_dec(perf_timer_queued, 1);
+	// Too far in the future, it will be cascaded again until it's due
+	if (delta >= (1ULL << (TIMER_WHEEL_SLOT_BITS * TIMER_WHEEL_LEVELS)))
+		tick = w->cur + (1ULL << (TIMER_WHEEL_SLOT_BITS * TIMER_WHEEL_LEVELS)) - 1;
 
-			// Process it
-			debug_timer( "Timer 0x%lx reached. Starting handler ...", (unsigned long) tmp);
-			if ((*tmp->handler) (tmp->priv, now) != POM_OK) {
-				return POM_ERR;
-			}
+	struct timer_slot *s = &w->slots[level][(tick >> (TIMER_WHEEL_SLOT_BITS * level)) & TIMER_WHEEL_SLOT_MASK];
 
-			registry_perf_inc(perf_timer_processed, 1);
+	t->next = NULL;
+	t->prev = s->tail;
+	if (s->tail)
+		s->tail->next = t;
+	else
+		s->head = t;
+	s->tail = t;
+
+	t->slot = s;
+	t->wheel = w;
+	w->count++;
+}
 
-			pom_mutex_lock(&timer_main_lock);
+static void timer_wheel_remove(struct timer_wheel *w, struct timer *t) {
 
-		}
-		tq = tq->next;
+	struct timer_slot *s = t->slot;
+
+	if (t->prev)
+		t->prev->next = t->next;
+	else
+		s->head = t->next;
+
+	if (t->next)
+		t->next->prev = t->prev;
+	else
+		s->tail = t->prev;
+
+	t->prev = NULL;
+	t->next = NULL;
+	t->slot = NULL;
+	__atomic_store_n(&t->wheel, NULL, __ATOMIC_RELEASE);
+	w->count--;
+}
+
+static void timer_wheel_cascade(struct timer_wheel *w, unsigned int level) {
+
+	if (level >= TIMER_WHEEL_LEVELS)
+		return;
+
+	unsigned int idx = (w->cur >> (TIMER_WHEEL_SLOT_BITS * level)) & TIMER_WHEEL_SLOT_MASK;
+	if (!idx)
+		timer_wheel_cascade(w, level + 1);
+
+	// Move the timers of this slot to the lower levels
+	struct timer_slot *s = &w->slots[level][idx];
+	struct timer *t = s->head;
+	s->head = NULL;
+	s->tail = NULL;
 
+	while (t) {
+		struct timer *next = t->next;
+		w->count--;
+		timer_wheel_add(w, t);
+		t = next;
 	}
+}
 
-	processing = 0;
+static void timer_wheel_resort(struct timer_wheel *w, uint64_t now_tick) {
+
+	// Gather all the timers and queue them again relative to the new time
+	struct timer *head = NULL;
+
+	unsigned int i, j;
+	for (i = 0; i < TIMER_WHEEL_LEVELS; i++) {
+		for (j = 0; j < TIMER_WHEEL_SLOTS; j++) {
+			struct timer_slot *s = &w->slots[i][j];
+			if (!s->head)
+				continue;
+			s->tail->next = head;
+			head = s->head;
+			s->head = NULL;
+			s->tail = NULL;
+		}
+	}
 
-	pom_mutex_unlock(&timer_main_lock);
+	// Expired timers will end up in the slot processed right away
+	w->count = 0;
+	w->cur = now_tick - 1;
 
-	return POM_OK;
+	while (head) {
+		struct timer *next = head->next;
+		timer_wheel_add(w, head);
+		head = next;
+	}
 }
 
+// Must be called with the wheel locked and w->processing set
+static int timer_wheel_process(struct timer_wheel *w, ptime now) {
 
-int timers_cleanup() {
+	uint64_t now_tick = now >> TIMER_WHEEL_TICK_SHIFT;
 
+	if (!w->count) {
+		if (w->cur < now_tick)
+			w->cur = now_tick;
+		w->now = now;
+		return POM_OK;
+	}
 
-	// Free the timers
+	// Walking a long way tick by tick is more expensive than sorting the timers again
+	uint64_t jump = now_tick - w->cur;
+	if (w->cur < now_tick && jump > TIMER_WHEEL_SLOTS && jump > w->count)
+		timer_wheel_resort(w, now_tick);
+
+	while (w->cur < now_tick) {
 
-	while (timer_queues) {
-		struct timer_queue *tmpq;
-		tmpq = timer_queues;
+		unsigned int idx = w->cur & TIMER_WHEEL_SLOT_MASK;
+		if (!idx)
+			timer_wheel_cascade(w, 1);
 
-		while (tmpq->head) {
-			
-			struct timer *tmp;
-			tmp = tmpq->head;
+		struct timer_slot *s = &w->slots[0][idx];
+		while (s->head) {
+			struct timer *t = s->head;
 
-			tmpq->head = tmpq->head->next;
+			// Must be visible before the timer shows up as dequeued
+			__atomic_store_n(&t->running_wheel, w, __ATOMIC_RELEASE);
+			w->running = t;
+			w->running_thread = pthread_self();
 
-			free(tmp);
+			timer_wheel_remove(w, t);
+			pom_mutex_unlock(&w->lock);
+			registry_perf_dec(w->perf_queued, 1);
 
-			pomlog(POMLOG_WARN "Timer not dequeued");
+			// Process it
+			debug_timer( "Timer 0x%lx reached. Starting handler ...", (unsigned long) t);
+			int res = (*t->handler) (t->priv, now);
+
+			pom_mutex_lock(&w->lock);
+
+			// The handler may have freed the timer, only touch it if it was released meanwhile
+			w->running = NULL;
+			void (*done) (void *) = w->running_done;
+			void *done_priv = w->running_done_priv;
+			w->running_done = NULL;
+			w->running_done_priv = NULL;
+
+			if (done) {
+				pom_mutex_unlock(&w->lock);
+				// The handler may have queued it again
+				timer_release(t, done, done_priv);
+				pom_mutex_lock(&w->lock);
+			}
 
+			if (res != POM_OK)
+				return POM_ERR;
+
+			registry_perf_inc(w->perf_processed, 1);
 		}
-		timer_queues = timer_queues->next;
 
-		free(tmpq);
+		w->cur++;
 	}
 
-	return POM_OK;
+	w->now = now;
 
+	return POM_OK;
 }
 
-struct timer *timer_alloc(void* priv, int (*handler) (void*, ptime)) {
+static int timer_wheel_try_process(struct timer_wheel *w, ptime now, int wait) {
 
-	struct timer *t;
-	t = malloc(sizeof(struct timer));
-	if (!t) {
-		pom_oom(sizeof(struct timer));
-		return NULL;
+	if (wait) {
+		pom_mutex_lock(&w->lock);
+	} else {
+		int res = pthread_mutex_trylock(&w->lock);
+		if (res == EBUSY) {
+			// Already locked, give up
+			return POM_OK;
+		} else if (res) {
+			// Something went wrong
+			pomlog(POMLOG_ERR "Error while trying to lock the timer wheel lock : %s", pom_strerror(res));
+			abort();
+			return POM_ERR;
+		}
 	}
-	memset(t, 0, sizeof(struct timer));
 
-	t->priv = priv;
-	t->handler = handler;
+	// Another thread is already processing this wheel, drop out
+	if (w->processing) {
+		pom_mutex_unlock(&w->lock);
+		return POM_OK;
+	}
 
-	registry_perf_inc(perf_timer_allocated, 1);
+	w->processing = 1;
+	int res = timer_wheel_process(w, now);
+	w->processing = 0;
 
-	return t;
+	pom_mutex_unlock(&w->lock);
+
+	return res;
 }
 
-int timer_cleanup(struct timer *t) {
+int timers_process(unsigned int thread_id) {
 
-	if (t->queue)
-		timer_dequeue(t);
+	if (!timer_wheel_local)
+		timer_wheel_local = &timer_wheels[thread_id];
 
-	free(t);
-	
-	registry_perf_dec(perf_timer_allocated, 1);
+	ptime now = core_get_clock();
+
+	if (timer_wheel_try_process(timer_wheel_local, now, 1) != POM_OK)
+		return POM_ERR;
+
+	// Take care of the wheels which are not processed by their thread
+	unsigned int i;
+	for (i = 0; i < timer_wheel_count; i++) {
+		struct timer_wheel *w = &timer_wheels[i];
+		if (w == timer_wheel_local || !w->count)
+			continue;
+
+		if (i < timer_wheel_count - 1 && w->now + TIMER_WHEEL_STALE > now)
+			continue;
+
+		if (timer_wheel_try_process(w, now, 0) != POM_OK)
+			return POM_ERR;
+	}
 
 	return POM_OK;
 }
 
-int timer_queue(struct timer *t, unsigned int expiry) {
 
-	return timer_queue_now(t, expiry, core_get_clock_last());
-}
+int timers_cleanup() {
 
-int timer_queue_now(struct timer *t, unsigned int expiry, ptime now) {
 
+	// Free the timers
 
-	pom_mutex_lock(&timer_main_lock);
+	unsigned int i, j, k;
+	for (i = 0; i < timer_wheel_count; i++) {
+		struct timer_wheel *w = &timer_wheels[i];
+
+		for (j = 0; j < TIMER_WHEEL_LEVELS; j++) {
+			for (k = 0; k < TIMER_WHEEL_SLOTS; k++) {
+				while (w->slots[j][k].head) {
+					struct timer *tmp = w->slots[j][k].head;
+					w->slots[j][k].head = tmp->next;
+					if (tmp->allocated)
+						free(tmp);
+					pomlog(POMLOG_WARN "Timer not dequeued");
+				}
+			}
+		}
 
-	struct timer_queue *tq = timer_queues;
+		pthread_mutex_destroy(&w->lock);
+	}
 
-	// Timer is still queued, dequeue it
-	if (t->queue) {
+	free(timer_wheels);
+	timer_wheels = NULL;
+	timer_wheel_count = 0;
 
-		// Start further in the list of queues if possible
-		if (expiry >= t->queue->expiry)
-			tq = t->queue;
+	return POM_OK;
 
-		if (t->prev) {
-			t->prev->next = t->next;
-		} else {
-			t->queue->head = t->next;
-			if (t->queue->head)
-				t->queue->head->prev = NULL;
-		}
+}
 
-		if (t->next) {
-			t->next->prev = t->prev;
-		} else {
-			t->queue->tail = t->prev;
-			if (t->queue->tail)
-				t->queue->tail->next = NULL;
-			
-		}
-		t->queue = NULL;
-		t->prev = NULL;
-		t->next = NULL;
-	} else {
-		registry_perf_inc(perf_timer_queued, 1);
+static struct timer_wheel *timer_wheel_lock(struct timer *t) {
+
+	// The timer may move to another wheel until we hold the lock of its current one
+	while (1) {
+		struct timer_wheel *w = __atomic_load_n(&t->wheel, __ATOMIC_ACQUIRE);
+		if (!w)
+			return NULL;
+
+		pom_mutex_lock(&w->lock);
+		if (t->wheel == w)
+			return w;
+		pom_mutex_unlock(&w->lock);
 	}
+}
 
-	// First find the right queue or create it
-	
-	if (!tq) {
+struct timer *timer_alloc(void* priv, int (*handler) (void*, ptime)) {
 
-		// There is no queue yet
-		tq = malloc(sizeof(struct timer_queue));
-		if (!tq) {
-			pom_mutex_unlock(&timer_main_lock);
-			pom_oom(sizeof(struct timer_queue));
-			return POM_ERR;
-		}
-		memset(tq, 0, sizeof(struct timer_queue));
-		timer_queues = tq;
+	struct timer *t;
+	t = malloc(sizeof(struct timer));
+	if (!t) {
+		pom_oom(sizeof(struct timer));
+		return NULL;
+	}
+	timer_init(t, priv, handler);
+	t->allocated = 1;
 
-		tq->expiry = expiry;
+	registry_perf_inc(perf_timer_allocated, 1);
 
-		registry_perf_inc(perf_timer_queues, 1);
+	return t;
+}
 
-	} else {
+// Initialize a timer embedded in another object
+void timer_init(struct timer *t, void *priv, int (*handler) (void*, ptime)) {
 
-		while (tq) {
-			
-			if (tq->expiry == expiry) { // The right queue already exists
-				
-				break;
+	memset(t, 0, sizeof(struct timer));
 
-			} else if (tq->expiry > expiry) { // The right queue doesn't exists and we are too far in the list
+	t->priv = priv;
+	t->handler = handler;
+}
 
-				struct timer_queue *tmp;
-				tmp = malloc(sizeof(struct timer_queue));
-				if (!tmp) {
-					pom_oom(sizeof(struct timer_queue));
-					pom_mutex_unlock(&timer_main_lock);
-					return POM_ERR;
-				}
-				memset(tmp, 0, sizeof(struct timer_queue));
+// Dequeue the timer and call done(done_priv) once its handler is not running anymore
+// If another thread is running the handler, that thread calls done when it returns
+// This never waits so it can be called with any lock held
+int timer_release(struct timer *t, void (*done) (void *), void *done_priv) {
 
-				tmp->prev = tq->prev;
-				tmp->next = tq;
-				tq->prev = tmp;
+	struct timer_wheel *w = timer_wheel_lock(t);
+	if (w) {
+		timer_wheel_remove(w, t);
+		pom_mutex_unlock(&w->lock);
+		registry_perf_dec(w->perf_queued, 1);
+	}
 
-				if (tmp->prev)
-					tmp->prev->next = tmp;
-				else
-					timer_queues = tmp;
+	// Set before the timer shows up as dequeued when its handler starts
+	w = __atomic_load_n(&t->running_wheel, __ATOMIC_ACQUIRE);
+	if (w) {
+		pom_mutex_lock(&w->lock);
+		if (w->running == t && (w->running_done || !pthread_equal(w->running_thread, pthread_self()))) {
+			// Already released by another thread or still running there
+			if (!w->running_done) {
+				w->running_done = done;
+				w->running_done_priv = done_priv;
+			}
+			pom_mutex_unlock(&w->lock);
+			return POM_OK;
+		}
+		pom_mutex_unlock(&w->lock);
+	}
 
+	if (done)
+		done(done_priv);
 
-				tq = tmp;
-				tq->expiry = expiry;
+	return POM_OK;
+}
 
-				registry_perf_inc(perf_timer_queues, 1);
+int timer_is_queued(struct timer *t) {
 
-				break;
-			
-			} else if (!tq->next) { // Looks like we are at the end of our list
+	return (__atomic_load_n(&t->wheel, __ATOMIC_ACQUIRE) ? 1 : 0);
+}
 
-				struct timer_queue *tmp;
-				tmp = malloc(sizeof(struct timer_queue));
-				if (!tmp) {
-					pom_oom(sizeof(struct timer_queue));
-					pom_mutex_unlock(&timer_main_lock);
-					return POM_ERR;
-				}
-				memset(tmp, 0, sizeof(struct timer_queue));
+static void timer_free(void *priv) {
 
-				tmp->prev = tq;
-				
-				tq->next = tmp;
+	free(priv);
 
-				tq = tmp;
+	registry_perf_dec(perf_timer_allocated, 1);
+}
 
-				tq->expiry = expiry;
+int timer_cleanup(struct timer *t) {
 
-				registry_perf_inc(perf_timer_queues, 1);
-				
-				break;
-			}
+	// The timer is freed once its handler returns if it is running
+	return timer_release(t, timer_free, t);
+}
 
-			tq = tq->next;
-		}
+int timer_queue(struct timer *t, unsigned int expiry) {
 
-	}
+	return timer_queue_now(t, expiry, core_get_clock_last());
+}
 
-	// Now we can queue the timer
-	
-	if (tq->head == NULL) {
-		tq->head = t;
-		tq->tail = t;
+int timer_queue_now(struct timer *t, unsigned int expiry, ptime now) {
+
+	struct timer_wheel *w = timer_wheel_get_local();
+
+	// Timer is still queued, dequeue it
+	struct timer_wheel *old = timer_wheel_lock(t);
+	if (old) {
+		timer_wheel_remove(old, t);
+		if (old != w) {
+			// The timer moves to the wheel of this thread
+			pom_mutex_unlock(&old->lock);
+			registry_perf_dec(old->perf_queued, 1);
+			registry_perf_inc(w->perf_queued, 1);
+			pom_mutex_lock(&w->lock);
+		}
 	} else {
-		t->prev = tq->tail;
-		tq->tail = t;
-		t->prev->next = t;
+		registry_perf_inc(w->perf_queued, 1);
+		pom_mutex_lock(&w->lock);
 	}
 
 	// Update the expiry time
-	
 	t->expires = now + (expiry * 1000000UL);
-	t->queue = tq;
-	pom_mutex_unlock(&timer_main_lock);
+	timer_wheel_add(w, t);
 
+	pom_mutex_unlock(&w->lock);
 
 	return POM_OK;
 }
@@ -333,42 +494,18 @@ int timer_queue_now(struct timer *t, unsigned int expiry, ptime now) {
 
 int timer_dequeue(struct timer *t) {
 
-	// First let's check if it's the one at the begining of the queue
-
-	pom_mutex_lock(&timer_main_lock);
+	struct timer_wheel *w = timer_wheel_lock(t);
 
-	if (!t->queue) {
+	if (!w) {
 		pomlog(POMLOG_WARN "Warning, timer %p was already dequeued", t);
-		pom_mutex_unlock(&timer_main_lock);
 		return POM_OK;
 	}
 
-	if (t->prev) {
-		t->prev->next = t->next;
-	} else {
-		t->queue->head = t->next;
-		if (t->queue->head)
-			t->queue->head->prev = NULL;
-	}
-
-	if (t->next) {
-		t->next->prev = t->prev;
-	} else {
-		t->queue->tail = t->prev;
-		if (t->queue->tail)
-			t->queue->tail->next = NULL;
-		
-	}
-
-
-	// Make sure this timer will not reference anything
+	timer_wheel_remove(w, t);
 
-	t->prev = NULL;
-	t->next = NULL;
-	t->queue = NULL;
-	pom_mutex_unlock(&timer_main_lock);
+	pom_mutex_unlock(&w->lock);
 
-	registry_perf_dec(perf_timer_queued, 1);
+	registry_perf_dec(w->perf_queued, 1);
 
 	return POM_OK;
 }
@@ -23,6 +23,7 @@
 #define __TIMER_H__
 
 #include <pom-ng/timer.h>
+#include <pthread.h>
 
 struct timer_sys {
 	time_t expiry;
@@ -31,33 +32,56 @@ struct timer_sys {
 	struct timer_sys *prev, *next;
 };
 
+#define TIMER_WHEEL_TICK_SHIFT	14 // A tick is about 16ms
+#define TIMER_WHEEL_LEVELS	4
+#define TIMER_WHEEL_SLOT_BITS	8
+#define TIMER_WHEEL_SLOTS	(1 << TIMER_WHEEL_SLOT_BITS)
+#define TIMER_WHEEL_SLOT_MASK	(TIMER_WHEEL_SLOTS - 1)
+#define TIMER_WHEEL_STALE	1000000UL // Process the wheel of another thread if it didn't for that long
+
 struct timer {
 
 	ptime expires;
 	void *priv;
 	int (*handler) (void *, ptime);
-	struct timer_queue *queue;
+	struct timer_wheel *wheel;
+	struct timer_slot *slot;
 	struct timer *next;
 	struct timer *prev;
+	struct timer_wheel *running_wheel; // Last wheel which ran the handler
+	int allocated; // Allocated by timer_alloc(), otherwise embedded in another object
 
 };
 
-struct timer_queue {
-
-	unsigned int expiry;
-	struct timer_queue *next;
-	struct timer_queue *prev;
+struct timer_slot {
 	struct timer *head;
 	struct timer *tail;
+};
+
+struct timer_wheel {
+
+	pthread_mutex_t lock;
+	int processing;
+	uint64_t cur; // Next tick to process
+	ptime now; // Last time this wheel was processed
+	unsigned int count;
+	struct timer *running; // Timer whose handler is being executed
+	pthread_t running_thread;
+	void (*running_done) (void *); // Set if the timer was released while its handler was running
+	void *running_done_priv;
+	struct timer_slot slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
 
+	struct registry_perf *perf_processed;
+	struct registry_perf *perf_queued;
 };
 
 int timers_init();
-int timers_process();
+int timers_process(unsigned int thread_id);
 int timers_cleanup();
 
-void timer_queue_lock(struct timer_queue *q, int write);
-void timer_queue_unlock(struct timer_queue *q);
+void timer_init(struct timer *t, void *priv, int (*handler) (void*, ptime));
+int timer_release(struct timer *t, void (*done) (void *), void *done_priv);
+int timer_is_queued(struct timer *t);
 
 int timer_sys_process();
 